@@ -30,11 +30,14 @@ struct ifs_header {
 struct ifs {
   FILE *f;
   uint32_t body_start;
+  void *toc_bytes;
+  struct prop_binary_doc *toc_doc;
   struct prop *toc;
 };
 
 static int ifs_header_read(FILE *f, struct ifs_header *header);
 static int ifs_iter_match(const struct ifs_iter *dirent, const char *path);
+static int ifs_name_escape(const char *path, char **out);
 
 static int ifs_header_read(FILE *f, struct ifs_header *header) {
   uint8_t header_bytes[ifs_header_size];
@@ -74,7 +77,6 @@ int ifs_open(struct ifs **out, const char *path) {
   struct ifs_header header;
   struct ifs_iter root;
   struct iobuf pp_buf;
-  void *pp_bytes;
   size_t pp_nbytes;
   int r;
 
@@ -82,7 +84,6 @@ int ifs_open(struct ifs **out, const char *path) {
   assert(path != NULL);
 
   *out = NULL;
-  pp_bytes = NULL;
 
   ifs = calloc(1, sizeof(*ifs));
 
@@ -109,15 +110,15 @@ int ifs_open(struct ifs **out, const char *path) {
   ifs->body_start = header.words[4];
 
   pp_nbytes = ifs->body_start - ifs_header_size;
-  pp_bytes = malloc(pp_nbytes);
+  ifs->toc_bytes = malloc(pp_nbytes);
 
-  if (pp_bytes == NULL) {
+  if (ifs->toc_bytes == NULL) {
     r = -ENOMEM;
 
     goto end;
   }
 
-  pp_buf.bytes = pp_bytes;
+  pp_buf.bytes = ifs->toc_bytes;
   pp_buf.nbytes = pp_nbytes;
   pp_buf.pos = 0;
 
@@ -129,12 +130,16 @@ int ifs_open(struct ifs **out, const char *path) {
     goto end;
   }
 
-  r = prop_binary_parse(&ifs->toc, pp_bytes, pp_nbytes);
+  /* Most callers only want a handful of paths out of the TOC, so the tree is
+     only materialized as far as somebody actually walks into it. */
+
+  r = prop_binary_doc_open(&ifs->toc_doc, ifs->toc_bytes, pp_nbytes);
 
   if (r < 0) {
     goto end;
   }
 
+  ifs->toc = prop_binary_doc_get_root(ifs->toc_doc);
   root.p = ifs->toc;
 
   if (!ifs_iter_is_dir(&root)) {
@@ -149,7 +154,6 @@ int ifs_open(struct ifs **out, const char *path) {
   r = 0;
 
 end:
-  free(pp_bytes);
   ifs_close(ifs);
 
   return r;
@@ -164,7 +168,8 @@ void ifs_close(struct ifs *ifs) {
     fclose(ifs->f);
   }
 
-  prop_free(ifs->toc);
+  prop_binary_doc_close(ifs->toc_doc);
+  free(ifs->toc_bytes);
   free(ifs);
 }
 
@@ -260,7 +265,9 @@ bool ifs_iter_is_valid(const struct ifs_iter *iter) {
 
 int ifs_iter_lookup(const struct ifs_iter *parent, const char *path,
                     struct ifs_iter *child) {
+  const struct prop *p;
   struct ifs_iter pos;
+  char *raw;
   int r;
 
   assert(parent != NULL);
@@ -269,6 +276,25 @@ int ifs_iter_lookup(const struct ifs_iter *parent, const char *path,
 
   ifs_iter_init(child);
 
+  /* Try the escaped form of the name first, since that gets to use the prop
+     tree's name index. We still fall back to decoding every sibling's name in
+     case this archive escapes things in some way that we don't. */
+
+  r = ifs_name_escape(path, &raw);
+
+  if (r < 0) {
+    return r;
+  }
+
+  p = prop_search_child_const(parent->p, raw);
+  free(raw);
+
+  if (p != NULL && !str_eq(prop_get_name(p), "_info_")) {
+    child->p = p;
+
+    return 1;
+  }
+
   for (ifs_iter_get_first_child(parent, &pos); ifs_iter_is_valid(&pos);
        ifs_iter_get_next_sibling(&pos)) {
     r = ifs_iter_match(&pos, path);
@@ -309,6 +335,44 @@ end:
   return r;
 }
 
+static int ifs_name_escape(const char *path, char **out) {
+  size_t i;
+  size_t j;
+  char *str;
+
+  assert(path != NULL);
+  assert(out != NULL);
+
+  *out = NULL;
+
+  for (i = 0, j = 0; path[i] != '\0'; i++) {
+    j += (path[i] == '.' || path[i] == '_') ? 2 : 1;
+  }
+
+  str = malloc(j + 1); /* Count terminating NUL */
+
+  if (str == NULL) {
+    return -ENOMEM;
+  }
+
+  for (i = 0, j = 0; path[i] != '\0'; i++) {
+    if (path[i] == '.') {
+      str[j++] = '_';
+      str[j++] = 'E';
+    } else if (path[i] == '_') {
+      str[j++] = '_';
+      str[j++] = '_';
+    } else {
+      str[j++] = path[i];
+    }
+  }
+
+  str[j] = '\0';
+  *out = str;
+
+  return 0;
+}
+
 void ifs_iter_get_first_child(const struct ifs_iter *iter,
                               struct ifs_iter *out) {
   const struct prop *pos;
@@ -13,90 +13,187 @@
 #include "util/iobuf.h"
 #include "util/log.h"
 #include "util/macro.h"
+#include "util/work.h"
 
 #define ALIGN32(x) (((x) + 3) & ~3)
 #define INVALID_OFFSET ((size_t)-1)
+#define PROP_BINARY_NAME_MAX 255
+#define PROP_BINARY_MAGIC 0xA0
+#define PROP_BINARY_PACKED_NAMES 0x42
+#define PROP_BINARY_RAW_NAMES 0x45
+#define PROP_BINARY_RAW_NAME_FLAG 0x40
+#define PROP_BINARY_PARALLEL_GRAIN 4096
+
+/* Headers start with a magic byte, a byte that says whether names are packed
+   six bits to a character or stored as raw bytes, and then the encoding along
+   with its complement as a sanity check. */
 
 struct prop_binary_parser {
   struct const_iobuf head;
   struct const_iobuf body;
   struct const_iobuf align_cave[2];
+  enum prop_encoding encoding;
+  bool packed_names;
+};
+
+/* One entry per node or attribute, in the order in which they appear in the
+   head stream. A node's subtree (its attributes, children and their
+   descendants) occupies the entries between its own index and its `end`
+   index, so direct children can be enumerated by hopping from one `end` to the
+   next without touching anything underneath them. */
+
+struct prop_binary_entry {
+  uint32_t name_pos;
+  uint32_t value_pos;
+  uint32_t value_nbytes;
+  uint32_t end;
+  uint8_t type;
+};
+
+struct prop_binary_doc {
+  struct prop_binary_parser bp;
+  struct prop_binary_entry *entries;
+  uint32_t nentries;
+  uint32_t max_entries;
+  struct prop *root;
+};
+
+struct prop_binary_tree {
+  struct prop *root;
+  struct prop *cur;
+  enum prop_encoding encoding;
+};
+
+/* State shared by the worker threads of a parallel parse. nodes[] runs
+   parallel to doc->entries and stays NULL for attributes. */
+
+struct prop_binary_batch {
+  const struct prop_binary_doc *doc;
+  struct prop **nodes;
 };
 
 static const char prop_binary_name_chars[] =
     "0123456789:ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz";
 
-static int prop_binary_read_node(struct prop_binary_parser *bp, uint8_t type,
-                                 struct prop **p);
-int prop_binary_header_read_name(struct prop_binary_parser *bp, char **out);
-static int prop_binary_read_attr(struct prop_binary_parser *bp, struct prop *p);
+static int prop_binary_tree_begin_doc(void *ctx, enum prop_encoding encoding);
+static int prop_binary_tree_begin_node(void *ctx, const char *name,
+                                       enum prop_type type,
+                                       const struct const_iobuf *value);
+static int prop_binary_tree_attr(void *ctx, const char *key, const char *val);
+static int prop_binary_tree_end_node(void *ctx);
+static int prop_binary_parser_init(struct prop_binary_parser *bp,
+                                   const void *bytes, size_t nbytes);
+static int prop_binary_visit_node(struct prop_binary_parser *bp, uint8_t type,
+                                  const struct prop_binary_visitor *v,
+                                  void *ctx);
+static int prop_binary_visit_attr(struct prop_binary_parser *bp,
+                                  const struct prop_binary_visitor *v,
+                                  void *ctx);
+static int prop_binary_read_name(struct const_iobuf *head, bool packed,
+                                 char *name);
+static int prop_binary_skip_name(struct const_iobuf *head, bool packed);
+static int prop_binary_read_packed_name(struct const_iobuf *head,
+                                        uint8_t nchars, char *name);
+static int prop_binary_check_attr(const char *name,
+                                  const struct const_iobuf *value);
 static int prop_binary_slice_value(struct prop_binary_parser *bp, uint8_t type,
                                    struct const_iobuf *out);
 static int prop_binary_body_slice_bytes(struct prop_binary_parser *bp,
                                         size_t nbytes, struct const_iobuf *out);
 static int prop_binary_body_slice_cave(struct prop_binary_parser *bp,
                                        size_t nbytes, struct const_iobuf *out);
+static int prop_binary_doc_push(struct prop_binary_doc *doc, uint32_t *index);
+static int prop_binary_doc_scan_node(struct prop_binary_doc *doc,
+                                     struct prop_binary_parser *bp,
+                                     uint8_t type);
+static int prop_binary_doc_scan_attr(struct prop_binary_doc *doc,
+                                     struct prop_binary_parser *bp);
+static int prop_binary_doc_make_node(struct prop_binary_doc *doc,
+                                     uint32_t index, struct prop **out);
+static int prop_binary_doc_load_children(void *ctx, struct prop *p,
+                                         uint32_t index);
+static int prop_binary_doc_index_node(struct prop_binary_doc *doc,
+                                      struct prop_binary_parser *bp,
+                                      uint8_t type);
+static int prop_binary_doc_index_attr(struct prop_binary_doc *doc,
+                                      struct prop_binary_parser *bp);
+static int prop_binary_batch_make_nodes(void *ctx, size_t begin, size_t end);
+static int prop_binary_batch_make_node(struct prop_binary_batch *b,
+                                       uint32_t index);
+static int prop_binary_batch_link_nodes(void *ctx, size_t begin, size_t end);
+
+static const struct prop_binary_visitor prop_binary_tree_visitor = {
+    .begin_doc = prop_binary_tree_begin_doc,
+    .begin_node = prop_binary_tree_begin_node,
+    .attr = prop_binary_tree_attr,
+    .end_node = prop_binary_tree_end_node,
+};
 
 int prop_binary_parse(struct prop **out, const void *bytes, size_t nbytes) {
-  struct prop *p;
-  struct prop_binary_parser bp;
-  struct const_iobuf file;
-  uint32_t head_nbytes;
-  uint32_t body_nbytes;
-  uint8_t type;
+  struct prop_binary_tree b;
   int r;
 
   assert(out != NULL);
   assert(bytes != NULL);
 
   *out = NULL;
-  p = NULL;
-  memset(&bp, 0, sizeof(bp));
+  memset(&b, 0, sizeof(b));
 
-  file.bytes = bytes;
-  file.nbytes = nbytes;
-  file.pos = 4; /* Skip initial magic # */
-
-  r = iobuf_read_be32(&file, &head_nbytes);
+  r = prop_binary_visit(bytes, nbytes, &prop_binary_tree_visitor, &b);
 
   if (r < 0) {
-    log_error(r);
+    prop_free(b.root);
 
-    goto end;
+    return r;
   }
 
-  r = iobuf_slice(&bp.head, &file, head_nbytes);
+  assert(b.root != NULL);
+  assert(b.cur == NULL);
 
-  if (r < 0) {
-    log_error(r);
+  *out = b.root;
 
-    goto end;
-  }
+  return 0;
+}
 
-  r = iobuf_align_read(&file, 4);
+/* The head stream has to be walked in order, since the position of each value
+   in the body depends on everything that came before it, but the walk itself
+   is cheap as long as it doesn't unpack names or copy anything. That leaves
+   building and validating the nodes, which is most of the work, to be spread
+   across threads. Nodes get linked together in a second parallel pass once
+   they all exist. */
+
+int prop_binary_parse_parallel(struct prop **out, const void *bytes,
+                               size_t nbytes, unsigned int nthreads) {
+  struct prop_binary_doc doc;
+  struct prop_binary_batch b;
+  struct prop_binary_parser bp;
+  uint32_t i;
+  uint8_t type;
+  int r;
 
-  if (r < 0) {
-    log_error(r);
+  assert(out != NULL);
+  assert(bytes != NULL);
 
-    goto end;
+  if (nthreads == 0) {
+    nthreads = work_get_cpu_count();
   }
 
-  r = iobuf_read_be32(&file, &body_nbytes);
-
-  if (r < 0) {
-    log_error(r);
-
-    goto end;
+  if (nbytes < PROP_BINARY_PARALLEL_MIN || nthreads <= 1) {
+    return prop_binary_parse(out, bytes, nbytes);
   }
 
-  r = iobuf_slice(&bp.body, &file, body_nbytes);
+  *out = NULL;
+  memset(&doc, 0, sizeof(doc));
+  b.doc = &doc;
+  b.nodes = NULL;
 
-  if (r < 0) {
-    log_error(r);
+  r = prop_binary_parser_init(&doc.bp, bytes, nbytes);
 
+  if (r < 0) {
     goto end;
   }
 
+  bp = doc.bp;
   r = iobuf_read_8(&bp.head, &type);
 
   if (r < 0) {
@@ -112,7 +209,7 @@ int prop_binary_parse(struct prop **out, const void *bytes, size_t nbytes) {
     goto end;
   }
 
-  r = prop_binary_read_node(&bp, type, &p);
+  r = prop_binary_doc_index_node(&doc, &bp, type);
 
   if (r < 0) {
     goto end;
@@ -131,257 +228,222 @@ int prop_binary_parse(struct prop **out, const void *bytes, size_t nbytes) {
     goto end;
   }
 
-  *out = p;
-  p = NULL;
-  r = 0;
-
-end:
-  prop_free(p);
-
-  return r;
-}
-
-static int prop_binary_read_node(struct prop_binary_parser *bp, uint8_t type,
-                                 struct prop **out) {
-  struct const_iobuf value;
-  struct prop *child;
-  struct prop *p;
-  uint8_t child_type;
-  char *name;
-  int r;
-
-  assert(bp != NULL);
-  assert(out != NULL);
-
-  *out = NULL;
-  name = NULL;
-  p = NULL;
-
-  r = prop_binary_header_read_name(bp, &name);
-
-  if (r < 0) {
-    log_write("Failed to read name");
-
-    goto end;
-  }
-
-  if (!prop_type_is_valid(type)) {
-    log_write("\"%s\": Unsupported type code %#x", name, type);
-    r = -ENOTSUP;
-
-    goto end;
-  }
-
-  r = prop_binary_slice_value(bp, type, &value);
+  b.nodes = calloc(doc.nentries, sizeof(*b.nodes));
 
-  if (r < 0) {
-    log_write("\"%s\": Failed to read value of type %s", name,
-              prop_type_to_string(type));
+  if (b.nodes == NULL) {
+    r = -ENOMEM;
 
     goto end;
   }
 
-  r = prop_alloc(&p, name, type, value.bytes, value.nbytes);
+  r = work_run(nthreads, doc.nentries, PROP_BINARY_PARALLEL_GRAIN,
+               prop_binary_batch_make_nodes, &b);
 
   if (r < 0) {
     goto end;
   }
 
-  for (;;) {
-    r = iobuf_read_8(&bp->head, &child_type);
-
-    if (r < 0) {
-      log_write("\"%s\": Failed to read next child's type code", name);
-
-      goto end;
-    }
+  r = work_run(nthreads, doc.nentries, PROP_BINARY_PARALLEL_GRAIN,
+               prop_binary_batch_link_nodes, &b);
 
-    if (child_type == 0xFE) {
-      break;
-    } else if (child_type == PROP_ATTR) {
-      r = prop_binary_read_attr(bp, p);
+  assert(r >= 0);
 
-      if (r < 0) {
-        goto end;
-      }
-    } else {
-      r = prop_binary_read_node(bp, child_type, &child);
+  prop_set_encoding(b.nodes[0], doc.bp.encoding);
+  *out = b.nodes[0];
+  b.nodes[0] = NULL;
 
-      if (r < 0) {
-        goto end;
-      }
+end:
+  /* Nothing is linked to anything else unless we succeeded, in which case
+     only the root is left and it has been handed over. */
 
-      prop_append(p, child);
+  if (b.nodes != NULL && *out == NULL) {
+    for (i = 0; i < doc.nentries; i++) {
+      prop_free(b.nodes[i]);
     }
   }
 
-  *out = p;
-  p = NULL;
-
-end:
-  free(name);
-  prop_free(p);
+  free(b.nodes);
+  free(doc.entries);
 
   return r;
 }
 
-int prop_binary_header_read_name(struct prop_binary_parser *bp, char **out) {
-  uint8_t nchars;
-  uint8_t x;
-  uint8_t y;
-  uint8_t z;
-  char *name;
-  int i;
-  int index;
+int prop_binary_visit(const void *bytes, size_t nbytes,
+                      const struct prop_binary_visitor *v, void *ctx) {
+  struct prop_binary_parser bp;
+  uint8_t type;
   int r;
 
-  *out = NULL;
-  name = NULL;
+  assert(bytes != NULL);
+  assert(v != NULL);
 
-  r = iobuf_read_8(&bp->head, &nchars);
+  r = prop_binary_parser_init(&bp, bytes, nbytes);
 
   if (r < 0) {
-    log_error(r);
+    return r;
+  }
 
-    goto end;
+  if (v->begin_doc != NULL) {
+    r = v->begin_doc(ctx, bp.encoding);
+
+    if (r < 0) {
+      return r;
+    }
   }
 
-  name = malloc(nchars + 1);
+  r = iobuf_read_8(&bp.head, &type);
 
-  if (name == NULL) {
-    r = -ENOMEM;
+  if (r < 0) {
+    log_write("Failed to read root node type code");
 
-    goto end;
+    return r;
   }
 
-  x = 0;
-  y = 0;
-  z = 0;
+  if (type == 0xFF) {
+    log_write("Binary prop has no root node");
 
-  for (i = 0; i < nchars; i++) {
-    switch (i % 4) {
-    case 0:
-      r = iobuf_read_8(&bp->head, &x);
+    return -EBADMSG;
+  }
 
-      if (r < 0) {
-        log_error(r);
+  r = prop_binary_visit_node(&bp, type, v, ctx);
 
-        goto end;
-      }
+  if (r < 0) {
+    return r;
+  }
 
-      index = (x >> 2) & 0x3F;
+  r = iobuf_read_8(&bp.head, &type);
 
-      break;
+  if (r < 0) {
+    return r;
+  }
 
-    case 1:
-      r = iobuf_read_8(&bp->head, &y);
+  if (type != 0xFF) {
+    log_write("Expected EOF marker in header, got %#x", type);
 
-      if (r < 0) {
-        log_error(r);
+    return -EBADMSG;
+  }
 
-        goto end;
-      }
+  return 0;
+}
 
-      index = ((x & 0x03) << 4) | ((y >> 4) & 0x0F);
+static int prop_binary_tree_begin_doc(void *ctx, enum prop_encoding encoding) {
+  struct prop_binary_tree *b;
 
-      break;
+  b = ctx;
+  b->encoding = encoding;
 
-    case 2:
-      r = iobuf_read_8(&bp->head, &z);
+  return 0;
+}
 
-      if (r < 0) {
-        log_error(r);
+static int prop_binary_tree_begin_node(void *ctx, const char *name,
+                                       enum prop_type type,
+                                       const struct const_iobuf *value) {
+  struct prop_binary_tree *b;
+  struct prop *p;
+  int r;
 
-        goto end;
-      }
+  b = ctx;
+  r = prop_alloc(&p, name, type, value->bytes, value->nbytes);
 
-      index = ((y & 0x0F) << 2) | ((z >> 6) & 0x03);
+  if (r < 0) {
+    return r;
+  }
 
-      break;
+  if (b->cur != NULL) {
+    prop_append(b->cur, p);
+  } else {
+    assert(b->root == NULL);
 
-    case 3:
-      index = z & 0x3F;
+    prop_set_encoding(p, b->encoding);
+    b->root = p;
+  }
 
-      break;
-    }
+  b->cur = p;
 
-    assert(index < lengthof(prop_binary_name_chars));
+  return 0;
+}
 
-    name[i] = prop_binary_name_chars[index];
-  }
+static int prop_binary_tree_attr(void *ctx, const char *key, const char *val) {
+  struct prop_binary_tree *b;
 
-  name[nchars] = '\0';
+  b = ctx;
 
-  *out = name;
-  name = NULL;
-  r = 0;
+  return prop_set_attr(b->cur, key, val);
+}
 
-end:
-  free(name);
+static int prop_binary_tree_end_node(void *ctx) {
+  struct prop_binary_tree *b;
 
-  return r;
+  b = ctx;
+  b->cur = prop_get_parent(b->cur);
+
+  return 0;
 }
 
-static int prop_binary_read_attr(struct prop_binary_parser *bp,
-                                 struct prop *p) {
-  struct const_iobuf value;
-  char *name;
+static int prop_binary_parser_init(struct prop_binary_parser *bp,
+                                   const void *bytes, size_t nbytes) {
+  struct const_iobuf file;
+  uint8_t magic[4];
+  uint32_t head_nbytes;
+  uint32_t body_nbytes;
   int r;
 
-  name = NULL;
-  r = prop_binary_header_read_name(bp, &name);
+  assert(bp != NULL);
+  assert(bytes != NULL);
+
+  memset(bp, 0, sizeof(*bp));
 
-  if (r < 0) {
-    goto end;
-  }
+  file.bytes = bytes;
+  file.nbytes = nbytes;
+  file.pos = 0;
 
-  r = prop_binary_slice_value(bp, PROP_ATTR, &value);
+  r = iobuf_read(&file, magic, sizeof(magic));
 
   if (r < 0) {
-    goto end;
+    log_error(r);
+
+    return r;
   }
 
-  if (value.nbytes == 0) {
-    log_write("Attr @%s has zero length", name);
-    r = -EBADMSG;
+  if (magic[0] != PROP_BINARY_MAGIC) {
+    log_write("Not a binary prop (magic %#x)", magic[0]);
 
-    goto end;
+    return -EBADMSG;
   }
 
-  if (value.bytes[value.nbytes - 1] != '\0') {
-    log_write("Attr @%s is not NUL terminated", name);
-    r = -EBADMSG;
+  if (magic[1] == PROP_BINARY_PACKED_NAMES) {
+    bp->packed_names = true;
+  } else if (magic[1] == PROP_BINARY_RAW_NAMES) {
+    bp->packed_names = false;
+  } else {
+    log_write("Unsupported binary prop variant %#x", magic[1]);
 
-    goto end;
+    return -ENOTSUP;
   }
 
-  r = prop_set_attr(p, name, (const char *)value.bytes);
+  if ((magic[2] ^ magic[3]) != 0xFF) {
+    log_write("Corrupt encoding %#x (check byte %#x)", magic[2], magic[3]);
 
-  if (r < 0) {
-    goto end;
+    return -EBADMSG;
   }
 
-  r = 0;
+  if (!prop_encoding_is_valid(magic[2])) {
+    log_write("Unsupported encoding %#x", magic[2]);
 
-end:
-  free(name);
+    return -ENOTSUP;
+  }
 
-  return r;
-}
+  bp->encoding = magic[2];
 
-static int prop_binary_slice_value(struct prop_binary_parser *bp, uint8_t type,
-                                   struct const_iobuf *out) {
-  int orig_nbytes;
-  uint32_t nbytes;
-  bool is_variable;
-  int r;
+  r = iobuf_read_be32(&file, &head_nbytes);
 
-  assert(bp != NULL);
-  assert(out != NULL);
+  if (r < 0) {
+    log_error(r);
 
-  memset(out, 0, sizeof(*out));
+    return r;
+  }
 
-  r = iobuf_align_read(&bp->body, 4);
+  r = iobuf_slice(&bp->head, &file, head_nbytes);
 
   if (r < 0) {
     log_error(r);
@@ -389,37 +451,183 @@ static int prop_binary_slice_value(struct prop_binary_parser *bp, uint8_t type,
     return r;
   }
 
-  orig_nbytes = prop_type_to_size(type);
+  r = iobuf_align_read(&file, 4);
 
-  if (orig_nbytes < 0 || prop_type_is_array(type)) {
-    is_variable = true;
-    r = iobuf_read_be32(&bp->body, &nbytes);
+  if (r < 0) {
+    log_error(r);
 
-    if (r < 0) {
-      log_error(r);
+    return r;
+  }
+
+  r = iobuf_read_be32(&file, &body_nbytes);
+
+  if (r < 0) {
+    log_error(r);
+
+    return r;
+  }
+
+  r = iobuf_slice(&bp->body, &file, body_nbytes);
+
+  if (r < 0) {
+    log_error(r);
+
+    return r;
+  }
+
+  return 0;
+}
+
+static int prop_binary_visit_node(struct prop_binary_parser *bp, uint8_t type,
+                                  const struct prop_binary_visitor *v,
+                                  void *ctx) {
+  struct const_iobuf value;
+  uint8_t child_type;
+  char name[PROP_BINARY_NAME_MAX + 1];
+  int r;
+
+  assert(bp != NULL);
+  assert(v != NULL);
+
+  r = prop_binary_read_name(&bp->head, bp->packed_names, name);
+
+  if (r < 0) {
+    log_write("Failed to read name");
+
+    return r;
+  }
+
+  if (!prop_type_is_valid(type)) {
+    log_write("\"%s\": Unsupported type code %#x", name, type);
+
+    return -ENOTSUP;
+  }
+
+  r = prop_binary_slice_value(bp, type, &value);
+
+  if (r < 0) {
+    log_write("\"%s\": Failed to read value of type %s", name,
+              prop_type_to_string(type));
+
+    return r;
+  }
+
+  r = prop_validate(name, type, value.bytes, value.nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = v->begin_node(ctx, name, type, &value);
+
+  if (r < 0) {
+    return r;
+  }
+
+  for (;;) {
+    r = iobuf_read_8(&bp->head, &child_type);
+
+    if (r < 0) {
+      log_write("\"%s\": Failed to read next child's type code", name);
 
       return r;
     }
-  } else {
-    is_variable = false;
-    nbytes = orig_nbytes;
+
+    if (child_type == 0xFE) {
+      break;
+    } else if (child_type == PROP_ATTR) {
+      r = prop_binary_visit_attr(bp, v, ctx);
+    } else {
+      r = prop_binary_visit_node(bp, child_type, v, ctx);
+    }
+
+    if (r < 0) {
+      return r;
+    }
   }
 
-  if (is_variable || nbytes >= 4) {
-    return prop_binary_body_slice_bytes(bp, nbytes, out);
-  } else if (nbytes > 0) {
-    return prop_binary_body_slice_cave(bp, nbytes, out);
+  return v->end_node(ctx);
+}
+
+/* Raw names get copied rather than borrowed, since everything downstream of
+   here wants NUL terminated strings, but that is still much cheaper than
+   unpacking them. */
+
+static int prop_binary_read_name(struct const_iobuf *head, bool packed,
+                                 char *name) {
+  uint8_t nchars;
+  int r;
+
+  assert(head != NULL);
+  assert(name != NULL);
+
+  name[0] = '\0';
+
+  r = iobuf_read_8(head, &nchars);
+
+  if (r < 0) {
+    log_error(r);
+
+    return r;
+  }
+
+  if (packed) {
+    return prop_binary_read_packed_name(head, nchars, name);
+  }
+
+  if (!(nchars & PROP_BINARY_RAW_NAME_FLAG)) {
+    log_write("Bad raw name length byte %#x", nchars);
+
+    return -EBADMSG;
+  }
+
+  nchars = (nchars & ~PROP_BINARY_RAW_NAME_FLAG) + 1;
+  r = iobuf_read(head, name, nchars);
+
+  if (r < 0) {
+    log_error(r);
+
+    return r;
+  }
+
+  if (memchr(name, '\0', nchars) != NULL) {
+    log_write("Raw name contains a NUL byte");
+
+    return -EBADMSG;
   }
 
+  name[nchars] = '\0';
+
   return 0;
 }
 
-static int prop_binary_body_slice_bytes(struct prop_binary_parser *bp,
-                                        size_t nbytes,
-                                        struct const_iobuf *out) {
+static int prop_binary_skip_name(struct const_iobuf *head, bool packed) {
+  struct const_iobuf name;
+  uint8_t nchars;
+  size_t nbytes;
   int r;
 
-  r = iobuf_slice(out, &bp->body, nbytes);
+  assert(head != NULL);
+
+  r = iobuf_read_8(head, &nchars);
+
+  if (r < 0) {
+    log_error(r);
+
+    return r;
+  }
+
+  if (packed) {
+    nbytes = (nchars * 6 + 7) / 8;
+  } else if (nchars & PROP_BINARY_RAW_NAME_FLAG) {
+    nbytes = (nchars & ~PROP_BINARY_RAW_NAME_FLAG) + 1;
+  } else {
+    log_write("Bad raw name length byte %#x", nchars);
+
+    return -EBADMSG;
+  }
+
+  r = iobuf_slice(&name, head, nbytes);
 
   if (r < 0) {
     log_error(r);
@@ -430,30 +638,832 @@ static int prop_binary_body_slice_bytes(struct prop_binary_parser *bp,
   return 0;
 }
 
-static int prop_binary_body_slice_cave(struct prop_binary_parser *bp,
-                                       size_t nbytes, struct const_iobuf *out) {
-  struct const_iobuf *cave;
+static int prop_binary_read_packed_name(struct const_iobuf *head,
+                                        uint8_t nchars, char *name) {
+  uint8_t x;
+  uint8_t y;
+  uint8_t z;
+  int i;
+  int index;
+  int r;
+
+  assert(head != NULL);
+  assert(name != NULL);
+
+  x = 0;
+  y = 0;
+  z = 0;
+
+  for (i = 0; i < nchars; i++) {
+    switch (i % 4) {
+    case 0:
+      r = iobuf_read_8(head, &x);
+
+      if (r < 0) {
+        log_error(r);
+
+        return r;
+      }
+
+      index = (x >> 2) & 0x3F;
+
+      break;
+
+    case 1:
+      r = iobuf_read_8(head, &y);
+
+      if (r < 0) {
+        log_error(r);
+
+        return r;
+      }
+
+      index = ((x & 0x03) << 4) | ((y >> 4) & 0x0F);
+
+      break;
+
+    case 2:
+      r = iobuf_read_8(head, &z);
+
+      if (r < 0) {
+        log_error(r);
+
+        return r;
+      }
+
+      index = ((y & 0x0F) << 2) | ((z >> 6) & 0x03);
+
+      break;
+
+    case 3:
+      index = z & 0x3F;
+
+      break;
+    }
+
+    assert(index < lengthof(prop_binary_name_chars));
+
+    name[i] = prop_binary_name_chars[index];
+  }
+
+  name[nchars] = '\0';
+
+  return 0;
+}
+
+static int prop_binary_visit_attr(struct prop_binary_parser *bp,
+                                  const struct prop_binary_visitor *v,
+                                  void *ctx) {
+  struct const_iobuf value;
+  char name[PROP_BINARY_NAME_MAX + 1];
+  int r;
+
+  assert(bp != NULL);
+  assert(v != NULL);
+
+  r = prop_binary_read_name(&bp->head, bp->packed_names, name);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_binary_slice_value(bp, PROP_ATTR, &value);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_binary_check_attr(name, &value);
+
+  if (r < 0) {
+    return r;
+  }
+
+  return v->attr(ctx, name, (const char *)value.bytes);
+}
+
+static int prop_binary_check_attr(const char *name,
+                                  const struct const_iobuf *value) {
+  assert(name != NULL);
+  assert(value != NULL);
+
+  if (value->nbytes == 0) {
+    log_write("Attr @%s has zero length", name);
+
+    return -EBADMSG;
+  }
+
+  if (value->bytes[value->nbytes - 1] != '\0') {
+    log_write("Attr @%s is not NUL terminated", name);
+
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+/* Values of one or two bytes get packed into shared 4-byte "align caves", one
+   for each size, so that they don't waste a whole aligned word each.
+   Everything else, including three-byte values like 3u8, starts on a fresh
+   4-byte boundary. */
+
+static int prop_binary_slice_value(struct prop_binary_parser *bp, uint8_t type,
+                                   struct const_iobuf *out) {
+  int orig_nbytes;
+  uint32_t nbytes;
+  bool is_variable;
   int r;
 
   assert(bp != NULL);
-  assert(nbytes == 1 || nbytes == 2);
   assert(out != NULL);
 
-  cave = &bp->align_cave[nbytes - 1];
+  memset(out, 0, sizeof(*out));
 
-  if (cave->pos >= cave->nbytes) {
-    r = iobuf_slice(cave, &bp->body, 4);
+  r = iobuf_align_read(&bp->body, 4);
+
+  if (r < 0) {
+    log_error(r);
+
+    return r;
+  }
+
+  orig_nbytes = prop_type_to_size(type);
+
+  if (orig_nbytes < 0 || prop_type_is_array(type)) {
+    is_variable = true;
+    r = iobuf_read_be32(&bp->body, &nbytes);
 
     if (r < 0) {
       log_error(r);
 
       return r;
     }
+  } else {
+    is_variable = false;
+    nbytes = orig_nbytes;
   }
 
-  r = iobuf_slice(out, cave, nbytes);
+  if (is_variable || nbytes > 2) {
+    return prop_binary_body_slice_bytes(bp, nbytes, out);
+  } else if (nbytes > 0) {
+    return prop_binary_body_slice_cave(bp, nbytes, out);
+  }
+
+  return 0;
+}
+
+static int prop_binary_body_slice_bytes(struct prop_binary_parser *bp,
+                                        size_t nbytes,
+                                        struct const_iobuf *out) {
+  int r;
+
+  r = iobuf_slice(out, &bp->body, nbytes);
+
+  if (r < 0) {
+    log_error(r);
+
+    return r;
+  }
+
+  return 0;
+}
+
+static int prop_binary_body_slice_cave(struct prop_binary_parser *bp,
+                                       size_t nbytes, struct const_iobuf *out) {
+  struct const_iobuf *cave;
+  int r;
+
+  assert(bp != NULL);
+  assert(nbytes == 1 || nbytes == 2);
+  assert(out != NULL);
+
+  cave = &bp->align_cave[nbytes - 1];
+
+  if (cave->pos >= cave->nbytes) {
+    r = iobuf_slice(cave, &bp->body, 4);
+
+    if (r < 0) {
+      log_error(r);
+
+      return r;
+    }
+  }
+
+  r = iobuf_slice(out, cave, nbytes);
 
   assert(r >= 0);
 
   return 0;
 }
+
+/* Lazy documents make a single allocation-light pass over the head stream to
+   validate everything and note down where each node's name and value live.
+   Actual prop nodes are only built one level at a time, as callers descend
+   into the tree. This turns a single path lookup in a large IFS TOC into a
+   cheap scan plus a handful of allocations along the path. */
+
+int prop_binary_doc_open(struct prop_binary_doc **out, const void *bytes,
+                         size_t nbytes) {
+  struct prop_binary_doc *doc;
+  struct prop_binary_parser bp;
+  uint8_t type;
+  int r;
+
+  assert(out != NULL);
+  assert(bytes != NULL);
+
+  *out = NULL;
+
+  doc = calloc(1, sizeof(*doc));
+
+  if (doc == NULL) {
+    r = -ENOMEM;
+
+    goto end;
+  }
+
+  r = prop_binary_parser_init(&doc->bp, bytes, nbytes);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  bp = doc->bp;
+  r = iobuf_read_8(&bp.head, &type);
+
+  if (r < 0) {
+    log_write("Failed to read root node type code");
+
+    goto end;
+  }
+
+  if (type == 0xFF) {
+    log_write("Binary prop has no root node");
+    r = -EBADMSG;
+
+    goto end;
+  }
+
+  r = prop_binary_doc_scan_node(doc, &bp, type);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = iobuf_read_8(&bp.head, &type);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  if (type != 0xFF) {
+    log_write("Expected EOF marker in header, got %#x", type);
+    r = -EBADMSG;
+
+    goto end;
+  }
+
+  r = prop_binary_doc_make_node(doc, 0, &doc->root);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  prop_set_encoding(doc->root, doc->bp.encoding);
+
+  *out = doc;
+  doc = NULL;
+
+end:
+  prop_binary_doc_close(doc);
+
+  return r;
+}
+
+void prop_binary_doc_close(struct prop_binary_doc *doc) {
+  if (doc == NULL) {
+    return;
+  }
+
+  prop_free(doc->root);
+  free(doc->entries);
+  free(doc);
+}
+
+struct prop *prop_binary_doc_get_root(struct prop_binary_doc *doc) {
+  assert(doc != NULL);
+
+  return doc->root;
+}
+
+static int prop_binary_doc_push(struct prop_binary_doc *doc, uint32_t *index) {
+  struct prop_binary_entry *entries;
+  uint32_t max_entries;
+
+  assert(doc != NULL);
+  assert(index != NULL);
+
+  if (doc->nentries == doc->max_entries) {
+    if (doc->max_entries > UINT32_MAX / 2) {
+      return -EOVERFLOW;
+    }
+
+    max_entries = doc->max_entries != 0 ? doc->max_entries * 2 : 64;
+    entries = realloc(doc->entries, max_entries * sizeof(*entries));
+
+    if (entries == NULL) {
+      return -ENOMEM;
+    }
+
+    doc->entries = entries;
+    doc->max_entries = max_entries;
+  }
+
+  *index = doc->nentries++;
+  memset(&doc->entries[*index], 0, sizeof(doc->entries[*index]));
+
+  return 0;
+}
+
+static int prop_binary_doc_scan_node(struct prop_binary_doc *doc,
+                                     struct prop_binary_parser *bp,
+                                     uint8_t type) {
+  struct prop_binary_entry *e;
+  struct const_iobuf value;
+  uint32_t index;
+  uint32_t name_pos;
+  uint8_t child_type;
+  char name[PROP_BINARY_NAME_MAX + 1];
+  int r;
+
+  assert(doc != NULL);
+  assert(bp != NULL);
+
+  name_pos = bp->head.pos;
+  r = prop_binary_read_name(&bp->head, bp->packed_names, name);
+
+  if (r < 0) {
+    log_write("Failed to read name");
+
+    return r;
+  }
+
+  if (!prop_type_is_valid(type)) {
+    log_write("\"%s\": Unsupported type code %#x", name, type);
+
+    return -ENOTSUP;
+  }
+
+  r = prop_binary_slice_value(bp, type, &value);
+
+  if (r < 0) {
+    log_write("\"%s\": Failed to read value of type %s", name,
+              prop_type_to_string(type));
+
+    return r;
+  }
+
+  r = prop_validate(name, type, value.bytes, value.nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_binary_doc_push(doc, &index);
+
+  if (r < 0) {
+    return r;
+  }
+
+  e = &doc->entries[index];
+  e->name_pos = name_pos;
+  e->value_pos = value.nbytes > 0 ? value.bytes - bp->body.bytes : 0;
+  e->value_nbytes = value.nbytes;
+  e->type = type;
+
+  for (;;) {
+    r = iobuf_read_8(&bp->head, &child_type);
+
+    if (r < 0) {
+      log_write("\"%s\": Failed to read next child's type code", name);
+
+      return r;
+    }
+
+    if (child_type == 0xFE) {
+      break;
+    } else if (child_type == PROP_ATTR) {
+      r = prop_binary_doc_scan_attr(doc, bp);
+    } else {
+      r = prop_binary_doc_scan_node(doc, bp, child_type);
+    }
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  /* Entries may have been reallocated by now, don't reuse `e` */
+  doc->entries[index].end = doc->nentries;
+
+  return 0;
+}
+
+static int prop_binary_doc_scan_attr(struct prop_binary_doc *doc,
+                                     struct prop_binary_parser *bp) {
+  struct prop_binary_entry *e;
+  struct const_iobuf value;
+  uint32_t index;
+  uint32_t name_pos;
+  char name[PROP_BINARY_NAME_MAX + 1];
+  int r;
+
+  assert(doc != NULL);
+  assert(bp != NULL);
+
+  name_pos = bp->head.pos;
+  r = prop_binary_read_name(&bp->head, bp->packed_names, name);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_binary_slice_value(bp, PROP_ATTR, &value);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_binary_check_attr(name, &value);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_binary_doc_push(doc, &index);
+
+  if (r < 0) {
+    return r;
+  }
+
+  e = &doc->entries[index];
+  e->name_pos = name_pos;
+  e->value_pos = value.bytes - bp->body.bytes;
+  e->value_nbytes = value.nbytes;
+  e->end = index + 1;
+  e->type = PROP_ATTR;
+
+  return 0;
+}
+
+static int prop_binary_doc_make_node(struct prop_binary_doc *doc,
+                                     uint32_t index, struct prop **out) {
+  const struct prop_binary_entry *e;
+  const struct prop_binary_entry *item;
+  struct const_iobuf head;
+  struct prop *p;
+  bool has_children;
+  uint32_t i;
+  char name[PROP_BINARY_NAME_MAX + 1];
+  int r;
+
+  assert(doc != NULL);
+  assert(index < doc->nentries);
+  assert(out != NULL);
+
+  *out = NULL;
+  p = NULL;
+  e = &doc->entries[index];
+  head = doc->bp.head;
+
+  /* Everything was bounds checked during the scan, so none of these reads
+     can fail. */
+
+  head.pos = e->name_pos;
+  r = prop_binary_read_name(&head, doc->bp.packed_names, name);
+
+  assert(r >= 0);
+
+  r = prop_alloc(&p, name, e->type, doc->bp.body.bytes + e->value_pos,
+                 e->value_nbytes);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  has_children = false;
+
+  for (i = index + 1; i < e->end; i = item->end) {
+    item = &doc->entries[i];
+
+    if (item->type != PROP_ATTR) {
+      has_children = true;
+
+      continue;
+    }
+
+    head.pos = item->name_pos;
+    r = prop_binary_read_name(&head, doc->bp.packed_names, name);
+
+    assert(r >= 0);
+
+    r = prop_set_attr(p, name,
+                      (const char *)doc->bp.body.bytes + item->value_pos);
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+  if (has_children) {
+    prop_defer_children(p, prop_binary_doc_load_children, doc, index);
+  }
+
+  *out = p;
+  p = NULL;
+  r = 0;
+
+end:
+  prop_free(p);
+
+  return r;
+}
+
+static int prop_binary_doc_load_children(void *ctx, struct prop *p,
+                                         uint32_t index) {
+  struct prop_binary_doc *doc;
+  const struct prop_binary_entry *e;
+  struct prop *child;
+  uint32_t i;
+  int r;
+
+  assert(ctx != NULL);
+  assert(p != NULL);
+
+  doc = ctx;
+  e = &doc->entries[index];
+
+  for (i = index + 1; i < e->end; i = doc->entries[i].end) {
+    if (doc->entries[i].type == PROP_ATTR) {
+      continue;
+    }
+
+    r = prop_binary_doc_make_node(doc, i, &child);
+
+    if (r < 0) {
+      return r;
+    }
+
+    prop_append(p, child);
+  }
+
+  return 0;
+}
+
+/* First pass of a parallel parse. This records the same entries as the lazy
+   document scan, but only checks as much as it takes to find its way through
+   the head and body. Names aren't available here, so errors can only point at
+   a position in the head. */
+
+static int prop_binary_doc_index_node(struct prop_binary_doc *doc,
+                                      struct prop_binary_parser *bp,
+                                      uint8_t type) {
+  struct prop_binary_entry *e;
+  struct const_iobuf value;
+  uint32_t index;
+  uint32_t name_pos;
+  uint8_t child_type;
+  int r;
+
+  assert(doc != NULL);
+  assert(bp != NULL);
+
+  name_pos = bp->head.pos;
+  r = prop_binary_skip_name(&bp->head, bp->packed_names);
+
+  if (r < 0) {
+    log_write("Failed to read name at head offset %#x", name_pos);
+
+    return r;
+  }
+
+  if (!prop_type_is_valid(type)) {
+    log_write("Unsupported type code %#x at head offset %#x", type, name_pos);
+
+    return -ENOTSUP;
+  }
+
+  r = prop_binary_slice_value(bp, type, &value);
+
+  if (r < 0) {
+    log_write("Failed to read value of type %s at head offset %#x",
+              prop_type_to_string(type), name_pos);
+
+    return r;
+  }
+
+  r = prop_binary_doc_push(doc, &index);
+
+  if (r < 0) {
+    return r;
+  }
+
+  e = &doc->entries[index];
+  e->name_pos = name_pos;
+  e->value_pos = value.nbytes > 0 ? value.bytes - bp->body.bytes : 0;
+  e->value_nbytes = value.nbytes;
+  e->type = type;
+
+  for (;;) {
+    r = iobuf_read_8(&bp->head, &child_type);
+
+    if (r < 0) {
+      log_write("Failed to read child type code of node at head offset %#x",
+                name_pos);
+
+      return r;
+    }
+
+    if (child_type == 0xFE) {
+      break;
+    } else if (child_type == PROP_ATTR) {
+      r = prop_binary_doc_index_attr(doc, bp);
+    } else {
+      r = prop_binary_doc_index_node(doc, bp, child_type);
+    }
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  doc->entries[index].end = doc->nentries;
+
+  return 0;
+}
+
+static int prop_binary_doc_index_attr(struct prop_binary_doc *doc,
+                                      struct prop_binary_parser *bp) {
+  struct prop_binary_entry *e;
+  struct const_iobuf value;
+  uint32_t index;
+  uint32_t name_pos;
+  int r;
+
+  assert(doc != NULL);
+  assert(bp != NULL);
+
+  name_pos = bp->head.pos;
+  r = prop_binary_skip_name(&bp->head, bp->packed_names);
+
+  if (r < 0) {
+    log_write("Failed to read name at head offset %#x", name_pos);
+
+    return r;
+  }
+
+  r = prop_binary_slice_value(bp, PROP_ATTR, &value);
+
+  if (r < 0) {
+    log_write("Failed to read attribute value at head offset %#x", name_pos);
+
+    return r;
+  }
+
+  r = prop_binary_doc_push(doc, &index);
+
+  if (r < 0) {
+    return r;
+  }
+
+  e = &doc->entries[index];
+  e->name_pos = name_pos;
+  e->value_pos = value.bytes - bp->body.bytes;
+  e->value_nbytes = value.nbytes;
+  e->end = index + 1;
+  e->type = PROP_ATTR;
+
+  return 0;
+}
+
+static int prop_binary_batch_make_nodes(void *ctx, size_t begin, size_t end) {
+  struct prop_binary_batch *b;
+  size_t i;
+  int r;
+
+  assert(ctx != NULL);
+
+  b = ctx;
+
+  for (i = begin; i < end; i++) {
+    if (b->doc->entries[i].type == PROP_ATTR) {
+      continue;
+    }
+
+    r = prop_binary_batch_make_node(b, i);
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  return 0;
+}
+
+/* Each node is built along with its attributes by whichever thread owns its
+   entry, even if some of the attribute entries fall into the next chunk. */
+
+static int prop_binary_batch_make_node(struct prop_binary_batch *b,
+                                       uint32_t index) {
+  const struct prop_binary_doc *doc;
+  const struct prop_binary_entry *e;
+  const struct prop_binary_entry *item;
+  struct const_iobuf head;
+  struct const_iobuf value;
+  uint32_t i;
+  char name[PROP_BINARY_NAME_MAX + 1];
+  int r;
+
+  assert(b != NULL);
+
+  doc = b->doc;
+  e = &doc->entries[index];
+  head = doc->bp.head;
+  head.pos = e->name_pos;
+
+  r = prop_binary_read_name(&head, doc->bp.packed_names, name);
+
+  if (r < 0) {
+    log_write("Failed to read name at head offset %#x", e->name_pos);
+
+    return r;
+  }
+
+  r = prop_alloc(&b->nodes[index], name, e->type,
+                 doc->bp.body.bytes + e->value_pos, e->value_nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  for (i = index + 1; i < e->end; i = item->end) {
+    item = &doc->entries[i];
+
+    if (item->type != PROP_ATTR) {
+      continue;
+    }
+
+    head.pos = item->name_pos;
+    r = prop_binary_read_name(&head, doc->bp.packed_names, name);
+
+    if (r < 0) {
+      log_write("Failed to read name at head offset %#x", item->name_pos);
+
+      return r;
+    }
+
+    value.bytes = doc->bp.body.bytes + item->value_pos;
+    value.nbytes = item->value_nbytes;
+    value.pos = 0;
+
+    r = prop_binary_check_attr(name, &value);
+
+    if (r < 0) {
+      return r;
+    }
+
+    r = prop_set_attr(b->nodes[index], name, (const char *)value.bytes);
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  return 0;
+}
+
+static int prop_binary_batch_link_nodes(void *ctx, size_t begin, size_t end) {
+  struct prop_binary_batch *b;
+  const struct prop_binary_entry *entries;
+  size_t i;
+  uint32_t j;
+
+  assert(ctx != NULL);
+
+  b = ctx;
+  entries = b->doc->entries;
+
+  for (i = begin; i < end; i++) {
+    if (entries[i].type == PROP_ATTR) {
+      continue;
+    }
+
+    for (j = i + 1; j < entries[i].end; j = entries[j].end) {
+      if (entries[j].type != PROP_ATTR) {
+        prop_append(b->nodes[i], b->nodes[j]);
+      }
+    }
+  }
+
+  return 0;
+}
@@ -2,6 +2,44 @@
 
 #include <stddef.h>
 
+#include "573file/prop-type.h"
 #include "573file/prop.h"
 
+#include "util/iobuf.h"
+
+struct prop_binary_doc;
+
+/* Event callbacks for prop_binary_visit(). Binary props store each node's
+   value right after its name, so the value is delivered along with the
+   node's begin event. Attributes follow, then any children, then the node's
+   end event. Names only live until the callback returns, whereas values and
+   attribute strings point into the caller's buffer. Returning a negative
+   error code from any callback aborts the walk. begin_doc is optional, and
+   reports the document's encoding before anything else happens. */
+
+struct prop_binary_visitor {
+  int (*begin_doc)(void *ctx, enum prop_encoding encoding);
+  int (*begin_node)(void *ctx, const char *name, enum prop_type type,
+                    const struct const_iobuf *value);
+  int (*attr)(void *ctx, const char *key, const char *val);
+  int (*end_node)(void *ctx);
+};
+
 int prop_binary_parse(struct prop **p, const void *bytes, size_t nbytes);
+
+/* Same result as prop_binary_parse(), but builds the nodes on up to nthreads
+   threads, or one per CPU if nthreads is 0. Props smaller than
+   PROP_BINARY_PARALLEL_MIN bytes aren't worth starting threads for, and are
+   parsed serially. */
+
+#define PROP_BINARY_PARALLEL_MIN (1024 * 1024)
+
+int prop_binary_parse_parallel(struct prop **p, const void *bytes,
+                               size_t nbytes, unsigned int nthreads);
+int prop_binary_visit(const void *bytes, size_t nbytes,
+                      const struct prop_binary_visitor *v, void *ctx);
+
+int prop_binary_doc_open(struct prop_binary_doc **doc, const void *bytes,
+                         size_t nbytes);
+void prop_binary_doc_close(struct prop_binary_doc *doc);
+struct prop *prop_binary_doc_get_root(struct prop_binary_doc *doc);
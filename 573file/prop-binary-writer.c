@@ -0,0 +1,1007 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "573file/prop-binary-writer.h"
+#include "573file/prop-type.h"
+#include "573file/prop.h"
+
+#include "util/fs.h"
+#include "util/iobuf.h"
+#include "util/log.h"
+#include "util/macro.h"
+
+#define ALIGN32(x) (((x) + 3) & ~3)
+#define PROP_BINARY_NAME_MAX 255
+#define PROP_BINARY_SPOOL_NBYTES 0x10000
+#define PROP_BINARY_MAGIC_NBYTES 4
+#define PROP_BINARY_RAW_NAME_MAX 64
+
+/* Align caves are 4-byte slots in the body stream that get shared between
+   consecutive 1-byte (or 2-byte) values. A cave is "full" when its fill level
+   reaches 4, which is also how we represent not having a cave yet. */
+
+struct prop_binary_writer {
+  struct iobuf head;
+  struct iobuf body;
+  size_t cave_pos[2];
+  size_t cave_fill[2];
+  bool packed_names;
+};
+
+/* A spool keeps the tail end of a stream in a fixed-size window and spills
+   everything before that into an anonymous temporary file. */
+
+struct prop_binary_spool {
+  FILE *f;
+  uint8_t *bytes;
+  size_t pos;
+  size_t nflushed;
+};
+
+struct prop_binary_builder {
+  struct prop_binary_spool head;
+  struct prop_binary_spool body;
+  size_t cave_pos[2];
+  size_t cave_fill[2];
+  unsigned int depth;
+  enum prop_encoding encoding;
+  bool packed_names;
+  bool done;
+};
+
+static void prop_binary_writer_init(struct prop_binary_writer *bw,
+                                    bool packed_names, uint8_t *head,
+                                    size_t head_nbytes, uint8_t *body,
+                                    size_t body_nbytes);
+static void prop_binary_write_magic(struct iobuf *dest,
+                                    enum prop_encoding encoding,
+                                    bool packed_names);
+static int prop_binary_write_node(struct prop_binary_writer *bw,
+                                  const struct prop *p);
+static int prop_binary_write_name(struct iobuf *head, bool packed,
+                                  const char *name);
+static int prop_binary_write_packed_name(struct iobuf *head, const char *name,
+                                         size_t nchars);
+static int prop_binary_name_char_index(char c);
+static void prop_binary_write_value(struct prop_binary_writer *bw,
+                                    enum prop_type type,
+                                    const struct const_iobuf *value);
+static void prop_binary_write_cave(struct prop_binary_writer *bw,
+                                   const struct const_iobuf *value);
+static void prop_binary_write_align(struct iobuf *dest);
+static int prop_binary_builder_write_name(struct prop_binary_builder *b,
+                                          const char *name);
+static int prop_binary_builder_write_value(struct prop_binary_builder *b,
+                                           enum prop_type type,
+                                           const struct const_iobuf *value);
+static int prop_binary_builder_write_cave(struct prop_binary_builder *b,
+                                          const struct const_iobuf *value);
+static int prop_binary_spool_init(struct prop_binary_spool *s);
+static void prop_binary_spool_fini(struct prop_binary_spool *s);
+static size_t prop_binary_spool_get_nbytes(const struct prop_binary_spool *s);
+static int prop_binary_spool_align(struct prop_binary_spool *s);
+static int prop_binary_spool_flush(struct prop_binary_spool *s);
+static int prop_binary_spool_write(struct prop_binary_spool *s,
+                                   const void *bytes, size_t nbytes);
+static int prop_binary_spool_patch(struct prop_binary_spool *s, size_t pos,
+                                   const void *bytes, size_t nbytes);
+static int prop_binary_spool_copy(struct prop_binary_spool *s, FILE *f);
+
+int prop_binary_write(const struct prop *p, void **out_bytes,
+                      size_t *out_nbytes) {
+  struct prop_binary_writer bw;
+  struct iobuf file;
+  uint8_t *bytes;
+  size_t head_nbytes;
+  size_t body_nbytes;
+  size_t nbytes;
+  bool packed_names;
+  int r;
+
+  assert(p != NULL);
+  assert(out_bytes != NULL);
+  assert(out_nbytes != NULL);
+
+  *out_bytes = NULL;
+  *out_nbytes = 0;
+
+  /* Dry run with zero-length buffers to lay everything out. This catches any
+     unencodable data too, so the real pass below cannot fail. Names that
+     cannot be packed into six bits per character force the whole document
+     over to raw names. */
+
+  packed_names = true;
+  prop_binary_writer_init(&bw, packed_names, NULL, 0, NULL, 0);
+  r = prop_binary_write_node(&bw, p);
+
+  if (r == -EILSEQ) {
+    packed_names = false;
+    prop_binary_writer_init(&bw, packed_names, NULL, 0, NULL, 0);
+    r = prop_binary_write_node(&bw, p);
+  }
+
+  if (r < 0) {
+    return r;
+  }
+
+  head_nbytes = ALIGN32(bw.head.pos + 1);
+  body_nbytes = ALIGN32(bw.body.pos);
+
+  if (head_nbytes > UINT32_MAX || body_nbytes > UINT32_MAX) {
+    log_write("Binary prop is too large (head %#llx, body %#llx)",
+              (unsigned long long)head_nbytes, (unsigned long long)body_nbytes);
+
+    return -EOVERFLOW;
+  }
+
+  nbytes = PROP_BINARY_MAGIC_NBYTES + 4 + head_nbytes + 4 + body_nbytes;
+  bytes = calloc(nbytes, 1);
+
+  if (bytes == NULL) {
+    return -ENOMEM;
+  }
+
+  file.bytes = bytes;
+  file.nbytes = nbytes;
+  file.pos = 0;
+
+  prop_binary_write_magic(&file, prop_get_encoding(p), packed_names);
+  iobuf_write_be32(&file, head_nbytes);
+  file.pos += head_nbytes;
+  iobuf_write_be32(&file, body_nbytes);
+
+  assert(file.pos + body_nbytes == nbytes);
+
+  prop_binary_writer_init(&bw, packed_names,
+                          bytes + PROP_BINARY_MAGIC_NBYTES + 4, head_nbytes,
+                          bytes + file.pos, body_nbytes);
+  r = prop_binary_write_node(&bw, p);
+
+  assert(r >= 0);
+
+  iobuf_write_8(&bw.head, 0xFF);
+
+  assert(ALIGN32(bw.head.pos) == head_nbytes);
+  assert(ALIGN32(bw.body.pos) == body_nbytes);
+
+  /* Trailing padding is already zero, courtesy of calloc() */
+
+  *out_bytes = bytes;
+  *out_nbytes = nbytes;
+
+  return 0;
+}
+
+static void prop_binary_writer_init(struct prop_binary_writer *bw,
+                                    bool packed_names, uint8_t *head,
+                                    size_t head_nbytes, uint8_t *body,
+                                    size_t body_nbytes) {
+  size_t i;
+
+  assert(bw != NULL);
+
+  bw->packed_names = packed_names;
+
+  bw->head.bytes = head;
+  bw->head.nbytes = head_nbytes;
+  bw->head.pos = 0;
+
+  bw->body.bytes = body;
+  bw->body.nbytes = body_nbytes;
+  bw->body.pos = 0;
+
+  for (i = 0; i < lengthof(bw->cave_fill); i++) {
+    bw->cave_pos[i] = 0;
+    bw->cave_fill[i] = 4;
+  }
+}
+
+static void prop_binary_write_magic(struct iobuf *dest,
+                                    enum prop_encoding encoding,
+                                    bool packed_names) {
+  assert(dest != NULL);
+  assert(prop_encoding_is_valid(encoding));
+
+  iobuf_write_8(dest, 0xA0);
+  iobuf_write_8(dest, packed_names ? 0x42 : 0x45);
+  iobuf_write_8(dest, encoding);
+  iobuf_write_8(dest, ~encoding);
+}
+
+static int prop_binary_write_node(struct prop_binary_writer *bw,
+                                  const struct prop *p) {
+  struct const_iobuf value;
+  const struct prop *child;
+  const struct attr *a;
+  const char *name;
+  const char *val;
+  enum prop_type type;
+  int r;
+
+  assert(bw != NULL);
+  assert(p != NULL);
+
+  name = prop_get_name(p);
+  type = prop_get_type(p);
+
+  iobuf_write_8(&bw->head, type);
+  r = prop_binary_write_name(&bw->head, bw->packed_names, name);
+
+  if (r < 0) {
+    return r;
+  }
+
+  prop_borrow_value(p, &value);
+  prop_binary_write_value(bw, type, &value);
+
+  for (a = prop_get_first_attr(p); a != NULL; a = attr_get_next_sibling(a)) {
+    iobuf_write_8(&bw->head, PROP_ATTR);
+    r = prop_binary_write_name(&bw->head, bw->packed_names, attr_get_key(a));
+
+    if (r < 0) {
+      return r;
+    }
+
+    val = attr_get_val(a);
+    value.bytes = (const uint8_t *)val;
+    value.nbytes = strlen(val) + 1;
+    value.pos = 0;
+
+    prop_binary_write_value(bw, PROP_ATTR, &value);
+  }
+
+  for (child = prop_get_first_child_const(p); child != NULL;
+       child = prop_get_next_sibling_const(child)) {
+    r = prop_binary_write_node(bw, child);
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  iobuf_write_8(&bw->head, 0xFE);
+
+  return 0;
+}
+
+/* Raw names are prefixed with their length minus one, with bit 6 set to
+   tell them apart from packed ones. */
+
+static int prop_binary_write_name(struct iobuf *head, bool packed,
+                                  const char *name) {
+  size_t nchars;
+
+  assert(head != NULL);
+  assert(name != NULL);
+
+  nchars = strlen(name);
+
+  if (packed) {
+    return prop_binary_write_packed_name(head, name, nchars);
+  }
+
+  if (nchars == 0 || nchars > PROP_BINARY_RAW_NAME_MAX) {
+    log_write("\"%s\": Bad length for a raw name (%u chars)", name,
+              (unsigned int)nchars);
+
+    return -EINVAL;
+  }
+
+  iobuf_write_8(head, (nchars - 1) | 0x40);
+  iobuf_write(head, name, nchars);
+
+  return 0;
+}
+
+static int prop_binary_write_packed_name(struct iobuf *head, const char *name,
+                                         size_t nchars) {
+  uint32_t bits;
+  size_t i;
+  int nbits;
+  int index;
+
+  assert(head != NULL);
+  assert(name != NULL);
+
+  if (nchars > PROP_BINARY_NAME_MAX) {
+    log_write("\"%s\": Name is too long (%u chars)", name,
+              (unsigned int)nchars);
+
+    return -EINVAL;
+  }
+
+  iobuf_write_8(head, nchars);
+
+  bits = 0;
+  nbits = 0;
+
+  for (i = 0; i < nchars; i++) {
+    index = prop_binary_name_char_index(name[i]);
+
+    /* Not logged, since callers fall back to raw names when they see this */
+
+    if (index < 0) {
+      return -EILSEQ;
+    }
+
+    bits = (bits << 6) | index;
+    nbits += 6;
+
+    if (nbits >= 8) {
+      nbits -= 8;
+      iobuf_write_8(head, bits >> nbits);
+    }
+  }
+
+  if (nbits > 0) {
+    iobuf_write_8(head, bits << (8 - nbits));
+  }
+
+  return 0;
+}
+
+static int prop_binary_name_char_index(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c == ':') {
+    return 10;
+  } else if (c >= 'A' && c <= 'Z') {
+    return 11 + (c - 'A');
+  } else if (c == '_') {
+    return 37;
+  } else if (c >= 'a' && c <= 'z') {
+    return 38 + (c - 'a');
+  } else {
+    return -1;
+  }
+}
+
+/* This has to mirror prop_binary_slice_value() in the reader exactly. */
+
+static void prop_binary_write_value(struct prop_binary_writer *bw,
+                                    enum prop_type type,
+                                    const struct const_iobuf *value) {
+  int nbytes;
+
+  assert(bw != NULL);
+  assert(value != NULL);
+
+  prop_binary_write_align(&bw->body);
+
+  nbytes = prop_type_to_size(type);
+
+  if (nbytes < 0 || prop_type_is_array(type)) {
+    iobuf_write_be32(&bw->body, value->nbytes);
+    iobuf_write(&bw->body, value->bytes, value->nbytes);
+  } else if (nbytes > 2) {
+    assert(value->nbytes == nbytes);
+
+    iobuf_write(&bw->body, value->bytes, value->nbytes);
+  } else if (nbytes > 0) {
+    assert(value->nbytes == nbytes);
+
+    prop_binary_write_cave(bw, value);
+  }
+}
+
+static void prop_binary_write_cave(struct prop_binary_writer *bw,
+                                   const struct const_iobuf *value) {
+  size_t pos;
+  size_t i;
+
+  assert(bw != NULL);
+  assert(value != NULL);
+  assert(value->nbytes == 1 || value->nbytes == 2);
+
+  i = value->nbytes - 1;
+
+  if (bw->cave_fill[i] >= 4) {
+    bw->cave_pos[i] = bw->body.pos;
+    bw->cave_fill[i] = 0;
+    iobuf_write_be32(&bw->body, 0);
+  }
+
+  pos = bw->cave_pos[i] + bw->cave_fill[i];
+
+  if (pos + value->nbytes <= bw->body.nbytes) {
+    memcpy(bw->body.bytes + pos, value->bytes, value->nbytes);
+  }
+
+  bw->cave_fill[i] += value->nbytes;
+}
+
+static void prop_binary_write_align(struct iobuf *dest) {
+  assert(dest != NULL);
+
+  while (dest->pos % 4 != 0) {
+    iobuf_write_8(dest, 0);
+  }
+}
+
+/* The builder produces the same output as prop_binary_write(), but takes the
+   document one event at a time instead of as a finished tree. The head and
+   body streams are accumulated separately through a pair of spools and only
+   concatenated by prop_binary_builder_finish(), so its memory footprint is
+   constant regardless of how many nodes pass through it. */
+
+int prop_binary_builder_alloc(struct prop_binary_builder **out) {
+  struct prop_binary_builder *b;
+  size_t i;
+  int r;
+
+  assert(out != NULL);
+
+  *out = NULL;
+  b = calloc(1, sizeof(*b));
+
+  if (b == NULL) {
+    r = -ENOMEM;
+
+    goto end;
+  }
+
+  r = prop_binary_spool_init(&b->head);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_binary_spool_init(&b->body);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  for (i = 0; i < lengthof(b->cave_fill); i++) {
+    b->cave_fill[i] = 4;
+  }
+
+  b->encoding = PROP_ENCODING_SHIFT_JIS;
+  b->packed_names = true;
+  *out = b;
+  b = NULL;
+
+end:
+  prop_binary_builder_free(b);
+
+  return r;
+}
+
+void prop_binary_builder_free(struct prop_binary_builder *b) {
+  if (b == NULL) {
+    return;
+  }
+
+  prop_binary_spool_fini(&b->head);
+  prop_binary_spool_fini(&b->body);
+  free(b);
+}
+
+void prop_binary_builder_set_encoding(struct prop_binary_builder *b,
+                                      enum prop_encoding encoding) {
+  assert(b != NULL);
+  assert(prop_encoding_is_valid(encoding));
+
+  b->encoding = encoding;
+}
+
+void prop_binary_builder_set_packed_names(struct prop_binary_builder *b,
+                                          bool packed_names) {
+  assert(b != NULL);
+  assert(prop_binary_spool_get_nbytes(&b->head) == 0);
+
+  b->packed_names = packed_names;
+}
+
+int prop_binary_builder_begin_node(struct prop_binary_builder *b,
+                                   const char *name, enum prop_type type,
+                                   const struct const_iobuf *value) {
+  uint8_t type_code;
+  int r;
+
+  assert(b != NULL);
+  assert(name != NULL);
+  assert(value != NULL);
+
+  if (b->done) {
+    log_write("\"%s\": Document already has a root node", name);
+
+    return -EINVAL;
+  }
+
+  r = prop_validate(name, type, value->bytes, value->nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  type_code = type;
+  r = prop_binary_spool_write(&b->head, &type_code, sizeof(type_code));
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_binary_builder_write_name(b, name);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_binary_builder_write_value(b, type, value);
+
+  if (r < 0) {
+    return r;
+  }
+
+  b->depth++;
+
+  return 0;
+}
+
+int prop_binary_builder_attr(struct prop_binary_builder *b, const char *key,
+                             const char *val) {
+  struct const_iobuf value;
+  uint8_t type_code;
+  int r;
+
+  assert(b != NULL);
+  assert(b->depth > 0);
+  assert(key != NULL);
+  assert(val != NULL);
+
+  type_code = PROP_ATTR;
+  r = prop_binary_spool_write(&b->head, &type_code, sizeof(type_code));
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_binary_builder_write_name(b, key);
+
+  if (r < 0) {
+    return r;
+  }
+
+  value.bytes = (const uint8_t *)val;
+  value.nbytes = strlen(val) + 1;
+  value.pos = 0;
+
+  return prop_binary_builder_write_value(b, PROP_ATTR, &value);
+}
+
+int prop_binary_builder_end_node(struct prop_binary_builder *b) {
+  uint8_t type_code;
+  int r;
+
+  assert(b != NULL);
+  assert(b->depth > 0);
+
+  type_code = 0xFE;
+  r = prop_binary_spool_write(&b->head, &type_code, sizeof(type_code));
+
+  if (r < 0) {
+    return r;
+  }
+
+  b->depth--;
+
+  if (b->depth == 0) {
+    b->done = true;
+  }
+
+  return 0;
+}
+
+int prop_binary_builder_finish(struct prop_binary_builder *b, FILE *f) {
+  uint8_t bytes[8];
+  struct const_iobuf src;
+  struct iobuf dest;
+  uint8_t type_code;
+  size_t head_nbytes;
+  size_t body_nbytes;
+  int r;
+
+  assert(b != NULL);
+  assert(f != NULL);
+
+  if (!b->done || b->depth > 0) {
+    log_write("Document is incomplete");
+
+    return -EINVAL;
+  }
+
+  type_code = 0xFF;
+  r = prop_binary_spool_write(&b->head, &type_code, sizeof(type_code));
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_binary_spool_align(&b->head);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_binary_spool_align(&b->body);
+
+  if (r < 0) {
+    return r;
+  }
+
+  head_nbytes = prop_binary_spool_get_nbytes(&b->head);
+  body_nbytes = prop_binary_spool_get_nbytes(&b->body);
+
+  if (head_nbytes > UINT32_MAX || body_nbytes > UINT32_MAX) {
+    log_write("Binary prop is too large (head %#llx, body %#llx)",
+              (unsigned long long)head_nbytes, (unsigned long long)body_nbytes);
+
+    return -EOVERFLOW;
+  }
+
+  dest.bytes = bytes;
+  dest.nbytes = sizeof(bytes);
+  dest.pos = 0;
+
+  prop_binary_write_magic(&dest, b->encoding, b->packed_names);
+  iobuf_write_be32(&dest, head_nbytes);
+
+  src.bytes = bytes;
+  src.nbytes = dest.pos;
+  src.pos = 0;
+
+  r = fs_write(f, &src);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_binary_spool_copy(&b->head, f);
+
+  if (r < 0) {
+    return r;
+  }
+
+  dest.pos = 0;
+  iobuf_write_be32(&dest, body_nbytes);
+
+  src.nbytes = dest.pos;
+  src.pos = 0;
+
+  r = fs_write(f, &src);
+
+  if (r < 0) {
+    return r;
+  }
+
+  return prop_binary_spool_copy(&b->body, f);
+}
+
+static int prop_binary_builder_write_name(struct prop_binary_builder *b,
+                                          const char *name) {
+  uint8_t bytes[1 + (PROP_BINARY_NAME_MAX * 6 + 7) / 8];
+  struct iobuf dest;
+  int r;
+
+  assert(b != NULL);
+  assert(name != NULL);
+
+  dest.bytes = bytes;
+  dest.nbytes = sizeof(bytes);
+  dest.pos = 0;
+
+  r = prop_binary_write_name(&dest, b->packed_names, name);
+
+  if (r < 0) {
+    return r;
+  }
+
+  assert(dest.pos <= dest.nbytes);
+
+  return prop_binary_spool_write(&b->head, bytes, dest.pos);
+}
+
+/* Same layout rules as prop_binary_write_value() */
+
+static int prop_binary_builder_write_value(struct prop_binary_builder *b,
+                                           enum prop_type type,
+                                           const struct const_iobuf *value) {
+  uint8_t bytes[4];
+  struct iobuf dest;
+  int nbytes;
+  int r;
+
+  assert(b != NULL);
+  assert(value != NULL);
+
+  r = prop_binary_spool_align(&b->body);
+
+  if (r < 0) {
+    return r;
+  }
+
+  nbytes = prop_type_to_size(type);
+
+  if (nbytes < 0 || prop_type_is_array(type)) {
+    dest.bytes = bytes;
+    dest.nbytes = sizeof(bytes);
+    dest.pos = 0;
+
+    iobuf_write_be32(&dest, value->nbytes);
+    r = prop_binary_spool_write(&b->body, bytes, sizeof(bytes));
+
+    if (r < 0) {
+      return r;
+    }
+
+    return prop_binary_spool_write(&b->body, value->bytes, value->nbytes);
+  } else if (nbytes > 2) {
+    return prop_binary_spool_write(&b->body, value->bytes, value->nbytes);
+  } else if (nbytes > 0) {
+    return prop_binary_builder_write_cave(b, value);
+  }
+
+  return 0;
+}
+
+static int prop_binary_builder_write_cave(struct prop_binary_builder *b,
+                                          const struct const_iobuf *value) {
+  static const uint8_t zeros[4];
+  size_t i;
+  int r;
+
+  assert(b != NULL);
+  assert(value != NULL);
+  assert(value->nbytes == 1 || value->nbytes == 2);
+
+  i = value->nbytes - 1;
+
+  if (b->cave_fill[i] >= 4) {
+    b->cave_pos[i] = prop_binary_spool_get_nbytes(&b->body);
+    b->cave_fill[i] = 0;
+
+    r = prop_binary_spool_write(&b->body, zeros, sizeof(zeros));
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  r = prop_binary_spool_patch(&b->body, b->cave_pos[i] + b->cave_fill[i],
+                              value->bytes, value->nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  b->cave_fill[i] += value->nbytes;
+
+  return 0;
+}
+
+static int prop_binary_spool_init(struct prop_binary_spool *s) {
+  assert(s != NULL);
+
+  memset(s, 0, sizeof(*s));
+  s->bytes = malloc(PROP_BINARY_SPOOL_NBYTES);
+
+  if (s->bytes == NULL) {
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+static void prop_binary_spool_fini(struct prop_binary_spool *s) {
+  assert(s != NULL);
+
+  fs_close(s->f);
+  free(s->bytes);
+}
+
+static size_t prop_binary_spool_get_nbytes(const struct prop_binary_spool *s) {
+  assert(s != NULL);
+
+  return s->nflushed + s->pos;
+}
+
+static int prop_binary_spool_align(struct prop_binary_spool *s) {
+  static const uint8_t zeros[4];
+  size_t nbytes;
+
+  assert(s != NULL);
+
+  nbytes = prop_binary_spool_get_nbytes(s);
+
+  return prop_binary_spool_write(s, zeros, ALIGN32(nbytes) - nbytes);
+}
+
+static int prop_binary_spool_flush(struct prop_binary_spool *s) {
+  struct const_iobuf src;
+  int r;
+
+  assert(s != NULL);
+
+  if (s->pos == 0) {
+    return 0;
+  }
+
+  if (s->f == NULL) {
+    s->f = tmpfile();
+
+    if (s->f == NULL) {
+      r = -errno;
+      log_write("Failed to create temporary file: %s (%i)", strerror(-r), r);
+
+      return r;
+    }
+  }
+
+  src.bytes = s->bytes;
+  src.nbytes = s->pos;
+  src.pos = 0;
+
+  r = fs_write(s->f, &src);
+
+  if (r < 0) {
+    return r;
+  }
+
+  s->nflushed += s->pos;
+  s->pos = 0;
+
+  return 0;
+}
+
+static int prop_binary_spool_write(struct prop_binary_spool *s,
+                                   const void *bytes, size_t nbytes) {
+  struct const_iobuf src;
+  int r;
+
+  assert(s != NULL);
+  assert(bytes != NULL || nbytes == 0);
+
+  if (s->pos + nbytes > PROP_BINARY_SPOOL_NBYTES) {
+    r = prop_binary_spool_flush(s);
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  if (nbytes > PROP_BINARY_SPOOL_NBYTES) {
+    /* Window is empty at this point, so just write this out directly */
+    src.bytes = bytes;
+    src.nbytes = nbytes;
+    src.pos = 0;
+
+    r = fs_write(s->f, &src);
+
+    if (r < 0) {
+      return r;
+    }
+
+    s->nflushed += nbytes;
+
+    return 0;
+  }
+
+  memcpy(s->bytes + s->pos, bytes, nbytes);
+  s->pos += nbytes;
+
+  return 0;
+}
+
+/* Rewrites bytes that have already been written. The range must not straddle
+   the boundary between the window and the file, which holds for align caves
+   since those are always written as a single 4-byte unit. */
+
+static int prop_binary_spool_patch(struct prop_binary_spool *s, size_t pos,
+                                   const void *bytes, size_t nbytes) {
+  struct const_iobuf src;
+  int r;
+
+  assert(s != NULL);
+  assert(bytes != NULL);
+  assert(pos + nbytes <= prop_binary_spool_get_nbytes(s));
+
+  if (pos >= s->nflushed) {
+    memcpy(s->bytes + (pos - s->nflushed), bytes, nbytes);
+
+    return 0;
+  }
+
+  assert(pos + nbytes <= s->nflushed);
+
+  r = fs_seek_to(s->f, pos);
+
+  if (r < 0) {
+    return r;
+  }
+
+  src.bytes = bytes;
+  src.nbytes = nbytes;
+  src.pos = 0;
+
+  r = fs_write(s->f, &src);
+
+  if (r < 0) {
+    return r;
+  }
+
+  if (fseek(s->f, 0, SEEK_END) != 0) {
+    r = -errno;
+    log_write("fseek(SEEK_END): %s (%i)", strerror(-r), r);
+
+    return r;
+  }
+
+  return 0;
+}
+
+static int prop_binary_spool_copy(struct prop_binary_spool *s, FILE *f) {
+  struct iobuf chunk;
+  struct const_iobuf src;
+  size_t remaining;
+  int r;
+
+  assert(s != NULL);
+  assert(f != NULL);
+
+  if (s->f != NULL) {
+    r = prop_binary_spool_flush(s);
+
+    if (r < 0) {
+      return r;
+    }
+
+    r = fs_seek_to(s->f, 0);
+
+    if (r < 0) {
+      return r;
+    }
+
+    for (remaining = s->nflushed; remaining > 0; remaining -= chunk.nbytes) {
+      chunk.bytes = s->bytes;
+      chunk.nbytes = remaining < PROP_BINARY_SPOOL_NBYTES
+                         ? remaining
+                         : PROP_BINARY_SPOOL_NBYTES;
+      chunk.pos = 0;
+
+      r = fs_read(s->f, &chunk);
+
+      if (r < 0) {
+        return r;
+      }
+
+      src.bytes = chunk.bytes;
+      src.nbytes = chunk.nbytes;
+      src.pos = 0;
+
+      r = fs_write(f, &src);
+
+      if (r < 0) {
+        return r;
+      }
+    }
+  } else {
+    src.bytes = s->bytes;
+    src.nbytes = s->pos;
+    src.pos = 0;
+
+    r = fs_write(f, &src);
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  return 0;
+}
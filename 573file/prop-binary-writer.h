@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "573file/prop-type.h"
+#include "573file/prop.h"
+
+#include "util/iobuf.h"
+
+/* Documents are written in the root node's encoding, with packed names
+   unless some name contains characters that cannot be packed. */
+
+int prop_binary_write(const struct prop *p, void **bytes, size_t *nbytes);
+
+/* Builders write Shift-JIS documents with packed names by default. The name
+   format can only be changed before the first node has been added. A name
+   that cannot be packed fails with -EILSEQ and nothing logged, so that the
+   caller can start over with raw names. */
+
+struct prop_binary_builder;
+
+int prop_binary_builder_alloc(struct prop_binary_builder **b);
+void prop_binary_builder_free(struct prop_binary_builder *b);
+void prop_binary_builder_set_encoding(struct prop_binary_builder *b,
+                                      enum prop_encoding encoding);
+void prop_binary_builder_set_packed_names(struct prop_binary_builder *b,
+                                          bool packed_names);
+int prop_binary_builder_begin_node(struct prop_binary_builder *b,
+                                   const char *name, enum prop_type type,
+                                   const struct const_iobuf *value);
+int prop_binary_builder_attr(struct prop_binary_builder *b, const char *key,
+                             const char *val);
+int prop_binary_builder_end_node(struct prop_binary_builder *b);
+int prop_binary_builder_finish(struct prop_binary_builder *b, FILE *f);
@@ -0,0 +1,1473 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "573file/prop-binary-reader.h"
+#include "573file/prop-cow.h"
+#include "573file/prop-type.h"
+#include "573file/prop-xml-reader.h"
+#include "573file/prop.h"
+
+#include "util/iobuf.h"
+#include "util/log.h"
+#include "util/str.h"
+
+#define PROP_COW_CHUNK 64
+
+/* A node's name, value and attributes live in a separately reference counted
+   block, so that copying a node in order to swap one of its children (which
+   is what happens to every ancestor of an edit) leaves these alone.
+
+   attrs has room for at least nattrs entries, since nodes are built up by
+   allocating the worst case number of attributes and then adding them. */
+
+struct prop_cow_attr {
+  char *key;
+  char *val;
+};
+
+struct prop_cow_data {
+  unsigned int refs;
+  char *name;
+  struct prop_cow_attr *attrs;
+  uint32_t name_hash;
+  uint32_t nattrs;
+  uint32_t nbytes;
+  enum prop_type type;
+  enum prop_encoding encoding;
+  uint8_t bytes[];
+};
+
+/* Child lists are split into reference counted chunks of up to
+   PROP_COW_CHUNK children, so that copying a node with a huge number of
+   children only copies its table of chunks plus the one chunk that actually
+   changed. Each span records the index of its chunk's first child. */
+
+struct prop_cow_chunk {
+  unsigned int refs;
+  uint32_t nchildren;
+  struct prop_cow *children[PROP_COW_CHUNK];
+};
+
+struct prop_cow_span {
+  uint32_t start;
+  struct prop_cow_chunk *chunk;
+};
+
+struct prop_cow {
+  unsigned int refs;
+  struct prop_cow_data *data;
+  uint32_t nchildren;
+  uint32_t nspans;
+  struct prop_cow_span spans[];
+};
+
+/* Child lists get put together by appending children (whose references the
+   builder takes over) and sharing whole chunks of existing nodes. */
+
+struct prop_cow_builder {
+  struct prop_cow_span *spans;
+  struct prop_cow_chunk *open;
+  uint32_t nchildren;
+  uint32_t nspans;
+  uint32_t max_spans;
+};
+
+struct prop_cow_value {
+  enum prop_type type;
+  const void *bytes;
+  uint32_t nbytes;
+};
+
+struct prop_cow_attr_edit {
+  const char *key;
+  const char *val;
+};
+
+struct prop_cow_splice {
+  uint32_t pos;
+  uint32_t ndelete;
+  struct prop_cow *child;
+};
+
+typedef int (*prop_cow_edit_t)(struct prop_cow **out, struct prop_cow *n,
+                               void *ctx);
+
+static int prop_cow_data_alloc(struct prop_cow_data **out, const char *name,
+                               enum prop_type type, const void *bytes,
+                               uint32_t nbytes, uint32_t max_attrs);
+static int prop_cow_data_copy(struct prop_cow_data **out,
+                              const struct prop_cow_data *src,
+                              enum prop_type type, const void *bytes,
+                              uint32_t nbytes, uint32_t nspare);
+static void prop_cow_data_unref(struct prop_cow_data *data);
+static int prop_cow_data_put_attr(struct prop_cow_data *data, const char *key,
+                                  const char *val);
+static void prop_cow_data_remove_attr(struct prop_cow_data *data,
+                                      const char *key);
+static int prop_cow_node_alloc(struct prop_cow **out,
+                               struct prop_cow_data *data, uint32_t nspans);
+static void prop_cow_chunk_unref(struct prop_cow_chunk *chunk);
+static void prop_cow_builder_init(struct prop_cow_builder *b);
+static void prop_cow_builder_fini(struct prop_cow_builder *b);
+static int prop_cow_builder_push(struct prop_cow_builder *b,
+                                 struct prop_cow *child);
+static int prop_cow_builder_share(struct prop_cow_builder *b,
+                                  struct prop_cow_chunk *chunk);
+static int prop_cow_builder_add_span(struct prop_cow_builder *b,
+                                     struct prop_cow_chunk *chunk);
+static int prop_cow_builder_finish(struct prop_cow_builder *b,
+                                   struct prop_cow_data *data,
+                                   struct prop_cow **out);
+static uint32_t prop_cow_find_span(const struct prop_cow *n, uint32_t i);
+static struct prop_cow *prop_cow_child_at(const struct prop_cow *n, uint32_t i);
+static int prop_cow_with_data(struct prop_cow **out, const struct prop_cow *n,
+                              struct prop_cow_data *data);
+static int prop_cow_splice(struct prop_cow **out, const struct prop_cow *n,
+                           uint32_t pos, uint32_t ndelete,
+                           struct prop_cow *child);
+static int prop_cow_edit_path(struct prop_cow **out, struct prop_cow *n,
+                              const uint32_t *path, uint32_t depth,
+                              prop_cow_edit_t edit, void *ctx);
+static int prop_cow_edit_value(struct prop_cow **out, struct prop_cow *n,
+                               void *ctx);
+static int prop_cow_edit_attr(struct prop_cow **out, struct prop_cow *n,
+                              void *ctx);
+static int prop_cow_edit_children(struct prop_cow **out, struct prop_cow *n,
+                                  void *ctx);
+static int prop_cow_import_node(struct prop_cow **out, const struct prop *p,
+                                bool overlay);
+static int prop_cow_merge(struct prop_cow **out, struct prop_cow *base,
+                          const struct prop *overlay);
+static int prop_cow_match(const struct prop_cow *base,
+                          const struct prop *overlay, const struct prop *child,
+                          uint32_t *out);
+static bool prop_cow_is_control_attr(const char *key);
+
+int prop_cow_alloc(struct prop_cow **out, const char *name, enum prop_type type,
+                   const void *bytes, uint32_t nbytes) {
+  struct prop_cow_data *data;
+  int r;
+
+  assert(out != NULL);
+  assert(name != NULL);
+  assert(bytes != NULL || nbytes == 0);
+
+  *out = NULL;
+
+  r = prop_cow_data_alloc(&data, name, type, bytes, nbytes, 0);
+
+  if (r < 0) {
+    return r;
+  }
+
+  return prop_cow_node_alloc(out, data, 0);
+}
+
+int prop_cow_import(struct prop_cow **out, const struct prop *p) {
+  assert(out != NULL);
+  assert(p != NULL);
+
+  return prop_cow_import_node(out, p, false);
+}
+
+int prop_cow_export(struct prop **out, const struct prop_cow *n) {
+  const struct prop_cow_data *data;
+  struct prop *p;
+  struct prop *child;
+  uint32_t i;
+  int r;
+
+  assert(out != NULL);
+  assert(n != NULL);
+
+  *out = NULL;
+  data = n->data;
+
+  r = prop_alloc(&p, data->name, data->type, data->bytes, data->nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  prop_set_encoding(p, data->encoding);
+
+  for (i = 0; i < data->nattrs; i++) {
+    r = prop_set_attr(p, data->attrs[i].key, data->attrs[i].val);
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+  for (i = 0; i < n->nchildren; i++) {
+    r = prop_cow_export(&child, prop_cow_child_at(n, i));
+
+    if (r < 0) {
+      goto end;
+    }
+
+    prop_append(p, child);
+  }
+
+  *out = p;
+  p = NULL;
+
+end:
+  prop_free(p);
+
+  return r;
+}
+
+struct prop_cow *prop_cow_ref(struct prop_cow *n) {
+  assert(n != NULL);
+
+  n->refs++;
+
+  return n;
+}
+
+void prop_cow_unref(struct prop_cow *n) {
+  uint32_t i;
+
+  if (n == NULL) {
+    return;
+  }
+
+  assert(n->refs > 0);
+
+  if (--n->refs > 0) {
+    return;
+  }
+
+  for (i = 0; i < n->nspans; i++) {
+    prop_cow_chunk_unref(n->spans[i].chunk);
+  }
+
+  prop_cow_data_unref(n->data);
+  free(n);
+}
+
+void prop_cow_borrow_value(const struct prop_cow *n, struct const_iobuf *out) {
+  assert(n != NULL);
+  assert(out != NULL);
+
+  out->bytes = n->data->bytes;
+  out->nbytes = n->data->nbytes;
+  out->pos = 0;
+}
+
+const char *prop_cow_get_attr(const struct prop_cow *n, const char *key) {
+  const struct prop_cow_data *data;
+  uint32_t i;
+
+  assert(n != NULL);
+  assert(key != NULL);
+
+  data = n->data;
+
+  for (i = 0; i < data->nattrs; i++) {
+    if (str_eq(data->attrs[i].key, key)) {
+      return data->attrs[i].val;
+    }
+  }
+
+  return NULL;
+}
+
+uint32_t prop_cow_get_attr_count(const struct prop_cow *n) {
+  assert(n != NULL);
+
+  return n->data->nattrs;
+}
+
+const char *prop_cow_get_attr_key(const struct prop_cow *n, uint32_t i) {
+  assert(n != NULL);
+  assert(i < n->data->nattrs);
+
+  return n->data->attrs[i].key;
+}
+
+const char *prop_cow_get_attr_val(const struct prop_cow *n, uint32_t i) {
+  assert(n != NULL);
+  assert(i < n->data->nattrs);
+
+  return n->data->attrs[i].val;
+}
+
+struct prop_cow *prop_cow_get_child(struct prop_cow *n, uint32_t i) {
+  assert(n != NULL);
+  assert(i < n->nchildren);
+
+  return prop_cow_child_at(n, i);
+}
+
+uint32_t prop_cow_get_child_count(const struct prop_cow *n) {
+  assert(n != NULL);
+
+  return n->nchildren;
+}
+
+const char *prop_cow_get_name(const struct prop_cow *n) {
+  assert(n != NULL);
+
+  return n->data->name;
+}
+
+enum prop_type prop_cow_get_type(const struct prop_cow *n) {
+  assert(n != NULL);
+
+  return n->data->type;
+}
+
+const char *prop_cow_get_value_str(const struct prop_cow *n) {
+  assert(n != NULL);
+  assert(n->data->type == PROP_STR);
+
+  return (const char *)n->data->bytes;
+}
+
+uint32_t prop_cow_search_child(const struct prop_cow *n, const char *name,
+                               uint32_t start) {
+  const struct prop_cow_data *data;
+  const struct prop_cow_span *span;
+  uint32_t hash;
+  uint32_t s;
+  uint32_t i;
+
+  assert(n != NULL);
+  assert(name != NULL);
+
+  if (start >= n->nchildren) {
+    return PROP_COW_NONE;
+  }
+
+  hash = str_hash(name);
+
+  for (s = prop_cow_find_span(n, start); s < n->nspans; s++) {
+    span = &n->spans[s];
+    i = start > span->start ? start - span->start : 0;
+
+    for (; i < span->chunk->nchildren; i++) {
+      data = span->chunk->children[i]->data;
+
+      if (data->name_hash == hash && str_eq(data->name, name)) {
+        return span->start + i;
+      }
+    }
+  }
+
+  return PROP_COW_NONE;
+}
+
+int prop_cow_set_value(struct prop_cow **out, struct prop_cow *root,
+                       const uint32_t *path, uint32_t depth,
+                       enum prop_type type, const void *bytes,
+                       uint32_t nbytes) {
+  struct prop_cow_value value;
+
+  assert(out != NULL);
+  assert(root != NULL);
+  assert(path != NULL || depth == 0);
+  assert(bytes != NULL || nbytes == 0);
+
+  value.type = type;
+  value.bytes = bytes;
+  value.nbytes = nbytes;
+
+  return prop_cow_edit_path(out, root, path, depth, prop_cow_edit_value,
+                            &value);
+}
+
+int prop_cow_set_attr(struct prop_cow **out, struct prop_cow *root,
+                      const uint32_t *path, uint32_t depth, const char *key,
+                      const char *val) {
+  struct prop_cow_attr_edit edit;
+
+  assert(out != NULL);
+  assert(root != NULL);
+  assert(path != NULL || depth == 0);
+  assert(key != NULL);
+
+  edit.key = key;
+  edit.val = val;
+
+  return prop_cow_edit_path(out, root, path, depth, prop_cow_edit_attr, &edit);
+}
+
+int prop_cow_insert_child(struct prop_cow **out, struct prop_cow *root,
+                          const uint32_t *path, uint32_t depth, uint32_t pos,
+                          struct prop_cow *child) {
+  struct prop_cow_splice splice;
+
+  assert(out != NULL);
+  assert(root != NULL);
+  assert(path != NULL || depth == 0);
+  assert(child != NULL);
+
+  splice.pos = pos;
+  splice.ndelete = 0;
+  splice.child = child;
+
+  return prop_cow_edit_path(out, root, path, depth, prop_cow_edit_children,
+                            &splice);
+}
+
+int prop_cow_remove_child(struct prop_cow **out, struct prop_cow *root,
+                          const uint32_t *path, uint32_t depth, uint32_t pos) {
+  struct prop_cow_splice splice;
+
+  assert(out != NULL);
+  assert(root != NULL);
+  assert(path != NULL || depth == 0);
+
+  splice.pos = pos;
+  splice.ndelete = 1;
+  splice.child = NULL;
+
+  return prop_cow_edit_path(out, root, path, depth, prop_cow_edit_children,
+                            &splice);
+}
+
+int prop_cow_apply(struct prop_cow **out, struct prop_cow *root,
+                   const struct prop *overlay) {
+  assert(out != NULL);
+  assert(root != NULL);
+  assert(overlay != NULL);
+
+  *out = NULL;
+
+  if (!str_eq(root->data->name, prop_get_name(overlay))) {
+    log_write("Overlay root <%s> does not match <%s>", prop_get_name(overlay),
+              root->data->name);
+
+    return -EINVAL;
+  }
+
+  return prop_cow_merge(out, root, overlay);
+}
+
+int prop_cow_apply_binary(struct prop_cow **out, struct prop_cow *root,
+                          const void *bytes, size_t nbytes) {
+  struct prop *overlay;
+  int r;
+
+  assert(out != NULL);
+  assert(root != NULL);
+  assert(bytes != NULL);
+
+  *out = NULL;
+
+  r = prop_binary_parse(&overlay, bytes, nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_cow_apply(out, root, overlay);
+  prop_free(overlay);
+
+  return r;
+}
+
+int prop_cow_apply_xml(struct prop_cow **out, struct prop_cow *root,
+                       const void *bytes, size_t nbytes) {
+  struct prop *overlay;
+  int r;
+
+  assert(out != NULL);
+  assert(root != NULL);
+  assert(bytes != NULL);
+
+  *out = NULL;
+
+  r = prop_xml_parse(&overlay, bytes, nbytes, root->data->encoding);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_cow_apply(out, root, overlay);
+  prop_free(overlay);
+
+  return r;
+}
+
+static int prop_cow_data_alloc(struct prop_cow_data **out, const char *name,
+                               enum prop_type type, const void *bytes,
+                               uint32_t nbytes, uint32_t max_attrs) {
+  struct prop_cow_data *data;
+  int r;
+
+  assert(out != NULL);
+  assert(name != NULL);
+
+  *out = NULL;
+  data = NULL;
+
+  r = prop_validate(name, type, bytes, nbytes);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  data = calloc(1, sizeof(*data) + nbytes);
+
+  if (data == NULL) {
+    r = -ENOMEM;
+
+    goto end;
+  }
+
+  data->refs = 1;
+
+  r = str_dup(&data->name, name);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  if (max_attrs > 0) {
+    data->attrs = calloc(max_attrs, sizeof(*data->attrs));
+
+    if (data->attrs == NULL) {
+      r = -ENOMEM;
+
+      goto end;
+    }
+  }
+
+  data->name_hash = str_hash(name);
+  data->type = type;
+  data->encoding = PROP_ENCODING_SHIFT_JIS;
+  data->nbytes = nbytes;
+
+  if (nbytes > 0) {
+    memcpy(data->bytes, bytes, nbytes);
+  }
+
+  *out = data;
+  data = NULL;
+
+end:
+  prop_cow_data_unref(data);
+
+  return r;
+}
+
+static int prop_cow_data_copy(struct prop_cow_data **out,
+                              const struct prop_cow_data *src,
+                              enum prop_type type, const void *bytes,
+                              uint32_t nbytes, uint32_t nspare) {
+  struct prop_cow_data *data;
+  uint32_t i;
+  int r;
+
+  assert(out != NULL);
+  assert(src != NULL);
+
+  *out = NULL;
+
+  r = prop_cow_data_alloc(&data, src->name, type, bytes, nbytes,
+                          src->nattrs + nspare);
+
+  if (r < 0) {
+    return r;
+  }
+
+  data->encoding = src->encoding;
+
+  for (i = 0; i < src->nattrs; i++) {
+    r = prop_cow_data_put_attr(data, src->attrs[i].key, src->attrs[i].val);
+
+    if (r < 0) {
+      prop_cow_data_unref(data);
+
+      return r;
+    }
+  }
+
+  *out = data;
+
+  return 0;
+}
+
+static void prop_cow_data_unref(struct prop_cow_data *data) {
+  uint32_t i;
+
+  if (data == NULL) {
+    return;
+  }
+
+  assert(data->refs > 0);
+
+  if (--data->refs > 0) {
+    return;
+  }
+
+  for (i = 0; i < data->nattrs; i++) {
+    free(data->attrs[i].key);
+    free(data->attrs[i].val);
+  }
+
+  free(data->attrs);
+  free(data->name);
+  free(data);
+}
+
+/* Caller must have allocated room for a new attribute */
+
+static int prop_cow_data_put_attr(struct prop_cow_data *data, const char *key,
+                                  const char *val) {
+  struct prop_cow_attr *attr;
+  char *copy;
+  uint32_t i;
+  int r;
+
+  assert(data != NULL);
+  assert(key != NULL);
+  assert(val != NULL);
+
+  r = str_dup(&copy, val);
+
+  if (r < 0) {
+    return r;
+  }
+
+  for (i = 0; i < data->nattrs; i++) {
+    attr = &data->attrs[i];
+
+    if (str_eq(attr->key, key)) {
+      free(attr->val);
+      attr->val = copy;
+
+      return 0;
+    }
+  }
+
+  attr = &data->attrs[data->nattrs];
+
+  r = str_dup(&attr->key, key);
+
+  if (r < 0) {
+    free(copy);
+
+    return r;
+  }
+
+  attr->val = copy;
+  data->nattrs++;
+
+  return 0;
+}
+
+static void prop_cow_data_remove_attr(struct prop_cow_data *data,
+                                      const char *key) {
+  uint32_t i;
+
+  assert(data != NULL);
+  assert(key != NULL);
+
+  for (i = 0; i < data->nattrs; i++) {
+    if (str_eq(data->attrs[i].key, key)) {
+      free(data->attrs[i].key);
+      free(data->attrs[i].val);
+      memmove(&data->attrs[i], &data->attrs[i + 1],
+              (data->nattrs - i - 1) * sizeof(*data->attrs));
+      data->nattrs--;
+
+      return;
+    }
+  }
+}
+
+/* Takes ownership of the caller's reference to data, even on failure. The
+   caller fills in the spans. */
+
+static int prop_cow_node_alloc(struct prop_cow **out,
+                               struct prop_cow_data *data, uint32_t nspans) {
+  struct prop_cow *n;
+
+  assert(out != NULL);
+  assert(data != NULL);
+
+  *out = NULL;
+  n = calloc(1, sizeof(*n) + nspans * sizeof(n->spans[0]));
+
+  if (n == NULL) {
+    prop_cow_data_unref(data);
+
+    return -ENOMEM;
+  }
+
+  n->refs = 1;
+  n->data = data;
+  n->nspans = nspans;
+  *out = n;
+
+  return 0;
+}
+
+static void prop_cow_chunk_unref(struct prop_cow_chunk *chunk) {
+  uint32_t i;
+
+  if (chunk == NULL) {
+    return;
+  }
+
+  assert(chunk->refs > 0);
+
+  if (--chunk->refs > 0) {
+    return;
+  }
+
+  for (i = 0; i < chunk->nchildren; i++) {
+    prop_cow_unref(chunk->children[i]);
+  }
+
+  free(chunk);
+}
+
+static void prop_cow_builder_init(struct prop_cow_builder *b) {
+  assert(b != NULL);
+
+  memset(b, 0, sizeof(*b));
+}
+
+static void prop_cow_builder_fini(struct prop_cow_builder *b) {
+  uint32_t i;
+
+  assert(b != NULL);
+
+  for (i = 0; i < b->nspans; i++) {
+    prop_cow_chunk_unref(b->spans[i].chunk);
+  }
+
+  free(b->spans);
+  prop_cow_builder_init(b);
+}
+
+/* Takes ownership of the caller's reference to child, even on failure */
+
+static int prop_cow_builder_push(struct prop_cow_builder *b,
+                                 struct prop_cow *child) {
+  struct prop_cow_chunk *chunk;
+  int r;
+
+  assert(b != NULL);
+  assert(child != NULL);
+
+  if (b->open == NULL || b->open->nchildren == PROP_COW_CHUNK) {
+    chunk = calloc(1, sizeof(*chunk));
+
+    if (chunk == NULL) {
+      prop_cow_unref(child);
+
+      return -ENOMEM;
+    }
+
+    chunk->refs = 1;
+
+    r = prop_cow_builder_add_span(b, chunk);
+
+    if (r < 0) {
+      free(chunk);
+      prop_cow_unref(child);
+
+      return r;
+    }
+
+    b->open = chunk;
+  }
+
+  b->open->children[b->open->nchildren++] = child;
+  b->nchildren++;
+
+  return 0;
+}
+
+static int prop_cow_builder_share(struct prop_cow_builder *b,
+                                  struct prop_cow_chunk *chunk) {
+  int r;
+
+  assert(b != NULL);
+  assert(chunk != NULL);
+
+  r = prop_cow_builder_add_span(b, chunk);
+
+  if (r < 0) {
+    return r;
+  }
+
+  chunk->refs++;
+  b->nchildren += chunk->nchildren;
+  b->open = NULL;
+
+  return 0;
+}
+
+static int prop_cow_builder_add_span(struct prop_cow_builder *b,
+                                     struct prop_cow_chunk *chunk) {
+  struct prop_cow_span *spans;
+  uint32_t max_spans;
+
+  assert(b != NULL);
+  assert(chunk != NULL);
+
+  if (b->nspans == b->max_spans) {
+    max_spans = b->max_spans > 0 ? b->max_spans * 2 : 4;
+    spans = realloc(b->spans, max_spans * sizeof(*spans));
+
+    if (spans == NULL) {
+      return -ENOMEM;
+    }
+
+    b->spans = spans;
+    b->max_spans = max_spans;
+  }
+
+  b->spans[b->nspans].start = b->nchildren;
+  b->spans[b->nspans].chunk = chunk;
+  b->nspans++;
+
+  return 0;
+}
+
+/* Takes ownership of the caller's reference to data, even on failure, and
+   leaves the builder empty on success. */
+
+static int prop_cow_builder_finish(struct prop_cow_builder *b,
+                                   struct prop_cow_data *data,
+                                   struct prop_cow **out) {
+  struct prop_cow *n;
+  int r;
+
+  assert(b != NULL);
+  assert(data != NULL);
+  assert(out != NULL);
+
+  r = prop_cow_node_alloc(&n, data, b->nspans);
+
+  if (r < 0) {
+    return r;
+  }
+
+  n->nchildren = b->nchildren;
+
+  if (b->nspans > 0) {
+    memcpy(n->spans, b->spans, b->nspans * sizeof(*b->spans));
+  }
+
+  free(b->spans);
+  prop_cow_builder_init(b);
+  *out = n;
+
+  return 0;
+}
+
+static uint32_t prop_cow_find_span(const struct prop_cow *n, uint32_t i) {
+  uint32_t lo;
+  uint32_t hi;
+  uint32_t mid;
+
+  assert(n != NULL);
+  assert(i < n->nchildren);
+
+  lo = 0;
+  hi = n->nspans;
+
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+
+    if (n->spans[mid].start <= i) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+static struct prop_cow *prop_cow_child_at(const struct prop_cow *n,
+                                          uint32_t i) {
+  const struct prop_cow_span *span;
+
+  span = &n->spans[prop_cow_find_span(n, i)];
+
+  return span->chunk->children[i - span->start];
+}
+
+/* Takes ownership of the caller's reference to data, even on failure */
+
+static int prop_cow_with_data(struct prop_cow **out, const struct prop_cow *n,
+                              struct prop_cow_data *data) {
+  uint32_t i;
+  int r;
+
+  assert(out != NULL);
+  assert(n != NULL);
+
+  r = prop_cow_node_alloc(out, data, n->nspans);
+
+  if (r < 0) {
+    return r;
+  }
+
+  (*out)->nchildren = n->nchildren;
+
+  for (i = 0; i < n->nspans; i++) {
+    (*out)->spans[i] = n->spans[i];
+    (*out)->spans[i].chunk->refs++;
+  }
+
+  return 0;
+}
+
+/* Copy n with ndelete children removed at pos and child (if any) inserted in
+   their place. Only the chunk holding pos gets copied. Takes ownership of the
+   caller's reference to child, even on failure. */
+
+static int prop_cow_splice(struct prop_cow **out, const struct prop_cow *n,
+                           uint32_t pos, uint32_t ndelete,
+                           struct prop_cow *child) {
+  struct prop_cow_builder b;
+  const struct prop_cow_span *span;
+  uint32_t target;
+  uint32_t i;
+  uint32_t s;
+  int r;
+
+  assert(out != NULL);
+  assert(n != NULL);
+  assert(pos + ndelete <= n->nchildren);
+
+  *out = NULL;
+  prop_cow_builder_init(&b);
+
+  /* Appends go into the last chunk while it has room, so that a run of them
+     does not leave a trail of tiny chunks behind. */
+
+  if (pos < n->nchildren) {
+    target = prop_cow_find_span(n, pos);
+  } else if (n->nspans > 0 &&
+             n->spans[n->nspans - 1].chunk->nchildren < PROP_COW_CHUNK) {
+    target = n->nspans - 1;
+  } else {
+    target = PROP_COW_NONE;
+  }
+
+  for (s = 0; s < n->nspans; s++) {
+    span = &n->spans[s];
+
+    if (s != target) {
+      r = prop_cow_builder_share(&b, span->chunk);
+
+      if (r < 0) {
+        goto end;
+      }
+
+      continue;
+    }
+
+    for (i = 0; i < span->chunk->nchildren; i++) {
+      if (span->start + i == pos && child != NULL) {
+        r = prop_cow_builder_push(&b, child);
+        child = NULL;
+
+        if (r < 0) {
+          goto end;
+        }
+      }
+
+      if (span->start + i >= pos && span->start + i < pos + ndelete) {
+        continue;
+      }
+
+      r = prop_cow_builder_push(&b, prop_cow_ref(span->chunk->children[i]));
+
+      if (r < 0) {
+        goto end;
+      }
+    }
+  }
+
+  if (child != NULL) {
+    r = prop_cow_builder_push(&b, child);
+    child = NULL;
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+  n->data->refs++;
+
+  r = prop_cow_builder_finish(&b, n->data, out);
+
+end:
+  prop_cow_unref(child);
+  prop_cow_builder_fini(&b);
+
+  return r;
+}
+
+/* Rebuild the path from n down to the node at path, which gets replaced by
+   whatever edit makes of it. Everything off that path is shared. */
+
+static int prop_cow_edit_path(struct prop_cow **out, struct prop_cow *n,
+                              const uint32_t *path, uint32_t depth,
+                              prop_cow_edit_t edit, void *ctx) {
+  struct prop_cow *child;
+  int r;
+
+  assert(out != NULL);
+  assert(n != NULL);
+
+  *out = NULL;
+
+  if (depth == 0) {
+    return edit(out, n, ctx);
+  }
+
+  if (path[0] >= n->nchildren) {
+    log_write("<%s>: No child at index %u", n->data->name, path[0]);
+
+    return -ENOENT;
+  }
+
+  r = prop_cow_edit_path(&child, prop_cow_child_at(n, path[0]), path + 1,
+                         depth - 1, edit, ctx);
+
+  if (r < 0) {
+    return r;
+  }
+
+  return prop_cow_splice(out, n, path[0], 1, child);
+}
+
+static int prop_cow_edit_value(struct prop_cow **out, struct prop_cow *n,
+                               void *ctx) {
+  const struct prop_cow_value *value;
+  struct prop_cow_data *data;
+  int r;
+
+  value = ctx;
+
+  r = prop_cow_data_copy(&data, n->data, value->type, value->bytes,
+                         value->nbytes, 0);
+
+  if (r < 0) {
+    return r;
+  }
+
+  return prop_cow_with_data(out, n, data);
+}
+
+static int prop_cow_edit_attr(struct prop_cow **out, struct prop_cow *n,
+                              void *ctx) {
+  const struct prop_cow_attr_edit *edit;
+  struct prop_cow_data *data;
+  int r;
+
+  edit = ctx;
+
+  r = prop_cow_data_copy(&data, n->data, n->data->type, n->data->bytes,
+                         n->data->nbytes, 1);
+
+  if (r < 0) {
+    return r;
+  }
+
+  if (edit->val != NULL) {
+    r = prop_cow_data_put_attr(data, edit->key, edit->val);
+
+    if (r < 0) {
+      prop_cow_data_unref(data);
+
+      return r;
+    }
+  } else {
+    prop_cow_data_remove_attr(data, edit->key);
+  }
+
+  return prop_cow_with_data(out, n, data);
+}
+
+static int prop_cow_edit_children(struct prop_cow **out, struct prop_cow *n,
+                                  void *ctx) {
+  const struct prop_cow_splice *splice;
+
+  splice = ctx;
+
+  if (splice->pos + splice->ndelete > n->nchildren) {
+    log_write("<%s>: Child index %u out of range", n->data->name, splice->pos);
+
+    return -ENOENT;
+  }
+
+  if (splice->child != NULL) {
+    prop_cow_ref(splice->child);
+  }
+
+  return prop_cow_splice(out, n, splice->pos, splice->ndelete, splice->child);
+}
+
+/* Overlay nodes keep their __ control attributes out of the result */
+
+static int prop_cow_import_node(struct prop_cow **out, const struct prop *p,
+                                bool overlay) {
+  struct prop_cow_builder b;
+  struct prop_cow_data *data;
+  struct prop_cow *n;
+  const struct prop *child;
+  const struct attr *attr;
+  struct const_iobuf value;
+  uint32_t nattrs;
+  int r;
+
+  assert(out != NULL);
+  assert(p != NULL);
+
+  *out = NULL;
+  data = NULL;
+  nattrs = 0;
+  prop_cow_builder_init(&b);
+
+  for (attr = prop_get_first_attr(p); attr != NULL;
+       attr = attr_get_next_sibling(attr)) {
+    nattrs++;
+  }
+
+  prop_borrow_value(p, &value);
+
+  r = prop_cow_data_alloc(&data, prop_get_name(p), prop_get_type(p),
+                          value.bytes, value.nbytes, nattrs);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  data->encoding = prop_get_encoding(p);
+
+  for (attr = prop_get_first_attr(p); attr != NULL;
+       attr = attr_get_next_sibling(attr)) {
+    if (overlay && prop_cow_is_control_attr(attr_get_key(attr))) {
+      continue;
+    }
+
+    r = prop_cow_data_put_attr(data, attr_get_key(attr), attr_get_val(attr));
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+  for (child = prop_get_first_child_const(p); child != NULL;
+       child = prop_get_next_sibling_const(child)) {
+    r = prop_cow_import_node(&n, child, overlay);
+
+    if (r < 0) {
+      goto end;
+    }
+
+    r = prop_cow_builder_push(&b, n);
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+  r = prop_cow_builder_finish(&b, data, out);
+  data = NULL;
+
+end:
+  prop_cow_builder_fini(&b);
+  prop_cow_data_unref(data);
+
+  return r;
+}
+
+static int prop_cow_merge(struct prop_cow **out, struct prop_cow *base,
+                          const struct prop *overlay) {
+  struct prop_cow_builder b;
+  struct prop_cow_data *data;
+  const struct prop_cow_span *span;
+  struct prop_cow **slots;
+  struct prop_cow **added;
+  struct prop_cow *result;
+  const struct prop *child;
+  const struct attr *attr;
+  struct const_iobuf value;
+  const char *op;
+  uint32_t nattrs;
+  uint32_t nchildren;
+  uint32_t nadded;
+  uint32_t nslots;
+  uint32_t i;
+  uint32_t j;
+  uint32_t s;
+  int r;
+
+  assert(out != NULL);
+  assert(base != NULL);
+  assert(overlay != NULL);
+
+  *out = NULL;
+  data = NULL;
+  slots = NULL;
+  added = NULL;
+  nadded = 0;
+  nattrs = 0;
+  nchildren = 0;
+  nslots = base->nchildren;
+  prop_cow_builder_init(&b);
+
+  for (attr = prop_get_first_attr(overlay); attr != NULL;
+       attr = attr_get_next_sibling(attr)) {
+    if (!prop_cow_is_control_attr(attr_get_key(attr))) {
+      nattrs++;
+    }
+  }
+
+  for (child = prop_get_first_child_const(overlay); child != NULL;
+       child = prop_get_next_sibling_const(child)) {
+    nchildren++;
+  }
+
+  /* Void overlay nodes are just there to hold attributes and children, so
+     they leave the base node's value alone. */
+
+  if (prop_get_type(overlay) != PROP_VOID) {
+    prop_borrow_value(overlay, &value);
+
+    r = prop_cow_data_copy(&data, base->data, prop_get_type(overlay),
+                           value.bytes, value.nbytes, nattrs);
+  } else if (nattrs > 0) {
+    r = prop_cow_data_copy(&data, base->data, base->data->type,
+                           base->data->bytes, base->data->nbytes, nattrs);
+  } else {
+    data = base->data;
+    data->refs++;
+    r = 0;
+  }
+
+  if (r < 0) {
+    goto end;
+  }
+
+  for (attr = prop_get_first_attr(overlay); attr != NULL && nattrs > 0;
+       attr = attr_get_next_sibling(attr)) {
+    if (prop_cow_is_control_attr(attr_get_key(attr))) {
+      continue;
+    }
+
+    r = prop_cow_data_put_attr(data, attr_get_key(attr), attr_get_val(attr));
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+  /* Overlay children are matched against the base's original children, so
+     the outcome does not depend on the order of the overlay's edits. */
+
+  slots = calloc(nslots + 1, sizeof(*slots));
+  added = calloc(nchildren + 1, sizeof(*added));
+
+  if (slots == NULL || added == NULL) {
+    r = -ENOMEM;
+
+    goto end;
+  }
+
+  for (s = 0; s < base->nspans; s++) {
+    span = &base->spans[s];
+
+    for (i = 0; i < span->chunk->nchildren; i++) {
+      slots[span->start + i] = prop_cow_ref(span->chunk->children[i]);
+    }
+  }
+
+  for (child = prop_get_first_child_const(overlay); child != NULL;
+       child = prop_get_next_sibling_const(child)) {
+    r = prop_cow_match(base, overlay, child, &i);
+
+    if (r < 0) {
+      goto end;
+    }
+
+    if (i != PROP_COW_NONE && slots[i] == NULL) {
+      i = PROP_COW_NONE;
+    }
+
+    op = prop_get_attr(child, "__op");
+
+    if (op == NULL || str_eq(op, "merge")) {
+      if (i != PROP_COW_NONE) {
+        r = prop_cow_merge(&result, slots[i], child);
+      } else {
+        r = prop_cow_import_node(&result, child, true);
+      }
+    } else if (str_eq(op, "replace")) {
+      r = prop_cow_import_node(&result, child, true);
+    } else if (str_eq(op, "delete")) {
+      result = NULL;
+      r = 0;
+    } else {
+      log_write("<%s>: Unknown overlay op \"%s\"", prop_get_name(child), op);
+      r = -EINVAL;
+    }
+
+    if (r < 0) {
+      goto end;
+    }
+
+    if (i != PROP_COW_NONE) {
+      prop_cow_unref(slots[i]);
+      slots[i] = result;
+    } else if (result != NULL) {
+      added[nadded++] = result;
+    }
+  }
+
+  /* Chunks that came through untouched are shared with the base */
+
+  for (s = 0; s < base->nspans; s++) {
+    span = &base->spans[s];
+
+    for (i = 0; i < span->chunk->nchildren; i++) {
+      if (slots[span->start + i] != span->chunk->children[i]) {
+        break;
+      }
+    }
+
+    if (i == span->chunk->nchildren) {
+      r = prop_cow_builder_share(&b, span->chunk);
+
+      if (r < 0) {
+        goto end;
+      }
+
+      continue;
+    }
+
+    for (i = 0; i < span->chunk->nchildren; i++) {
+      j = span->start + i;
+
+      if (slots[j] != NULL) {
+        r = prop_cow_builder_push(&b, slots[j]);
+        slots[j] = NULL;
+
+        if (r < 0) {
+          goto end;
+        }
+      }
+    }
+  }
+
+  for (i = 0; i < nadded; i++) {
+    r = prop_cow_builder_push(&b, added[i]);
+    added[i] = NULL;
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+  r = prop_cow_builder_finish(&b, data, out);
+  data = NULL;
+
+end:
+  if (slots != NULL) {
+    for (i = 0; i < nslots; i++) {
+      prop_cow_unref(slots[i]);
+    }
+  }
+
+  if (added != NULL) {
+    for (i = 0; i < nadded; i++) {
+      prop_cow_unref(added[i]);
+    }
+  }
+
+  free(slots);
+  free(added);
+  prop_cow_builder_fini(&b);
+  prop_cow_data_unref(data);
+
+  return r;
+}
+
+/* Find the base child that one of overlay's children refers to, see
+   prop-cow.h for the rules. */
+
+static int prop_cow_match(const struct prop_cow *base,
+                          const struct prop *overlay, const struct prop *child,
+                          uint32_t *out) {
+  const struct prop *sibling;
+  const char *name;
+  const char *key;
+  const char *val;
+  uint32_t nth;
+  uint32_t i;
+
+  assert(base != NULL);
+  assert(overlay != NULL);
+  assert(child != NULL);
+  assert(out != NULL);
+
+  *out = PROP_COW_NONE;
+  name = prop_get_name(child);
+  key = prop_get_attr(child, "__key");
+
+  if (key != NULL) {
+    val = prop_get_attr(child, key);
+
+    if (val == NULL) {
+      log_write("<%s>: Overlay key attribute \"%s\" is missing", name, key);
+
+      return -EINVAL;
+    }
+
+    for (i = prop_cow_search_child(base, name, 0); i != PROP_COW_NONE;
+         i = prop_cow_search_child(base, name, i + 1)) {
+      if (str_eq(prop_cow_get_attr(prop_cow_child_at(base, i), key), val)) {
+        *out = i;
+
+        break;
+      }
+    }
+
+    return 0;
+  }
+
+  nth = 0;
+
+  for (sibling = prop_get_first_child_const(overlay); sibling != child;
+       sibling = prop_get_next_sibling_const(sibling)) {
+    if (str_eq(prop_get_name(sibling), name) &&
+        prop_get_attr(sibling, "__key") == NULL) {
+      nth++;
+    }
+  }
+
+  for (i = prop_cow_search_child(base, name, 0); i != PROP_COW_NONE;
+       i = prop_cow_search_child(base, name, i + 1)) {
+    if (nth-- == 0) {
+      *out = i;
+
+      break;
+    }
+  }
+
+  return 0;
+}
+
+static bool prop_cow_is_control_attr(const char *key) {
+  return key[0] == '_' && key[1] == '_';
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "573file/prop-type.h"
+#include "573file/prop.h"
+
+#include "util/iobuf.h"
+
+/* Immutable, reference counted prop trees. A tree never changes once it has
+   been built: each edit returns a new root that shares everything with the
+   old one except for the nodes along the path to the edit. Keeping many
+   patched variants of one big tree around therefore costs memory in
+   proportion to the edits, not to the number of variants.
+
+   Cloning a tree is just prop_cow_ref(). Reference counts are not atomic, so
+   a tree and everything derived from it should stay on one thread at a time.
+
+   Edits address a node by its path from the root, given as an array of child
+   indexes. Every function that produces a tree returns a new reference in
+   *out and leaves its inputs alone. */
+
+#define PROP_COW_NONE UINT32_MAX
+
+struct prop_cow;
+
+int prop_cow_alloc(struct prop_cow **out, const char *name, enum prop_type type,
+                   const void *bytes, uint32_t nbytes);
+int prop_cow_import(struct prop_cow **out, const struct prop *p);
+int prop_cow_export(struct prop **out, const struct prop_cow *n);
+struct prop_cow *prop_cow_ref(struct prop_cow *n);
+void prop_cow_unref(struct prop_cow *n);
+
+void prop_cow_borrow_value(const struct prop_cow *n, struct const_iobuf *out);
+const char *prop_cow_get_attr(const struct prop_cow *n, const char *key);
+uint32_t prop_cow_get_attr_count(const struct prop_cow *n);
+const char *prop_cow_get_attr_key(const struct prop_cow *n, uint32_t i);
+const char *prop_cow_get_attr_val(const struct prop_cow *n, uint32_t i);
+struct prop_cow *prop_cow_get_child(struct prop_cow *n, uint32_t i);
+uint32_t prop_cow_get_child_count(const struct prop_cow *n);
+const char *prop_cow_get_name(const struct prop_cow *n);
+enum prop_type prop_cow_get_type(const struct prop_cow *n);
+const char *prop_cow_get_value_str(const struct prop_cow *n);
+uint32_t prop_cow_search_child(const struct prop_cow *n, const char *name,
+                               uint32_t start);
+
+/* A NULL val removes the attribute. Inserting a child takes a new reference
+   to it, and pos may be equal to the child count in order to append. */
+
+int prop_cow_set_value(struct prop_cow **out, struct prop_cow *root,
+                       const uint32_t *path, uint32_t depth,
+                       enum prop_type type, const void *bytes, uint32_t nbytes);
+int prop_cow_set_attr(struct prop_cow **out, struct prop_cow *root,
+                      const uint32_t *path, uint32_t depth, const char *key,
+                      const char *val);
+int prop_cow_insert_child(struct prop_cow **out, struct prop_cow *root,
+                          const uint32_t *path, uint32_t depth, uint32_t pos,
+                          struct prop_cow *child);
+int prop_cow_remove_child(struct prop_cow **out, struct prop_cow *root,
+                          const uint32_t *path, uint32_t depth, uint32_t pos);
+
+/* Overlays are props whose root has the same name as the tree they patch.
+   Each overlay node is matched against the children of the corresponding
+   base node:
+
+   - If the overlay node has a __key="attr" attribute, it matches the
+     same-named base child whose "attr" attribute has the same value.
+   - Otherwise the Nth overlay node with a given name matches the Nth base
+     child with that name.
+
+   A __op attribute then says what to do with the match. "delete" removes it,
+   "replace" swaps in the overlay subtree wholesale, and the default "merge"
+   applies the overlay node's value (unless it is void) and attributes and
+   then recurses into its children. Unmatched overlay nodes are appended.
+   Attributes starting with __ never make it into the result. */
+
+int prop_cow_apply(struct prop_cow **out, struct prop_cow *root,
+                   const struct prop *overlay);
+int prop_cow_apply_binary(struct prop_cow **out, struct prop_cow *root,
+                          const void *bytes, size_t nbytes);
+
+/* XML overlays have their strings converted to the base tree's encoding */
+
+int prop_cow_apply_xml(struct prop_cow **out, struct prop_cow *root,
+                       const void *bytes, size_t nbytes);
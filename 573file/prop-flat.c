@@ -0,0 +1,1283 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "573file/prop-binary-reader.h"
+#include "573file/prop-flat.h"
+#include "573file/prop-type.h"
+#include "573file/prop.h"
+
+#include "util/crypto.h"
+#include "util/fs.h"
+#include "util/iobuf.h"
+#include "util/log.h"
+#include "util/macro.h"
+#include "util/str.h"
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+#define PROP_FLAT_NSECTIONS 13
+#define PROP_FLAT_VERSION 3
+
+/* Every string is stored once in strs, NUL-terminated, and is identified by
+   its offset into it. str_slots is an open-addressed hash table over those
+   offsets (plus one, so that zero means an empty slot) for interning and for
+   turning names back into IDs. attr_firsts has one extra entry at the end so
+   that node i's attributes are always attr_firsts[i] .. attr_firsts[i + 1]. */
+
+struct prop_flat {
+  uint8_t *types;
+  uint32_t *names;
+  uint32_t *parents;
+  uint32_t *first_children;
+  uint32_t *next_siblings;
+  uint32_t *value_offsets;
+  uint32_t *value_nbytes;
+  uint32_t *attr_firsts;
+  uint32_t *attr_keys;
+  uint32_t *attr_vals;
+  uint32_t *str_slots;
+  char *strs;
+  uint8_t *values;
+  uint32_t nnodes;
+  uint32_t nattrs;
+  uint32_t nstrs;
+  uint32_t nstr_slots;
+  uint32_t strs_nbytes;
+  uint32_t values_nbytes;
+  enum prop_encoding encoding;
+  const void *map;
+  size_t map_nbytes;
+};
+
+/* A cache file is this header followed by each of the arrays above, in the
+   order given by prop_flat_get_sections(), each one padded out to a multiple
+   of 8 bytes. Everything is in native byte order, and byte_order tells us
+   whether that's still the case. */
+
+struct prop_flat_file_header {
+  uint8_t magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t nnodes;
+  uint32_t nattrs;
+  uint32_t nstrs;
+  uint32_t nstr_slots;
+  uint32_t strs_nbytes;
+  uint32_t values_nbytes;
+  uint32_t encoding;
+  uint32_t has_md5;
+  uint64_t src_nbytes;
+  int64_t src_mtime_ns;
+  uint8_t src_md5[16];
+};
+
+struct prop_flat_section {
+  void **ptr;
+  size_t nbytes;
+};
+
+struct prop_flat_frame {
+  uint32_t node;
+  uint32_t last_child;
+};
+
+struct prop_flat_builder {
+  struct prop_flat *f;
+  struct prop_flat_frame *frames;
+  uint32_t nframes;
+  uint32_t max_frames;
+  uint32_t max_nodes;
+  uint32_t max_attrs;
+  uint32_t max_strs_nbytes;
+  uint32_t max_values_nbytes;
+};
+
+static int prop_flat_builder_init(struct prop_flat_builder *fb);
+static void prop_flat_builder_fini(struct prop_flat_builder *fb);
+static int prop_flat_builder_finish(struct prop_flat_builder *fb,
+                                    struct prop_flat **out);
+static int prop_flat_builder_add_tree(struct prop_flat_builder *fb,
+                                      const struct prop *p);
+static int prop_flat_builder_begin_doc(void *ctx, enum prop_encoding encoding);
+static int prop_flat_builder_begin_node(void *ctx, const char *name,
+                                        enum prop_type type,
+                                        const struct const_iobuf *value);
+static int prop_flat_builder_attr(void *ctx, const char *key, const char *val);
+static int prop_flat_builder_end_node(void *ctx);
+static int prop_flat_builder_reserve_node(struct prop_flat_builder *fb);
+static int prop_flat_builder_reserve_attr(struct prop_flat_builder *fb);
+static int prop_flat_builder_append(struct prop_flat_builder *fb,
+                                    const void *bytes, uint32_t nbytes,
+                                    bool is_str, uint32_t *out);
+static int prop_flat_builder_intern(struct prop_flat_builder *fb,
+                                    const char *str, uint32_t *out);
+static int prop_flat_grow(void *items, size_t item_nbytes, uint32_t *max,
+                          uint32_t count);
+static uint32_t *prop_flat_probe(const struct prop_flat *f, const char *str,
+                                 uint32_t hash);
+static void prop_flat_get_sections(struct prop_flat *f,
+                                   struct prop_flat_section *sections);
+static int prop_flat_check_header(const struct prop_flat_file_header *header,
+                                  const struct prop_flat_key *key);
+static int prop_flat_write_file(const struct prop_flat *f, FILE *file,
+                                const struct prop_flat_key *key);
+
+static const uint8_t prop_flat_magic[] = {'P', 'F', 'L', 'T'};
+static const uint8_t prop_flat_padding[8];
+
+static const struct prop_binary_visitor prop_flat_builder_visitor = {
+    .begin_doc = prop_flat_builder_begin_doc,
+    .begin_node = prop_flat_builder_begin_node,
+    .attr = prop_flat_builder_attr,
+    .end_node = prop_flat_builder_end_node,
+};
+
+int prop_flat_build(struct prop_flat **out, const struct prop *p) {
+  struct prop_flat_builder fb;
+  int r;
+
+  assert(out != NULL);
+  assert(p != NULL);
+
+  *out = NULL;
+
+  r = prop_flat_builder_init(&fb);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  fb.f->encoding = prop_get_encoding(p);
+  r = prop_flat_builder_add_tree(&fb, p);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_flat_builder_finish(&fb, out);
+
+end:
+  prop_flat_builder_fini(&fb);
+
+  return r;
+}
+
+int prop_flat_parse_binary(struct prop_flat **out, const void *bytes,
+                           size_t nbytes) {
+  struct prop_flat_builder fb;
+  int r;
+
+  assert(out != NULL);
+  assert(bytes != NULL);
+
+  *out = NULL;
+
+  r = prop_flat_builder_init(&fb);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_binary_visit(bytes, nbytes, &prop_flat_builder_visitor, &fb);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_flat_builder_finish(&fb, out);
+
+end:
+  prop_flat_builder_fini(&fb);
+
+  return r;
+}
+
+void prop_flat_free(struct prop_flat *f) {
+  if (f == NULL) {
+    return;
+  }
+
+  if (f->map != NULL) {
+    fs_unmap_file(f->map, f->map_nbytes);
+    free(f);
+
+    return;
+  }
+
+  free(f->types);
+  free(f->names);
+  free(f->parents);
+  free(f->first_children);
+  free(f->next_siblings);
+  free(f->value_offsets);
+  free(f->value_nbytes);
+  free(f->attr_firsts);
+  free(f->attr_keys);
+  free(f->attr_vals);
+  free(f->str_slots);
+  free(f->strs);
+  free(f->values);
+  free(f);
+}
+
+int prop_flat_key_init(struct prop_flat_key *key, const char *src_path) {
+  int r;
+
+  assert(key != NULL);
+  assert(src_path != NULL);
+
+  memset(key, 0, sizeof(*key));
+  r = fs_stat(src_path, &key->nbytes, &key->mtime_ns);
+
+  if (r < 0) {
+    log_write("stat(%s): %s (%i)", src_path, strerror(-r), r);
+
+    return r;
+  }
+
+  return 0;
+}
+
+int prop_flat_key_set_md5(struct prop_flat_key *key, const void *bytes,
+                          size_t nbytes) {
+  int r;
+
+  assert(key != NULL);
+  assert(bytes != NULL);
+
+  r = md5_compute(&key->md5, bytes, nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  key->has_md5 = true;
+
+  return 0;
+}
+
+int prop_flat_load(struct prop_flat **out, const char *path,
+                   const struct prop_flat_key *key) {
+  struct prop_flat_section sections[PROP_FLAT_NSECTIONS];
+  struct prop_flat_file_header header;
+  struct prop_flat *f;
+  const uint8_t *bytes;
+  const void *map;
+  size_t map_nbytes;
+  size_t pos;
+  size_t i;
+  int r;
+
+  assert(out != NULL);
+  assert(path != NULL);
+  assert(key != NULL);
+
+  *out = NULL;
+  f = NULL;
+
+  r = fs_map_file(path, &map, &map_nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  bytes = map;
+
+  if (map_nbytes < sizeof(header)) {
+    log_write("%s: Truncated header", path);
+    r = -EBADMSG;
+
+    goto end;
+  }
+
+  memcpy(&header, bytes, sizeof(header));
+  r = prop_flat_check_header(&header, key);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  f = calloc(1, sizeof(*f));
+
+  if (f == NULL) {
+    r = -ENOMEM;
+
+    goto end;
+  }
+
+  f->nnodes = header.nnodes;
+  f->nattrs = header.nattrs;
+  f->nstrs = header.nstrs;
+  f->nstr_slots = header.nstr_slots;
+  f->strs_nbytes = header.strs_nbytes;
+  f->values_nbytes = header.values_nbytes;
+  f->encoding = header.encoding;
+
+  prop_flat_get_sections(f, sections);
+  pos = ALIGN8(sizeof(header));
+
+  for (i = 0; i < lengthof(sections); i++) {
+    if (pos > map_nbytes || map_nbytes - pos < sections[i].nbytes) {
+      log_write("%s: Truncated file", path);
+      r = -EBADMSG;
+
+      goto end;
+    }
+
+    *sections[i].ptr = (void *)&bytes[pos];
+    pos = ALIGN8(pos + sections[i].nbytes);
+  }
+
+  if (f->attr_firsts[f->nnodes] != f->nattrs ||
+      f->strs[f->strs_nbytes - 1] != '\0') {
+    log_write("%s: Corrupt file", path);
+    r = -EBADMSG;
+
+    goto end;
+  }
+
+  f->map = map;
+  f->map_nbytes = map_nbytes;
+  map = NULL;
+
+  *out = f;
+  f = NULL;
+  r = 0;
+
+end:
+  prop_flat_free(f);
+  fs_unmap_file(map, map_nbytes);
+
+  return r;
+}
+
+int prop_flat_save(const struct prop_flat *f, const char *path,
+                   const struct prop_flat_key *key) {
+  char *tmp_path;
+  FILE *file;
+  int r;
+
+  assert(f != NULL);
+  assert(path != NULL);
+  assert(key != NULL);
+
+  file = NULL;
+
+  /* Write to the side and then rename into place, so that nobody ever maps a
+     half-written cache file. */
+
+  r = str_printf(&tmp_path, "%s.tmp", path);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = fs_open(&file, tmp_path, "wb");
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_flat_write_file(f, file, key);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = fclose(file);
+  file = NULL;
+
+  if (r != 0) {
+    r = -errno;
+    log_write("%s: Write failed: %s (%i)", tmp_path, strerror(-r), r);
+
+    goto end;
+  }
+
+#ifdef _WIN32
+  remove(path);
+#endif
+
+  r = rename(tmp_path, path);
+
+  if (r != 0) {
+    r = -errno;
+    log_write("rename(%s): %s (%i)", path, strerror(-r), r);
+
+    goto end;
+  }
+
+end:
+  if (file != NULL) {
+    fclose(file);
+  }
+
+  if (r < 0) {
+    remove(tmp_path);
+  }
+
+  free(tmp_path);
+
+  return r;
+}
+
+uint32_t prop_flat_get_count(const struct prop_flat *f) {
+  assert(f != NULL);
+
+  return f->nnodes;
+}
+
+enum prop_encoding prop_flat_get_encoding(const struct prop_flat *f) {
+  assert(f != NULL);
+
+  return f->encoding;
+}
+
+uint32_t prop_flat_get_root(const struct prop_flat *f) {
+  assert(f != NULL);
+  assert(f->nnodes > 0);
+
+  return 0;
+}
+
+uint32_t prop_flat_lookup_name(const struct prop_flat *f, const char *name) {
+  uint32_t *slot;
+
+  assert(f != NULL);
+  assert(name != NULL);
+
+  slot = prop_flat_probe(f, name, str_hash(name));
+
+  if (*slot == 0) {
+    return PROP_FLAT_NONE;
+  }
+
+  return *slot - 1;
+}
+
+void prop_flat_borrow_value(const struct prop_flat *f, uint32_t node,
+                            struct const_iobuf *out) {
+  assert(f != NULL);
+  assert(node < f->nnodes);
+  assert(out != NULL);
+
+  out->bytes = &f->values[f->value_offsets[node]];
+  out->nbytes = f->value_nbytes[node];
+  out->pos = 0;
+}
+
+const char *prop_flat_get_attr(const struct prop_flat *f, uint32_t node,
+                               const char *key) {
+  uint32_t key_id;
+
+  assert(f != NULL);
+  assert(node < f->nnodes);
+  assert(key != NULL);
+
+  key_id = prop_flat_lookup_name(f, key);
+
+  if (key_id == PROP_FLAT_NONE) {
+    return NULL;
+  }
+
+  return prop_flat_get_attr_by_id(f, node, key_id);
+}
+
+const char *prop_flat_get_attr_by_id(const struct prop_flat *f, uint32_t node,
+                                     uint32_t key_id) {
+  uint32_t i;
+
+  assert(f != NULL);
+  assert(node < f->nnodes);
+
+  for (i = f->attr_firsts[node]; i < f->attr_firsts[node + 1]; i++) {
+    if (f->attr_keys[i] == key_id) {
+      return &f->strs[f->attr_vals[i]];
+    }
+  }
+
+  return NULL;
+}
+
+uint32_t prop_flat_get_attr_count(const struct prop_flat *f, uint32_t node) {
+  assert(f != NULL);
+  assert(node < f->nnodes);
+
+  return f->attr_firsts[node + 1] - f->attr_firsts[node];
+}
+
+uint32_t prop_flat_get_first_attr(const struct prop_flat *f, uint32_t node) {
+  assert(f != NULL);
+  assert(node < f->nnodes);
+
+  return f->attr_firsts[node];
+}
+
+uint32_t prop_flat_get_first_child(const struct prop_flat *f, uint32_t node) {
+  assert(f != NULL);
+  assert(node < f->nnodes);
+
+  return f->first_children[node];
+}
+
+const char *prop_flat_get_name(const struct prop_flat *f, uint32_t node) {
+  assert(f != NULL);
+  assert(node < f->nnodes);
+
+  return &f->strs[f->names[node]];
+}
+
+uint32_t prop_flat_get_name_id(const struct prop_flat *f, uint32_t node) {
+  assert(f != NULL);
+  assert(node < f->nnodes);
+
+  return f->names[node];
+}
+
+uint32_t prop_flat_get_next_sibling(const struct prop_flat *f, uint32_t node) {
+  assert(f != NULL);
+  assert(node < f->nnodes);
+
+  return f->next_siblings[node];
+}
+
+uint32_t prop_flat_get_parent(const struct prop_flat *f, uint32_t node) {
+  assert(f != NULL);
+  assert(node < f->nnodes);
+
+  return f->parents[node];
+}
+
+enum prop_type prop_flat_get_type(const struct prop_flat *f, uint32_t node) {
+  assert(f != NULL);
+  assert(node < f->nnodes);
+
+  return f->types[node];
+}
+
+const char *prop_flat_get_value_str(const struct prop_flat *f, uint32_t node) {
+  assert(f != NULL);
+  assert(node < f->nnodes);
+  assert(f->types[node] == PROP_STR);
+
+  return (const char *)&f->values[f->value_offsets[node]];
+}
+
+uint32_t prop_flat_search_child(const struct prop_flat *f, uint32_t node,
+                                const char *name) {
+  uint32_t name_id;
+  uint32_t child;
+
+  assert(f != NULL);
+  assert(node < f->nnodes);
+  assert(name != NULL);
+
+  name_id = prop_flat_lookup_name(f, name);
+
+  if (name_id == PROP_FLAT_NONE) {
+    return PROP_FLAT_NONE;
+  }
+
+  for (child = f->first_children[node]; child != PROP_FLAT_NONE;
+       child = f->next_siblings[child]) {
+    if (f->names[child] == name_id) {
+      return child;
+    }
+  }
+
+  return PROP_FLAT_NONE;
+}
+
+uint32_t prop_flat_search_next(const struct prop_flat *f, uint32_t node) {
+  uint32_t sibling;
+
+  assert(f != NULL);
+  assert(node < f->nnodes);
+
+  for (sibling = f->next_siblings[node]; sibling != PROP_FLAT_NONE;
+       sibling = f->next_siblings[sibling]) {
+    if (f->names[sibling] == f->names[node]) {
+      return sibling;
+    }
+  }
+
+  return PROP_FLAT_NONE;
+}
+
+const char *prop_flat_attr_get_key(const struct prop_flat *f, uint32_t attr) {
+  assert(f != NULL);
+  assert(attr < f->nattrs);
+
+  return &f->strs[f->attr_keys[attr]];
+}
+
+const char *prop_flat_attr_get_val(const struct prop_flat *f, uint32_t attr) {
+  assert(f != NULL);
+  assert(attr < f->nattrs);
+
+  return &f->strs[f->attr_vals[attr]];
+}
+
+static int prop_flat_builder_init(struct prop_flat_builder *fb) {
+  assert(fb != NULL);
+
+  memset(fb, 0, sizeof(*fb));
+  fb->f = calloc(1, sizeof(*fb->f));
+
+  if (fb->f == NULL) {
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+static void prop_flat_builder_fini(struct prop_flat_builder *fb) {
+  assert(fb != NULL);
+
+  prop_flat_free(fb->f);
+  free(fb->frames);
+}
+
+static int prop_flat_builder_finish(struct prop_flat_builder *fb,
+                                    struct prop_flat **out) {
+  struct prop_flat *f;
+
+  assert(fb != NULL);
+  assert(out != NULL);
+
+  f = fb->f;
+
+  if (f->nnodes == 0 || fb->nframes != 0) {
+    log_write("Incomplete prop tree");
+
+    return -EINVAL;
+  }
+
+  /* reserve_node() always leaves room for this one */
+
+  f->attr_firsts[f->nnodes] = f->nattrs;
+
+  *out = f;
+  fb->f = NULL;
+
+  return 0;
+}
+
+static int prop_flat_builder_add_tree(struct prop_flat_builder *fb,
+                                      const struct prop *p) {
+  struct const_iobuf value;
+  const struct prop *child;
+  const struct attr *a;
+  int r;
+
+  assert(fb != NULL);
+  assert(p != NULL);
+
+  prop_borrow_value(p, &value);
+  r = prop_flat_builder_begin_node(fb, prop_get_name(p), prop_get_type(p),
+                                   &value);
+
+  if (r < 0) {
+    return r;
+  }
+
+  for (a = prop_get_first_attr(p); a != NULL; a = attr_get_next_sibling(a)) {
+    r = prop_flat_builder_attr(fb, attr_get_key(a), attr_get_val(a));
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  for (child = prop_get_first_child_const(p); child != NULL;
+       child = prop_get_next_sibling_const(child)) {
+    r = prop_flat_builder_add_tree(fb, child);
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  return prop_flat_builder_end_node(fb);
+}
+
+static int prop_flat_builder_begin_doc(void *ctx, enum prop_encoding encoding) {
+  struct prop_flat_builder *fb;
+
+  fb = ctx;
+  fb->f->encoding = encoding;
+
+  return 0;
+}
+
+static int prop_flat_builder_begin_node(void *ctx, const char *name,
+                                        enum prop_type type,
+                                        const struct const_iobuf *value) {
+  struct prop_flat_builder *fb;
+  struct prop_flat_frame *frame;
+  struct prop_flat *f;
+  uint32_t node;
+  uint32_t name_id;
+  uint32_t value_offset;
+  int r;
+
+  fb = ctx;
+  f = fb->f;
+
+  assert(name != NULL);
+  assert(value != NULL);
+
+  if (fb->nframes == 0 && f->nnodes != 0) {
+    log_write("%s: Prop tree has more than one root", name);
+
+    return -EINVAL;
+  }
+
+  if (value->nbytes > UINT32_MAX) {
+    return -E2BIG;
+  }
+
+  r = prop_flat_builder_reserve_node(fb);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_flat_grow(&fb->frames, sizeof(*fb->frames), &fb->max_frames,
+                     fb->nframes + 1);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_flat_builder_intern(fb, name, &name_id);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_flat_builder_append(fb, value->bytes, value->nbytes, false,
+                               &value_offset);
+
+  if (r < 0) {
+    return r;
+  }
+
+  node = f->nnodes++;
+
+  f->types[node] = type;
+  f->names[node] = name_id;
+  f->first_children[node] = PROP_FLAT_NONE;
+  f->next_siblings[node] = PROP_FLAT_NONE;
+  f->value_offsets[node] = value_offset;
+  f->value_nbytes[node] = value->nbytes;
+  f->attr_firsts[node] = f->nattrs;
+
+  if (fb->nframes > 0) {
+    frame = &fb->frames[fb->nframes - 1];
+    f->parents[node] = frame->node;
+
+    if (frame->last_child != PROP_FLAT_NONE) {
+      f->next_siblings[frame->last_child] = node;
+    } else {
+      f->first_children[frame->node] = node;
+    }
+
+    frame->last_child = node;
+  } else {
+    f->parents[node] = PROP_FLAT_NONE;
+  }
+
+  frame = &fb->frames[fb->nframes++];
+  frame->node = node;
+  frame->last_child = PROP_FLAT_NONE;
+
+  return 0;
+}
+
+static int prop_flat_builder_attr(void *ctx, const char *key, const char *val) {
+  struct prop_flat_builder *fb;
+  struct prop_flat *f;
+  uint32_t key_id;
+  uint32_t val_id;
+  int r;
+
+  fb = ctx;
+  f = fb->f;
+
+  assert(key != NULL);
+  assert(val != NULL);
+
+  /* Attributes must arrive before any children, so that each node's
+     attributes end up contiguous. */
+
+  assert(fb->nframes > 0);
+  assert(fb->frames[fb->nframes - 1].node == f->nnodes - 1);
+
+  r = prop_flat_builder_reserve_attr(fb);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_flat_builder_intern(fb, key, &key_id);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_flat_builder_intern(fb, val, &val_id);
+
+  if (r < 0) {
+    return r;
+  }
+
+  f->attr_keys[f->nattrs] = key_id;
+  f->attr_vals[f->nattrs] = val_id;
+  f->nattrs++;
+
+  return 0;
+}
+
+static int prop_flat_builder_end_node(void *ctx) {
+  struct prop_flat_builder *fb;
+
+  fb = ctx;
+
+  assert(fb->nframes > 0);
+
+  fb->nframes--;
+
+  return 0;
+}
+
+static int prop_flat_builder_reserve_node(struct prop_flat_builder *fb) {
+  struct prop_flat *f;
+  uint32_t **arrays[6];
+  uint32_t *attr_firsts;
+  uint32_t max;
+  size_t i;
+  int r;
+
+  assert(fb != NULL);
+
+  f = fb->f;
+
+  /* PROP_FLAT_NONE is not a valid node index */
+
+  if (f->nnodes == UINT32_MAX - 1) {
+    return -E2BIG;
+  }
+
+  if (f->nnodes < fb->max_nodes) {
+    return 0;
+  }
+
+  /* All of these get grown to the same size. If one of them fails then the
+     ones before it are just left oversized, which is harmless. */
+
+  max = fb->max_nodes;
+  r = prop_flat_grow(&f->types, sizeof(*f->types), &max, f->nnodes + 1);
+
+  if (r < 0) {
+    return r;
+  }
+
+  arrays[0] = &f->names;
+  arrays[1] = &f->parents;
+  arrays[2] = &f->first_children;
+  arrays[3] = &f->next_siblings;
+  arrays[4] = &f->value_offsets;
+  arrays[5] = &f->value_nbytes;
+
+  for (i = 0; i < lengthof(arrays); i++) {
+    max = fb->max_nodes;
+    r = prop_flat_grow(arrays[i], sizeof(uint32_t), &max, f->nnodes + 1);
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  /* attr_firsts needs an extra entry for the end of the last node's range */
+
+  attr_firsts = realloc(f->attr_firsts, (max + 1) * sizeof(*attr_firsts));
+
+  if (attr_firsts == NULL) {
+    return -ENOMEM;
+  }
+
+  f->attr_firsts = attr_firsts;
+  fb->max_nodes = max;
+
+  return 0;
+}
+
+static int prop_flat_builder_reserve_attr(struct prop_flat_builder *fb) {
+  struct prop_flat *f;
+  uint32_t max;
+  int r;
+
+  assert(fb != NULL);
+
+  f = fb->f;
+  max = fb->max_attrs;
+  r = prop_flat_grow(&f->attr_keys, sizeof(*f->attr_keys), &max, f->nattrs + 1);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_flat_grow(&f->attr_vals, sizeof(*f->attr_vals), &fb->max_attrs,
+                     f->nattrs + 1);
+
+  if (r < 0) {
+    return r;
+  }
+
+  return 0;
+}
+
+static int prop_flat_builder_append(struct prop_flat_builder *fb,
+                                    const void *bytes, uint32_t nbytes,
+                                    bool is_str, uint32_t *out) {
+  struct prop_flat *f;
+  uint32_t *used;
+  uint32_t *max;
+  uint8_t **blob;
+  int r;
+
+  assert(fb != NULL);
+  assert(out != NULL);
+
+  f = fb->f;
+
+  if (is_str) {
+    blob = (uint8_t **)&f->strs;
+    used = &f->strs_nbytes;
+    max = &fb->max_strs_nbytes;
+  } else {
+    blob = &f->values;
+    used = &f->values_nbytes;
+    max = &fb->max_values_nbytes;
+  }
+
+  if (nbytes > UINT32_MAX - *used) {
+    return -E2BIG;
+  }
+
+  r = prop_flat_grow(blob, 1, max, *used + nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  if (nbytes > 0) {
+    memcpy(*blob + *used, bytes, nbytes);
+  }
+
+  *out = *used;
+  *used += nbytes;
+
+  return 0;
+}
+
+static int prop_flat_builder_intern(struct prop_flat_builder *fb,
+                                    const char *str, uint32_t *out) {
+  struct prop_flat *f;
+  uint32_t *slots;
+  uint32_t *slot;
+  uint32_t nslots;
+  uint32_t offset;
+  uint32_t hash;
+  uint32_t i;
+  size_t nchars;
+  int r;
+
+  assert(fb != NULL);
+  assert(str != NULL);
+  assert(out != NULL);
+
+  f = fb->f;
+
+  /* Keep the table at most half full */
+
+  if ((f->nstrs + 1) * 2 > f->nstr_slots) {
+    if (f->nstr_slots > UINT32_MAX / 4) {
+      return -E2BIG;
+    }
+
+    nslots = f->nstr_slots != 0 ? f->nstr_slots * 2 : 256;
+    slots = calloc(nslots, sizeof(*slots));
+
+    if (slots == NULL) {
+      return -ENOMEM;
+    }
+
+    for (i = 0; i < f->nstr_slots; i++) {
+      offset = f->str_slots[i];
+
+      if (offset != 0) {
+        hash = str_hash(&f->strs[offset - 1]);
+
+        while (slots[hash & (nslots - 1)] != 0) {
+          hash++;
+        }
+
+        slots[hash & (nslots - 1)] = offset;
+      }
+    }
+
+    free(f->str_slots);
+    f->str_slots = slots;
+    f->nstr_slots = nslots;
+  }
+
+  slot = prop_flat_probe(f, str, str_hash(str));
+
+  if (*slot != 0) {
+    *out = *slot - 1;
+
+    return 0;
+  }
+
+  nchars = strlen(str);
+
+  if (nchars >= UINT32_MAX - 1) {
+    return -E2BIG;
+  }
+
+  r = prop_flat_builder_append(fb, str, nchars + 1, true, &offset);
+
+  if (r < 0) {
+    return r;
+  }
+
+  *slot = offset + 1;
+  f->nstrs++;
+  *out = offset;
+
+  return 0;
+}
+
+/* Grows a malloc'd array to hold at least count items, doubling as it goes */
+
+static int prop_flat_grow(void *items, size_t item_nbytes, uint32_t *max,
+                          uint32_t count) {
+  void **ptr;
+  void *tmp;
+  uint32_t new_max;
+
+  assert(items != NULL);
+  assert(max != NULL);
+
+  if (count <= *max) {
+    return 0;
+  }
+
+  new_max = *max != 0 ? *max : 64;
+
+  while (new_max < count) {
+    new_max = new_max <= UINT32_MAX / 2 ? new_max * 2 : UINT32_MAX;
+  }
+
+  if (new_max > SIZE_MAX / item_nbytes) {
+    return -ENOMEM;
+  }
+
+  ptr = items;
+  tmp = realloc(*ptr, new_max * item_nbytes);
+
+  if (tmp == NULL) {
+    return -ENOMEM;
+  }
+
+  *ptr = tmp;
+  *max = new_max;
+
+  return 0;
+}
+
+static uint32_t *prop_flat_probe(const struct prop_flat *f, const char *str,
+                                 uint32_t hash) {
+  uint32_t *slot;
+  uint32_t mask;
+  uint32_t i;
+
+  assert(f != NULL);
+  assert(f->nstr_slots > 0);
+  assert(str != NULL);
+
+  mask = f->nstr_slots - 1;
+
+  for (i = hash & mask;; i = (i + 1) & mask) {
+    slot = &f->str_slots[i];
+
+    if (*slot == 0 || str_eq(&f->strs[*slot - 1], str)) {
+      return slot;
+    }
+  }
+}
+
+static void prop_flat_get_sections(struct prop_flat *f,
+                                   struct prop_flat_section *sections) {
+  size_t nodes_nbytes;
+  size_t attrs_nbytes;
+
+  assert(f != NULL);
+  assert(sections != NULL);
+
+  nodes_nbytes = (size_t)f->nnodes * sizeof(uint32_t);
+  attrs_nbytes = (size_t)f->nattrs * sizeof(uint32_t);
+
+  sections[0].ptr = (void **)&f->types;
+  sections[0].nbytes = f->nnodes;
+  sections[1].ptr = (void **)&f->names;
+  sections[1].nbytes = nodes_nbytes;
+  sections[2].ptr = (void **)&f->parents;
+  sections[2].nbytes = nodes_nbytes;
+  sections[3].ptr = (void **)&f->first_children;
+  sections[3].nbytes = nodes_nbytes;
+  sections[4].ptr = (void **)&f->next_siblings;
+  sections[4].nbytes = nodes_nbytes;
+  sections[5].ptr = (void **)&f->value_offsets;
+  sections[5].nbytes = nodes_nbytes;
+  sections[6].ptr = (void **)&f->value_nbytes;
+  sections[6].nbytes = nodes_nbytes;
+  sections[7].ptr = (void **)&f->attr_firsts;
+  sections[7].nbytes = nodes_nbytes + sizeof(uint32_t);
+  sections[8].ptr = (void **)&f->attr_keys;
+  sections[8].nbytes = attrs_nbytes;
+  sections[9].ptr = (void **)&f->attr_vals;
+  sections[9].nbytes = attrs_nbytes;
+  sections[10].ptr = (void **)&f->str_slots;
+  sections[10].nbytes = (size_t)f->nstr_slots * sizeof(uint32_t);
+  sections[11].ptr = (void **)&f->strs;
+  sections[11].nbytes = f->strs_nbytes;
+  sections[12].ptr = (void **)&f->values;
+  sections[12].nbytes = f->values_nbytes;
+}
+
+static int prop_flat_check_header(const struct prop_flat_file_header *header,
+                                  const struct prop_flat_key *key) {
+  assert(header != NULL);
+  assert(key != NULL);
+
+  if (memcmp(header->magic, prop_flat_magic, sizeof(prop_flat_magic)) != 0) {
+    log_write("Not a prop cache file");
+
+    return -EBADMSG;
+  }
+
+  if (header->version != PROP_FLAT_VERSION || header->byte_order != 1) {
+    /* Just as good as a missing cache file, it'll get rebuilt */
+    return -ENOENT;
+  }
+
+  if (header->nnodes == 0 || header->nnodes == PROP_FLAT_NONE ||
+      header->nstr_slots == 0 ||
+      (header->nstr_slots & (header->nstr_slots - 1)) != 0 ||
+      header->strs_nbytes == 0 || !prop_encoding_is_valid(header->encoding)) {
+    log_write("Corrupt prop cache file header");
+
+    return -EBADMSG;
+  }
+
+  if (header->src_nbytes != key->nbytes) {
+    return -ENOENT;
+  }
+
+  /* An mtime can stay the same across an edit, so it's only a fallback for
+     when there's no MD5 to go on */
+
+  if (header->has_md5 && key->has_md5) {
+    if (memcmp(header->src_md5, key->md5.b, sizeof(key->md5.b)) != 0) {
+      return -ENOENT;
+    }
+  } else if (header->src_mtime_ns != key->mtime_ns) {
+    return -ENOENT;
+  }
+
+  return 0;
+}
+
+static int prop_flat_write_file(const struct prop_flat *f, FILE *file,
+                                const struct prop_flat_key *key) {
+  struct prop_flat_section sections[PROP_FLAT_NSECTIONS];
+  struct prop_flat_file_header header;
+  struct prop_flat tmp;
+  struct const_iobuf buf;
+  size_t i;
+  int r;
+
+  assert(f != NULL);
+  assert(file != NULL);
+  assert(key != NULL);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, prop_flat_magic, sizeof(prop_flat_magic));
+  header.version = PROP_FLAT_VERSION;
+  header.byte_order = 1;
+  header.nnodes = f->nnodes;
+  header.nattrs = f->nattrs;
+  header.nstrs = f->nstrs;
+  header.nstr_slots = f->nstr_slots;
+  header.strs_nbytes = f->strs_nbytes;
+  header.values_nbytes = f->values_nbytes;
+  header.encoding = f->encoding;
+  header.has_md5 = key->has_md5;
+  header.src_nbytes = key->nbytes;
+  header.src_mtime_ns = key->mtime_ns;
+  memcpy(header.src_md5, key->md5.b, sizeof(key->md5.b));
+
+  buf.bytes = (const uint8_t *)&header;
+  buf.nbytes = sizeof(header);
+  buf.pos = 0;
+
+  r = fs_write(file, &buf);
+
+  if (r < 0) {
+    return r;
+  }
+
+  buf.bytes = prop_flat_padding;
+  buf.nbytes = ALIGN8(sizeof(header)) - sizeof(header);
+  buf.pos = 0;
+
+  r = fs_write(file, &buf);
+
+  if (r < 0) {
+    return r;
+  }
+
+  tmp = *f;
+  prop_flat_get_sections(&tmp, sections);
+
+  for (i = 0; i < lengthof(sections); i++) {
+    buf.bytes = *sections[i].ptr;
+    buf.nbytes = sections[i].nbytes;
+    buf.pos = 0;
+
+    r = fs_write(file, &buf);
+
+    if (r < 0) {
+      return r;
+    }
+
+    buf.bytes = prop_flat_padding;
+    buf.nbytes = ALIGN8(sections[i].nbytes) - sections[i].nbytes;
+    buf.pos = 0;
+
+    r = fs_write(file, &buf);
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  return 0;
+}
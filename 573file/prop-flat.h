@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "573file/prop-type.h"
+#include "573file/prop.h"
+
+#include "util/crypto.h"
+#include "util/iobuf.h"
+
+/* Read-only prop tree packed into parallel arrays. Nodes are identified by
+   their index, and are numbered in document order starting from the root at
+   index 0, so walking the whole tree is just a loop over 0..count-1. Each
+   node's attributes are numbered consecutively in the same way.
+
+   Node names and attribute strings are interned, so equal names always have
+   the same name ID. PROP_FLAT_NONE stands in for a missing node. */
+
+#define PROP_FLAT_NONE UINT32_MAX
+
+struct prop_flat;
+
+/* Identifies the source a cache file was built from. A cache file is only
+   used if the source's size and MD5 still match when both sides have an MD5
+   (which lets caches survive a plain copy or touch), or otherwise its size and
+   nanosecond mtime. */
+
+struct prop_flat_key {
+  uint64_t nbytes;
+  int64_t mtime_ns;
+  struct md5_hash md5;
+  bool has_md5;
+};
+
+int prop_flat_build(struct prop_flat **out, const struct prop *p);
+int prop_flat_parse_binary(struct prop_flat **out, const void *bytes,
+                           size_t nbytes);
+void prop_flat_free(struct prop_flat *f);
+
+/* Cache files hold a flat tree exactly as it is laid out in memory, so that
+   prop_flat_load() can map one and use it as-is. They are in native byte
+   order, and are treated as trusted local files: only their headers are
+   checked. prop_flat_load() returns -ENOENT if the cache file is missing or
+   doesn't match the key, either way it needs rebuilding. */
+
+int prop_flat_key_init(struct prop_flat_key *key, const char *src_path);
+int prop_flat_key_set_md5(struct prop_flat_key *key, const void *bytes,
+                          size_t nbytes);
+int prop_flat_load(struct prop_flat **out, const char *path,
+                   const struct prop_flat_key *key);
+int prop_flat_save(const struct prop_flat *f, const char *path,
+                   const struct prop_flat_key *key);
+
+uint32_t prop_flat_get_count(const struct prop_flat *f);
+enum prop_encoding prop_flat_get_encoding(const struct prop_flat *f);
+uint32_t prop_flat_get_root(const struct prop_flat *f);
+uint32_t prop_flat_lookup_name(const struct prop_flat *f, const char *name);
+
+void prop_flat_borrow_value(const struct prop_flat *f, uint32_t node,
+                            struct const_iobuf *out);
+const char *prop_flat_get_attr(const struct prop_flat *f, uint32_t node,
+                               const char *key);
+const char *prop_flat_get_attr_by_id(const struct prop_flat *f, uint32_t node,
+                                     uint32_t key_id);
+uint32_t prop_flat_get_attr_count(const struct prop_flat *f, uint32_t node);
+uint32_t prop_flat_get_first_attr(const struct prop_flat *f, uint32_t node);
+uint32_t prop_flat_get_first_child(const struct prop_flat *f, uint32_t node);
+const char *prop_flat_get_name(const struct prop_flat *f, uint32_t node);
+uint32_t prop_flat_get_name_id(const struct prop_flat *f, uint32_t node);
+uint32_t prop_flat_get_next_sibling(const struct prop_flat *f, uint32_t node);
+uint32_t prop_flat_get_parent(const struct prop_flat *f, uint32_t node);
+enum prop_type prop_flat_get_type(const struct prop_flat *f, uint32_t node);
+const char *prop_flat_get_value_str(const struct prop_flat *f, uint32_t node);
+uint32_t prop_flat_search_child(const struct prop_flat *f, uint32_t node,
+                                const char *name);
+uint32_t prop_flat_search_next(const struct prop_flat *f, uint32_t node);
+
+const char *prop_flat_attr_get_key(const struct prop_flat *f, uint32_t attr);
+const char *prop_flat_attr_get_val(const struct prop_flat *f, uint32_t attr);
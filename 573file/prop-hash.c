@@ -0,0 +1,124 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "573file/prop-flat.h"
+#include "573file/prop-hash.h"
+#include "573file/prop-type.h"
+#include "573file/prop.h"
+
+#include "util/hash.h"
+#include "util/iobuf.h"
+
+static uint64_t prop_hash_begin(const char *name, enum prop_type type,
+                                const struct const_iobuf *value);
+static uint64_t prop_hash_attr(uint64_t h, const char *key, const char *val);
+
+uint64_t prop_hash(const struct prop *p) {
+  struct const_iobuf value;
+  const struct prop *child;
+  const struct attr *a;
+  uint64_t count;
+  uint64_t h;
+
+  assert(p != NULL);
+
+  prop_borrow_value(p, &value);
+  h = prop_hash_begin(prop_get_name(p), prop_get_type(p), &value);
+  count = 0;
+
+  for (a = prop_get_first_attr(p); a != NULL; a = attr_get_next_sibling(a)) {
+    h = prop_hash_attr(h, attr_get_key(a), attr_get_val(a));
+    count++;
+  }
+
+  h = hash64_combine(h, count);
+  count = 0;
+
+  for (child = prop_get_first_child_const(p); child != NULL;
+       child = prop_get_next_sibling_const(child)) {
+    h = hash64_combine(h, prop_hash(child));
+    count++;
+  }
+
+  return hash64_combine(h, count);
+}
+
+int prop_flat_hash(const struct prop_flat *f, uint64_t **out) {
+  struct const_iobuf value;
+  uint64_t *hashes;
+  uint64_t count;
+  uint64_t h;
+  uint32_t nattrs;
+  uint32_t node;
+  uint32_t child;
+  uint32_t a;
+  uint32_t i;
+
+  assert(f != NULL);
+  assert(out != NULL);
+
+  *out = NULL;
+  hashes = malloc(prop_flat_get_count(f) * sizeof(*hashes));
+
+  if (hashes == NULL) {
+    return -ENOMEM;
+  }
+
+  /* Children always come after their parents, so going backwards means each
+     node's children have already been hashed by the time we get to it. */
+
+  for (i = prop_flat_get_count(f); i > 0; i--) {
+    node = i - 1;
+
+    prop_flat_borrow_value(f, node, &value);
+    h = prop_hash_begin(prop_flat_get_name(f, node),
+                        prop_flat_get_type(f, node), &value);
+
+    a = prop_flat_get_first_attr(f, node);
+    nattrs = prop_flat_get_attr_count(f, node);
+
+    for (; nattrs > 0; a++, nattrs--) {
+      h = prop_hash_attr(h, prop_flat_attr_get_key(f, a),
+                         prop_flat_attr_get_val(f, a));
+    }
+
+    h = hash64_combine(h, prop_flat_get_attr_count(f, node));
+    count = 0;
+
+    for (child = prop_flat_get_first_child(f, node); child != PROP_FLAT_NONE;
+         child = prop_flat_get_next_sibling(f, child)) {
+      h = hash64_combine(h, hashes[child]);
+      count++;
+    }
+
+    hashes[node] = hash64_combine(h, count);
+  }
+
+  *out = hashes;
+
+  return 0;
+}
+
+static uint64_t prop_hash_begin(const char *name, enum prop_type type,
+                                const struct const_iobuf *value) {
+  uint64_t h;
+
+  assert(name != NULL);
+  assert(value != NULL);
+
+  h = hash64(name, strlen(name), type);
+
+  return hash64(value->bytes, value->nbytes, h);
+}
+
+static uint64_t prop_hash_attr(uint64_t h, const char *key, const char *val) {
+  assert(key != NULL);
+  assert(val != NULL);
+
+  h = hash64_combine(h, hash64(key, strlen(key), 0));
+
+  return hash64_combine(h, hash64(val, strlen(val), 0));
+}
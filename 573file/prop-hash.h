@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "573file/prop-flat.h"
+#include "573file/prop.h"
+
+/* Structural hashes of whole subtrees, covering each node's name, type,
+   value, attributes (in order) and children (in order). Equal subtrees hash
+   equal in either representation, so two trees can be compared by descending
+   only into subtrees whose hashes differ. */
+
+uint64_t prop_hash(const struct prop *p);
+int prop_flat_hash(const struct prop_flat *f, uint64_t **out);
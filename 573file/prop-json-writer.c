@@ -0,0 +1,610 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "573file/prop-json-writer.h"
+#include "573file/prop-type.h"
+#include "573file/prop.h"
+
+#include "util/charset.h"
+#include "util/iobuf.h"
+#include "util/log.h"
+#include "util/str.h"
+
+/* Strings are scanned for characters that need escaping or transcoding the
+   same way as in the XML writer, 16 or 32 bytes at a time on x86. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PROP_JSON_X86
+#include <immintrin.h>
+#endif
+
+/* Size of the buffers that file output is staged in */
+
+#define PROP_JSON_SINK_NCHARS (64 * 1024)
+
+struct prop_json_stream_frame {
+  bool has_attrs;
+  bool has_children;
+};
+
+struct prop_json_stream {
+  enum charset cs;
+  struct prop_json_stream_frame *frames;
+  size_t nframes;
+  size_t max_frames;
+  struct strbuf out;
+};
+
+static enum charset prop_json_charset(enum prop_encoding encoding);
+static void prop_json_write_attr(struct strbuf *dest, const char *key,
+                                 const char *val, enum charset cs, bool first);
+static void prop_json_write_head(struct strbuf *dest, const char *name,
+                                 enum prop_type type,
+                                 const struct const_iobuf *value,
+                                 enum charset cs, unsigned int indent);
+static void prop_json_write_indent(struct strbuf *dest, unsigned int indent);
+static void prop_json_write_node(struct strbuf *dest, const struct prop *p,
+                                 enum charset cs, unsigned int indent);
+static void prop_json_write_string(struct strbuf *dest, const char *str,
+                                   size_t nchars, enum charset cs);
+static void prop_json_write_value(struct strbuf *dest, enum prop_type type,
+                                  const struct const_iobuf *value,
+                                  enum charset cs);
+static size_t prop_json_plain_span(const char *str, size_t nchars);
+static int prop_json_stream_open_parent(struct prop_json_stream *s);
+
+#ifdef PROP_JSON_X86
+
+static size_t prop_json_plain_span_simd(const uint8_t *bytes, size_t nbytes);
+static size_t prop_json_plain_span_sse2(const uint8_t *bytes, size_t nbytes)
+    __attribute__((target("sse2")));
+static size_t prop_json_plain_span_avx2(const uint8_t *bytes, size_t nbytes)
+    __attribute__((target("avx2")));
+
+#endif
+
+int prop_json_write(const struct prop *p, char **out) {
+  struct strbuf buf;
+
+  assert(p != NULL);
+  assert(out != NULL);
+
+  strbuf_init(&buf);
+  prop_json_write_node(&buf, p, prop_json_charset(prop_get_encoding(p)), 0);
+  strbuf_putc(&buf, '\n');
+
+  return strbuf_finish(&buf, out);
+}
+
+int prop_json_write_file(const struct prop *p, FILE *f) {
+  struct strbuf buf;
+  char *chars;
+  int r;
+
+  assert(p != NULL);
+  assert(f != NULL);
+
+  chars = malloc(PROP_JSON_SINK_NCHARS);
+
+  if (chars == NULL) {
+    return -ENOMEM;
+  }
+
+  strbuf_init_sink(&buf, f, chars, PROP_JSON_SINK_NCHARS);
+  prop_json_write_node(&buf, p, prop_json_charset(prop_get_encoding(p)), 0);
+  strbuf_putc(&buf, '\n');
+  r = strbuf_flush(&buf);
+  free(chars);
+
+  return r;
+}
+
+static enum charset prop_json_charset(enum prop_encoding encoding) {
+  switch (encoding) {
+  case PROP_ENCODING_ASCII:
+    return CHARSET_ASCII;
+
+  case PROP_ENCODING_ISO_8859_1:
+    return CHARSET_ISO_8859_1;
+
+  case PROP_ENCODING_EUC_JP:
+    return CHARSET_EUC_JP;
+
+  case PROP_ENCODING_UTF_8:
+    return CHARSET_UTF_8;
+
+  default:
+    return CHARSET_SHIFT_JIS;
+  }
+}
+
+static void prop_json_write_node(struct strbuf *dest, const struct prop *p,
+                                 enum charset cs, unsigned int indent) {
+  const struct prop *child;
+  const struct attr *first;
+  const struct attr *a;
+  struct const_iobuf value;
+
+  assert(dest != NULL);
+  assert(p != NULL);
+
+  prop_borrow_value(p, &value);
+  prop_json_write_head(dest, prop_get_name(p), prop_get_type(p), &value, cs,
+                       indent);
+
+  first = prop_get_first_attr(p);
+
+  for (a = first; a != NULL; a = attr_get_next_sibling(a)) {
+    prop_json_write_attr(dest, attr_get_key(a), attr_get_val(a), cs,
+                         a == first);
+  }
+
+  if (first != NULL) {
+    strbuf_putc(dest, '}');
+  }
+
+  child = prop_get_first_child_const(p);
+
+  if (child != NULL) {
+    strbuf_puts(dest, ",\"children\":[\n");
+
+    for (; child != NULL; child = prop_get_next_sibling_const(child)) {
+      prop_json_write_node(dest, child, cs, indent + 1);
+
+      if (prop_get_next_sibling_const(child) != NULL) {
+        strbuf_putc(dest, ',');
+      }
+
+      strbuf_putc(dest, '\n');
+    }
+
+    prop_json_write_indent(dest, indent);
+    strbuf_putc(dest, ']');
+  }
+
+  strbuf_putc(dest, '}');
+}
+
+/* Writes everything up to the node's attributes, leaving its object open */
+
+static void prop_json_write_head(struct strbuf *dest, const char *name,
+                                 enum prop_type type,
+                                 const struct const_iobuf *value,
+                                 enum charset cs, unsigned int indent) {
+  unsigned long count;
+
+  assert(dest != NULL);
+  assert(name != NULL);
+  assert(value != NULL);
+
+  prop_json_write_indent(dest, indent);
+  strbuf_puts(dest, "{\"name\":");
+  prop_json_write_string(dest, name, strlen(name), cs);
+
+  if (type == PROP_VOID) {
+    return;
+  }
+
+  strbuf_printf(dest, ",\"type\":\"%s\"", prop_type_to_string(type));
+
+  if (prop_type_is_array(type)) {
+    count = value->nbytes / prop_type_to_size(type);
+    strbuf_printf(dest, ",\"count\":%lu", count);
+  }
+
+  strbuf_puts(dest, ",\"value\":");
+  prop_json_write_value(dest, type, value, cs);
+}
+
+static void prop_json_write_attr(struct strbuf *dest, const char *key,
+                                 const char *val, enum charset cs, bool first) {
+  assert(dest != NULL);
+  assert(key != NULL);
+  assert(val != NULL);
+
+  strbuf_puts(dest, first ? ",\"attrs\":{" : ",");
+  prop_json_write_string(dest, key, strlen(key), cs);
+  strbuf_putc(dest, ':');
+  prop_json_write_string(dest, val, strlen(val), cs);
+}
+
+static void prop_json_write_indent(struct strbuf *dest, unsigned int indent) {
+  unsigned int i;
+
+  assert(dest != NULL);
+
+  for (i = 0; i < indent; i++) {
+    strbuf_puts(dest, "  ");
+  }
+}
+
+/* Numbers go through the same format functions as XML text does. Brackets
+   around the whole value come from here, and the format function closes and
+   reopens the inner ones between the values of an array. */
+
+static void prop_json_write_value(struct strbuf *dest, enum prop_type type,
+                                  const struct const_iobuf *value,
+                                  enum charset cs) {
+  const struct prop_type_info *info;
+  bool is_array;
+
+  assert(dest != NULL);
+  assert(value != NULL);
+  assert(value->pos <= value->nbytes);
+
+  if (type == PROP_STR) {
+    prop_json_write_string(dest, (const char *)value->bytes + value->pos,
+                           prop_type_str_len(value), cs);
+
+    return;
+  } else if (type == PROP_BIN) {
+    strbuf_putc(dest, '"');
+    prop_type_format_value(dest, type, value, cs, PROP_TYPE_SYNTAX_JSON);
+    strbuf_putc(dest, '"');
+
+    return;
+  }
+
+  info = prop_type_get_info(type);
+
+  if (info->count == 0) {
+    strbuf_puts(dest, "null");
+
+    return;
+  }
+
+  is_array = prop_type_is_array(type);
+
+  if (is_array && info->count > 1 && value->pos == value->nbytes) {
+    strbuf_puts(dest, "[]");
+
+    return;
+  }
+
+  if (is_array) {
+    strbuf_putc(dest, '[');
+  }
+
+  if (info->count > 1) {
+    strbuf_putc(dest, '[');
+  }
+
+  prop_type_format_value(dest, type, value, cs, PROP_TYPE_SYNTAX_JSON);
+
+  if (info->count > 1) {
+    strbuf_putc(dest, ']');
+  }
+
+  if (is_array) {
+    strbuf_putc(dest, ']');
+  }
+}
+
+/* As with XML, anything that isn't ASCII gets transcoded to UTF-8 one
+   character at a time. Multi-byte characters are decoded as a whole starting
+   from their first byte, so a Shift-JIS trail byte that happens to be a
+   backslash never gets mistaken for one. */
+
+static void prop_json_write_string(struct strbuf *dest, const char *str,
+                                   size_t nchars, enum charset cs) {
+  size_t pos;
+  size_t end;
+  uint32_t c;
+
+  assert(dest != NULL);
+  assert(str != NULL);
+
+  strbuf_putc(dest, '"');
+  pos = 0;
+
+  while (pos < nchars) {
+    end = pos + prop_json_plain_span(str + pos, nchars - pos);
+    strbuf_putn(dest, str + pos, end - pos);
+    pos = end;
+
+    if (pos == nchars) {
+      break;
+    }
+
+    c = (uint8_t)str[pos];
+
+    switch (c) {
+    case '"':
+      strbuf_puts(dest, "\\\"");
+      pos++;
+
+      break;
+
+    case '\\':
+      strbuf_puts(dest, "\\\\");
+      pos++;
+
+      break;
+
+    case '\n':
+      strbuf_puts(dest, "\\n");
+      pos++;
+
+      break;
+
+    case '\r':
+      strbuf_puts(dest, "\\r");
+      pos++;
+
+      break;
+
+    case '\t':
+      strbuf_puts(dest, "\\t");
+      pos++;
+
+      break;
+
+    default:
+      if (c < 0x20) {
+        strbuf_printf(dest, "\\u%04x", (unsigned int)c);
+        pos++;
+      } else {
+        pos += charset_decode(cs, &c, str + pos, nchars - pos);
+        charset_put_utf8(dest, c);
+      }
+
+      break;
+    }
+  }
+
+  strbuf_putc(dest, '"');
+}
+
+/* Returns the length of the run of chars at the start of the string that can
+   be copied out as-is: printable ASCII other than quotes and backslashes. */
+
+static size_t prop_json_plain_span(const char *str, size_t nchars) {
+  const uint8_t *bytes;
+  size_t i;
+  uint8_t c;
+
+  assert(str != NULL || nchars == 0);
+
+  bytes = (const uint8_t *)str;
+  i = 0;
+
+#ifdef PROP_JSON_X86
+  if (nchars >= 16) {
+    i = prop_json_plain_span_simd(bytes, nchars);
+  }
+#endif
+
+  for (; i < nchars; i++) {
+    c = bytes[i];
+
+    if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\') {
+      break;
+    }
+  }
+
+  return i;
+}
+
+/* Unlike XML, JSON output needs no lookahead: a node's attributes and
+   children can be appended to its object as they arrive, so the only state
+   kept per level is which of the two lists have been opened. */
+
+int prop_json_stream_alloc(struct prop_json_stream **out, FILE *f) {
+  struct prop_json_stream *s;
+  char *chars;
+
+  assert(out != NULL);
+  assert(f != NULL);
+
+  *out = NULL;
+  s = calloc(1, sizeof(*s));
+  chars = malloc(PROP_JSON_SINK_NCHARS);
+
+  if (s == NULL || chars == NULL) {
+    free(chars);
+    free(s);
+
+    return -ENOMEM;
+  }
+
+  s->cs = prop_json_charset(PROP_ENCODING_SHIFT_JIS);
+  strbuf_init_sink(&s->out, f, chars, PROP_JSON_SINK_NCHARS);
+  *out = s;
+
+  return 0;
+}
+
+void prop_json_stream_free(struct prop_json_stream *s) {
+  if (s == NULL) {
+    return;
+  }
+
+  free(s->frames);
+  free(s->out.chars);
+  free(s);
+}
+
+void prop_json_stream_set_encoding(struct prop_json_stream *s,
+                                   enum prop_encoding encoding) {
+  assert(s != NULL);
+  assert(s->nframes == 0);
+
+  s->cs = prop_json_charset(encoding);
+}
+
+int prop_json_stream_begin_node(struct prop_json_stream *s, const char *name,
+                                enum prop_type type,
+                                const struct const_iobuf *value) {
+  struct prop_json_stream_frame *frames;
+  size_t max_frames;
+  int r;
+
+  assert(s != NULL);
+  assert(name != NULL);
+  assert(value != NULL);
+
+  r = prop_json_stream_open_parent(s);
+
+  if (r < 0) {
+    return r;
+  }
+
+  if (s->nframes == s->max_frames) {
+    max_frames = s->max_frames != 0 ? s->max_frames * 2 : 16;
+    frames = realloc(s->frames, max_frames * sizeof(*frames));
+
+    if (frames == NULL) {
+      return -ENOMEM;
+    }
+
+    s->frames = frames;
+    s->max_frames = max_frames;
+  }
+
+  prop_json_write_head(&s->out, name, type, value, s->cs, s->nframes);
+
+  s->frames[s->nframes].has_attrs = false;
+  s->frames[s->nframes].has_children = false;
+  s->nframes++;
+
+  return s->out.error;
+}
+
+int prop_json_stream_attr(struct prop_json_stream *s, const char *key,
+                          const char *val) {
+  struct prop_json_stream_frame *frame;
+
+  assert(s != NULL);
+  assert(s->nframes > 0);
+  assert(key != NULL);
+  assert(val != NULL);
+
+  frame = &s->frames[s->nframes - 1];
+
+  if (frame->has_children) {
+    log_write("Attribute @%s follows a child node", key);
+
+    return -ENOTSUP;
+  }
+
+  prop_json_write_attr(&s->out, key, val, s->cs, !frame->has_attrs);
+  frame->has_attrs = true;
+
+  return s->out.error;
+}
+
+int prop_json_stream_end_node(struct prop_json_stream *s) {
+  struct prop_json_stream_frame *frame;
+
+  assert(s != NULL);
+  assert(s->nframes > 0);
+
+  frame = &s->frames[s->nframes - 1];
+
+  if (frame->has_children) {
+    strbuf_putc(&s->out, '\n');
+    prop_json_write_indent(&s->out, s->nframes - 1);
+    strbuf_putc(&s->out, ']');
+  } else if (frame->has_attrs) {
+    strbuf_putc(&s->out, '}');
+  }
+
+  strbuf_putc(&s->out, '}');
+  s->nframes--;
+
+  if (s->nframes == 0) {
+    strbuf_putc(&s->out, '\n');
+
+    return strbuf_flush(&s->out);
+  }
+
+  return s->out.error;
+}
+
+/* Closes the parent's attribute list and opens its child list, or separates
+   the new node from its previous sibling. */
+
+static int prop_json_stream_open_parent(struct prop_json_stream *s) {
+  struct prop_json_stream_frame *frame;
+
+  assert(s != NULL);
+
+  if (s->nframes == 0) {
+    return 0;
+  }
+
+  frame = &s->frames[s->nframes - 1];
+
+  if (frame->has_children) {
+    strbuf_puts(&s->out, ",\n");
+  } else {
+    strbuf_puts(&s->out, frame->has_attrs ? "},\"children\":[\n"
+                                          : ",\"children\":[\n");
+    frame->has_children = true;
+  }
+
+  return s->out.error;
+}
+
+#ifdef PROP_JSON_X86
+
+/* These return the offset of the first special byte, or the end of the last
+   whole block if there isn't one. A signed comparison against 0x20 catches
+   control characters and non-ASCII bytes in one go. */
+
+static size_t prop_json_plain_span_simd(const uint8_t *bytes, size_t nbytes) {
+  if (__builtin_cpu_supports("avx2")) {
+    return prop_json_plain_span_avx2(bytes, nbytes);
+  } else if (__builtin_cpu_supports("sse2")) {
+    return prop_json_plain_span_sse2(bytes, nbytes);
+  } else {
+    return 0;
+  }
+}
+
+static size_t prop_json_plain_span_sse2(const uint8_t *bytes, size_t nbytes) {
+  __m128i v;
+  __m128i m;
+  unsigned int mask;
+  size_t i;
+
+  for (i = 0; i + 16 <= nbytes; i += 16) {
+    v = _mm_loadu_si128((const __m128i *)(bytes + i));
+    m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    m = _mm_or_si128(m, _mm_cmplt_epi8(v, _mm_set1_epi8(0x20)));
+    mask = _mm_movemask_epi8(m);
+
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return i;
+}
+
+static size_t prop_json_plain_span_avx2(const uint8_t *bytes, size_t nbytes) {
+  __m256i v;
+  __m256i m;
+  unsigned int mask;
+  size_t i;
+
+  for (i = 0; i + 32 <= nbytes; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *)(bytes + i));
+    m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    m = _mm256_or_si256(m, _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v));
+    mask = _mm256_movemask_epi8(m);
+
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return i + prop_json_plain_span_sse2(bytes + i, nbytes - i);
+}
+
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "573file/prop-type.h"
+#include "573file/prop.h"
+
+#include "util/iobuf.h"
+
+struct prop_json_stream;
+
+/* Writes a prop out as JSON, with each node as an object like
+
+     {"name":"x","type":"3s32","count":2,"value":[[1,2,3],[4,5,6]],
+      "attrs":{"k":"v"},"children":[...]}
+
+   where type and value are left out for void nodes, count only appears for
+   arrays, and attrs and children only appear if there are any. Values are
+   formatted the same way as in XML, except that arrays and multi-element
+   values become JSON arrays, bools are true or false, and ip4s and bins
+   (in hex) are strings. Strings come out as UTF-8. */
+
+int prop_json_write(const struct prop *p, char **out);
+
+/* Same as prop_json_write(), but writes to a file a bufferful at a time. */
+
+int prop_json_write_file(const struct prop *p, FILE *f);
+
+/* Event-driven counterpart to prop_json_write_file(), which takes the same
+   events as prop_xml_stream does. */
+
+int prop_json_stream_alloc(struct prop_json_stream **s, FILE *f);
+void prop_json_stream_free(struct prop_json_stream *s);
+void prop_json_stream_set_encoding(struct prop_json_stream *s,
+                                   enum prop_encoding encoding);
+int prop_json_stream_begin_node(struct prop_json_stream *s, const char *name,
+                                enum prop_type type,
+                                const struct const_iobuf *value);
+int prop_json_stream_attr(struct prop_json_stream *s, const char *key,
+                          const char *val);
+int prop_json_stream_end_node(struct prop_json_stream *s);
@@ -0,0 +1,830 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "573file/prop-query.h"
+#include "573file/prop-type.h"
+#include "573file/prop.h"
+
+#include "util/iobuf.h"
+#include "util/log.h"
+#include "util/str.h"
+
+/* Predicate counters live on the stack while a query runs, so that a compiled
+   query never needs to be written to. */
+
+#define PROP_QUERY_MAX_PREDS 8
+
+enum prop_query_pred_type {
+  PROP_QUERY_PRED_INDEX,
+  PROP_QUERY_PRED_ATTR,
+  PROP_QUERY_PRED_CHILD,
+  PROP_QUERY_PRED_SELF,
+};
+
+enum prop_query_op {
+  PROP_QUERY_OP_EXISTS,
+  PROP_QUERY_OP_EQ,
+  PROP_QUERY_OP_NE,
+};
+
+/* Names are hashed at compile time so that running a query never hashes
+   anything. A NULL str is a wildcard. */
+
+struct prop_query_name {
+  char *str;
+  uint32_t hash;
+};
+
+struct prop_query_literal {
+  char *str;
+  uint64_t magnitude;
+  bool is_int;
+  bool negative;
+};
+
+struct prop_query_pred {
+  enum prop_query_pred_type type;
+  enum prop_query_op op;
+  struct prop_query_name name;
+  struct prop_query_literal literal;
+  uint32_t index;
+};
+
+struct prop_query_step {
+  struct prop_query_name name;
+  struct prop_query_pred preds[PROP_QUERY_MAX_PREDS];
+  unsigned int npreds;
+};
+
+struct prop_query {
+  struct prop_query_step *steps;
+  size_t nsteps;
+  struct prop_query_name attr;
+  bool absolute;
+};
+
+struct prop_query_parser {
+  const char *expr;
+  size_t pos;
+};
+
+struct prop_query_exec {
+  const struct prop_query *q;
+  prop_query_callback_t callback;
+  void *ctx;
+  int nmatches;
+};
+
+struct prop_query_first {
+  const struct prop *p;
+  const char *val;
+};
+
+static int prop_query_parse_step(struct prop_query_parser *qp,
+                                 struct prop_query_step *step);
+static int prop_query_parse_pred(struct prop_query_parser *qp,
+                                 struct prop_query_pred *pred);
+static int prop_query_parse_op(struct prop_query_parser *qp,
+                               struct prop_query_pred *pred);
+static int prop_query_parse_literal(struct prop_query_parser *qp,
+                                    struct prop_query_literal *lit);
+static int prop_query_parse_name(struct prop_query_parser *qp, bool is_key,
+                                 struct prop_query_name *name);
+static int prop_query_parse_error(const struct prop_query_parser *qp,
+                                  const char *what);
+static bool prop_query_is_name_char(char c, bool is_key);
+static void prop_query_literal_init_int(struct prop_query_literal *lit);
+static void prop_query_step_fini(struct prop_query_step *step);
+static int prop_query_exec_step(struct prop_query_exec *ex,
+                                const struct prop *parent, size_t i);
+static int prop_query_exec_descend(struct prop_query_exec *ex,
+                                   const struct prop *p, size_t i);
+static int prop_query_exec_emit(struct prop_query_exec *ex,
+                                const struct prop *p);
+static bool prop_query_test(const struct prop_query_step *step,
+                            const struct prop *p, uint32_t *counters);
+static bool prop_query_test_pred(const struct prop_query_pred *pred,
+                                 const struct prop *p, uint32_t *counter);
+static bool prop_query_test_value(const struct prop *p,
+                                  const struct prop_query_literal *lit);
+static int prop_query_first_callback(void *ctx, const struct prop *p,
+                                     const char *attr_val);
+
+int prop_query_compile(struct prop_query **out, const char *expr) {
+  struct prop_query_parser qp;
+  struct prop_query_step *steps;
+  struct prop_query *q;
+  size_t max_steps;
+  int r;
+
+  assert(out != NULL);
+  assert(expr != NULL);
+
+  *out = NULL;
+
+  q = calloc(1, sizeof(*q));
+
+  if (q == NULL) {
+    r = -ENOMEM;
+
+    goto end;
+  }
+
+  qp.expr = expr;
+  qp.pos = 0;
+  max_steps = 0;
+
+  if (expr[0] == '/') {
+    q->absolute = true;
+    qp.pos++;
+  }
+
+  for (;;) {
+    if (expr[qp.pos] == '@') {
+      qp.pos++;
+      r = prop_query_parse_name(&qp, true, &q->attr);
+
+      if (r < 0) {
+        goto end;
+      }
+
+      break;
+    }
+
+    if (q->nsteps == max_steps) {
+      max_steps = max_steps != 0 ? max_steps * 2 : 4;
+      steps = realloc(q->steps, max_steps * sizeof(*steps));
+
+      if (steps == NULL) {
+        r = -ENOMEM;
+
+        goto end;
+      }
+
+      q->steps = steps;
+    }
+
+    memset(&q->steps[q->nsteps], 0, sizeof(q->steps[q->nsteps]));
+    q->nsteps++;
+
+    r = prop_query_parse_step(&qp, &q->steps[q->nsteps - 1]);
+
+    if (r < 0) {
+      goto end;
+    }
+
+    if (expr[qp.pos] != '/') {
+      break;
+    }
+
+    qp.pos++;
+  }
+
+  if (expr[qp.pos] != '\0') {
+    r = prop_query_parse_error(&qp, "Expected end of query");
+
+    goto end;
+  }
+
+  if (q->absolute && q->nsteps == 0) {
+    r = prop_query_parse_error(&qp, "Absolute query has no steps");
+
+    goto end;
+  }
+
+  *out = q;
+  q = NULL;
+  r = 0;
+
+end:
+  prop_query_free(q);
+
+  return r;
+}
+
+void prop_query_free(struct prop_query *q) {
+  size_t i;
+
+  if (q == NULL) {
+    return;
+  }
+
+  for (i = 0; i < q->nsteps; i++) {
+    prop_query_step_fini(&q->steps[i]);
+  }
+
+  free(q->steps);
+  free(q->attr.str);
+  free(q);
+}
+
+int prop_query_run(const struct prop_query *q, const struct prop *p,
+                   prop_query_callback_t callback, void *ctx) {
+  const struct prop_query_step *step;
+  struct prop_query_exec ex;
+  uint32_t counters[PROP_QUERY_MAX_PREDS];
+  int r;
+
+  assert(q != NULL);
+  assert(p != NULL);
+  assert(callback != NULL);
+
+  ex.q = q;
+  ex.callback = callback;
+  ex.ctx = ctx;
+  ex.nmatches = 0;
+
+  if (q->absolute) {
+    step = &q->steps[0];
+    memset(counters, 0, sizeof(counters));
+
+    if (step->name.str != NULL && !str_eq(prop_get_name(p), step->name.str)) {
+      return 0;
+    }
+
+    if (!prop_query_test(step, p, counters)) {
+      return 0;
+    }
+
+    r = prop_query_exec_descend(&ex, p, 1);
+  } else {
+    r = prop_query_exec_descend(&ex, p, 0);
+  }
+
+  if (r < 0) {
+    return r;
+  }
+
+  return ex.nmatches;
+}
+
+int prop_query_get_first(const struct prop_query *q, const struct prop *p,
+                         const struct prop **out_p, const char **out_val) {
+  struct prop_query_first first;
+  int r;
+
+  first.p = NULL;
+  first.val = NULL;
+
+  r = prop_query_run(q, p, prop_query_first_callback, &first);
+
+  if (out_p != NULL) {
+    *out_p = first.p;
+  }
+
+  if (out_val != NULL) {
+    *out_val = first.val;
+  }
+
+  if (r < 0) {
+    return r;
+  }
+
+  return first.p != NULL ? 1 : 0;
+}
+
+static int prop_query_first_callback(void *ctx, const struct prop *p,
+                                     const char *attr_val) {
+  struct prop_query_first *first;
+
+  first = ctx;
+  first->p = p;
+  first->val = attr_val;
+
+  return 1;
+}
+
+static int prop_query_parse_step(struct prop_query_parser *qp,
+                                 struct prop_query_step *step) {
+  int r;
+
+  assert(qp != NULL);
+  assert(step != NULL);
+
+  if (qp->expr[qp->pos] == '*') {
+    qp->pos++;
+  } else {
+    r = prop_query_parse_name(qp, false, &step->name);
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  while (qp->expr[qp->pos] == '[') {
+    if (step->npreds == PROP_QUERY_MAX_PREDS) {
+      log_write("Query step has more than %u predicates", PROP_QUERY_MAX_PREDS);
+
+      return -E2BIG;
+    }
+
+    qp->pos++;
+    r = prop_query_parse_pred(qp, &step->preds[step->npreds++]);
+
+    if (r < 0) {
+      return r;
+    }
+
+    if (qp->expr[qp->pos] != ']') {
+      return prop_query_parse_error(qp, "Expected ']'");
+    }
+
+    qp->pos++;
+  }
+
+  return 0;
+}
+
+static int prop_query_parse_pred(struct prop_query_parser *qp,
+                                 struct prop_query_pred *pred) {
+  uint32_t index;
+  char c;
+  int r;
+
+  assert(qp != NULL);
+  assert(pred != NULL);
+
+  c = qp->expr[qp->pos];
+
+  if (c >= '0' && c <= '9') {
+    index = 0;
+
+    for (; c >= '0' && c <= '9'; c = qp->expr[++qp->pos]) {
+      if (index > (UINT32_MAX - 9) / 10) {
+        return prop_query_parse_error(qp, "Index out of range");
+      }
+
+      index = index * 10 + (c - '0');
+    }
+
+    if (index == 0) {
+      return prop_query_parse_error(qp, "Indexes start at 1");
+    }
+
+    pred->type = PROP_QUERY_PRED_INDEX;
+    pred->index = index;
+
+    return 0;
+  }
+
+  if (c == '.') {
+    qp->pos++;
+    pred->type = PROP_QUERY_PRED_SELF;
+    r = prop_query_parse_op(qp, pred);
+
+    if (r < 0) {
+      return r;
+    }
+
+    if (pred->op == PROP_QUERY_OP_EXISTS) {
+      return prop_query_parse_error(qp, "Expected '=' or '!='");
+    }
+
+    return 0;
+  }
+
+  if (c == '@') {
+    qp->pos++;
+    pred->type = PROP_QUERY_PRED_ATTR;
+    r = prop_query_parse_name(qp, true, &pred->name);
+  } else {
+    pred->type = PROP_QUERY_PRED_CHILD;
+    r = prop_query_parse_name(qp, false, &pred->name);
+  }
+
+  if (r < 0) {
+    return r;
+  }
+
+  return prop_query_parse_op(qp, pred);
+}
+
+static int prop_query_parse_op(struct prop_query_parser *qp,
+                               struct prop_query_pred *pred) {
+  assert(qp != NULL);
+  assert(pred != NULL);
+
+  if (qp->expr[qp->pos] == '=') {
+    qp->pos++;
+    pred->op = PROP_QUERY_OP_EQ;
+  } else if (qp->expr[qp->pos] == '!' && qp->expr[qp->pos + 1] == '=') {
+    qp->pos += 2;
+    pred->op = PROP_QUERY_OP_NE;
+  } else {
+    pred->op = PROP_QUERY_OP_EXISTS;
+
+    return 0;
+  }
+
+  return prop_query_parse_literal(qp, &pred->literal);
+}
+
+static int prop_query_parse_literal(struct prop_query_parser *qp,
+                                    struct prop_query_literal *lit) {
+  const char *begin;
+  size_t nchars;
+  char quote;
+
+  assert(qp != NULL);
+  assert(lit != NULL);
+
+  quote = qp->expr[qp->pos];
+
+  if (quote == '\'' || quote == '"') {
+    qp->pos++;
+    begin = &qp->expr[qp->pos];
+
+    while (qp->expr[qp->pos] != quote) {
+      if (qp->expr[qp->pos] == '\0') {
+        return prop_query_parse_error(qp, "Unterminated string");
+      }
+
+      qp->pos++;
+    }
+
+    nchars = &qp->expr[qp->pos] - begin;
+    qp->pos++;
+  } else {
+    begin = &qp->expr[qp->pos];
+
+    while (qp->expr[qp->pos] == '-' ||
+           (qp->expr[qp->pos] >= '0' && qp->expr[qp->pos] <= '9')) {
+      qp->pos++;
+    }
+
+    nchars = &qp->expr[qp->pos] - begin;
+
+    if (nchars == 0) {
+      return prop_query_parse_error(qp, "Expected a value");
+    }
+  }
+
+  lit->str = malloc(nchars + 1);
+
+  if (lit->str == NULL) {
+    return -ENOMEM;
+  }
+
+  memcpy(lit->str, begin, nchars);
+  lit->str[nchars] = '\0';
+  prop_query_literal_init_int(lit);
+
+  return 0;
+}
+
+static void prop_query_literal_init_int(struct prop_query_literal *lit) {
+  const char *pos;
+  uint64_t magnitude;
+
+  assert(lit != NULL);
+  assert(lit->str != NULL);
+
+  pos = lit->str;
+  lit->is_int = false;
+  lit->negative = *pos == '-';
+
+  if (lit->negative) {
+    pos++;
+  }
+
+  if (*pos == '\0') {
+    return;
+  }
+
+  for (magnitude = 0; *pos != '\0'; pos++) {
+    if (*pos < '0' || *pos > '9') {
+      return;
+    }
+
+    if (magnitude > (UINT64_MAX - 9) / 10) {
+      return;
+    }
+
+    magnitude = magnitude * 10 + (*pos - '0');
+  }
+
+  lit->is_int = true;
+  lit->magnitude = magnitude;
+
+  if (magnitude == 0) {
+    lit->negative = false;
+  }
+}
+
+static int prop_query_parse_name(struct prop_query_parser *qp, bool is_key,
+                                 struct prop_query_name *name) {
+  size_t begin;
+  size_t nchars;
+
+  assert(qp != NULL);
+  assert(name != NULL);
+
+  begin = qp->pos;
+
+  while (prop_query_is_name_char(qp->expr[qp->pos], is_key)) {
+    qp->pos++;
+  }
+
+  nchars = qp->pos - begin;
+
+  if (nchars == 0) {
+    return prop_query_parse_error(qp, "Expected a name");
+  }
+
+  name->str = malloc(nchars + 1);
+
+  if (name->str == NULL) {
+    return -ENOMEM;
+  }
+
+  memcpy(name->str, &qp->expr[begin], nchars);
+  name->str[nchars] = '\0';
+  name->hash = str_hash(name->str);
+
+  return 0;
+}
+
+static bool prop_query_is_name_char(char c, bool is_key) {
+  if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') ||
+      (c >= 'a' && c <= 'z') || c == '_' || c == ':') {
+    return true;
+  }
+
+  /* Attribute keys aren't bound by the 6-bit node name alphabet */
+
+  return is_key && (c == '-' || c == '.');
+}
+
+static int prop_query_parse_error(const struct prop_query_parser *qp,
+                                  const char *what) {
+  assert(qp != NULL);
+  assert(what != NULL);
+
+  log_write("%s: %s at offset %u", qp->expr, what, (unsigned int)qp->pos);
+
+  return -EINVAL;
+}
+
+static void prop_query_step_fini(struct prop_query_step *step) {
+  unsigned int i;
+
+  assert(step != NULL);
+
+  free(step->name.str);
+
+  for (i = 0; i < step->npreds; i++) {
+    free(step->preds[i].name.str);
+    free(step->preds[i].literal.str);
+  }
+}
+
+static int prop_query_exec_step(struct prop_query_exec *ex,
+                                const struct prop *parent, size_t i) {
+  const struct prop_query_step *step;
+  const struct prop *child;
+  uint32_t counters[PROP_QUERY_MAX_PREDS];
+  int r;
+
+  assert(ex != NULL);
+  assert(parent != NULL);
+  assert(i < ex->q->nsteps);
+
+  step = &ex->q->steps[i];
+  memset(counters, 0, sizeof(counters));
+
+  if (step->name.str != NULL) {
+    child = prop_search_child_hashed_const(parent, step->name.str,
+                                           step->name.hash);
+  } else {
+    child = prop_get_first_child_const(parent);
+  }
+
+  while (child != NULL) {
+    if (prop_query_test(step, child, counters)) {
+      r = prop_query_exec_descend(ex, child, i + 1);
+
+      if (r != 0) {
+        return r;
+      }
+    }
+
+    if (step->name.str != NULL) {
+      child = prop_search_next_const(child);
+    } else {
+      child = prop_get_next_sibling_const(child);
+    }
+  }
+
+  return 0;
+}
+
+static int prop_query_exec_descend(struct prop_query_exec *ex,
+                                   const struct prop *p, size_t i) {
+  assert(ex != NULL);
+  assert(p != NULL);
+
+  if (i == ex->q->nsteps) {
+    return prop_query_exec_emit(ex, p);
+  } else {
+    return prop_query_exec_step(ex, p, i);
+  }
+}
+
+static int prop_query_exec_emit(struct prop_query_exec *ex,
+                                const struct prop *p) {
+  const struct prop_query_name *attr;
+  const char *val;
+
+  assert(ex != NULL);
+  assert(p != NULL);
+
+  attr = &ex->q->attr;
+
+  if (attr->str != NULL) {
+    val = prop_get_attr_hashed(p, attr->str, attr->hash);
+
+    if (val == NULL) {
+      return 0;
+    }
+  } else {
+    val = NULL;
+  }
+
+  ex->nmatches++;
+
+  return ex->callback(ex->ctx, p, val);
+}
+
+/* Candidates have already been matched by name. Predicates apply left to
+   right, so an index predicate counts the candidates that got past all of the
+   predicates before it. */
+
+static bool prop_query_test(const struct prop_query_step *step,
+                            const struct prop *p, uint32_t *counters) {
+  unsigned int i;
+
+  assert(step != NULL);
+  assert(p != NULL);
+  assert(counters != NULL);
+
+  for (i = 0; i < step->npreds; i++) {
+    if (!prop_query_test_pred(&step->preds[i], p, &counters[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool prop_query_test_pred(const struct prop_query_pred *pred,
+                                 const struct prop *p, uint32_t *counter) {
+  const struct prop *child;
+  const char *val;
+  bool eq;
+
+  assert(pred != NULL);
+  assert(p != NULL);
+  assert(counter != NULL);
+
+  switch (pred->type) {
+  case PROP_QUERY_PRED_INDEX:
+    return ++(*counter) == pred->index;
+
+  case PROP_QUERY_PRED_ATTR:
+    val = prop_get_attr_hashed(p, pred->name.str, pred->name.hash);
+
+    if (val == NULL) {
+      return false;
+    }
+
+    if (pred->op == PROP_QUERY_OP_EXISTS) {
+      return true;
+    }
+
+    eq = str_eq(val, pred->literal.str);
+
+    return pred->op == PROP_QUERY_OP_EQ ? eq : !eq;
+
+  case PROP_QUERY_PRED_CHILD:
+    /* As in XPath, this holds if any child with this name satisfies it */
+
+    for (child = prop_search_child_hashed_const(p, pred->name.str,
+                                                pred->name.hash);
+         child != NULL; child = prop_search_next_const(child)) {
+      if (pred->op == PROP_QUERY_OP_EXISTS) {
+        return true;
+      }
+
+      eq = prop_query_test_value(child, &pred->literal);
+
+      if (pred->op == PROP_QUERY_OP_EQ ? eq : !eq) {
+        return true;
+      }
+    }
+
+    return false;
+
+  case PROP_QUERY_PRED_SELF:
+    eq = prop_query_test_value(p, &pred->literal);
+
+    return pred->op == PROP_QUERY_OP_EQ ? eq : !eq;
+
+  default:
+    abort();
+  }
+}
+
+static bool prop_query_test_value(const struct prop *p,
+                                  const struct prop_query_literal *lit) {
+  struct const_iobuf src;
+  uint64_t magnitude;
+  uint64_t u64;
+  uint32_t u32;
+  uint16_t u16;
+  uint8_t u8;
+  bool negative;
+  int r;
+
+  assert(p != NULL);
+  assert(lit != NULL);
+
+  prop_borrow_value(p, &src);
+
+  switch (prop_get_type(p)) {
+  case PROP_STR:
+    return src.nbytes == strlen(lit->str) + 1 &&
+           memcmp(src.bytes, lit->str, src.nbytes) == 0;
+
+  case PROP_S8:
+    r = iobuf_read_8(&src, &u8);
+    negative = (int8_t)u8 < 0;
+    magnitude = negative ? -(int64_t)(int8_t)u8 : u8;
+
+    break;
+
+  case PROP_U8:
+  case PROP_BOOL:
+    r = iobuf_read_8(&src, &u8);
+    negative = false;
+    magnitude = u8;
+
+    break;
+
+  case PROP_S16:
+    r = iobuf_read_be16(&src, &u16);
+    negative = (int16_t)u16 < 0;
+    magnitude = negative ? -(int64_t)(int16_t)u16 : u16;
+
+    break;
+
+  case PROP_U16:
+    r = iobuf_read_be16(&src, &u16);
+    negative = false;
+    magnitude = u16;
+
+    break;
+
+  case PROP_S32:
+    r = iobuf_read_be32(&src, &u32);
+    negative = (int32_t)u32 < 0;
+    magnitude = negative ? -(int64_t)(int32_t)u32 : u32;
+
+    break;
+
+  case PROP_U32:
+  case PROP_TIME:
+    r = iobuf_read_be32(&src, &u32);
+    negative = false;
+    magnitude = u32;
+
+    break;
+
+  case PROP_S64:
+    r = iobuf_read_be64(&src, &u64);
+    negative = (int64_t)u64 < 0;
+    magnitude = negative ? -u64 : u64;
+
+    break;
+
+  case PROP_U64:
+    r = iobuf_read_be64(&src, &u64);
+    negative = false;
+    magnitude = u64;
+
+    break;
+
+  default:
+    return false;
+  }
+
+  if (r < 0 || !lit->is_int) {
+    return false;
+  }
+
+  return lit->negative == negative && lit->magnitude == magnitude;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "573file/prop.h"
+
+struct prop_query;
+
+/* Called once per match, in document order. attr_val is the value of the
+   selected attribute if the query ends in a /@name step, NULL otherwise.
+   Return a negative errno to abort, a positive value to stop early, or zero to
+   keep going. */
+
+typedef int (*prop_query_callback_t)(void *ctx, const struct prop *p,
+                                     const char *attr_val);
+
+/* Queries are a small subset of XPath:
+
+     /texturelist/texture[@format]/image/@name
+     texture[2]/size
+     *[@format]/image[@name='foo']
+     entry[.='1']
+     entry[name!='bar']
+
+   An absolute query starts by matching the node that it is run against,
+   whereas a relative one starts with that node's children. Each step is a
+   name or *, followed by any number of [N] (1-based index among the matches so
+   far), [@key], [@key='val'], [child], [child='val'] or [.='val'] predicates,
+   any of which may use != instead. Values are compared against strings and
+   integer scalars.
+
+   A compiled query is immutable, so it can be run against any number of trees
+   from any number of threads at once. Trees with deferred children still to
+   load are the exception, since the first visit loads them (see prop.h). */
+
+int prop_query_compile(struct prop_query **out, const char *expr);
+void prop_query_free(struct prop_query *q);
+int prop_query_run(const struct prop_query *q, const struct prop *p,
+                   prop_query_callback_t callback, void *ctx);
+int prop_query_get_first(const struct prop_query *q, const struct prop *p,
+                         const struct prop **out_p, const char **out_val);
@@ -0,0 +1,719 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "573file/prop-flat.h"
+#include "573file/prop-table.h"
+#include "573file/prop-type.h"
+
+#include "util/charset.h"
+#include "util/iobuf.h"
+#include "util/log.h"
+#include "util/str.h"
+
+#define PROP_TABLE_NONE UINT32_MAX
+
+/* Field paths get merged into a trie of node names rooted at the record,
+   which is node 0, so that fields with a common prefix share the lookups
+   for it. Children always come after their parents. */
+
+struct prop_table_node {
+  char *name;
+  uint32_t parent;
+  uint32_t first_child;
+  uint32_t next_sibling;
+};
+
+struct prop_table_field {
+  char *path;
+  char *key;
+  uint32_t node;
+};
+
+struct prop_table {
+  char **steps;
+  size_t nsteps;
+  struct prop_table_node *nodes;
+  size_t nnodes;
+  struct prop_table_field *fields;
+  size_t nfields;
+};
+
+/* A table's names mean nothing to a flat tree until they've been turned
+   into its name IDs, which happens once per tree. After that, finding a
+   record's fields only takes integer comparisons, and each node's children
+   get scanned once for all of the trie's branches below it. matches[] holds
+   the flat node that each trie node resolved to for the current record. */
+
+struct prop_table_run {
+  const struct prop_table *t;
+  const struct prop_flat *f;
+  enum prop_table_format format;
+  const char *prefix;
+  enum charset cs;
+  uint32_t *step_ids;
+  uint32_t *node_ids;
+  uint32_t *key_ids;
+  uint32_t *matches;
+  struct strbuf *dest;
+  struct strbuf cell;
+};
+
+static int prop_table_add_field(struct prop_table *t,
+                                struct prop_table_field *field,
+                                const char *path);
+static int prop_table_add_node(struct prop_table *t, uint32_t parent,
+                               const char *name, size_t nchars, uint32_t *out);
+static int prop_table_dup_step(char **out, const char *chars, size_t nchars);
+static enum charset prop_table_charset(enum prop_encoding encoding);
+static int prop_table_run_init(struct prop_table_run *run,
+                               const struct prop_table *t,
+                               const struct prop_flat *f);
+static void prop_table_run_fini(struct prop_table_run *run);
+static int prop_table_visit(struct prop_table_run *run, uint32_t node,
+                            size_t depth);
+static void prop_table_match(struct prop_table_run *run, uint32_t record);
+static void prop_table_match_children(struct prop_table_run *run,
+                                      uint32_t node);
+static int prop_table_write_row(struct prop_table_run *run, uint32_t record);
+static void prop_table_format_field(struct prop_table_run *run, size_t i);
+static void prop_table_write_cell(struct strbuf *dest, const char *chars,
+                                  size_t nchars, enum prop_table_format format);
+static void prop_table_write_sep(struct strbuf *dest,
+                                 enum prop_table_format format);
+
+int prop_table_compile(struct prop_table **out, const char *record,
+                       const char *const *fields, size_t nfields) {
+  struct prop_table *t;
+  const char *pos;
+  const char *end;
+  size_t max_nodes;
+  size_t i;
+  int r;
+
+  assert(out != NULL);
+  assert(record != NULL);
+  assert(fields != NULL || nfields == 0);
+
+  *out = NULL;
+  t = calloc(1, sizeof(*t));
+
+  if (t == NULL) {
+    return -ENOMEM;
+  }
+
+  /* Every step takes up at least one char, plus there's the record node */
+
+  max_nodes = 1;
+
+  for (i = 0; i < nfields; i++) {
+    max_nodes += strlen(fields[i]);
+  }
+
+  t->steps = calloc(strlen(record) + 1, sizeof(*t->steps));
+  t->nodes = calloc(max_nodes, sizeof(*t->nodes));
+  t->fields = calloc(nfields, sizeof(*t->fields));
+
+  if (t->steps == NULL || t->nodes == NULL ||
+      (t->fields == NULL && nfields > 0)) {
+    r = -ENOMEM;
+
+    goto end;
+  }
+
+  t->nodes[0].parent = PROP_TABLE_NONE;
+  t->nodes[0].first_child = PROP_TABLE_NONE;
+  t->nodes[0].next_sibling = PROP_TABLE_NONE;
+  t->nnodes = 1;
+
+  pos = record;
+
+  if (*pos == '/') {
+    pos++;
+  }
+
+  do {
+    end = strchr(pos, '/');
+
+    if (end == NULL) {
+      end = pos + strlen(pos);
+    }
+
+    if (end == pos || *pos == '@') {
+      log_write("\"%s\": Record path needs a node name in every step", record);
+      r = -EINVAL;
+
+      goto end;
+    }
+
+    r = prop_table_dup_step(&t->steps[t->nsteps], pos, end - pos);
+
+    if (r < 0) {
+      goto end;
+    }
+
+    t->nsteps++;
+    pos = end + 1;
+  } while (*end != '\0');
+
+  for (i = 0; i < nfields; i++) {
+    r = prop_table_add_field(t, &t->fields[i], fields[i]);
+    t->nfields++;
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+  *out = t;
+  t = NULL;
+  r = 0;
+
+end:
+  prop_table_free(t);
+
+  return r;
+}
+
+void prop_table_free(struct prop_table *t) {
+  size_t i;
+
+  if (t == NULL) {
+    return;
+  }
+
+  for (i = 0; i < t->nsteps; i++) {
+    free(t->steps[i]);
+  }
+
+  for (i = 0; i < t->nnodes; i++) {
+    free(t->nodes[i].name);
+  }
+
+  for (i = 0; i < t->nfields; i++) {
+    free(t->fields[i].path);
+    free(t->fields[i].key);
+  }
+
+  free(t->steps);
+  free(t->nodes);
+  free(t->fields);
+  free(t);
+}
+
+void prop_table_write_header(const struct prop_table *t,
+                             enum prop_table_format format, const char *prefix,
+                             struct strbuf *dest) {
+  size_t i;
+
+  assert(t != NULL);
+  assert(dest != NULL);
+
+  if (prefix != NULL) {
+    prop_table_write_cell(dest, prefix, strlen(prefix), format);
+  }
+
+  for (i = 0; i < t->nfields; i++) {
+    if (prefix != NULL || i > 0) {
+      prop_table_write_sep(dest, format);
+    }
+
+    prop_table_write_cell(dest, t->fields[i].path, strlen(t->fields[i].path),
+                          format);
+  }
+
+  strbuf_putc(dest, '\n');
+}
+
+int prop_table_write_rows(const struct prop_table *t, const struct prop_flat *f,
+                          enum prop_table_format format, const char *prefix,
+                          struct strbuf *dest) {
+  struct prop_table_run run;
+  uint32_t root;
+  size_t i;
+  int r;
+
+  assert(t != NULL);
+  assert(f != NULL);
+  assert(dest != NULL);
+
+  r = prop_table_run_init(&run, t, f);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  run.format = format;
+  run.prefix = prefix;
+  run.dest = dest;
+
+  /* A name that the tree doesn't have anywhere can't match any records */
+
+  for (i = 0; i < t->nsteps; i++) {
+    if (run.step_ids[i] == PROP_FLAT_NONE) {
+      goto end;
+    }
+  }
+
+  root = prop_flat_get_root(f);
+
+  if (prop_flat_get_name_id(f, root) == run.step_ids[0]) {
+    r = prop_table_visit(&run, root, 0);
+  }
+
+end:
+  prop_table_run_fini(&run);
+
+  return r;
+}
+
+/* Parses a field path and adds whatever nodes it needs to the trie */
+
+static int prop_table_add_field(struct prop_table *t,
+                                struct prop_table_field *field,
+                                const char *path) {
+  const char *pos;
+  const char *end;
+  uint32_t node;
+  int r;
+
+  assert(t != NULL);
+  assert(field != NULL);
+  assert(path != NULL);
+
+  r = str_dup(&field->path, path);
+
+  if (r < 0) {
+    return r;
+  }
+
+  node = 0;
+  pos = path;
+
+  if (strcmp(path, ".") == 0) {
+    field->node = 0;
+
+    return 0;
+  }
+
+  for (;;) {
+    end = strchr(pos, '/');
+
+    if (end == NULL) {
+      end = pos + strlen(pos);
+    }
+
+    if (*pos == '@' && *end == '\0' && end - pos > 1) {
+      r = prop_table_dup_step(&field->key, pos + 1, end - pos - 1);
+
+      if (r < 0) {
+        return r;
+      }
+
+      break;
+    }
+
+    if (end == pos || *pos == '@') {
+      log_write("\"%s\": Bad field path", path);
+
+      return -EINVAL;
+    }
+
+    r = prop_table_add_node(t, node, pos, end - pos, &node);
+
+    if (r < 0) {
+      return r;
+    }
+
+    if (*end == '\0') {
+      break;
+    }
+
+    pos = end + 1;
+  }
+
+  field->node = node;
+
+  return 0;
+}
+
+static int prop_table_add_node(struct prop_table *t, uint32_t parent,
+                               const char *name, size_t nchars, uint32_t *out) {
+  struct prop_table_node *node;
+  uint32_t child;
+  uint32_t *link;
+  int r;
+
+  assert(t != NULL);
+  assert(parent < t->nnodes);
+  assert(name != NULL);
+  assert(out != NULL);
+
+  link = &t->nodes[parent].first_child;
+
+  for (child = *link; child != PROP_TABLE_NONE;
+       child = t->nodes[child].next_sibling) {
+    node = &t->nodes[child];
+
+    if (strlen(node->name) == nchars &&
+        memcmp(node->name, name, nchars) == 0) {
+      *out = child;
+
+      return 0;
+    }
+
+    link = &node->next_sibling;
+  }
+
+  node = &t->nodes[t->nnodes];
+  r = prop_table_dup_step(&node->name, name, nchars);
+
+  if (r < 0) {
+    return r;
+  }
+
+  node->parent = parent;
+  node->first_child = PROP_TABLE_NONE;
+  node->next_sibling = PROP_TABLE_NONE;
+  *link = t->nnodes;
+  *out = t->nnodes;
+  t->nnodes++;
+
+  return 0;
+}
+
+static int prop_table_dup_step(char **out, const char *chars, size_t nchars) {
+  char *str;
+
+  assert(out != NULL);
+  assert(chars != NULL);
+
+  str = malloc(nchars + 1);
+
+  if (str == NULL) {
+    return -ENOMEM;
+  }
+
+  memcpy(str, chars, nchars);
+  str[nchars] = '\0';
+  *out = str;
+
+  return 0;
+}
+
+static enum charset prop_table_charset(enum prop_encoding encoding) {
+  switch (encoding) {
+  case PROP_ENCODING_ASCII:
+    return CHARSET_ASCII;
+
+  case PROP_ENCODING_ISO_8859_1:
+    return CHARSET_ISO_8859_1;
+
+  case PROP_ENCODING_EUC_JP:
+    return CHARSET_EUC_JP;
+
+  case PROP_ENCODING_UTF_8:
+    return CHARSET_UTF_8;
+
+  default:
+    return CHARSET_SHIFT_JIS;
+  }
+}
+
+static int prop_table_run_init(struct prop_table_run *run,
+                               const struct prop_table *t,
+                               const struct prop_flat *f) {
+  size_t i;
+
+  assert(run != NULL);
+  assert(t != NULL);
+  assert(f != NULL);
+
+  memset(run, 0, sizeof(*run));
+  run->t = t;
+  run->f = f;
+  run->cs = prop_table_charset(prop_flat_get_encoding(f));
+  strbuf_init(&run->cell);
+
+  run->step_ids = malloc(t->nsteps * sizeof(*run->step_ids));
+  run->node_ids = malloc(t->nnodes * sizeof(*run->node_ids));
+  run->key_ids = malloc((t->nfields + 1) * sizeof(*run->key_ids));
+  run->matches = malloc(t->nnodes * sizeof(*run->matches));
+
+  if (run->step_ids == NULL || run->node_ids == NULL ||
+      run->key_ids == NULL || run->matches == NULL) {
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < t->nsteps; i++) {
+    run->step_ids[i] = prop_flat_lookup_name(f, t->steps[i]);
+  }
+
+  run->node_ids[0] = PROP_FLAT_NONE;
+
+  for (i = 1; i < t->nnodes; i++) {
+    run->node_ids[i] = prop_flat_lookup_name(f, t->nodes[i].name);
+  }
+
+  for (i = 0; i < t->nfields; i++) {
+    if (t->fields[i].key != NULL) {
+      run->key_ids[i] = prop_flat_lookup_name(f, t->fields[i].key);
+    } else {
+      run->key_ids[i] = PROP_FLAT_NONE;
+    }
+  }
+
+  return 0;
+}
+
+static void prop_table_run_fini(struct prop_table_run *run) {
+  assert(run != NULL);
+
+  free(run->step_ids);
+  free(run->node_ids);
+  free(run->key_ids);
+  free(run->matches);
+  free(run->cell.chars);
+}
+
+static int prop_table_visit(struct prop_table_run *run, uint32_t node,
+                            size_t depth) {
+  uint32_t child;
+  int r;
+
+  assert(run != NULL);
+  assert(depth < run->t->nsteps);
+
+  if (depth + 1 == run->t->nsteps) {
+    return prop_table_write_row(run, node);
+  }
+
+  for (child = prop_flat_get_first_child(run->f, node);
+       child != PROP_FLAT_NONE;
+       child = prop_flat_get_next_sibling(run->f, child)) {
+    if (prop_flat_get_name_id(run->f, child) == run->step_ids[depth + 1]) {
+      r = prop_table_visit(run, child, depth + 1);
+
+      if (r < 0) {
+        return r;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static void prop_table_match(struct prop_table_run *run, uint32_t record) {
+  size_t i;
+
+  assert(run != NULL);
+
+  run->matches[0] = record;
+
+  for (i = 1; i < run->t->nnodes; i++) {
+    run->matches[i] = PROP_FLAT_NONE;
+  }
+
+  for (i = 0; i < run->t->nnodes; i++) {
+    if (run->matches[i] != PROP_FLAT_NONE &&
+        run->t->nodes[i].first_child != PROP_TABLE_NONE) {
+      prop_table_match_children(run, i);
+    }
+  }
+}
+
+static void prop_table_match_children(struct prop_table_run *run,
+                                      uint32_t node) {
+  const struct prop_table_node *nodes;
+  uint32_t child;
+  uint32_t name_id;
+  uint32_t i;
+  size_t nwanted;
+
+  assert(run != NULL);
+
+  nodes = run->t->nodes;
+  nwanted = 0;
+
+  for (i = nodes[node].first_child; i != PROP_TABLE_NONE;
+       i = nodes[i].next_sibling) {
+    if (run->node_ids[i] != PROP_FLAT_NONE) {
+      nwanted++;
+    }
+  }
+
+  for (child = prop_flat_get_first_child(run->f, run->matches[node]);
+       child != PROP_FLAT_NONE && nwanted > 0;
+       child = prop_flat_get_next_sibling(run->f, child)) {
+    name_id = prop_flat_get_name_id(run->f, child);
+
+    for (i = nodes[node].first_child; i != PROP_TABLE_NONE;
+         i = nodes[i].next_sibling) {
+      if (run->node_ids[i] == name_id && run->matches[i] == PROP_FLAT_NONE) {
+        run->matches[i] = child;
+        nwanted--;
+
+        break;
+      }
+    }
+  }
+}
+
+static int prop_table_write_row(struct prop_table_run *run, uint32_t record) {
+  size_t i;
+
+  assert(run != NULL);
+
+  prop_table_match(run, record);
+
+  if (run->prefix != NULL) {
+    prop_table_write_cell(run->dest, run->prefix, strlen(run->prefix),
+                          run->format);
+  }
+
+  for (i = 0; i < run->t->nfields; i++) {
+    if (run->prefix != NULL || i > 0) {
+      prop_table_write_sep(run->dest, run->format);
+    }
+
+    run->cell.pos = 0;
+    prop_table_format_field(run, i);
+    prop_table_write_cell(run->dest, run->cell.chars, run->cell.pos,
+                          run->format);
+  }
+
+  strbuf_putc(run->dest, '\n');
+
+  if (run->cell.error < 0) {
+    return run->cell.error;
+  }
+
+  return run->dest->error;
+}
+
+static void prop_table_format_field(struct prop_table_run *run, size_t i) {
+  const struct prop_table_field *field;
+  struct const_iobuf value;
+  const char *val;
+  uint32_t node;
+
+  assert(run != NULL);
+
+  field = &run->t->fields[i];
+  node = run->matches[field->node];
+
+  if (node == PROP_FLAT_NONE) {
+    return;
+  }
+
+  if (field->key == NULL) {
+    prop_flat_borrow_value(run->f, node, &value);
+    prop_type_format_value(&run->cell, prop_flat_get_type(run->f, node), &value,
+                           run->cs, PROP_TYPE_SYNTAX_XML);
+
+    return;
+  }
+
+  if (run->key_ids[i] == PROP_FLAT_NONE) {
+    return;
+  }
+
+  val = prop_flat_get_attr_by_id(run->f, node, run->key_ids[i]);
+
+  if (val != NULL) {
+    charset_put_utf8_str(&run->cell, run->cs, val, strlen(val));
+  }
+}
+
+static void prop_table_write_cell(struct strbuf *dest, const char *chars,
+                                  size_t nchars,
+                                  enum prop_table_format format) {
+  size_t pos;
+  size_t end;
+  char c;
+
+  assert(dest != NULL);
+  assert(chars != NULL || nchars == 0);
+
+  if (format == PROP_TABLE_CSV) {
+    for (end = 0; end < nchars; end++) {
+      c = chars[end];
+
+      if (c == ',' || c == '"' || c == '\n' || c == '\r') {
+        break;
+      }
+    }
+
+    if (end == nchars) {
+      strbuf_putn(dest, chars, nchars);
+
+      return;
+    }
+
+    strbuf_putc(dest, '"');
+
+    for (pos = 0; pos < nchars; pos = end + 1) {
+      end = pos;
+
+      while (end < nchars && chars[end] != '"') {
+        end++;
+      }
+
+      strbuf_putn(dest, chars + pos, end - pos);
+
+      if (end < nchars) {
+        strbuf_puts(dest, "\"\"");
+      }
+    }
+
+    strbuf_putc(dest, '"');
+
+    return;
+  }
+
+  for (pos = 0; pos < nchars; pos = end + 1) {
+    end = pos;
+
+    while (end < nchars && chars[end] != '\t' && chars[end] != '\n' &&
+           chars[end] != '\r' && chars[end] != '\\') {
+      end++;
+    }
+
+    strbuf_putn(dest, chars + pos, end - pos);
+
+    if (end == nchars) {
+      break;
+    }
+
+    switch (chars[end]) {
+    case '\t':
+      strbuf_puts(dest, "\\t");
+
+      break;
+
+    case '\n':
+      strbuf_puts(dest, "\\n");
+
+      break;
+
+    case '\r':
+      strbuf_puts(dest, "\\r");
+
+      break;
+
+    default:
+      strbuf_puts(dest, "\\\\");
+
+      break;
+    }
+  }
+}
+
+static void prop_table_write_sep(struct strbuf *dest,
+                                 enum prop_table_format format) {
+  strbuf_putc(dest, format == PROP_TABLE_CSV ? ',' : '\t');
+}
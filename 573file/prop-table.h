@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "573file/prop-flat.h"
+
+#include "util/str.h"
+
+struct prop_table;
+
+enum prop_table_format {
+  PROP_TABLE_TSV,
+  PROP_TABLE_CSV,
+};
+
+/* Flattens repeated records into rows, such as every music node of a music
+   DB with one column per field of interest.
+
+   The record path is a list of node names separated by slashes, starting
+   with the root's, like /mdb/music. It matches every node along that path,
+   not just the first. Field paths are relative to the record, like
+   info/title_name, and pick out the first node that matches. A field path
+   may end in @key to read an attribute instead, so @id is the record's own
+   id attribute, and "." is the record's own value. Fields that aren't there
+   come out empty.
+
+   Values are formatted the same way as XML text, with strings converted to
+   UTF-8. TSV output escapes tabs, newlines, carriage returns and backslashes
+   with a backslash, and CSV output quotes fields the way RFC 4180 does.
+
+   The optional prefix adds a first column that holds the same value on
+   every row, such as the path of the file the rows came from. A compiled
+   table is immutable, so it can be used from any number of threads at
+   once. */
+
+int prop_table_compile(struct prop_table **out, const char *record,
+                       const char *const *fields, size_t nfields);
+void prop_table_free(struct prop_table *t);
+void prop_table_write_header(const struct prop_table *t,
+                             enum prop_table_format format, const char *prefix,
+                             struct strbuf *dest);
+int prop_table_write_rows(const struct prop_table *t, const struct prop_flat *f,
+                          enum prop_table_format format, const char *prefix,
+                          struct strbuf *dest);
@@ -1,27 +1,208 @@
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "573file/prop-type.h"
 
+#include "util/charset.h"
+#include "util/dec.h"
+#include "util/hex.h"
+#include "util/iobuf.h"
 #include "util/macro.h"
+#include "util/str.h"
 
-static const char *const prop_type_names[64] = {
-    [PROP_VOID] = "void", [PROP_S8] = "s8",     [PROP_U8] = "u8",
-    [PROP_S16] = "s16",   [PROP_U16] = "u16",   [PROP_S32] = "s32",
-    [PROP_U32] = "u32",   [PROP_S64] = "s64",   [PROP_U64] = "u64",
-    [PROP_BIN] = "bin",   [PROP_STR] = "str",   [PROP_IP4] = "ip4",
-    [PROP_TIME] = "time", [PROP_2U16] = "2u16", [PROP_3S32] = "3s32",
-    [PROP_4U16] = "4u16", [PROP_BOOL] = "bool",
+/* Size of the scratch buffer that integers are formatted and binary values
+   hex encoded into */
+
+#define PROP_TYPE_FORMAT_NCHARS 1024
+
+static void prop_type_format_s8(struct strbuf *dest, const uint8_t *bytes,
+                                size_t nelems, unsigned int count,
+                                enum prop_type_syntax syntax);
+static void prop_type_format_u8(struct strbuf *dest, const uint8_t *bytes,
+                                size_t nelems, unsigned int count,
+                                enum prop_type_syntax syntax);
+static void prop_type_format_s16(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax);
+static void prop_type_format_u16(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax);
+static void prop_type_format_s32(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax);
+static void prop_type_format_u32(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax);
+static void prop_type_format_s64(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax);
+static void prop_type_format_u64(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax);
+static void prop_type_format_float(struct strbuf *dest, const uint8_t *bytes,
+                                   size_t nelems, unsigned int count,
+                                   enum prop_type_syntax syntax);
+static void prop_type_format_double(struct strbuf *dest, const uint8_t *bytes,
+                                    size_t nelems, unsigned int count,
+                                    enum prop_type_syntax syntax);
+static void prop_type_format_bool(struct strbuf *dest, const uint8_t *bytes,
+                                  size_t nelems, unsigned int count,
+                                  enum prop_type_syntax syntax);
+static void prop_type_format_ip4(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax);
+static void prop_type_format_int(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 unsigned int elem_size, bool is_signed,
+                                 enum prop_type_syntax syntax);
+static void prop_type_format_sep(struct strbuf *dest, size_t i,
+                                 unsigned int count,
+                                 enum prop_type_syntax syntax);
+static const char *prop_type_value_sep(unsigned int count,
+                                       enum prop_type_syntax syntax);
+static int prop_type_parse_s8(uint8_t *bytes, const char *chars, size_t nchars,
+                              size_t nelems);
+static int prop_type_parse_u8(uint8_t *bytes, const char *chars, size_t nchars,
+                              size_t nelems);
+static int prop_type_parse_s16(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems);
+static int prop_type_parse_u16(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems);
+static int prop_type_parse_s32(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems);
+static int prop_type_parse_u32(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems);
+static int prop_type_parse_s64(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems);
+static int prop_type_parse_u64(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems);
+static int prop_type_parse_float(uint8_t *bytes, const char *chars,
+                                 size_t nchars, size_t nelems);
+static int prop_type_parse_double(uint8_t *bytes, const char *chars,
+                                  size_t nchars, size_t nelems);
+static int prop_type_parse_bool(uint8_t *bytes, const char *chars,
+                                size_t nchars, size_t nelems);
+static int prop_type_parse_ip4(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems);
+static int prop_type_parse_int(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems, unsigned int elem_size,
+                               bool is_signed);
+static int prop_type_parse_dec(const char *chars, size_t nchars, uint64_t max,
+                               uint64_t *out);
+static bool prop_type_is_sep(char c);
+static bool prop_type_next_token(const char *chars, size_t nchars, size_t *pos,
+                                 size_t *len);
+static int prop_type_parse_end(const char *chars, size_t nchars, size_t pos);
+static void prop_type_put_be(uint8_t *bytes, uint64_t value,
+                             unsigned int elem_size);
+static uint16_t prop_type_be16(const uint8_t *bytes);
+static uint32_t prop_type_be32(const uint8_t *bytes);
+static uint64_t prop_type_be64(const uint8_t *bytes);
+
+/* The attribute pseudo-type is not a valid node type, but it does have a
+   (variable) size for the benefit of the binary reader's value slicing. */
+
+static const struct prop_type_info prop_type_infos[64] = {
+    [PROP_VOID] = {"void", 0, 0, 0, NULL, NULL},
+    [PROP_S8] = {"s8", 1, 1, 1, prop_type_format_s8, prop_type_parse_s8},
+    [PROP_U8] = {"u8", 1, 1, 1, prop_type_format_u8, prop_type_parse_u8},
+    [PROP_S16] = {"s16", 2, 1, 2, prop_type_format_s16, prop_type_parse_s16},
+    [PROP_U16] = {"u16", 2, 1, 2, prop_type_format_u16, prop_type_parse_u16},
+    [PROP_S32] = {"s32", 4, 1, 4, prop_type_format_s32, prop_type_parse_s32},
+    [PROP_U32] = {"u32", 4, 1, 4, prop_type_format_u32, prop_type_parse_u32},
+    [PROP_S64] = {"s64", 8, 1, 8, prop_type_format_s64, prop_type_parse_s64},
+    [PROP_U64] = {"u64", 8, 1, 8, prop_type_format_u64, prop_type_parse_u64},
+    [PROP_BIN] = {"bin", -1, 0, 0, NULL, NULL},
+    [PROP_STR] = {"str", -1, 0, 0, NULL, NULL},
+    [PROP_IP4] = {"ip4", 4, 1, 4, prop_type_format_ip4, prop_type_parse_ip4},
+    [PROP_TIME] = {"time", 4, 1, 4, prop_type_format_u32, prop_type_parse_u32},
+    [PROP_FLOAT] = {"float", 4, 1, 4, prop_type_format_float,
+                    prop_type_parse_float},
+    [PROP_DOUBLE] = {"double", 8, 1, 8, prop_type_format_double,
+                     prop_type_parse_double},
+    [PROP_2S8] = {"2s8", 2, 2, 1, prop_type_format_s8, prop_type_parse_s8},
+    [PROP_2U8] = {"2u8", 2, 2, 1, prop_type_format_u8, prop_type_parse_u8},
+    [PROP_2S16] = {"2s16", 4, 2, 2, prop_type_format_s16, prop_type_parse_s16},
+    [PROP_2U16] = {"2u16", 4, 2, 2, prop_type_format_u16, prop_type_parse_u16},
+    [PROP_2S32] = {"2s32", 8, 2, 4, prop_type_format_s32, prop_type_parse_s32},
+    [PROP_2U32] = {"2u32", 8, 2, 4, prop_type_format_u32, prop_type_parse_u32},
+    [PROP_2S64] = {"2s64", 16, 2, 8, prop_type_format_s64, prop_type_parse_s64},
+    [PROP_2U64] = {"2u64", 16, 2, 8, prop_type_format_u64, prop_type_parse_u64},
+    [PROP_2FLOAT] = {"2f", 8, 2, 4, prop_type_format_float,
+                     prop_type_parse_float},
+    [PROP_2DOUBLE] = {"2d", 16, 2, 8, prop_type_format_double,
+                      prop_type_parse_double},
+    [PROP_3S8] = {"3s8", 3, 3, 1, prop_type_format_s8, prop_type_parse_s8},
+    [PROP_3U8] = {"3u8", 3, 3, 1, prop_type_format_u8, prop_type_parse_u8},
+    [PROP_3S16] = {"3s16", 6, 3, 2, prop_type_format_s16, prop_type_parse_s16},
+    [PROP_3U16] = {"3u16", 6, 3, 2, prop_type_format_u16, prop_type_parse_u16},
+    [PROP_3S32] = {"3s32", 12, 3, 4, prop_type_format_s32, prop_type_parse_s32},
+    [PROP_3U32] = {"3u32", 12, 3, 4, prop_type_format_u32, prop_type_parse_u32},
+    [PROP_3S64] = {"3s64", 24, 3, 8, prop_type_format_s64, prop_type_parse_s64},
+    [PROP_3U64] = {"3u64", 24, 3, 8, prop_type_format_u64, prop_type_parse_u64},
+    [PROP_3FLOAT] = {"3f", 12, 3, 4, prop_type_format_float,
+                     prop_type_parse_float},
+    [PROP_3DOUBLE] = {"3d", 24, 3, 8, prop_type_format_double,
+                      prop_type_parse_double},
+    [PROP_4S8] = {"4s8", 4, 4, 1, prop_type_format_s8, prop_type_parse_s8},
+    [PROP_4U8] = {"4u8", 4, 4, 1, prop_type_format_u8, prop_type_parse_u8},
+    [PROP_4S16] = {"4s16", 8, 4, 2, prop_type_format_s16, prop_type_parse_s16},
+    [PROP_4U16] = {"4u16", 8, 4, 2, prop_type_format_u16, prop_type_parse_u16},
+    [PROP_4S32] = {"4s32", 16, 4, 4, prop_type_format_s32, prop_type_parse_s32},
+    [PROP_4U32] = {"4u32", 16, 4, 4, prop_type_format_u32, prop_type_parse_u32},
+    [PROP_4S64] = {"4s64", 32, 4, 8, prop_type_format_s64, prop_type_parse_s64},
+    [PROP_4U64] = {"4u64", 32, 4, 8, prop_type_format_u64, prop_type_parse_u64},
+    [PROP_4FLOAT] = {"4f", 16, 4, 4, prop_type_format_float,
+                     prop_type_parse_float},
+    [PROP_4DOUBLE] = {"4d", 32, 4, 8, prop_type_format_double,
+                      prop_type_parse_double},
+    [PROP_ATTR] = {NULL, -1, 0, 0, NULL, NULL},
+    [PROP_VS8] = {"vs8", 16, 16, 1, prop_type_format_s8, prop_type_parse_s8},
+    [PROP_VU8] = {"vu8", 16, 16, 1, prop_type_format_u8, prop_type_parse_u8},
+    [PROP_VS16] = {"vs16", 16, 8, 2, prop_type_format_s16, prop_type_parse_s16},
+    [PROP_VU16] = {"vu16", 16, 8, 2, prop_type_format_u16, prop_type_parse_u16},
+    [PROP_BOOL] = {"bool", 1, 1, 1, prop_type_format_bool,
+                   prop_type_parse_bool},
+    [PROP_2BOOL] = {"2b", 2, 2, 1, prop_type_format_bool, prop_type_parse_bool},
+    [PROP_3BOOL] = {"3b", 3, 3, 1, prop_type_format_bool, prop_type_parse_bool},
+    [PROP_4BOOL] = {"4b", 4, 4, 1, prop_type_format_bool, prop_type_parse_bool},
+    [PROP_VBOOL] = {"vb", 16, 16, 1, prop_type_format_bool,
+                    prop_type_parse_bool},
 };
 
-static const int prop_type_sizes[64] = {
-    [PROP_VOID] = 0,  [PROP_S8] = 1,   [PROP_U8] = 1,    [PROP_S16] = 2,
-    [PROP_U16] = 2,   [PROP_S32] = 4,  [PROP_U32] = 4,   [PROP_S64] = 8,
-    [PROP_U64] = 8,   [PROP_BIN] = -1, [PROP_STR] = -1,  [PROP_IP4] = 4,
-    [PROP_TIME] = 4,  [PROP_2U16] = 4, [PROP_3S32] = 12, [PROP_4U16] = 8,
-    [PROP_ATTR] = -1, [PROP_BOOL] = 1,
+static const char *const prop_encoding_names[8] = {
+    "none", "ASCII", "ISO-8859-1", "EUC-JP", "SHIFT_JIS", "UTF-8",
 };
 
+int prop_type_from_string(enum prop_type *out, const char *name) {
+  enum prop_type type;
+
+  assert(out != NULL);
+  assert(name != NULL);
+
+  for (type = 0; type < lengthof(prop_type_infos); type++) {
+    if (str_eq(prop_type_infos[type].name, name)) {
+      *out = type;
+
+      return 0;
+    }
+  }
+
+  return -ENOENT;
+}
+
+const struct prop_type_info *prop_type_get_info(enum prop_type type) {
+  assert(prop_type_is_valid(type));
+
+  return &prop_type_infos[type & ~PROP_ARRAY_FLAG];
+}
+
 bool prop_type_is_array(enum prop_type type) {
   return (type & PROP_ARRAY_FLAG) != 0;
 }
@@ -29,21 +210,680 @@ bool prop_type_is_array(enum prop_type type) {
 bool prop_type_is_valid(enum prop_type type) {
   type &= ~PROP_ARRAY_FLAG;
 
-  if (type < 0 || type >= lengthof(prop_type_names)) {
+  if (type < 0 || type >= lengthof(prop_type_infos)) {
     return false;
   }
 
-  return prop_type_names[type] != NULL;
+  return prop_type_infos[type].name != NULL;
 }
 
 const char *prop_type_to_string(enum prop_type type) {
   assert(prop_type_is_valid(type));
 
-  return prop_type_names[type & ~PROP_ARRAY_FLAG];
+  return prop_type_infos[type & ~PROP_ARRAY_FLAG].name;
 }
 
 int prop_type_to_size(enum prop_type type) {
   assert(type == PROP_ATTR /* hack */ || prop_type_is_valid(type));
 
-  return prop_type_sizes[type & ~PROP_ARRAY_FLAG];
+  return prop_type_infos[type & ~PROP_ARRAY_FLAG].size;
+}
+
+void prop_type_format_value(struct strbuf *dest, enum prop_type type,
+                            const struct const_iobuf *value, enum charset cs,
+                            enum prop_type_syntax syntax) {
+  const struct prop_type_info *info;
+  char chars[PROP_TYPE_FORMAT_NCHARS];
+  size_t nelems;
+  size_t nbytes;
+  size_t pos;
+
+  assert(dest != NULL);
+  assert(value != NULL);
+  assert(value->pos <= value->nbytes);
+
+  if (type == PROP_STR) {
+    charset_put_utf8_str(dest, cs, (const char *)value->bytes + value->pos,
+                         prop_type_str_len(value));
+
+    return;
+  } else if (type == PROP_BIN) {
+    for (pos = value->pos; pos < value->nbytes; pos += nbytes) {
+      nbytes = value->nbytes - pos;
+
+      if (nbytes > sizeof(chars) / 2) {
+        nbytes = sizeof(chars) / 2;
+      }
+
+      hex_format_lc(chars, value->bytes + pos, nbytes);
+      strbuf_putn(dest, chars, nbytes * 2);
+    }
+
+    return;
+  }
+
+  info = prop_type_get_info(type);
+
+  assert(info->size >= 0);
+  assert(info->format != NULL || info->count == 0);
+
+  if (info->count == 0) {
+    return;
+  }
+
+  if (prop_type_is_array(type)) {
+    nelems = (value->nbytes - value->pos) / info->size * info->count;
+  } else {
+    nelems = info->count;
+  }
+
+  assert(value->pos + nelems * info->elem_size <= value->nbytes);
+
+  info->format(dest, value->bytes + value->pos, nelems, info->count, syntax);
+}
+
+size_t prop_type_str_len(const struct const_iobuf *value) {
+  const char *chars;
+  const char *nul;
+  size_t nchars;
+
+  assert(value != NULL);
+  assert(value->pos <= value->nbytes);
+
+  chars = (const char *)value->bytes + value->pos;
+  nchars = value->nbytes - value->pos;
+
+  if (nchars == 0) {
+    return 0;
+  }
+
+  /* Strs are stored with a NUL on the end, but any NUL ends them early, same
+     as prop_get_value_str() has it. XML can't hold a NUL character anyway. */
+
+  nul = memchr(chars, '\0', nchars);
+
+  return nul != NULL ? (size_t)(nul - chars) : nchars;
+}
+
+int prop_encoding_from_string(enum prop_encoding *out, const char *name) {
+  size_t i;
+
+  assert(out != NULL);
+  assert(name != NULL);
+
+  for (i = 0; i < lengthof(prop_encoding_names); i++) {
+    if (str_eq(prop_encoding_names[i], name)) {
+      *out = i << 5;
+
+      return 0;
+    }
+  }
+
+  return -ENOENT;
+}
+
+bool prop_encoding_is_valid(enum prop_encoding encoding) {
+  if ((encoding & 0x1F) != 0 || encoding < 0 || encoding > 0xFF) {
+    return false;
+  }
+
+  return prop_encoding_names[encoding >> 5] != NULL;
+}
+
+const char *prop_encoding_to_string(enum prop_encoding encoding) {
+  assert(prop_encoding_is_valid(encoding));
+
+  return prop_encoding_names[encoding >> 5];
+}
+
+static void prop_type_format_s8(struct strbuf *dest, const uint8_t *bytes,
+                                size_t nelems, unsigned int count,
+                                enum prop_type_syntax syntax) {
+  prop_type_format_int(dest, bytes, nelems, count, 1, true, syntax);
+}
+
+static void prop_type_format_u8(struct strbuf *dest, const uint8_t *bytes,
+                                size_t nelems, unsigned int count,
+                                enum prop_type_syntax syntax) {
+  prop_type_format_int(dest, bytes, nelems, count, 1, false, syntax);
+}
+
+static void prop_type_format_s16(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax) {
+  prop_type_format_int(dest, bytes, nelems, count, 2, true, syntax);
+}
+
+static void prop_type_format_u16(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax) {
+  prop_type_format_int(dest, bytes, nelems, count, 2, false, syntax);
+}
+
+static void prop_type_format_s32(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax) {
+  prop_type_format_int(dest, bytes, nelems, count, 4, true, syntax);
+}
+
+static void prop_type_format_u32(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax) {
+  prop_type_format_int(dest, bytes, nelems, count, 4, false, syntax);
+}
+
+static void prop_type_format_s64(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax) {
+  prop_type_format_int(dest, bytes, nelems, count, 8, true, syntax);
+}
+
+static void prop_type_format_u64(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax) {
+  prop_type_format_int(dest, bytes, nelems, count, 8, false, syntax);
+}
+
+/* Integers get formatted into a local buffer a chunk at a time, which keeps
+   strbuf overhead out of the loop for long arrays. */
+
+static void prop_type_format_int(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 unsigned int elem_size, bool is_signed,
+                                 enum prop_type_syntax syntax) {
+  char chars[PROP_TYPE_FORMAT_NCHARS];
+  const char *sep;
+  size_t sep_nchars;
+  size_t pos;
+  size_t i;
+  unsigned int j;
+
+  assert(dest != NULL);
+  assert(bytes != NULL || nelems == 0);
+  assert(count > 0);
+
+  sep = prop_type_value_sep(count, syntax);
+  sep_nchars = strlen(sep);
+  pos = 0;
+  j = 0;
+
+  for (i = 0; i < nelems; i++, bytes += elem_size) {
+    if (pos + sep_nchars + DEC_MAX_NCHARS > sizeof(chars)) {
+      strbuf_putn(dest, chars, pos);
+      pos = 0;
+    }
+
+    if (i > 0 && j != 0) {
+      chars[pos++] = ',';
+    } else if (i > 0) {
+      memcpy(chars + pos, sep, sep_nchars);
+      pos += sep_nchars;
+    }
+
+    switch (elem_size) {
+    case 1:
+      if (is_signed) {
+        pos += dec_format_s32(chars + pos, (int8_t)bytes[0]);
+      } else {
+        pos += dec_format_u32(chars + pos, bytes[0]);
+      }
+
+      break;
+
+    case 2:
+      if (is_signed) {
+        pos += dec_format_s32(chars + pos, (int16_t)prop_type_be16(bytes));
+      } else {
+        pos += dec_format_u32(chars + pos, prop_type_be16(bytes));
+      }
+
+      break;
+
+    case 4:
+      if (is_signed) {
+        pos += dec_format_s32(chars + pos, (int32_t)prop_type_be32(bytes));
+      } else {
+        pos += dec_format_u32(chars + pos, prop_type_be32(bytes));
+      }
+
+      break;
+
+    default:
+      assert(elem_size == 8);
+
+      if (is_signed) {
+        pos += dec_format_s64(chars + pos, (int64_t)prop_type_be64(bytes));
+      } else {
+        pos += dec_format_u64(chars + pos, prop_type_be64(bytes));
+      }
+
+      break;
+    }
+
+    if (++j == count) {
+      j = 0;
+    }
+  }
+
+  strbuf_putn(dest, chars, pos);
+}
+
+/* Six decimal places, like printf's %f, is what AVS itself writes. JSON has
+   no way to spell infinities or NaNs, so those become null there. */
+
+static void prop_type_format_float(struct strbuf *dest, const uint8_t *bytes,
+                                   size_t nelems, unsigned int count,
+                                   enum prop_type_syntax syntax) {
+  uint32_t bits;
+  float value;
+  size_t i;
+
+  for (i = 0; i < nelems; i++) {
+    prop_type_format_sep(dest, i, count, syntax);
+    bits = prop_type_be32(bytes + i * 4);
+    memcpy(&value, &bits, sizeof(value));
+
+    if (syntax == PROP_TYPE_SYNTAX_JSON && !isfinite(value)) {
+      strbuf_puts(dest, "null");
+    } else {
+      strbuf_printf(dest, "%f", value);
+    }
+  }
+}
+
+static void prop_type_format_double(struct strbuf *dest, const uint8_t *bytes,
+                                    size_t nelems, unsigned int count,
+                                    enum prop_type_syntax syntax) {
+  uint64_t bits;
+  double value;
+  size_t i;
+
+  for (i = 0; i < nelems; i++) {
+    prop_type_format_sep(dest, i, count, syntax);
+    bits = prop_type_be64(bytes + i * 8);
+    memcpy(&value, &bits, sizeof(value));
+
+    if (syntax == PROP_TYPE_SYNTAX_JSON && !isfinite(value)) {
+      strbuf_puts(dest, "null");
+    } else {
+      strbuf_printf(dest, "%f", value);
+    }
+  }
+}
+
+static void prop_type_format_bool(struct strbuf *dest, const uint8_t *bytes,
+                                  size_t nelems, unsigned int count,
+                                  enum prop_type_syntax syntax) {
+  size_t i;
+
+  for (i = 0; i < nelems; i++) {
+    prop_type_format_sep(dest, i, count, syntax);
+
+    if (syntax == PROP_TYPE_SYNTAX_JSON) {
+      strbuf_puts(dest, bytes[i] ? "true" : "false");
+    } else {
+      strbuf_putc(dest, bytes[i] ? '1' : '0');
+    }
+  }
+}
+
+static void prop_type_format_ip4(struct strbuf *dest, const uint8_t *bytes,
+                                 size_t nelems, unsigned int count,
+                                 enum prop_type_syntax syntax) {
+  size_t i;
+
+  for (i = 0; i < nelems; i++, bytes += 4) {
+    prop_type_format_sep(dest, i, count, syntax);
+
+    if (syntax == PROP_TYPE_SYNTAX_JSON) {
+      strbuf_printf(dest, "\"%i.%i.%i.%i\"", bytes[0], bytes[1], bytes[2],
+                    bytes[3]);
+    } else {
+      strbuf_printf(dest, "%i.%i.%i.%i", bytes[0], bytes[1], bytes[2],
+                    bytes[3]);
+    }
+  }
+}
+
+static void prop_type_format_sep(struct strbuf *dest, size_t i,
+                                 unsigned int count,
+                                 enum prop_type_syntax syntax) {
+  assert(count > 0);
+
+  if (i > 0 && i % count != 0) {
+    strbuf_putc(dest, ',');
+  } else if (i > 0) {
+    strbuf_puts(dest, prop_type_value_sep(count, syntax));
+  }
+}
+
+/* JSON has no separator of its own for multi-element values, so arrays of
+   them are written as arrays of arrays and the caller supplies the outermost
+   brackets. */
+
+static const char *prop_type_value_sep(unsigned int count,
+                                       enum prop_type_syntax syntax) {
+  if (syntax != PROP_TYPE_SYNTAX_JSON) {
+    return " ";
+  } else if (count > 1) {
+    return "],[";
+  } else {
+    return ",";
+  }
+}
+
+static int prop_type_parse_s8(uint8_t *bytes, const char *chars, size_t nchars,
+                              size_t nelems) {
+  return prop_type_parse_int(bytes, chars, nchars, nelems, 1, true);
+}
+
+static int prop_type_parse_u8(uint8_t *bytes, const char *chars, size_t nchars,
+                              size_t nelems) {
+  return prop_type_parse_int(bytes, chars, nchars, nelems, 1, false);
+}
+
+static int prop_type_parse_s16(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems) {
+  return prop_type_parse_int(bytes, chars, nchars, nelems, 2, true);
+}
+
+static int prop_type_parse_u16(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems) {
+  return prop_type_parse_int(bytes, chars, nchars, nelems, 2, false);
+}
+
+static int prop_type_parse_s32(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems) {
+  return prop_type_parse_int(bytes, chars, nchars, nelems, 4, true);
+}
+
+static int prop_type_parse_u32(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems) {
+  return prop_type_parse_int(bytes, chars, nchars, nelems, 4, false);
+}
+
+static int prop_type_parse_s64(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems) {
+  return prop_type_parse_int(bytes, chars, nchars, nelems, 8, true);
+}
+
+static int prop_type_parse_u64(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems) {
+  return prop_type_parse_int(bytes, chars, nchars, nelems, 8, false);
+}
+
+/* Parsing is the reverse of formatting, except that any mix of commas and
+   whitespace is accepted between elements. Each function expects exactly
+   nelems elements and writes them out in big-endian byte order. */
+
+static int prop_type_parse_int(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems, unsigned int elem_size,
+                               bool is_signed) {
+  uint64_t max;
+  uint64_t value;
+  size_t pos;
+  size_t len;
+  size_t i;
+  bool neg;
+  int r;
+
+  assert(bytes != NULL || nelems == 0);
+  assert(chars != NULL || nchars == 0);
+
+  if (elem_size == 8) {
+    max = UINT64_MAX;
+  } else {
+    max = ((uint64_t)1 << (elem_size * 8)) - 1;
+  }
+
+  if (is_signed) {
+    max >>= 1;
+  }
+
+  pos = 0;
+
+  for (i = 0; i < nelems; i++, bytes += elem_size) {
+    if (!prop_type_next_token(chars, nchars, &pos, &len)) {
+      return -EINVAL;
+    }
+
+    neg = is_signed && chars[pos] == '-';
+
+    /* The most negative value has one more unit of magnitude than the most
+       positive one */
+
+    if (neg) {
+      r = prop_type_parse_dec(chars + pos + 1, len - 1, max + 1, &value);
+      value = 0 - value;
+    } else {
+      r = prop_type_parse_dec(chars + pos, len, max, &value);
+    }
+
+    if (r < 0) {
+      return r;
+    }
+
+    prop_type_put_be(bytes, value, elem_size);
+    pos += len;
+  }
+
+  return prop_type_parse_end(chars, nchars, pos);
+}
+
+static int prop_type_parse_float(uint8_t *bytes, const char *chars,
+                                 size_t nchars, size_t nelems) {
+  char token[64];
+  uint32_t bits;
+  float value;
+  char *end;
+  size_t pos;
+  size_t len;
+  size_t i;
+
+  pos = 0;
+
+  for (i = 0; i < nelems; i++, bytes += 4) {
+    if (!prop_type_next_token(chars, nchars, &pos, &len) ||
+        len >= sizeof(token)) {
+      return -EINVAL;
+    }
+
+    memcpy(token, chars + pos, len);
+    token[len] = '\0';
+    value = strtof(token, &end);
+
+    if (end != token + len) {
+      return -EINVAL;
+    }
+
+    memcpy(&bits, &value, sizeof(bits));
+    prop_type_put_be(bytes, bits, 4);
+    pos += len;
+  }
+
+  return prop_type_parse_end(chars, nchars, pos);
+}
+
+static int prop_type_parse_double(uint8_t *bytes, const char *chars,
+                                  size_t nchars, size_t nelems) {
+  char token[64];
+  uint64_t bits;
+  double value;
+  char *end;
+  size_t pos;
+  size_t len;
+  size_t i;
+
+  pos = 0;
+
+  for (i = 0; i < nelems; i++, bytes += 8) {
+    if (!prop_type_next_token(chars, nchars, &pos, &len) ||
+        len >= sizeof(token)) {
+      return -EINVAL;
+    }
+
+    memcpy(token, chars + pos, len);
+    token[len] = '\0';
+    value = strtod(token, &end);
+
+    if (end != token + len) {
+      return -EINVAL;
+    }
+
+    memcpy(&bits, &value, sizeof(bits));
+    prop_type_put_be(bytes, bits, 8);
+    pos += len;
+  }
+
+  return prop_type_parse_end(chars, nchars, pos);
+}
+
+static int prop_type_parse_bool(uint8_t *bytes, const char *chars,
+                                size_t nchars, size_t nelems) {
+  size_t i;
+  int r;
+
+  r = prop_type_parse_int(bytes, chars, nchars, nelems, 1, false);
+
+  if (r < 0) {
+    return r;
+  }
+
+  for (i = 0; i < nelems; i++) {
+    if (bytes[i] > 1) {
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+static int prop_type_parse_ip4(uint8_t *bytes, const char *chars, size_t nchars,
+                               size_t nelems) {
+  uint64_t octet;
+  size_t pos;
+  size_t len;
+  size_t start;
+  size_t i;
+  size_t j;
+  unsigned int k;
+  int r;
+
+  pos = 0;
+
+  for (i = 0; i < nelems; i++, bytes += 4) {
+    if (!prop_type_next_token(chars, nchars, &pos, &len)) {
+      return -EINVAL;
+    }
+
+    start = pos;
+
+    for (k = 0; k < 4; k++) {
+      for (j = start; j < pos + len && chars[j] != '.'; j++) {
+      }
+
+      if ((k < 3) != (j < pos + len)) {
+        return -EINVAL;
+      }
+
+      r = prop_type_parse_dec(chars + start, j - start, 255, &octet);
+
+      if (r < 0) {
+        return r;
+      }
+
+      bytes[k] = octet;
+      start = j + 1;
+    }
+
+    pos += len;
+  }
+
+  return prop_type_parse_end(chars, nchars, pos);
+}
+
+/* Parses a run of decimal digits that must not exceed max */
+
+static int prop_type_parse_dec(const char *chars, size_t nchars, uint64_t max,
+                               uint64_t *out) {
+  uint64_t value;
+  unsigned int digit;
+  size_t i;
+
+  *out = 0;
+
+  if (nchars == 0) {
+    return -EINVAL;
+  }
+
+  value = 0;
+
+  for (i = 0; i < nchars; i++) {
+    digit = (unsigned char)chars[i] - '0';
+
+    if (digit > 9 || value > (max - digit) / 10) {
+      return -EINVAL;
+    }
+
+    value = value * 10 + digit;
+  }
+
+  *out = value;
+
+  return 0;
+}
+
+static bool prop_type_is_sep(char c) {
+  return c == ' ' || c == ',' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* Skips separators and finds the extent of the token that follows them */
+
+static bool prop_type_next_token(const char *chars, size_t nchars, size_t *pos,
+                                 size_t *len) {
+  size_t i;
+
+  for (i = *pos; i < nchars && prop_type_is_sep(chars[i]); i++) {
+  }
+
+  *pos = i;
+
+  for (; i < nchars && !prop_type_is_sep(chars[i]); i++) {
+  }
+
+  *len = i - *pos;
+
+  return *len > 0;
+}
+
+static int prop_type_parse_end(const char *chars, size_t nchars, size_t pos) {
+  for (; pos < nchars; pos++) {
+    if (!prop_type_is_sep(chars[pos])) {
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+static void prop_type_put_be(uint8_t *bytes, uint64_t value,
+                             unsigned int elem_size) {
+  unsigned int i;
+
+  for (i = 0; i < elem_size; i++) {
+    bytes[i] = value >> ((elem_size - 1 - i) * 8);
+  }
+}
+
+static uint16_t prop_type_be16(const uint8_t *bytes) {
+  return ((uint16_t)bytes[0] << 8) | bytes[1];
+}
+
+static uint32_t prop_type_be32(const uint8_t *bytes) {
+  return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) |
+         ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static uint64_t prop_type_be64(const uint8_t *bytes) {
+  return ((uint64_t)prop_type_be32(bytes) << 32) | prop_type_be32(bytes + 4);
 }
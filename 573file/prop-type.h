@@ -1,5 +1,13 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/charset.h"
+#include "util/iobuf.h"
+#include "util/str.h"
+
 enum prop_type {
   PROP_INVALID_TYPE = 0x00,
   PROP_VOID = 0x01,
@@ -15,15 +23,123 @@ enum prop_type {
   PROP_STR = 0x0B,
   PROP_IP4 = 0x0C,
   PROP_TIME = 0x0D,
+  PROP_FLOAT = 0x0E,
+  PROP_DOUBLE = 0x0F,
+  PROP_2S8 = 0x10,
+  PROP_2U8 = 0x11,
+  PROP_2S16 = 0x12,
   PROP_2U16 = 0x13,
+  PROP_2S32 = 0x14,
+  PROP_2U32 = 0x15,
+  PROP_2S64 = 0x16,
+  PROP_2U64 = 0x17,
+  PROP_2FLOAT = 0x18,
+  PROP_2DOUBLE = 0x19,
+  PROP_3S8 = 0x1A,
+  PROP_3U8 = 0x1B,
+  PROP_3S16 = 0x1C,
+  PROP_3U16 = 0x1D,
   PROP_3S32 = 0x1E,
+  PROP_3U32 = 0x1F,
+  PROP_3S64 = 0x20,
+  PROP_3U64 = 0x21,
+  PROP_3FLOAT = 0x22,
+  PROP_3DOUBLE = 0x23,
+  PROP_4S8 = 0x24,
+  PROP_4U8 = 0x25,
+  PROP_4S16 = 0x26,
   PROP_4U16 = 0x27,
+  PROP_4S32 = 0x28,
+  PROP_4U32 = 0x29,
+  PROP_4S64 = 0x2A,
+  PROP_4U64 = 0x2B,
+  PROP_4FLOAT = 0x2C,
+  PROP_4DOUBLE = 0x2D,
   PROP_ATTR = 0x2E, /* Pseudo-type */
+  PROP_VS8 = 0x30,
+  PROP_VU8 = 0x31,
+  PROP_VS16 = 0x32,
+  PROP_VU16 = 0x33,
   PROP_BOOL = 0x34,
+  PROP_2BOOL = 0x35,
+  PROP_3BOOL = 0x36,
+  PROP_4BOOL = 0x37,
+  PROP_VBOOL = 0x38,
   PROP_ARRAY_FLAG = 0x40
 };
 
+/* Flavour of text that a format function writes values out as */
+
+enum prop_type_syntax {
+  PROP_TYPE_SYNTAX_XML,
+  PROP_TYPE_SYNTAX_JSON,
+};
+
+/* Convert runs of big-endian elements to and from text, as described below */
+
+typedef void (*prop_type_format_t)(struct strbuf *dest, const uint8_t *bytes,
+                                   size_t nelems, unsigned int count,
+                                   enum prop_type_syntax syntax);
+typedef int (*prop_type_parse_t)(uint8_t *bytes, const char *chars,
+                                 size_t nchars, size_t nelems);
+
+/* Fixed-size values are made up of `count` elements of elem_size bytes each,
+   so a 3s32 is three 4-byte elements and an ip4 is one. Variable-size types
+   (bin, str and the attribute pseudo-type) have a size of -1, a count of zero
+   and no format function.
+
+   The format function writes out nelems consecutive big-endian elements in
+   one go, which may span several values of an array. Elements within a value
+   are separated by commas and values by spaces. JSON separates values with
+   commas too, or with "],[" if they have more than one element, and spells
+   bools, ip4s and non-finite floats the JSON way. The parse function reverses
+   the XML syntax, accepting any mix of commas and whitespace between elements,
+   and returns -EINVAL unless the text holds exactly nelems valid elements. */
+
+struct prop_type_info {
+  const char *name;
+  int size;
+  uint8_t count;
+  uint8_t elem_size;
+  prop_type_format_t format;
+  prop_type_parse_t parse;
+};
+
+/* Writes out the value starting at value->pos as text, with nothing escaped.
+   A str ends at its first NUL and gets transcoded from cs to UTF-8, a bin
+   comes out as lowercase hex, and fixed-size types go through their format
+   function, a whole array at a time. Void values write nothing. */
+
+void prop_type_format_value(struct strbuf *dest, enum prop_type type,
+                            const struct const_iobuf *value, enum charset cs,
+                            enum prop_type_syntax syntax);
+
+/* Returns the length of the str value starting at value->pos, which is the
+   number of chars before its first NUL. */
+
+size_t prop_type_str_len(const struct const_iobuf *value);
+
+/* Text encoding of a binary prop's strings, as given by its header */
+
+enum prop_encoding {
+  PROP_ENCODING_NONE = 0x00,
+  PROP_ENCODING_ASCII = 0x20,
+  PROP_ENCODING_ISO_8859_1 = 0x40,
+  PROP_ENCODING_EUC_JP = 0x60,
+  PROP_ENCODING_SHIFT_JIS = 0x80,
+  PROP_ENCODING_UTF_8 = 0xA0,
+};
+
+/* Looks up a type by the name that prop_type_to_string() gives it, which is
+   the same for array and non-array types. */
+
+int prop_type_from_string(enum prop_type *out, const char *name);
+const struct prop_type_info *prop_type_get_info(enum prop_type type);
 bool prop_type_is_array(enum prop_type type);
 bool prop_type_is_valid(enum prop_type type);
 const char *prop_type_to_string(enum prop_type type);
 int prop_type_to_size(enum prop_type type);
+
+int prop_encoding_from_string(enum prop_encoding *out, const char *name);
+bool prop_encoding_is_valid(enum prop_encoding encoding);
+const char *prop_encoding_to_string(enum prop_encoding encoding);
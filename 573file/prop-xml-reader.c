@@ -0,0 +1,1766 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "573file/prop-binary-reader.h"
+#include "573file/prop-binary-writer.h"
+#include "573file/prop-type.h"
+#include "573file/prop-xml-reader.h"
+#include "573file/prop.h"
+
+#include "util/charset.h"
+#include "util/fs.h"
+#include "util/hex.h"
+#include "util/iobuf.h"
+#include "util/log.h"
+#include "util/macro.h"
+
+/* Parsing happens in two stages. The first one finds every '<' in the input,
+   a window at a time, and on x86 it does so 32 or 64 bytes at a time. '<'
+   can't appear anywhere in well-formed XML except at the start of markup, so
+   there is no need to track quotes while doing this. The second stage then
+   hops from one piece of markup to the next using that index, and only ever
+   looks at the bytes in between when they are a value it has to decode. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PROP_XML_READER_X86
+#include <immintrin.h>
+#endif
+
+/* Number of input bytes covered by each refill of the '<' index */
+
+#define PROP_XML_WINDOW (64 * 1024)
+
+/* Every type name fits in 7 bytes, so that a name and its length can be
+   packed into an integer and compared in one go. There are fewer than 64
+   types. */
+
+#define PROP_XML_TYPE_NCHARS 7
+#define PROP_XML_MAX_TYPES 64
+
+struct prop_xml_buf {
+  uint8_t *bytes;
+  size_t nbytes;
+  size_t max_nbytes;
+};
+
+struct prop_xml_frame {
+  const char *name;
+  size_t len;
+};
+
+/* The raw contents of the start tag being processed. Attribute values are
+   pointers into the input, still escaped. Ordinary attributes are decoded into
+   consecutive pairs of NUL-terminated key and value strings in attrs. */
+
+struct prop_xml_tag {
+  const char *name;
+  size_t name_len;
+  const char *type;
+  size_t type_len;
+  const char *count;
+  size_t count_len;
+  const char *value;
+  size_t value_len;
+  bool has_type;
+  bool has_count;
+  bool has_value;
+  bool is_empty;
+};
+
+/* Type names that have been seen before are remembered along with the type
+   they stand for, since a document rarely uses more than a handful of types.
+   Values alternate between two buffers so that the
+   previous node's value stays valid while the next node's begin event is
+   being handled. */
+
+struct prop_xml_parser {
+  const char *chars;
+  size_t nchars;
+  size_t pos;
+  size_t start;
+  enum charset in_cs;
+  enum charset cs;
+  const struct prop_binary_visitor *v;
+  void *ctx;
+  uint32_t *index;
+  size_t index_base;
+  size_t index_pos;
+  size_t index_len;
+  size_t scanned;
+  struct prop_xml_frame *frames;
+  size_t nframes;
+  size_t max_frames;
+  struct prop_xml_tag tag;
+  uint64_t type_keys[PROP_XML_MAX_TYPES];
+  enum prop_type types[PROP_XML_MAX_TYPES];
+  size_t ntypes;
+  struct prop_xml_buf name;
+  struct prop_xml_buf attrs;
+  struct prop_xml_buf values[2];
+  unsigned int nvalues;
+};
+
+struct prop_xml_tree {
+  struct prop *root;
+  struct prop *cur;
+  enum prop_encoding encoding;
+};
+
+/* bad_name notes that the builder couldn't pack a name, as opposed to the
+   parser failing to encode a string, which is also -EILSEQ. */
+
+struct prop_xml_pack {
+  struct prop_binary_builder *b;
+  bool bad_name;
+};
+
+static int prop_xml_tree_begin_doc(void *ctx, enum prop_encoding encoding);
+static int prop_xml_tree_begin_node(void *ctx, const char *name,
+                                    enum prop_type type,
+                                    const struct const_iobuf *value);
+static int prop_xml_tree_attr(void *ctx, const char *key, const char *val);
+static int prop_xml_tree_end_node(void *ctx);
+static int prop_xml_pack_visit(struct prop_xml_pack *pk, const void *bytes,
+                               size_t nbytes, enum prop_encoding encoding,
+                               bool packed_names);
+static int prop_xml_pack_begin_doc(void *ctx, enum prop_encoding encoding);
+static int prop_xml_pack_begin_node(void *ctx, const char *name,
+                                    enum prop_type type,
+                                    const struct const_iobuf *value);
+static int prop_xml_pack_attr(void *ctx, const char *key, const char *val);
+static int prop_xml_pack_end_node(void *ctx);
+static enum charset prop_xml_charset(enum prop_encoding encoding);
+static int prop_xml_parse_doc(struct prop_xml_parser *px);
+static int prop_xml_parse_element(struct prop_xml_parser *px, size_t lt);
+static int prop_xml_parse_start_tag(struct prop_xml_parser *px, size_t lt);
+static int prop_xml_parse_end_tag(struct prop_xml_parser *px, size_t lt,
+                                  const char *name, size_t len);
+static int prop_xml_parse_attr(struct prop_xml_parser *px, const char *key,
+                               size_t key_len, const char *val, size_t val_len);
+static int prop_xml_skip_markup(struct prop_xml_parser *px, size_t lt);
+static int prop_xml_parse_decl(struct prop_xml_parser *px, const char *chars,
+                               size_t nchars);
+static bool prop_xml_charset_from_name(enum charset *out, const char *name,
+                                       size_t len);
+static int prop_xml_push(struct prop_xml_parser *px, const char *name,
+                         size_t len);
+static int prop_xml_emit_node(struct prop_xml_parser *px, const char *text,
+                              size_t text_len, bool is_leaf);
+static int prop_xml_decode_type(struct prop_xml_parser *px, const char *text,
+                                size_t text_len, enum prop_type *out);
+static int prop_xml_decode_value(struct prop_xml_parser *px,
+                                 enum prop_type type, const char *text,
+                                 size_t text_len, struct prop_xml_buf *out);
+static int prop_xml_decode_string(struct prop_xml_parser *px,
+                                  struct prop_xml_buf *out, const char *chars,
+                                  size_t nchars);
+static int prop_xml_decode_entity(const char *chars, size_t nchars,
+                                  uint32_t *out, size_t *len);
+static int prop_xml_decode_u32(const char *chars, size_t nchars, uint32_t *out);
+static int prop_xml_buf_reserve(struct prop_xml_buf *buf, size_t nbytes);
+static void prop_xml_buf_free(struct prop_xml_buf *buf);
+static bool prop_xml_find(const struct prop_xml_parser *px, size_t from,
+                          const char *str, size_t *out);
+static bool prop_xml_next_lt(struct prop_xml_parser *px, size_t from,
+                             size_t *out);
+static void prop_xml_index_window(struct prop_xml_parser *px);
+static bool prop_xml_is_blank(const char *chars, size_t nchars);
+static bool prop_xml_is_space(char c);
+static bool prop_xml_key_is(const char *key, size_t len, const char *str);
+static unsigned long prop_xml_line(const struct prop_xml_parser *px,
+                                   size_t pos);
+
+#ifdef PROP_XML_READER_X86
+
+static size_t prop_xml_index_simd(const char *chars, size_t nchars,
+                                  uint32_t *index, size_t *count);
+static size_t prop_xml_index_sse2(const char *chars, size_t nchars,
+                                  uint32_t *index, size_t *count)
+    __attribute__((target("sse2")));
+static size_t prop_xml_index_avx2(const char *chars, size_t nchars,
+                                  uint32_t *index, size_t *count)
+    __attribute__((target("avx2")));
+
+#endif
+
+static const struct prop_binary_visitor prop_xml_tree_visitor = {
+    .begin_doc = prop_xml_tree_begin_doc,
+    .begin_node = prop_xml_tree_begin_node,
+    .attr = prop_xml_tree_attr,
+    .end_node = prop_xml_tree_end_node,
+};
+
+static const struct prop_binary_visitor prop_xml_pack_visitor = {
+    .begin_doc = prop_xml_pack_begin_doc,
+    .begin_node = prop_xml_pack_begin_node,
+    .attr = prop_xml_pack_attr,
+    .end_node = prop_xml_pack_end_node,
+};
+
+int prop_xml_parse(struct prop **out, const void *bytes, size_t nbytes,
+                   enum prop_encoding encoding) {
+  struct prop_xml_tree b;
+  int r;
+
+  assert(out != NULL);
+  assert(bytes != NULL);
+
+  *out = NULL;
+  memset(&b, 0, sizeof(b));
+
+  r = prop_xml_visit(bytes, nbytes, encoding, &prop_xml_tree_visitor, &b);
+
+  if (r < 0) {
+    prop_free(b.root);
+
+    return r;
+  }
+
+  assert(b.root != NULL);
+  assert(b.cur == NULL);
+
+  *out = b.root;
+
+  return 0;
+}
+
+int prop_xml_parse_file(struct prop **out, const char *path,
+                        enum prop_encoding encoding) {
+  const void *bytes;
+  size_t nbytes;
+  int r;
+
+  assert(out != NULL);
+  assert(path != NULL);
+
+  *out = NULL;
+
+  r = fs_map_file(path, &bytes, &nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_xml_parse(out, bytes, nbytes, encoding);
+  fs_unmap_file(bytes, nbytes);
+
+  return r;
+}
+
+int prop_xml_visit(const void *bytes, size_t nbytes,
+                   enum prop_encoding encoding,
+                   const struct prop_binary_visitor *v, void *ctx) {
+  struct prop_xml_parser px;
+  int r;
+
+  assert(bytes != NULL);
+  assert(prop_encoding_is_valid(encoding));
+  assert(v != NULL);
+  assert(v->begin_node != NULL);
+  assert(v->attr != NULL);
+  assert(v->end_node != NULL);
+
+  memset(&px, 0, sizeof(px));
+  px.chars = bytes;
+  px.nchars = nbytes;
+  px.in_cs = CHARSET_UTF_8;
+  px.cs = prop_xml_charset(encoding);
+  px.v = v;
+  px.ctx = ctx;
+  px.index = malloc(PROP_XML_WINDOW * sizeof(*px.index));
+
+  if (px.index == NULL) {
+    r = -ENOMEM;
+
+    goto end;
+  }
+
+  if (v->begin_doc != NULL) {
+    r = v->begin_doc(ctx, encoding);
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+  r = prop_xml_parse_doc(&px);
+
+end:
+  prop_xml_buf_free(&px.values[1]);
+  prop_xml_buf_free(&px.values[0]);
+  prop_xml_buf_free(&px.attrs);
+  prop_xml_buf_free(&px.name);
+  free(px.frames);
+  free(px.index);
+
+  return r;
+}
+
+/* Whether names can be packed isn't known until they have all been seen, by
+   which point the head has been written with packed names. The input is all
+   in memory though, so it can simply be parsed again. */
+
+int prop_xml_pack(const void *bytes, size_t nbytes, enum prop_encoding encoding,
+                  FILE *f) {
+  struct prop_xml_pack pk;
+  int r;
+
+  assert(bytes != NULL);
+  assert(f != NULL);
+
+  memset(&pk, 0, sizeof(pk));
+
+  r = prop_xml_pack_visit(&pk, bytes, nbytes, encoding, true);
+
+  if (r == -EILSEQ && pk.bad_name) {
+    r = prop_xml_pack_visit(&pk, bytes, nbytes, encoding, false);
+  }
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_binary_builder_finish(pk.b, f);
+
+end:
+  prop_binary_builder_free(pk.b);
+
+  return r;
+}
+
+static int prop_xml_tree_begin_doc(void *ctx, enum prop_encoding encoding) {
+  struct prop_xml_tree *b;
+
+  b = ctx;
+  b->encoding = encoding;
+
+  return 0;
+}
+
+static int prop_xml_tree_begin_node(void *ctx, const char *name,
+                                    enum prop_type type,
+                                    const struct const_iobuf *value) {
+  struct prop_xml_tree *b;
+  struct prop *p;
+  int r;
+
+  b = ctx;
+  r = prop_alloc(&p, name, type, value->bytes, value->nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  if (b->cur != NULL) {
+    prop_append(b->cur, p);
+  } else {
+    assert(b->root == NULL);
+
+    prop_set_encoding(p, b->encoding);
+    b->root = p;
+  }
+
+  b->cur = p;
+
+  return 0;
+}
+
+static int prop_xml_tree_attr(void *ctx, const char *key, const char *val) {
+  struct prop_xml_tree *b;
+
+  b = ctx;
+
+  return prop_set_attr(b->cur, key, val);
+}
+
+static int prop_xml_tree_end_node(void *ctx) {
+  struct prop_xml_tree *b;
+
+  b = ctx;
+  b->cur = prop_get_parent(b->cur);
+
+  return 0;
+}
+
+static int prop_xml_pack_visit(struct prop_xml_pack *pk, const void *bytes,
+                               size_t nbytes, enum prop_encoding encoding,
+                               bool packed_names) {
+  int r;
+
+  assert(pk != NULL);
+  assert(bytes != NULL);
+
+  prop_binary_builder_free(pk->b);
+  pk->b = NULL;
+  pk->bad_name = false;
+
+  r = prop_binary_builder_alloc(&pk->b);
+
+  if (r < 0) {
+    return r;
+  }
+
+  prop_binary_builder_set_packed_names(pk->b, packed_names);
+
+  return prop_xml_visit(bytes, nbytes, encoding, &prop_xml_pack_visitor, pk);
+}
+
+static int prop_xml_pack_begin_doc(void *ctx, enum prop_encoding encoding) {
+  struct prop_xml_pack *pk;
+
+  pk = ctx;
+  prop_binary_builder_set_encoding(pk->b, encoding);
+
+  return 0;
+}
+
+static int prop_xml_pack_begin_node(void *ctx, const char *name,
+                                    enum prop_type type,
+                                    const struct const_iobuf *value) {
+  struct prop_xml_pack *pk;
+  int r;
+
+  pk = ctx;
+  r = prop_binary_builder_begin_node(pk->b, name, type, value);
+
+  if (r == -EILSEQ) {
+    pk->bad_name = true;
+  }
+
+  return r;
+}
+
+static int prop_xml_pack_attr(void *ctx, const char *key, const char *val) {
+  struct prop_xml_pack *pk;
+  int r;
+
+  pk = ctx;
+  r = prop_binary_builder_attr(pk->b, key, val);
+
+  if (r == -EILSEQ) {
+    pk->bad_name = true;
+  }
+
+  return r;
+}
+
+static int prop_xml_pack_end_node(void *ctx) {
+  struct prop_xml_pack *pk;
+
+  pk = ctx;
+
+  return prop_binary_builder_end_node(pk->b);
+}
+
+static enum charset prop_xml_charset(enum prop_encoding encoding) {
+  switch (encoding) {
+  case PROP_ENCODING_ASCII:
+    return CHARSET_ASCII;
+
+  case PROP_ENCODING_ISO_8859_1:
+    return CHARSET_ISO_8859_1;
+
+  case PROP_ENCODING_EUC_JP:
+    return CHARSET_EUC_JP;
+
+  case PROP_ENCODING_UTF_8:
+    return CHARSET_UTF_8;
+
+  default:
+    return CHARSET_SHIFT_JIS;
+  }
+}
+
+static int prop_xml_parse_doc(struct prop_xml_parser *px) {
+  bool has_root;
+  size_t lt;
+  int r;
+
+  assert(px != NULL);
+
+  has_root = false;
+
+  if (px->nchars >= 3 && memcmp(px->chars, "\xEF\xBB\xBF", 3) == 0) {
+    px->pos = 3;
+  }
+
+  px->start = px->pos;
+
+  for (;;) {
+    if (!prop_xml_next_lt(px, px->pos, &lt)) {
+      lt = px->nchars;
+    }
+
+    if (!prop_xml_is_blank(px->chars + px->pos, lt - px->pos)) {
+      log_write("Line %lu: Unexpected text outside of a leaf element",
+                prop_xml_line(px, px->pos));
+
+      return -EBADMSG;
+    }
+
+    if (lt == px->nchars) {
+      break;
+    }
+
+    r = prop_xml_skip_markup(px, lt);
+
+    if (r < 0) {
+      return r;
+    }
+
+    if (r > 0) {
+      continue;
+    }
+
+    if (lt + 1 < px->nchars && px->chars[lt + 1] == '/') {
+      if (px->nframes == 0) {
+        log_write("Line %lu: Unexpected end tag", prop_xml_line(px, lt));
+
+        return -EBADMSG;
+      }
+
+      r = prop_xml_parse_end_tag(px, lt, px->frames[px->nframes - 1].name,
+                                 px->frames[px->nframes - 1].len);
+
+      if (r < 0) {
+        return r;
+      }
+
+      r = px->v->end_node(px->ctx);
+
+      if (r < 0) {
+        return r;
+      }
+
+      px->nframes--;
+    } else {
+      if (has_root && px->nframes == 0) {
+        log_write("Line %lu: Document has more than one root element",
+                  prop_xml_line(px, lt));
+
+        return -EBADMSG;
+      }
+
+      r = prop_xml_parse_element(px, lt);
+
+      if (r < 0) {
+        return r;
+      }
+
+      has_root = true;
+    }
+  }
+
+  if (px->nframes > 0) {
+    log_write("Line %lu: Element <%.*s> is never closed",
+              prop_xml_line(px, px->frames[px->nframes - 1].name - px->chars),
+              (int)px->frames[px->nframes - 1].len,
+              px->frames[px->nframes - 1].name);
+
+    return -EBADMSG;
+  }
+
+  if (!has_root) {
+    log_write("Document has no root element");
+
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+/* An element whose start tag is followed by text and then straight away by
+   an end tag is a leaf, and that text is its value. Anything else opens a
+   node that children can be added to, and whatever comes between its child
+   elements has to be whitespace. */
+
+static int prop_xml_parse_element(struct prop_xml_parser *px, size_t lt) {
+  const struct prop_xml_tag *tag;
+  size_t next;
+  size_t text;
+  int r;
+
+  assert(px != NULL);
+
+  tag = &px->tag;
+  r = prop_xml_parse_start_tag(px, lt);
+
+  if (r < 0) {
+    return r;
+  }
+
+  if (tag->is_empty) {
+    return prop_xml_emit_node(px, NULL, 0, true);
+  }
+
+  if (!prop_xml_next_lt(px, px->pos, &next)) {
+    log_write("Line %lu: Element <%.*s> is never closed", prop_xml_line(px, lt),
+              (int)tag->name_len, tag->name);
+
+    return -EBADMSG;
+  }
+
+  if (next + 1 < px->nchars && px->chars[next + 1] == '/') {
+    text = px->pos;
+    r = prop_xml_parse_end_tag(px, next, tag->name, tag->name_len);
+
+    if (r < 0) {
+      return r;
+    }
+
+    return prop_xml_emit_node(px, px->chars + text, next - text, true);
+  }
+
+  if (!prop_xml_is_blank(px->chars + px->pos, next - px->pos)) {
+    log_write("Line %lu: Element <%.*s> has mixed content",
+              prop_xml_line(px, px->pos), (int)tag->name_len, tag->name);
+
+    return -EBADMSG;
+  }
+
+  r = prop_xml_emit_node(px, NULL, 0, false);
+
+  if (r < 0) {
+    return r;
+  }
+
+  return prop_xml_push(px, tag->name, tag->name_len);
+}
+
+static int prop_xml_parse_start_tag(struct prop_xml_parser *px, size_t lt) {
+  struct prop_xml_tag *tag;
+  const char *chars;
+  const char *close;
+  size_t key;
+  size_t key_len;
+  size_t pos;
+  char quote;
+  int r;
+
+  assert(px != NULL);
+
+  chars = px->chars;
+  tag = &px->tag;
+  memset(tag, 0, sizeof(*tag));
+  px->attrs.nbytes = 0;
+
+  pos = lt + 1;
+  tag->name = chars + pos;
+
+  while (pos < px->nchars && !prop_xml_is_space(chars[pos]) &&
+         chars[pos] != '/' && chars[pos] != '>') {
+    pos++;
+  }
+
+  tag->name_len = pos - (lt + 1);
+
+  if (tag->name_len == 0 || memchr(tag->name, '\0', tag->name_len) != NULL) {
+    goto malformed;
+  }
+
+  for (;;) {
+    while (pos < px->nchars && prop_xml_is_space(chars[pos])) {
+      pos++;
+    }
+
+    if (pos >= px->nchars) {
+      goto malformed;
+    }
+
+    if (chars[pos] == '>') {
+      pos++;
+
+      break;
+    }
+
+    if (chars[pos] == '/') {
+      if (pos + 1 >= px->nchars || chars[pos + 1] != '>') {
+        goto malformed;
+      }
+
+      tag->is_empty = true;
+      pos += 2;
+
+      break;
+    }
+
+    key = pos;
+
+    while (pos < px->nchars && !prop_xml_is_space(chars[pos]) &&
+           chars[pos] != '=' && chars[pos] != '/' && chars[pos] != '>') {
+      pos++;
+    }
+
+    key_len = pos - key;
+
+    while (pos < px->nchars && prop_xml_is_space(chars[pos])) {
+      pos++;
+    }
+
+    if (key_len == 0 || memchr(chars + key, '\0', key_len) != NULL ||
+        pos >= px->nchars || chars[pos] != '=') {
+      goto malformed;
+    }
+
+    pos++;
+
+    while (pos < px->nchars && prop_xml_is_space(chars[pos])) {
+      pos++;
+    }
+
+    if (pos >= px->nchars || (chars[pos] != '"' && chars[pos] != '\'')) {
+      goto malformed;
+    }
+
+    quote = chars[pos++];
+    close = memchr(chars + pos, quote, px->nchars - pos);
+
+    if (close == NULL) {
+      goto malformed;
+    }
+
+    r = prop_xml_parse_attr(px, chars + key, key_len, chars + pos,
+                            close - (chars + pos));
+
+    if (r < 0) {
+      return r;
+    }
+
+    pos = close - chars + 1;
+  }
+
+  px->pos = pos;
+
+  return 0;
+
+malformed:
+  log_write("Line %lu: Malformed start tag", prop_xml_line(px, lt));
+
+  return -EBADMSG;
+}
+
+static int prop_xml_parse_end_tag(struct prop_xml_parser *px, size_t lt,
+                                  const char *name, size_t len) {
+  const char *chars;
+  size_t pos;
+
+  assert(px != NULL);
+  assert(name != NULL);
+
+  chars = px->chars;
+  pos = lt + 2;
+
+  if (px->nchars - pos < len || memcmp(chars + pos, name, len) != 0) {
+    goto mismatch;
+  }
+
+  pos += len;
+
+  while (pos < px->nchars && prop_xml_is_space(chars[pos])) {
+    pos++;
+  }
+
+  if (pos >= px->nchars || chars[pos] != '>') {
+    goto mismatch;
+  }
+
+  px->pos = pos + 1;
+
+  return 0;
+
+mismatch:
+  log_write("Line %lu: Expected </%.*s>", prop_xml_line(px, lt), (int)len,
+            name);
+
+  return -EBADMSG;
+}
+
+/* The special attributes that prop_xml_write() uses to describe the node
+   itself are only noted down here, and get decoded once the whole start tag
+   has been seen. __size is redundant and ignored. */
+
+static int prop_xml_parse_attr(struct prop_xml_parser *px, const char *key,
+                               size_t key_len, const char *val,
+                               size_t val_len) {
+  struct prop_xml_tag *tag;
+  int r;
+
+  assert(px != NULL);
+  assert(key != NULL);
+  assert(val != NULL);
+
+  tag = &px->tag;
+
+  if (prop_xml_key_is(key, key_len, "__type")) {
+    tag->type = val;
+    tag->type_len = val_len;
+    tag->has_type = true;
+
+    return 0;
+  }
+
+  if (prop_xml_key_is(key, key_len, "__count")) {
+    tag->count = val;
+    tag->count_len = val_len;
+    tag->has_count = true;
+
+    return 0;
+  }
+
+  if (prop_xml_key_is(key, key_len, "__value")) {
+    tag->value = val;
+    tag->value_len = val_len;
+    tag->has_value = true;
+
+    return 0;
+  }
+
+  if (prop_xml_key_is(key, key_len, "__size")) {
+    return 0;
+  }
+
+  r = prop_xml_buf_reserve(&px->attrs, key_len + 1);
+
+  if (r < 0) {
+    return r;
+  }
+
+  memcpy(px->attrs.bytes + px->attrs.nbytes, key, key_len);
+  px->attrs.nbytes += key_len;
+  px->attrs.bytes[px->attrs.nbytes++] = '\0';
+
+  return prop_xml_decode_string(px, &px->attrs, val, val_len);
+}
+
+/* Skips over a processing instruction, comment or DOCTYPE declaration.
+   Returns 1 if there was one, or 0 if the markup at lt is a tag. */
+
+static int prop_xml_skip_markup(struct prop_xml_parser *px, size_t lt) {
+  const char *chars;
+  size_t nchars;
+  size_t end;
+  int r;
+
+  assert(px != NULL);
+
+  chars = px->chars + lt;
+  nchars = px->nchars - lt;
+
+  if (nchars >= 2 && chars[1] == '?') {
+    if (!prop_xml_find(px, lt + 2, "?>", &end)) {
+      goto unterminated;
+    }
+
+    if (lt == px->start && end - lt > 5 && memcmp(chars, "<?xml", 5) == 0 &&
+        prop_xml_is_space(chars[5])) {
+      r = prop_xml_parse_decl(px, chars + 5, end - lt - 5);
+
+      if (r < 0) {
+        return r;
+      }
+    }
+
+    px->pos = end + 2;
+
+    return 1;
+  }
+
+  if (nchars >= 4 && memcmp(chars, "<!--", 4) == 0) {
+    if (!prop_xml_find(px, lt + 4, "-->", &end)) {
+      goto unterminated;
+    }
+
+    px->pos = end + 3;
+
+    return 1;
+  }
+
+  if (nchars >= 9 && memcmp(chars, "<![CDATA[", 9) == 0) {
+    log_write("Line %lu: CDATA sections are not supported",
+              prop_xml_line(px, lt));
+
+    return -EBADMSG;
+  }
+
+  if (nchars >= 2 && chars[1] == '!') {
+    if (!prop_xml_find(px, lt + 2, ">", &end)) {
+      goto unterminated;
+    }
+
+    px->pos = end + 1;
+
+    return 1;
+  }
+
+  return 0;
+
+unterminated:
+  log_write("Line %lu: Unterminated markup", prop_xml_line(px, lt));
+
+  return -EBADMSG;
+}
+
+/* The XML declaration may name an encoding other than UTF-8, which is what
+   hand-made AVS XML files are usually written in. All the ones we support
+   keep ASCII as-is and never use bytes below 0x40 inside a multi-byte
+   character, so the markup can be parsed the same way regardless. Only the
+   encoding pseudo-attribute matters here. */
+
+static int prop_xml_parse_decl(struct prop_xml_parser *px, const char *chars,
+                               size_t nchars) {
+  const char *close;
+  const char *pos;
+  const char *end;
+  char quote;
+
+  assert(px != NULL);
+  assert(chars != NULL);
+
+  end = chars + nchars;
+
+  for (pos = chars; (size_t)(end - pos) > 8; pos++) {
+    if (memcmp(pos, "encoding", 8) == 0 && prop_xml_is_space(pos[-1])) {
+      break;
+    }
+  }
+
+  if ((size_t)(end - pos) <= 8) {
+    return 0;
+  }
+
+  pos += 8;
+
+  while (pos < end && prop_xml_is_space(*pos)) {
+    pos++;
+  }
+
+  if (pos == end || *pos != '=') {
+    goto malformed;
+  }
+
+  pos++;
+
+  while (pos < end && prop_xml_is_space(*pos)) {
+    pos++;
+  }
+
+  if (pos == end || (*pos != '"' && *pos != '\'')) {
+    goto malformed;
+  }
+
+  quote = *pos++;
+  close = memchr(pos, quote, end - pos);
+
+  if (close == NULL) {
+    goto malformed;
+  }
+
+  if (!prop_xml_charset_from_name(&px->in_cs, pos, close - pos)) {
+    log_write("Unsupported XML encoding \"%.*s\"", (int)(close - pos), pos);
+
+    return -EBADMSG;
+  }
+
+  return 0;
+
+malformed:
+  log_write("Malformed XML declaration");
+
+  return -EBADMSG;
+}
+
+static bool prop_xml_charset_from_name(enum charset *out, const char *name,
+                                       size_t len) {
+  static const struct {
+    const char *name;
+    enum charset cs;
+  } names[] = {
+      {"ascii", CHARSET_ASCII},
+      {"us-ascii", CHARSET_ASCII},
+      {"iso-8859-1", CHARSET_ISO_8859_1},
+      {"latin1", CHARSET_ISO_8859_1},
+      {"euc-jp", CHARSET_EUC_JP},
+      {"shift_jis", CHARSET_SHIFT_JIS},
+      {"shift-jis", CHARSET_SHIFT_JIS},
+      {"sjis", CHARSET_SHIFT_JIS},
+      {"cp932", CHARSET_SHIFT_JIS},
+      {"windows-31j", CHARSET_SHIFT_JIS},
+      {"utf-8", CHARSET_UTF_8},
+  };
+  char lower[16];
+  size_t i;
+
+  assert(out != NULL);
+  assert(name != NULL);
+
+  if (len >= sizeof(lower)) {
+    return false;
+  }
+
+  for (i = 0; i < len; i++) {
+    lower[i] = name[i] >= 'A' && name[i] <= 'Z' ? name[i] + 32 : name[i];
+  }
+
+  lower[len] = '\0';
+
+  for (i = 0; i < lengthof(names); i++) {
+    if (strcmp(names[i].name, lower) == 0) {
+      *out = names[i].cs;
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static int prop_xml_push(struct prop_xml_parser *px, const char *name,
+                         size_t len) {
+  struct prop_xml_frame *frames;
+  size_t max_frames;
+
+  assert(px != NULL);
+  assert(name != NULL);
+
+  if (px->nframes == px->max_frames) {
+    max_frames = px->max_frames != 0 ? px->max_frames * 2 : 16;
+    frames = realloc(px->frames, max_frames * sizeof(*frames));
+
+    if (frames == NULL) {
+      return -ENOMEM;
+    }
+
+    px->frames = frames;
+    px->max_frames = max_frames;
+  }
+
+  px->frames[px->nframes].name = name;
+  px->frames[px->nframes].len = len;
+  px->nframes++;
+
+  return 0;
+}
+
+static int prop_xml_emit_node(struct prop_xml_parser *px, const char *text,
+                              size_t text_len, bool is_leaf) {
+  const struct prop_xml_tag *tag;
+  struct prop_xml_buf *buf;
+  struct const_iobuf value;
+  const char *key;
+  const char *val;
+  enum prop_type type;
+  size_t pos;
+  int r;
+
+  assert(px != NULL);
+
+  tag = &px->tag;
+
+  if (tag->has_value) {
+    text = tag->value;
+    text_len = tag->value_len;
+  }
+
+  r = prop_xml_decode_type(px, text, text_len, &type);
+
+  if (r < 0) {
+    return r;
+  }
+
+  buf = &px->values[px->nvalues++ & 1];
+  buf->nbytes = 0;
+  r = prop_xml_decode_value(px, type, text, text_len, buf);
+
+  if (r < 0) {
+    return r;
+  }
+
+  px->name.nbytes = 0;
+  r = prop_xml_buf_reserve(&px->name, tag->name_len + 1);
+
+  if (r < 0) {
+    return r;
+  }
+
+  memcpy(px->name.bytes, tag->name, tag->name_len);
+  px->name.bytes[tag->name_len] = '\0';
+
+  value.bytes = buf->bytes;
+  value.nbytes = buf->nbytes;
+  value.pos = 0;
+
+  r = px->v->begin_node(px->ctx, (const char *)px->name.bytes, type, &value);
+
+  if (r < 0) {
+    return r;
+  }
+
+  for (pos = 0; pos < px->attrs.nbytes;) {
+    key = (const char *)px->attrs.bytes + pos;
+    pos += strlen(key) + 1;
+    val = (const char *)px->attrs.bytes + pos;
+    pos += strlen(val) + 1;
+
+    r = px->v->attr(px->ctx, key, val);
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  if (is_leaf) {
+    r = px->v->end_node(px->ctx);
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  return 0;
+}
+
+static int prop_xml_decode_type(struct prop_xml_parser *px, const char *text,
+                                size_t text_len, enum prop_type *out) {
+  const struct prop_xml_tag *tag;
+  char name[PROP_XML_TYPE_NCHARS + 1];
+  enum prop_type type;
+  uint64_t key;
+  size_t i;
+
+  assert(px != NULL);
+  assert(out != NULL);
+
+  tag = &px->tag;
+
+  if (!tag->has_type) {
+    type = prop_xml_is_blank(text, text_len) ? PROP_VOID : PROP_STR;
+  } else {
+    if (tag->type_len == 0 || tag->type_len > PROP_XML_TYPE_NCHARS) {
+      goto bad_type;
+    }
+
+    key = tag->type_len;
+
+    for (i = 0; i < tag->type_len; i++) {
+      key = (key << 8) | (uint8_t)tag->type[i];
+    }
+
+    for (i = 0; i < px->ntypes; i++) {
+      if (px->type_keys[i] == key) {
+        break;
+      }
+    }
+
+    if (i == px->ntypes) {
+      memcpy(name, tag->type, tag->type_len);
+      name[tag->type_len] = '\0';
+
+      if (prop_type_from_string(&type, name) < 0 || type == PROP_ATTR) {
+        goto bad_type;
+      }
+
+      assert(px->ntypes < PROP_XML_MAX_TYPES);
+
+      px->type_keys[px->ntypes] = key;
+      px->types[px->ntypes] = type;
+      px->ntypes++;
+    }
+
+    type = px->types[i];
+  }
+
+  if (tag->has_count) {
+    if (prop_type_to_size(type) <= 0) {
+      log_write("Line %lu: <%.*s> can't be an array of %s",
+                prop_xml_line(px, tag->name - px->chars), (int)tag->name_len,
+                tag->name, prop_type_to_string(type));
+
+      return -EBADMSG;
+    }
+
+    type |= PROP_ARRAY_FLAG;
+  }
+
+  *out = type;
+
+  return 0;
+
+bad_type:
+  log_write("Line %lu: <%.*s> has unknown type \"%.*s\"",
+            prop_xml_line(px, tag->name - px->chars), (int)tag->name_len,
+            tag->name, (int)tag->type_len, tag->type);
+
+  return -EBADMSG;
+}
+
+static int prop_xml_decode_value(struct prop_xml_parser *px,
+                                 enum prop_type type, const char *text,
+                                 size_t text_len, struct prop_xml_buf *out) {
+  const struct prop_xml_tag *tag;
+  const struct prop_type_info *info;
+  uint32_t count;
+  size_t nelems;
+  size_t nbytes;
+  int r;
+
+  assert(px != NULL);
+  assert(out != NULL);
+
+  tag = &px->tag;
+
+  switch (type) {
+  case PROP_VOID:
+    return 0;
+
+  case PROP_STR:
+    return prop_xml_decode_string(px, out, text, text_len);
+
+  case PROP_BIN:
+    while (text_len > 0 && prop_xml_is_space(text[0])) {
+      text++;
+      text_len--;
+    }
+
+    while (text_len > 0 && prop_xml_is_space(text[text_len - 1])) {
+      text_len--;
+    }
+
+    r = prop_xml_buf_reserve(out, text_len / 2);
+
+    if (r < 0) {
+      return r;
+    }
+
+    if (hex_decode(out->bytes, text, text_len) < 0) {
+      goto bad_value;
+    }
+
+    out->nbytes = text_len / 2;
+
+    return 0;
+
+  default:
+    break;
+  }
+
+  info = prop_type_get_info(type);
+
+  if (prop_type_is_array(type)) {
+    if (prop_xml_decode_u32(tag->count, tag->count_len, &count) < 0) {
+      log_write("Line %lu: <%.*s> has a bad __count",
+                prop_xml_line(px, tag->name - px->chars), (int)tag->name_len,
+                tag->name);
+
+      return -EBADMSG;
+    }
+
+    nelems = (size_t)count * info->count;
+    nbytes = (size_t)count * info->size;
+  } else {
+    nelems = info->count;
+    nbytes = info->size;
+  }
+
+  /* Every element takes up at least one character, so don't go allocating
+     space for more of them than there could possibly be. */
+
+  if (nelems > text_len || nbytes > UINT32_MAX) {
+    goto bad_value;
+  }
+
+  r = prop_xml_buf_reserve(out, nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  if (info->parse(out->bytes, text, text_len, nelems) < 0) {
+    goto bad_value;
+  }
+
+  out->nbytes = nbytes;
+
+  return 0;
+
+bad_value:
+  log_write("Line %lu: <%.*s> has a bad %s value",
+            prop_xml_line(px, tag->name - px->chars), (int)tag->name_len,
+            tag->name, prop_type_to_string(type));
+
+  return -EBADMSG;
+}
+
+/* Unescapes and transcodes a string from the XML, and appends it to a buffer
+   along with a NUL terminator. Coming from UTF-8, the result never takes up
+   more bytes than the XML did: entities are longer than the characters they
+   stand for, and none of the target encodings needs more bytes for a
+   character than UTF-8 does. Coming from anything else, a single byte (such
+   as a half-width katakana in Shift-JIS) can turn into as many as three. */
+
+static int prop_xml_decode_string(struct prop_xml_parser *px,
+                                  struct prop_xml_buf *out, const char *chars,
+                                  size_t nchars) {
+  uint8_t tmp[CHARSET_MAX_NBYTES];
+  uint8_t *dest;
+  uint32_t c;
+  size_t max_nbytes;
+  size_t len;
+  size_t n;
+  size_t i;
+  int r;
+
+  assert(px != NULL);
+  assert(out != NULL);
+  assert(chars != NULL || nchars == 0);
+
+  if (px->in_cs == CHARSET_UTF_8) {
+    max_nbytes = nchars;
+  } else if (nchars <= SIZE_MAX / 3 - 1) {
+    max_nbytes = nchars * 3;
+  } else {
+    return -ENOMEM;
+  }
+
+  r = prop_xml_buf_reserve(out, max_nbytes + 1);
+
+  if (r < 0) {
+    return r;
+  }
+
+  dest = out->bytes + out->nbytes;
+
+  for (i = 0; i < nchars; i += len) {
+    c = (uint8_t)chars[i];
+
+    if (c < 0x80 && c != '&' && c != '\0') {
+      *dest++ = c;
+      len = 1;
+
+      continue;
+    }
+
+    if (c == '&') {
+      if (prop_xml_decode_entity(chars + i, nchars - i, &c, &len) < 0) {
+        log_write("Line %lu: Bad entity reference",
+                  prop_xml_line(px, chars + i - px->chars));
+
+        return -EBADMSG;
+      }
+    } else if (c == '\0') {
+      log_write("Line %lu: Unexpected NUL character",
+                prop_xml_line(px, chars + i - px->chars));
+
+      return -EBADMSG;
+    } else {
+      len = charset_decode(px->in_cs, &c, chars + i, nchars - i);
+
+      if (c == CHARSET_REPLACEMENT &&
+          (px->in_cs != CHARSET_UTF_8 || len != 3 ||
+           memcmp(chars + i, "\xEF\xBF\xBD", 3) != 0)) {
+        log_write("Line %lu: Invalid character in XML",
+                  prop_xml_line(px, chars + i - px->chars));
+
+        return -EILSEQ;
+      }
+
+      if (px->cs == px->in_cs) {
+        memcpy(dest, chars + i, len);
+        dest += len;
+
+        continue;
+      }
+    }
+
+    n = charset_encode(px->cs, tmp, c);
+
+    if (n == 0) {
+      log_write("Line %lu: U+%04lX isn't in the prop's encoding",
+                prop_xml_line(px, chars + i - px->chars), (unsigned long)c);
+
+      return -EILSEQ;
+    }
+
+    memcpy(dest, tmp, n);
+    dest += n;
+  }
+
+  *dest++ = '\0';
+  out->nbytes = dest - out->bytes;
+
+  return 0;
+}
+
+static int prop_xml_decode_entity(const char *chars, size_t nchars,
+                                  uint32_t *out, size_t *len) {
+  const char *end;
+  const char *body;
+  uint32_t c;
+  size_t nbody;
+  size_t i;
+  int d;
+
+  assert(chars != NULL);
+  assert(out != NULL);
+  assert(len != NULL);
+
+  end = memchr(chars, ';', nchars < 12 ? nchars : 12);
+
+  if (end == NULL) {
+    return -EBADMSG;
+  }
+
+  body = chars + 1;
+  nbody = end - body;
+  *len = end - chars + 1;
+
+  if (prop_xml_key_is(body, nbody, "lt")) {
+    *out = '<';
+  } else if (prop_xml_key_is(body, nbody, "gt")) {
+    *out = '>';
+  } else if (prop_xml_key_is(body, nbody, "amp")) {
+    *out = '&';
+  } else if (prop_xml_key_is(body, nbody, "apos")) {
+    *out = '\'';
+  } else if (prop_xml_key_is(body, nbody, "quot")) {
+    *out = '"';
+  } else if (nbody >= 2 && body[0] == '#') {
+    c = 0;
+    i = body[1] == 'x' ? 2 : 1;
+
+    if (i == nbody) {
+      return -EBADMSG;
+    }
+
+    for (; i < nbody; i++) {
+      if (body[i] >= '0' && body[i] <= '9') {
+        d = body[i] - '0';
+      } else if (body[1] == 'x' && (body[i] | 0x20) >= 'a' &&
+                 (body[i] | 0x20) <= 'f') {
+        d = (body[i] | 0x20) - 'a' + 10;
+      } else {
+        return -EBADMSG;
+      }
+
+      c = c * (body[1] == 'x' ? 16 : 10) + d;
+
+      if (c > 0x10FFFF) {
+        return -EBADMSG;
+      }
+    }
+
+    if (c == 0 || (c >= 0xD800 && c <= 0xDFFF)) {
+      return -EBADMSG;
+    }
+
+    *out = c;
+  } else {
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+static int prop_xml_decode_u32(const char *chars, size_t nchars,
+                               uint32_t *out) {
+  uint64_t value;
+  size_t i;
+
+  assert(chars != NULL);
+  assert(out != NULL);
+
+  if (nchars == 0) {
+    return -EINVAL;
+  }
+
+  value = 0;
+
+  for (i = 0; i < nchars; i++) {
+    if (chars[i] < '0' || chars[i] > '9') {
+      return -EINVAL;
+    }
+
+    value = value * 10 + (chars[i] - '0');
+
+    if (value > UINT32_MAX) {
+      return -EINVAL;
+    }
+  }
+
+  *out = value;
+
+  return 0;
+}
+
+/* Makes room for nbytes more bytes. Buffers are never left empty, so that
+   their bytes pointer is always usable. */
+
+static int prop_xml_buf_reserve(struct prop_xml_buf *buf, size_t nbytes) {
+  uint8_t *bytes;
+  size_t max_nbytes;
+
+  assert(buf != NULL);
+
+  if (buf->bytes != NULL && buf->max_nbytes - buf->nbytes >= nbytes) {
+    return 0;
+  }
+
+  max_nbytes = buf->max_nbytes != 0 ? buf->max_nbytes : 64;
+
+  while (max_nbytes - buf->nbytes < nbytes) {
+    if (max_nbytes > SIZE_MAX / 2) {
+      return -ENOMEM;
+    }
+
+    max_nbytes *= 2;
+  }
+
+  bytes = realloc(buf->bytes, max_nbytes);
+
+  if (bytes == NULL) {
+    return -ENOMEM;
+  }
+
+  buf->bytes = bytes;
+  buf->max_nbytes = max_nbytes;
+
+  return 0;
+}
+
+static void prop_xml_buf_free(struct prop_xml_buf *buf) {
+  assert(buf != NULL);
+
+  free(buf->bytes);
+}
+
+static bool prop_xml_find(const struct prop_xml_parser *px, size_t from,
+                          const char *str, size_t *out) {
+  const char *pos;
+  size_t len;
+
+  assert(px != NULL);
+  assert(str != NULL);
+  assert(out != NULL);
+
+  len = strlen(str);
+
+  while (from < px->nchars && px->nchars - from >= len) {
+    pos = memchr(px->chars + from, str[0], px->nchars - from);
+
+    if (pos == NULL) {
+      return false;
+    }
+
+    from = pos - px->chars;
+
+    if (px->nchars - from >= len && memcmp(pos, str, len) == 0) {
+      *out = from;
+
+      return true;
+    }
+
+    from++;
+  }
+
+  return false;
+}
+
+/* Finds the first '<' at or after from. Index entries before from are stale,
+   and nothing before from gets scanned if the index has fallen behind. */
+
+static bool prop_xml_next_lt(struct prop_xml_parser *px, size_t from,
+                             size_t *out) {
+  size_t pos;
+
+  assert(px != NULL);
+  assert(out != NULL);
+
+  for (;;) {
+    while (px->index_pos < px->index_len) {
+      pos = px->index_base + px->index[px->index_pos];
+
+      if (pos >= from) {
+        *out = pos;
+
+        return true;
+      }
+
+      px->index_pos++;
+    }
+
+    if (px->scanned < from) {
+      px->scanned = from;
+    }
+
+    if (px->scanned >= px->nchars) {
+      return false;
+    }
+
+    prop_xml_index_window(px);
+  }
+}
+
+static void prop_xml_index_window(struct prop_xml_parser *px) {
+  const char *chars;
+  size_t nchars;
+  size_t count;
+  size_t i;
+
+  assert(px != NULL);
+
+  chars = px->chars + px->scanned;
+  nchars = px->nchars - px->scanned;
+
+  if (nchars > PROP_XML_WINDOW) {
+    nchars = PROP_XML_WINDOW;
+  }
+
+  i = 0;
+  count = 0;
+
+#ifdef PROP_XML_READER_X86
+  if (nchars >= 64) {
+    i = prop_xml_index_simd(chars, nchars, px->index, &count);
+  }
+#endif
+
+  for (; i < nchars; i++) {
+    if (chars[i] == '<') {
+      px->index[count++] = i;
+    }
+  }
+
+  px->index_base = px->scanned;
+  px->index_pos = 0;
+  px->index_len = count;
+  px->scanned += nchars;
+}
+
+static bool prop_xml_is_blank(const char *chars, size_t nchars) {
+  size_t i;
+
+  assert(chars != NULL || nchars == 0);
+
+  for (i = 0; i < nchars; i++) {
+    if (!prop_xml_is_space(chars[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool prop_xml_is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool prop_xml_key_is(const char *key, size_t len, const char *str) {
+  assert(key != NULL);
+  assert(str != NULL);
+
+  return strlen(str) == len && memcmp(key, str, len) == 0;
+}
+
+/* Only used for error messages, so it doesn't matter that this is slow */
+
+static unsigned long prop_xml_line(const struct prop_xml_parser *px,
+                                   size_t pos) {
+  const char *cur;
+  const char *end;
+  unsigned long line;
+
+  assert(px != NULL);
+
+  cur = px->chars;
+  end = px->chars + pos;
+  line = 1;
+
+  while ((cur = memchr(cur, '\n', end - cur)) != NULL) {
+    cur++;
+    line++;
+  }
+
+  return line;
+}
+
+#ifdef PROP_XML_READER_X86
+
+/* These index whole 64-byte blocks and return how many bytes they got
+   through, leaving the rest to the caller. */
+
+static size_t prop_xml_index_simd(const char *chars, size_t nchars,
+                                  uint32_t *index, size_t *count) {
+  if (__builtin_cpu_supports("avx2")) {
+    return prop_xml_index_avx2(chars, nchars, index, count);
+  } else if (__builtin_cpu_supports("sse2")) {
+    return prop_xml_index_sse2(chars, nchars, index, count);
+  } else {
+    return 0;
+  }
+}
+
+static size_t prop_xml_index_sse2(const char *chars, size_t nchars,
+                                  uint32_t *index, size_t *count) {
+  __m128i lt;
+  uint64_t mask;
+  size_t n;
+  size_t i;
+  int j;
+
+  lt = _mm_set1_epi8('<');
+  n = *count;
+
+  for (i = 0; i + 64 <= nchars; i += 64) {
+    mask = 0;
+
+    for (j = 0; j < 4; j++) {
+      mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                  _mm_loadu_si128((const __m128i *)(chars + i + j * 16)), lt))
+              << (j * 16);
+    }
+
+    while (mask != 0) {
+      index[n++] = i + __builtin_ctzll(mask);
+      mask &= mask - 1;
+    }
+  }
+
+  *count = n;
+
+  return i;
+}
+
+static size_t prop_xml_index_avx2(const char *chars, size_t nchars,
+                                  uint32_t *index, size_t *count) {
+  __m256i lt;
+  uint64_t mask;
+  size_t n;
+  size_t i;
+
+  lt = _mm256_set1_epi8('<');
+  n = *count;
+
+  for (i = 0; i + 64 <= nchars; i += 64) {
+    mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        _mm256_loadu_si256((const __m256i *)(chars + i)), lt));
+    mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)(chars + i + 32)), lt))
+            << 32;
+
+    while (mask != 0) {
+      index[n++] = i + __builtin_ctzll(mask);
+      mask &= mask - 1;
+    }
+  }
+
+  *count = n;
+
+  return i;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "573file/prop-binary-reader.h"
+#include "573file/prop-type.h"
+#include "573file/prop.h"
+
+/* Reads XML laid out the way prop_xml_write() writes it. Each element is a
+   node whose type is given by its __type attribute, and __count turns it into
+   an array of that many values. A node's value is the element's text, or its
+   __value attribute if it has child elements. Elements without a __type are
+   strings if they contain text and void otherwise. All other attributes
+   become prop attributes.
+
+   The XML is read as UTF-8 unless its declaration names one of the other
+   encodings props can use. Its strings get converted to the given encoding,
+   and the parse fails with -EILSEQ if that encoding can't represent one of
+   their characters. Anything else that's wrong with the input fails with
+   -EBADMSG. */
+
+int prop_xml_parse(struct prop **p, const void *bytes, size_t nbytes,
+                   enum prop_encoding encoding);
+
+/* Parses a file in place by mapping it into memory */
+
+int prop_xml_parse_file(struct prop **p, const char *path,
+                        enum prop_encoding encoding);
+
+/* Event-driven counterpart to prop_xml_parse(), which produces the same
+   events as prop_binary_visit() would for the equivalent binary prop.
+   begin_doc reports the requested encoding. Names and attribute strings only
+   live until the callback returns, and a node's value stays valid until the
+   begin event of the node after it has been handled. */
+
+int prop_xml_visit(const void *bytes, size_t nbytes,
+                   enum prop_encoding encoding,
+                   const struct prop_binary_visitor *v, void *ctx);
+
+/* Converts XML into a binary prop and writes it to f, feeding the parser's
+   events straight into a prop_binary_builder. Memory use depends on how
+   deeply the XML is nested and on its largest value, but not on its overall
+   size. Names are packed unless one of them can't be, as with
+   prop_binary_write(). */
+
+int prop_xml_pack(const void *bytes, size_t nbytes, enum prop_encoding encoding,
+                  FILE *f);
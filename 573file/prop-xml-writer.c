@@ -1,194 +1,525 @@
 #include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "573file/prop-type.h"
 #include "573file/prop-xml-writer.h"
 #include "573file/prop.h"
 
+#include "util/charset.h"
 #include "util/iobuf.h"
 #include "util/log.h"
 #include "util/str.h"
+#include "util/work.h"
+
+/* Escaping is a hot path for string-heavy props. Most strings have nothing
+   in them that needs escaping or transcoding, so on x86 the writer looks for
+   the next special byte 16 or 32 bytes at a time and copies everything before
+   it in one go. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PROP_XML_X86
+#include <immintrin.h>
+#endif
+
+/* Size of the buffers that file output is staged in */
+
+#define PROP_XML_SINK_NCHARS (64 * 1024)
+
+/* Number of sibling nodes that a worker formats in one go, and number of
+   such chunks per thread that get formatted before they're written out */
+
+#define PROP_XML_PARALLEL_GRAIN 64
+#define PROP_XML_PARALLEL_NCHUNKS 4
 
 enum prop_xml_escape {
   PROP_XML_ESCAPE_ATTR,
   PROP_XML_ESCAPE_TEXT,
 };
 
-static void prop_xml_write_attr_list(struct strbuf *dest, const struct prop *p);
+struct prop_xml_stream_frame {
+  char *name;
+  size_t max_name;
+  enum prop_type type;
+  struct const_iobuf value;
+  bool is_open;
+};
+
+/* Attributes of the innermost node are accumulated as consecutive pairs of
+   NUL-terminated key and value strings until the node's start tag gets
+   written out. */
+
+struct prop_xml_stream {
+  enum charset cs;
+  struct prop_xml_stream_frame *frames;
+  size_t nframes;
+  size_t max_frames;
+  char *attrs;
+  size_t attrs_nchars;
+  size_t max_attrs_nchars;
+  struct strbuf out;
+};
+
+/* State shared by the worker threads of a parallel write. Chunk i of the
+   current round covers the GRAIN children starting at
+   first + i * PROP_XML_PARALLEL_GRAIN, and gets formatted into bufs[i]. */
+
+struct prop_xml_batch {
+  const struct prop **children;
+  size_t nchildren;
+  size_t first;
+  struct strbuf *bufs;
+  enum charset cs;
+  unsigned int indent;
+};
+
+typedef void (*prop_xml_stream_format_t)(struct strbuf *dest,
+                                         const struct prop_xml_stream *s);
+
+static enum charset prop_xml_charset(enum prop_encoding encoding);
+static void prop_xml_write_attr(struct strbuf *dest, const char *key,
+                                const char *val, enum charset cs);
+static void prop_xml_write_attr_list(struct strbuf *dest, const struct prop *p,
+                                     enum charset cs);
 static void prop_xml_write_children(struct strbuf *dest, const struct prop *p,
-                                    unsigned int indent);
+                                    enum charset cs, unsigned int indent);
+static void prop_xml_write_close_tag(struct strbuf *dest, const char *name,
+                                     unsigned int indent);
 static void prop_xml_write_escaped_string(struct strbuf *dest, const char *str,
+                                          size_t nchars, enum charset cs,
                                           enum prop_xml_escape ctx);
 static void prop_xml_write_indent(struct strbuf *dest, unsigned int indent);
+static size_t prop_xml_plain_span(const char *str, size_t nchars,
+                                  enum prop_xml_escape ctx);
 static void prop_xml_write_node(struct strbuf *dest, const struct prop *p,
-                                unsigned int indent);
-static void prop_xml_write_nonvoid(struct strbuf *dest, const struct prop *p,
-                                   unsigned int indent);
-static void prop_xml_write_void(struct strbuf *dest, const struct prop *p,
-                                unsigned int indent);
-static void prop_xml_write_text(struct strbuf *dest, const struct prop *p,
-                                enum prop_xml_escape ctx);
-static void prop_xml_write_text_element(struct strbuf *dest,
-                                        enum prop_type type,
-                                        struct const_iobuf *src,
-                                        enum prop_xml_escape ctx);
-static void prop_xml_write_text_s8(struct strbuf *dest,
-                                   struct const_iobuf *src);
-static void prop_xml_write_text_s16(struct strbuf *dest,
-                                    struct const_iobuf *src);
-static void prop_xml_write_text_s32(struct strbuf *dest,
-                                    struct const_iobuf *src);
-static void prop_xml_write_text_s64(struct strbuf *dest,
-                                    struct const_iobuf *src);
-static void prop_xml_write_text_u8(struct strbuf *dest,
-                                   struct const_iobuf *src);
-static void prop_xml_write_text_u16(struct strbuf *dest,
-                                    struct const_iobuf *src);
-static void prop_xml_write_text_u32(struct strbuf *dest,
-                                    struct const_iobuf *src);
-static void prop_xml_write_text_u64(struct strbuf *dest,
-                                    struct const_iobuf *src);
-static void prop_xml_write_text_bin(struct strbuf *dest,
-                                    struct const_iobuf *src);
-static void prop_xml_write_text_str(struct strbuf *dest,
-                                    struct const_iobuf *src,
-                                    enum prop_xml_escape ctx);
-static void prop_xml_write_text_ip4(struct strbuf *dest,
-                                    struct const_iobuf *src);
-static void prop_xml_write_text_bool(struct strbuf *dest,
-                                     struct const_iobuf *src);
-static void prop_xml_write_text_s32_tuple(struct strbuf *dest,
-                                          struct const_iobuf *src,
-                                          size_t count);
-static void prop_xml_write_text_u16_tuple(struct strbuf *dest,
-                                          struct const_iobuf *src,
-                                          size_t count);
+                                enum charset cs, unsigned int indent);
+static int prop_xml_write_node_parallel(struct strbuf *dest,
+                                        const struct prop *p, enum charset cs,
+                                        unsigned int indent,
+                                        unsigned int nthreads);
+static int prop_xml_write_children_parallel(struct strbuf *dest,
+                                            const struct prop *p,
+                                            size_t nchildren, enum charset cs,
+                                            unsigned int indent,
+                                            unsigned int nthreads);
+static int prop_xml_batch_format(void *ctx, size_t begin, size_t end);
+static void prop_xml_write_start_tag(struct strbuf *dest, const char *name,
+                                     enum prop_type type,
+                                     const struct const_iobuf *value,
+                                     enum charset cs, bool has_children,
+                                     unsigned int indent);
+static void prop_xml_write_start_tag_end(struct strbuf *dest, const char *name,
+                                         enum prop_type type,
+                                         const struct const_iobuf *value,
+                                         enum charset cs, bool has_children);
+static void prop_xml_write_text(struct strbuf *dest, enum prop_type type,
+                                const struct const_iobuf *value,
+                                enum charset cs, enum prop_xml_escape ctx);
+static int prop_xml_stream_emit(struct prop_xml_stream *s,
+                                prop_xml_stream_format_t format);
+static void prop_xml_stream_format_close(struct strbuf *dest,
+                                         const struct prop_xml_stream *s);
+static void prop_xml_stream_format_element(struct strbuf *dest,
+                                           const struct prop_xml_stream *s);
+static void prop_xml_stream_format_open(struct strbuf *dest,
+                                        const struct prop_xml_stream *s);
+static void prop_xml_stream_format_start_tag(struct strbuf *dest,
+                                             const struct prop_xml_stream *s,
+                                             bool has_children);
+static int prop_xml_stream_open_parent(struct prop_xml_stream *s);
+
+#ifdef PROP_XML_X86
+
+static size_t prop_xml_plain_span_simd(const uint8_t *bytes, size_t nbytes,
+                                       char quot, char apos);
+static size_t prop_xml_plain_span_sse2(const uint8_t *bytes, size_t nbytes,
+                                       char quot, char apos)
+    __attribute__((target("sse2")));
+static size_t prop_xml_plain_span_avx2(const uint8_t *bytes, size_t nbytes,
+                                       char quot, char apos)
+    __attribute__((target("avx2")));
+
+#endif
+
+int prop_xml_format_value(enum prop_type type, enum prop_encoding encoding,
+                          const struct const_iobuf *value, char **out) {
+  struct strbuf buf;
+
+  assert(value != NULL);
+  assert(out != NULL);
+
+  strbuf_init(&buf);
+  prop_xml_write_text(&buf, type, value, prop_xml_charset(encoding),
+                      PROP_XML_ESCAPE_TEXT);
+
+  return strbuf_finish(&buf, out);
+}
 
 int prop_xml_write(const struct prop *p, char **out) {
   struct strbuf buf;
-  char *chars;
 
   assert(p != NULL);
   assert(out != NULL);
 
-  *out = NULL;
+  strbuf_init(&buf);
+  prop_xml_write_node(&buf, p, prop_xml_charset(prop_get_encoding(p)), 0);
+
+  return strbuf_finish(&buf, out);
+}
 
-  buf.chars = NULL;
-  buf.nchars = 0;
-  buf.pos = 0;
+int prop_xml_write_file(const struct prop *p, FILE *f) {
+  struct strbuf buf;
+  char *chars;
+  int r;
 
-  prop_xml_write_node(&buf, p, 0);
-  chars = malloc(buf.pos + 1);
+  assert(p != NULL);
+  assert(f != NULL);
+
+  chars = malloc(PROP_XML_SINK_NCHARS);
 
   if (chars == NULL) {
     return -ENOMEM;
   }
 
-  buf.chars = chars;
-  buf.nchars = buf.pos + 1;
-  buf.pos = 0;
+  strbuf_init_sink(&buf, f, chars, PROP_XML_SINK_NCHARS);
+  prop_xml_write_node(&buf, p, prop_xml_charset(prop_get_encoding(p)), 0);
+  r = strbuf_flush(&buf);
+  free(chars);
 
-  prop_xml_write_node(&buf, p, 0);
+  return r;
+}
 
-  assert(buf.pos + 1 == buf.nchars);
+int prop_xml_write_file_parallel(const struct prop *p, FILE *f,
+                                 unsigned int nthreads) {
+  struct strbuf buf;
+  char *chars;
+  int r;
 
-  *out = chars;
+  assert(p != NULL);
+  assert(f != NULL);
 
-  return 0;
+  if (nthreads == 0) {
+    nthreads = work_get_cpu_count();
+  }
+
+  if (nthreads <= 1) {
+    return prop_xml_write_file(p, f);
+  }
+
+  chars = malloc(PROP_XML_SINK_NCHARS);
+
+  if (chars == NULL) {
+    return -ENOMEM;
+  }
+
+  strbuf_init_sink(&buf, f, chars, PROP_XML_SINK_NCHARS);
+  r = prop_xml_write_node_parallel(&buf, p,
+                                   prop_xml_charset(prop_get_encoding(p)), 0,
+                                   nthreads);
+
+  if (r >= 0) {
+    r = strbuf_flush(&buf);
+  }
+
+  free(chars);
+
+  return r;
+}
+
+/* XML always comes out as UTF-8. Headers that don't name an encoding get the
+   one the games use for everything else. */
+
+static enum charset prop_xml_charset(enum prop_encoding encoding) {
+  switch (encoding) {
+  case PROP_ENCODING_ASCII:
+    return CHARSET_ASCII;
+
+  case PROP_ENCODING_ISO_8859_1:
+    return CHARSET_ISO_8859_1;
+
+  case PROP_ENCODING_EUC_JP:
+    return CHARSET_EUC_JP;
+
+  case PROP_ENCODING_UTF_8:
+    return CHARSET_UTF_8;
+
+  default:
+    return CHARSET_SHIFT_JIS;
+  }
 }
 
 static void prop_xml_write_node(struct strbuf *dest, const struct prop *p,
-                                unsigned int indent) {
+                                enum charset cs, unsigned int indent) {
+  struct const_iobuf value;
+  const char *name;
   enum prop_type type;
+  bool has_children;
 
   assert(dest != NULL);
   assert(p != NULL);
 
+  name = prop_get_name(p);
   type = prop_get_type(p);
+  prop_borrow_value(p, &value);
+  has_children = prop_get_first_child_const(p) != NULL;
 
-  if (type == PROP_VOID) {
-    prop_xml_write_void(dest, p, indent);
-  } else {
-    prop_xml_write_nonvoid(dest, p, indent);
+  prop_xml_write_start_tag(dest, name, type, &value, cs, has_children, indent);
+  prop_xml_write_attr_list(dest, p, cs);
+  prop_xml_write_start_tag_end(dest, name, type, &value, cs, has_children);
+
+  if (has_children) {
+    prop_xml_write_children(dest, p, cs, indent + 1);
+    prop_xml_write_close_tag(dest, name, indent);
   }
 }
 
-static void prop_xml_write_void(struct strbuf *dest, const struct prop *p,
-                                unsigned int indent) {
-  const struct prop *first_child;
+/* Mirrors prop_xml_write_node(), but looks for a node with enough children
+   to be worth splitting up, which for a typical DB prop is the root or its
+   only child. Everything on the way there is written out serially. */
+
+static int prop_xml_write_node_parallel(struct strbuf *dest,
+                                        const struct prop *p, enum charset cs,
+                                        unsigned int indent,
+                                        unsigned int nthreads) {
+  const struct prop *child;
+  struct const_iobuf value;
   const char *name;
+  enum prop_type type;
+  size_t nchildren;
+  int r;
 
   assert(dest != NULL);
   assert(p != NULL);
 
+  nchildren = 0;
+
+  for (child = prop_get_first_child_const(p); child != NULL;
+       child = prop_get_next_sibling_const(child)) {
+    nchildren++;
+  }
+
+  if (nchildren == 0) {
+    prop_xml_write_node(dest, p, cs, indent);
+
+    return dest->error;
+  }
+
   name = prop_get_name(p);
+  type = prop_get_type(p);
+  prop_borrow_value(p, &value);
 
-  prop_xml_write_indent(dest, indent);
-  strbuf_printf(dest, "<%s", name);
-  prop_xml_write_attr_list(dest, p);
+  prop_xml_write_start_tag(dest, name, type, &value, cs, true, indent);
+  prop_xml_write_attr_list(dest, p, cs);
+  prop_xml_write_start_tag_end(dest, name, type, &value, cs, true);
 
-  first_child = prop_get_first_child_const(p);
+  if (nchildren >= PROP_XML_PARALLEL_MIN) {
+    r = prop_xml_write_children_parallel(dest, p, nchildren, cs, indent + 1,
+                                         nthreads);
 
-  if (first_child != NULL) {
-    strbuf_puts(dest, ">\n");
-    prop_xml_write_children(dest, p, indent + 1);
-    prop_xml_write_indent(dest, indent);
-    strbuf_printf(dest, "</%s>\n", name);
+    if (r < 0) {
+      return r;
+    }
   } else {
-    strbuf_puts(dest, "/>\n");
+    for (child = prop_get_first_child_const(p); child != NULL;
+         child = prop_get_next_sibling_const(child)) {
+      r = prop_xml_write_node_parallel(dest, child, cs, indent + 1, nthreads);
+
+      if (r < 0) {
+        return r;
+      }
+    }
   }
+
+  prop_xml_write_close_tag(dest, name, indent);
+
+  return dest->error;
+}
+
+/* Children are handed out in rounds of a few chunks per thread. Each chunk
+   gets its own growable buffer, which is kept for the next round once its
+   contents have been copied to dest. */
+
+static int prop_xml_write_children_parallel(struct strbuf *dest,
+                                            const struct prop *p,
+                                            size_t nchildren, enum charset cs,
+                                            unsigned int indent,
+                                            unsigned int nthreads) {
+  struct prop_xml_batch b;
+  const struct prop *child;
+  size_t max_chunks;
+  size_t nchunks;
+  size_t i;
+  int r;
+
+  assert(dest != NULL);
+  assert(p != NULL);
+
+  b.nchildren = nchildren;
+  max_chunks = (size_t)nthreads * PROP_XML_PARALLEL_NCHUNKS;
+  b.children = malloc(b.nchildren * sizeof(*b.children));
+  b.bufs = malloc(max_chunks * sizeof(*b.bufs));
+  b.cs = cs;
+  b.indent = indent;
+
+  if (b.children == NULL || b.bufs == NULL) {
+    free(b.bufs);
+    free(b.children);
+
+    return -ENOMEM;
+  }
+
+  i = 0;
+
+  for (child = prop_get_first_child_const(p); child != NULL;
+       child = prop_get_next_sibling_const(child)) {
+    b.children[i++] = child;
+  }
+
+  for (i = 0; i < max_chunks; i++) {
+    strbuf_init(&b.bufs[i]);
+  }
+
+  r = 0;
+
+  for (b.first = 0; b.first < b.nchildren;
+       b.first += nchunks * PROP_XML_PARALLEL_GRAIN) {
+    nchunks = (b.nchildren - b.first + PROP_XML_PARALLEL_GRAIN - 1) /
+              PROP_XML_PARALLEL_GRAIN;
+
+    if (nchunks > max_chunks) {
+      nchunks = max_chunks;
+    }
+
+    r = work_run(nthreads, nchunks, 1, prop_xml_batch_format, &b);
+
+    if (r < 0) {
+      goto end;
+    }
+
+    for (i = 0; i < nchunks; i++) {
+      strbuf_putn(dest, b.bufs[i].chars, b.bufs[i].pos);
+    }
+
+    r = dest->error;
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+end:
+  for (i = 0; i < max_chunks; i++) {
+    free(b.bufs[i].chars);
+  }
+
+  free(b.bufs);
+  free(b.children);
+
+  return r;
+}
+
+static int prop_xml_batch_format(void *ctx, size_t begin, size_t end) {
+  struct prop_xml_batch *b;
+  struct strbuf *buf;
+  size_t first;
+  size_t last;
+  size_t i;
+  size_t j;
+
+  b = ctx;
+
+  for (i = begin; i < end; i++) {
+    first = b->first + i * PROP_XML_PARALLEL_GRAIN;
+    last = first + PROP_XML_PARALLEL_GRAIN;
+
+    if (last > b->nchildren) {
+      last = b->nchildren;
+    }
+
+    buf = &b->bufs[i];
+    buf->pos = 0;
+
+    for (j = first; j < last; j++) {
+      prop_xml_write_node(buf, b->children[j], b->cs, b->indent);
+    }
+
+    if (buf->error < 0) {
+      return buf->error;
+    }
+  }
+
+  return 0;
 }
 
 /* AVS doesn't understand this __value attribute here, this is my own
    invention, but generally we don't see any property pages with mixed content
    nodes being stored in XML format to begin with. */
 
-static void prop_xml_write_nonvoid(struct strbuf *dest, const struct prop *p,
-                                   unsigned int indent) {
-  const struct prop *first_child;
-  const char *name;
-  const char *type_str;
-  enum prop_type type;
+static void prop_xml_write_start_tag(struct strbuf *dest, const char *name,
+                                     enum prop_type type,
+                                     const struct const_iobuf *value,
+                                     enum charset cs, bool has_children,
+                                     unsigned int indent) {
+  unsigned long count;
 
   assert(dest != NULL);
-  assert(p != NULL);
-
-  name = prop_get_name(p);
-  type = prop_get_type(p);
-  type_str = prop_type_to_string(type);
+  assert(name != NULL);
+  assert(value != NULL);
 
   prop_xml_write_indent(dest, indent);
-  strbuf_printf(dest, "<%s __type=\"%s\"", name, type_str);
 
-  if (prop_type_is_array(type)) {
-    strbuf_printf(dest, " __count=\"%lu\"", (unsigned long)prop_get_count(p));
+  if (type == PROP_VOID) {
+    strbuf_printf(dest, "<%s", name);
+
+    return;
   }
 
-  first_child = prop_get_first_child_const(p);
+  strbuf_printf(dest, "<%s __type=\"%s\"", name, prop_type_to_string(type));
+
+  if (prop_type_is_array(type)) {
+    count = value->nbytes / prop_type_to_size(type);
+    strbuf_printf(dest, " __count=\"%lu\"", count);
+  }
 
-  if (first_child != NULL) {
+  if (has_children) {
     strbuf_puts(dest, " __value=\"");
-    prop_xml_write_text(dest, p, PROP_XML_ESCAPE_ATTR);
+    prop_xml_write_text(dest, type, value, cs, PROP_XML_ESCAPE_ATTR);
     strbuf_putc(dest, '"');
+  }
+}
 
-    prop_xml_write_attr_list(dest, p);
-    strbuf_puts(dest, ">\n");
-
-    prop_xml_write_children(dest, p, indent + 1);
+static void prop_xml_write_start_tag_end(struct strbuf *dest, const char *name,
+                                         enum prop_type type,
+                                         const struct const_iobuf *value,
+                                         enum charset cs, bool has_children) {
+  assert(dest != NULL);
+  assert(name != NULL);
+  assert(value != NULL);
 
-    prop_xml_write_indent(dest, indent);
-    strbuf_printf(dest, "</%s>\n", name);
+  if (has_children) {
+    strbuf_puts(dest, ">\n");
+  } else if (type == PROP_VOID) {
+    strbuf_puts(dest, "/>\n");
   } else {
-    prop_xml_write_attr_list(dest, p);
     strbuf_putc(dest, '>');
-
-    prop_xml_write_text(dest, p, PROP_XML_ESCAPE_TEXT);
-
+    prop_xml_write_text(dest, type, value, cs, PROP_XML_ESCAPE_TEXT);
     strbuf_printf(dest, "</%s>\n", name);
   }
 }
 
+static void prop_xml_write_close_tag(struct strbuf *dest, const char *name,
+                                     unsigned int indent) {
+  assert(dest != NULL);
+  assert(name != NULL);
+
+  prop_xml_write_indent(dest, indent);
+  strbuf_printf(dest, "</%s>\n", name);
+}
+
 static void prop_xml_write_children(struct strbuf *dest, const struct prop *p,
-                                    unsigned int indent) {
+                                    enum charset cs, unsigned int indent) {
   const struct prop *child;
 
   assert(dest != NULL);
@@ -196,76 +527,99 @@ static void prop_xml_write_children(struct strbuf *dest, const struct prop *p,
 
   for (child = prop_get_first_child_const(p); child != NULL;
        child = prop_get_next_sibling_const(child)) {
-    prop_xml_write_node(dest, child, indent);
+    prop_xml_write_node(dest, child, cs, indent);
   }
 }
 
-static void prop_xml_write_attr_list(struct strbuf *dest,
-                                     const struct prop *p) {
+static void prop_xml_write_attr_list(struct strbuf *dest, const struct prop *p,
+                                     enum charset cs) {
   const struct attr *a;
-  const char *attr_key;
-  const char *attr_val;
 
   assert(dest != NULL);
   assert(p != NULL);
 
   for (a = prop_get_first_attr(p); a != NULL; a = attr_get_next_sibling(a)) {
-    attr_key = attr_get_key(a);
-    attr_val = attr_get_val(a);
-
-    strbuf_printf(dest, " %s=\"", attr_key);
-    prop_xml_write_escaped_string(dest, attr_val, PROP_XML_ESCAPE_ATTR);
-    strbuf_putc(dest, '"');
+    prop_xml_write_attr(dest, attr_get_key(a), attr_get_val(a), cs);
   }
 }
 
+static void prop_xml_write_attr(struct strbuf *dest, const char *key,
+                                const char *val, enum charset cs) {
+  assert(dest != NULL);
+  assert(key != NULL);
+  assert(val != NULL);
+
+  strbuf_printf(dest, " %s=\"", key);
+  prop_xml_write_escaped_string(dest, val, strlen(val), cs,
+                                PROP_XML_ESCAPE_ATTR);
+  strbuf_putc(dest, '"');
+}
+
+/* Strings get transcoded to UTF-8 on their way out. prop_xml_plain_span()
+   finds the longest run of ASCII that needs neither transcoding nor
+   escaping, which gets copied out in one go. Whatever stops the run is then
+   either escaped or, if it's not ASCII, sent through the charset decoder one
+   character at a time. None of the supported multi-byte encodings use bytes
+   below 0x40 inside a character, so no escapable character can be hidden in
+   one. */
+
 static void prop_xml_write_escaped_string(struct strbuf *dest, const char *str,
+                                          size_t nchars, enum charset cs,
                                           enum prop_xml_escape ctx) {
-  const char *pos;
-  char c;
+  size_t pos;
+  size_t end;
+  uint32_t c;
 
   assert(dest != NULL);
   assert(str != NULL);
 
-  for (pos = str; *pos != '\0'; pos++) {
-    c = *pos;
+  pos = 0;
+
+  while (pos < nchars) {
+    end = pos + prop_xml_plain_span(str + pos, nchars - pos, ctx);
+    strbuf_putn(dest, str + pos, end - pos);
+    pos = end;
 
-    switch (c) {
+    if (pos == nchars) {
+      break;
+    }
+
+    switch (str[pos]) {
     case '<':
       strbuf_puts(dest, "&lt;");
+      pos++;
 
       break;
 
     case '>':
       strbuf_puts(dest, "&gt;");
+      pos++;
 
       break;
 
     case '&':
       strbuf_puts(dest, "&amp;");
+      pos++;
 
       break;
 
+    /* Quotes only end a span in attribute values */
+
     case '\'':
-      if (ctx == PROP_XML_ESCAPE_ATTR) {
-        strbuf_puts(dest, "&apos;");
-      } else {
-        strbuf_putc(dest, c);
-      }
+      strbuf_puts(dest, "&apos;");
+      pos++;
 
       break;
 
     case '"':
-      if (ctx == PROP_XML_ESCAPE_ATTR) {
-        strbuf_puts(dest, "&quot;");
-      } else {
-        strbuf_putc(dest, c);
-      }
+      strbuf_puts(dest, "&quot;");
+      pos++;
 
       break;
 
     default:
-      strbuf_putc(dest, c);
+      pos += charset_decode(cs, &c, str + pos, nchars - pos);
+      charset_put_utf8(dest, c);
 
       break;
     }
@@ -282,378 +636,418 @@ static void prop_xml_write_indent(struct strbuf *dest, unsigned int indent) {
   }
 }
 
-static void prop_xml_write_text(struct strbuf *dest, const struct prop *p,
-                                enum prop_xml_escape ctx) {
-  struct const_iobuf value;
-  struct const_iobuf item;
-  enum prop_type type;
-  uint32_t count;
-  uint32_t i;
-  int item_size;
-  int r;
+/* Returns the length of the run of chars at the start of the string that can
+   be copied out as-is: ASCII other than markup characters, and other than
+   quotes in attribute values. */
 
-  type = prop_get_type(p);
-  prop_borrow_value(p, &value);
+static size_t prop_xml_plain_span(const char *str, size_t nchars,
+                                  enum prop_xml_escape ctx) {
+  const uint8_t *bytes;
+  size_t i;
+  uint8_t c;
 
-  if (prop_type_is_array(type)) {
-    item_size = prop_type_to_size(type);
-    count = prop_get_count(p);
+  assert(str != NULL || nchars == 0);
 
-    assert(item_size > 0);
+  bytes = (const uint8_t *)str;
+  i = 0;
 
-    for (i = 0; i < count; i++) {
-      if (i > 0) {
-        strbuf_putc(dest, ' ');
-      }
+#ifdef PROP_XML_X86
+  if (nchars >= 16) {
+    if (ctx == PROP_XML_ESCAPE_ATTR) {
+      i = prop_xml_plain_span_simd(bytes, nchars, '"', '\'');
+    } else {
+      i = prop_xml_plain_span_simd(bytes, nchars, '<', '<');
+    }
+  }
+#endif
 
-      r = iobuf_slice(&item, &value, item_size);
+  for (; i < nchars; i++) {
+    c = bytes[i];
 
-      assert(r >= 0);
+    if (c >= 0x80 || c == '<' || c == '>' || c == '&') {
+      break;
+    }
 
-      prop_xml_write_text_element(dest, type, &item, ctx);
+    if (ctx == PROP_XML_ESCAPE_ATTR && (c == '"' || c == '\'')) {
+      break;
     }
-  } else {
-    prop_xml_write_text_element(dest, type, &value, ctx);
   }
-}
 
-static void prop_xml_write_text_element(struct strbuf *dest,
-                                        enum prop_type type,
-                                        struct const_iobuf *src,
-                                        enum prop_xml_escape ctx) {
-  type &= ~PROP_ARRAY_FLAG;
+  return i;
+}
 
-  switch (type) {
-  case PROP_S8:
-    prop_xml_write_text_s8(dest, src);
+/* I don't know how tuples are actually serialized to XML, the real format
+   might be different. */
 
-    break;
+static void prop_xml_write_text(struct strbuf *dest, enum prop_type type,
+                                const struct const_iobuf *value,
+                                enum charset cs, enum prop_xml_escape ctx) {
+  assert(dest != NULL);
+  assert(value != NULL);
 
-  case PROP_S16:
-    prop_xml_write_text_s16(dest, src);
+  /* Only strs can hold anything that needs escaping */
 
-    break;
+  if (type == PROP_STR) {
+    prop_xml_write_escaped_string(dest, (const char *)value->bytes + value->pos,
+                                  prop_type_str_len(value), cs, ctx);
+  } else {
+    prop_type_format_value(dest, type, value, cs, PROP_TYPE_SYNTAX_XML);
+  }
+}
 
-  case PROP_S32:
-    prop_xml_write_text_s32(dest, src);
+/* The streaming writer receives one node at a time and doesn't know whether
+   a node has any children until either its first child or its end event shows
+   up. Start tags are therefore held back until then, along with whatever
+   attributes arrive in the meantime. Output goes through a fixed-size buffer
+   that gets written out whenever it fills up and once the root node ends, so
+   memory use is governed by nesting depth rather than by the size of the
+   document. */
 
-    break;
+int prop_xml_stream_alloc(struct prop_xml_stream **out, FILE *f) {
+  struct prop_xml_stream *s;
+  char *chars;
 
-  case PROP_S64:
-    prop_xml_write_text_s64(dest, src);
+  assert(out != NULL);
+  assert(f != NULL);
 
-    break;
+  *out = NULL;
+  s = calloc(1, sizeof(*s));
+  chars = malloc(PROP_XML_SINK_NCHARS);
 
-  case PROP_U8:
-    prop_xml_write_text_u8(dest, src);
+  if (s == NULL || chars == NULL) {
+    free(chars);
+    free(s);
 
-    break;
+    return -ENOMEM;
+  }
 
-  case PROP_U16:
-    prop_xml_write_text_u16(dest, src);
+  s->cs = prop_xml_charset(PROP_ENCODING_SHIFT_JIS);
+  strbuf_init_sink(&s->out, f, chars, PROP_XML_SINK_NCHARS);
+  *out = s;
 
-    break;
+  return 0;
+}
 
-  case PROP_U32:
-    prop_xml_write_text_u32(dest, src);
+void prop_xml_stream_free(struct prop_xml_stream *s) {
+  size_t i;
 
-    break;
+  if (s == NULL) {
+    return;
+  }
 
-  case PROP_U64:
-    prop_xml_write_text_u64(dest, src);
+  for (i = 0; i < s->max_frames; i++) {
+    free(s->frames[i].name);
+  }
 
-    break;
+  free(s->frames);
+  free(s->attrs);
+  free(s->out.chars);
+  free(s);
+}
 
-  case PROP_BIN:
-    prop_xml_write_text_bin(dest, src);
+void prop_xml_stream_set_encoding(struct prop_xml_stream *s,
+                                  enum prop_encoding encoding) {
+  assert(s != NULL);
+  assert(s->nframes == 0);
 
-    break;
+  s->cs = prop_xml_charset(encoding);
+}
 
-  case PROP_STR:
-    prop_xml_write_text_str(dest, src, ctx);
+int prop_xml_stream_begin_node(struct prop_xml_stream *s, const char *name,
+                               enum prop_type type,
+                               const struct const_iobuf *value) {
+  struct prop_xml_stream_frame *frames;
+  struct prop_xml_stream_frame *frame;
+  size_t max_frames;
+  size_t len;
+  char *chars;
+  int r;
 
-    break;
+  assert(s != NULL);
+  assert(name != NULL);
+  assert(value != NULL);
 
-  case PROP_IP4:
-    prop_xml_write_text_ip4(dest, src);
+  r = prop_xml_stream_open_parent(s);
 
-    break;
+  if (r < 0) {
+    return r;
+  }
 
-  case PROP_TIME:
-    /* Reuse the u32 writer for timestamps */
-    prop_xml_write_text_u32(dest, src);
+  if (s->nframes == s->max_frames) {
+    max_frames = s->max_frames != 0 ? s->max_frames * 2 : 16;
+    frames = realloc(s->frames, max_frames * sizeof(*frames));
 
-    break;
+    if (frames == NULL) {
+      return -ENOMEM;
+    }
 
-  case PROP_2U16:
-    prop_xml_write_text_u16_tuple(dest, src, 2);
+    memset(&frames[s->max_frames], 0,
+           (max_frames - s->max_frames) * sizeof(*frames));
 
-    break;
+    s->frames = frames;
+    s->max_frames = max_frames;
+  }
 
-  case PROP_3S32:
-    prop_xml_write_text_s32_tuple(dest, src, 3);
+  /* Frames (and their name buffers) get recycled between siblings */
 
-    break;
+  frame = &s->frames[s->nframes];
+  len = strlen(name);
 
-  case PROP_4U16:
-    prop_xml_write_text_u16_tuple(dest, src, 4);
+  if (len + 1 > frame->max_name) {
+    chars = realloc(frame->name, len + 1);
 
-    break;
+    if (chars == NULL) {
+      return -ENOMEM;
+    }
 
-  case PROP_BOOL:
-    prop_xml_write_text_bool(dest, src);
+    frame->name = chars;
+    frame->max_name = len + 1;
+  }
 
-    break;
+  memcpy(frame->name, name, len + 1);
+  frame->type = type;
+  frame->value = *value;
+  frame->is_open = false;
 
-  default:
-    log_write("Unsupported type: %#x", type);
+  s->nframes++;
+  s->attrs_nchars = 0;
 
-    abort();
-  }
+  return 0;
 }
 
-static void prop_xml_write_text_s8(struct strbuf *dest,
-                                   struct const_iobuf *src) {
-  uint8_t value;
-  int r;
-
-  assert(dest != NULL);
-  assert(src != NULL);
+int prop_xml_stream_attr(struct prop_xml_stream *s, const char *key,
+                         const char *val) {
+  struct prop_xml_stream_frame *frame;
+  size_t key_nchars;
+  size_t val_nchars;
+  size_t nchars;
+  size_t max_nchars;
+  char *chars;
 
-  r = iobuf_read_8(src, &value);
+  assert(s != NULL);
+  assert(s->nframes > 0);
+  assert(key != NULL);
+  assert(val != NULL);
 
-  assert(r >= 0);
+  frame = &s->frames[s->nframes - 1];
 
-  strbuf_printf(dest, "%i", (int8_t)value);
-}
+  if (frame->is_open) {
+    log_write("\"%s\": Attribute @%s follows a child node", frame->name, key);
 
-static void prop_xml_write_text_s16(struct strbuf *dest,
-                                    struct const_iobuf *src) {
-  uint16_t value;
-  int r;
-
-  assert(dest != NULL);
-  assert(src != NULL);
+    return -ENOTSUP;
+  }
 
-  r = iobuf_read_be16(src, &value);
+  key_nchars = strlen(key) + 1;
+  val_nchars = strlen(val) + 1;
+  nchars = s->attrs_nchars + key_nchars + val_nchars;
 
-  assert(r >= 0);
+  if (nchars > s->max_attrs_nchars) {
+    max_nchars = s->max_attrs_nchars != 0 ? s->max_attrs_nchars : 256;
 
-  strbuf_printf(dest, "%i", (int16_t)value);
-}
+    while (max_nchars < nchars) {
+      max_nchars *= 2;
+    }
 
-static void prop_xml_write_text_s32(struct strbuf *dest,
-                                    struct const_iobuf *src) {
-  uint32_t value;
-  int r;
+    chars = realloc(s->attrs, max_nchars);
 
-  assert(dest != NULL);
-  assert(src != NULL);
+    if (chars == NULL) {
+      return -ENOMEM;
+    }
 
-  r = iobuf_read_be32(src, &value);
+    s->attrs = chars;
+    s->max_attrs_nchars = max_nchars;
+  }
 
-  assert(r >= 0);
+  memcpy(s->attrs + s->attrs_nchars, key, key_nchars);
+  s->attrs_nchars += key_nchars;
+  memcpy(s->attrs + s->attrs_nchars, val, val_nchars);
+  s->attrs_nchars += val_nchars;
 
-  strbuf_printf(dest, "%i", (int32_t)value);
+  return 0;
 }
 
-static void prop_xml_write_text_s64(struct strbuf *dest,
-                                    struct const_iobuf *src) {
-  uint64_t value;
+int prop_xml_stream_end_node(struct prop_xml_stream *s) {
+  struct prop_xml_stream_frame *frame;
   int r;
 
-  assert(dest != NULL);
-  assert(src != NULL);
-
-  r = iobuf_read_be64(src, &value);
-
-  assert(r >= 0);
+  assert(s != NULL);
+  assert(s->nframes > 0);
 
-  strbuf_printf(dest, "%lli", (long long)value);
-}
+  frame = &s->frames[s->nframes - 1];
 
-static void prop_xml_write_text_u8(struct strbuf *dest,
-                                   struct const_iobuf *src) {
-  uint8_t value;
-  int r;
+  if (frame->is_open) {
+    r = prop_xml_stream_emit(s, prop_xml_stream_format_close);
+  } else {
+    r = prop_xml_stream_emit(s, prop_xml_stream_format_element);
+  }
 
-  assert(dest != NULL);
-  assert(src != NULL);
+  if (r < 0) {
+    return r;
+  }
 
-  r = iobuf_read_8(src, &value);
+  s->nframes--;
+  s->attrs_nchars = 0;
 
-  assert(r >= 0);
+  if (s->nframes == 0) {
+    return strbuf_flush(&s->out);
+  }
 
-  strbuf_printf(dest, "%i", value);
+  return 0;
 }
 
-static void prop_xml_write_text_u16(struct strbuf *dest,
-                                    struct const_iobuf *src) {
-  uint16_t value;
+static int prop_xml_stream_open_parent(struct prop_xml_stream *s) {
+  struct prop_xml_stream_frame *frame;
   int r;
 
-  assert(dest != NULL);
-  assert(src != NULL);
+  assert(s != NULL);
 
-  r = iobuf_read_be16(src, &value);
+  if (s->nframes == 0) {
+    return 0;
+  }
 
-  assert(r >= 0);
+  frame = &s->frames[s->nframes - 1];
 
-  strbuf_printf(dest, "%u", value);
-}
+  if (frame->is_open) {
+    return 0;
+  }
 
-static void prop_xml_write_text_u32(struct strbuf *dest,
-                                    struct const_iobuf *src) {
-  uint32_t value;
-  int r;
+  r = prop_xml_stream_emit(s, prop_xml_stream_format_open);
 
-  assert(dest != NULL);
-  assert(src != NULL);
-
-  r = iobuf_read_be32(src, &value);
+  if (r < 0) {
+    return r;
+  }
 
-  assert(r >= 0);
+  frame->is_open = true;
 
-  strbuf_printf(dest, "%u", value);
+  return 0;
 }
 
-static void prop_xml_write_text_u64(struct strbuf *dest,
-                                    struct const_iobuf *src) {
-  uint64_t value;
-  int r;
-
-  assert(dest != NULL);
-  assert(src != NULL);
-
-  r = iobuf_read_be64(src, &value);
+static int prop_xml_stream_emit(struct prop_xml_stream *s,
+                                prop_xml_stream_format_t format) {
+  assert(s != NULL);
+  assert(format != NULL);
 
-  assert(r >= 0);
+  format(&s->out, s);
 
-  strbuf_printf(dest, "%llu", (unsigned long long)value);
+  return s->out.error;
 }
 
-static void prop_xml_write_text_bin(struct strbuf *dest,
-                                    struct const_iobuf *src) {
-  uint8_t byte;
-  uint8_t nibble;
-  uint8_t nibbles[2];
-  size_t i;
-  size_t j;
-  char c;
+static void prop_xml_stream_format_start_tag(struct strbuf *dest,
+                                             const struct prop_xml_stream *s,
+                                             bool has_children) {
+  const struct prop_xml_stream_frame *frame;
+  const char *key;
+  const char *val;
+  size_t pos;
 
   assert(dest != NULL);
-  assert(src != NULL);
+  assert(s != NULL);
+  assert(s->nframes > 0);
 
-  for (i = src->pos; i < src->nbytes; i++) {
-    byte = src->bytes[i];
-    nibbles[0] = byte >> 4;
-    nibbles[1] = byte & 0x0f;
+  frame = &s->frames[s->nframes - 1];
 
-    for (j = 0; j < 2; j++) {
-      nibble = nibbles[j];
+  prop_xml_write_start_tag(dest, frame->name, frame->type, &frame->value, s->cs,
+                           has_children, s->nframes - 1);
 
-      if (nibble < 10) {
-        c = '0' + nibble;
-      } else {
-        c = 'a' + (nibble - 10);
-      }
+  for (pos = 0; pos < s->attrs_nchars;) {
+    key = s->attrs + pos;
+    pos += strlen(key) + 1;
+    val = s->attrs + pos;
+    pos += strlen(val) + 1;
 
-      strbuf_putc(dest, c);
-    }
+    prop_xml_write_attr(dest, key, val, s->cs);
   }
 
-  src->pos = i;
+  prop_xml_write_start_tag_end(dest, frame->name, frame->type, &frame->value,
+                               s->cs, has_children);
 }
 
-static void prop_xml_write_text_str(struct strbuf *dest,
-                                    struct const_iobuf *src,
-                                    enum prop_xml_escape ctx) {
-  const char *chars;
-  size_t nchars;
-
-  assert(dest != NULL);
-  assert(src != NULL);
-  assert(src->pos <= src->nbytes);
-
-  chars = (const char *)&src->bytes[src->pos];
-  nchars = src->nbytes - src->pos;
-
-  assert(chars[nchars - 1] == '\0');
-
-  prop_xml_write_escaped_string(dest, chars, ctx);
-  src->pos += nchars;
+static void prop_xml_stream_format_open(struct strbuf *dest,
+                                        const struct prop_xml_stream *s) {
+  prop_xml_stream_format_start_tag(dest, s, true);
 }
 
-static void prop_xml_write_text_ip4(struct strbuf *dest,
-                                    struct const_iobuf *src) {
-  const uint8_t *b;
+static void prop_xml_stream_format_element(struct strbuf *dest,
+                                           const struct prop_xml_stream *s) {
+  prop_xml_stream_format_start_tag(dest, s, false);
+}
 
+static void prop_xml_stream_format_close(struct strbuf *dest,
+                                         const struct prop_xml_stream *s) {
   assert(dest != NULL);
-  assert(src != NULL);
-  assert(src->pos + 4 <= src->nbytes);
+  assert(s != NULL);
+  assert(s->nframes > 0);
 
-  b = src->bytes + src->pos;
-  strbuf_printf(dest, "%i.%i.%i.%i", b[0], b[1], b[2], b[3]);
+  prop_xml_write_close_tag(dest, s->frames[s->nframes - 1].name,
+                           s->nframes - 1);
 }
 
-static void prop_xml_write_text_bool(struct strbuf *dest,
-                                     struct const_iobuf *src) {
-  assert(dest != NULL);
-  assert(src != NULL);
-  assert(src->pos < src->nbytes);
+#ifdef PROP_XML_X86
 
-  if (src->bytes[src->pos]) {
-    strbuf_putc(dest, '1');
+/* These return the offset of the first special byte, or the end of the last
+   whole block if there isn't one. Text content passes '<' in place of the
+   quote characters, which it doesn't escape. */
+
+static size_t prop_xml_plain_span_simd(const uint8_t *bytes, size_t nbytes,
+                                       char quot, char apos) {
+  if (__builtin_cpu_supports("avx2")) {
+    return prop_xml_plain_span_avx2(bytes, nbytes, quot, apos);
+  } else if (__builtin_cpu_supports("sse2")) {
+    return prop_xml_plain_span_sse2(bytes, nbytes, quot, apos);
   } else {
-    strbuf_putc(dest, '0');
+    return 0;
   }
 }
 
-/* I don't know how tuples are actually serialized to XML, the real format
-   might be different. */
-
-static void prop_xml_write_text_s32_tuple(struct strbuf *dest,
-                                          struct const_iobuf *src,
-                                          size_t count) {
-  uint32_t value;
+static size_t prop_xml_plain_span_sse2(const uint8_t *bytes, size_t nbytes,
+                                       char quot, char apos) {
+  __m128i v;
+  __m128i m;
+  unsigned int mask;
   size_t i;
-  int r;
 
-  assert(dest != NULL);
-  assert(src != NULL);
-
-  for (i = 0; i < count; i++) {
-    if (i > 0) {
-      strbuf_putc(dest, ',');
-    }
+  for (i = 0; i + 16 <= nbytes; i += 16) {
+    v = _mm_loadu_si128((const __m128i *)(bytes + i));
+    m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(quot)));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(apos)));
 
-    r = iobuf_read_be32(src, &value);
+    /* Non-ASCII bytes already have their top bit set */
 
-    assert(r >= 0);
+    mask = _mm_movemask_epi8(_mm_or_si128(m, v));
 
-    strbuf_printf(dest, "%i", (int32_t)value);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
   }
+
+  return i;
 }
 
-static void prop_xml_write_text_u16_tuple(struct strbuf *dest,
-                                          struct const_iobuf *src,
-                                          size_t count) {
-  uint16_t value;
+static size_t prop_xml_plain_span_avx2(const uint8_t *bytes, size_t nbytes,
+                                       char quot, char apos) {
+  __m256i v;
+  __m256i m;
+  unsigned int mask;
   size_t i;
-  int r;
 
-  assert(dest != NULL);
-  assert(src != NULL);
-
-  for (i = 0; i < count; i++) {
-    if (i > 0) {
-      strbuf_putc(dest, ',');
+  for (i = 0; i + 32 <= nbytes; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *)(bytes + i));
+    m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(quot)));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(apos)));
+    mask = _mm256_movemask_epi8(_mm256_or_si256(m, v));
+
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
     }
-
-    r = iobuf_read_be16(src, &value);
-
-    assert(r >= 0);
-
-    strbuf_printf(dest, "%u", value);
   }
+
+  return i + prop_xml_plain_span_sse2(bytes + i, nbytes - i, quot, apos);
 }
+
+#endif
@@ -1,5 +1,48 @@
 #pragma once
 
+#include <stdio.h>
+
+#include "573file/prop-type.h"
 #include "573file/prop.h"
 
+#include "util/iobuf.h"
+
+struct prop_xml_stream;
+
 int prop_xml_write(const struct prop *p, char **out);
+
+/* Same as prop_xml_write(), but writes to a file a bufferful at a time. */
+
+int prop_xml_write_file(const struct prop *p, FILE *f);
+
+/* Same output as prop_xml_write_file(), but nodes with at least
+   PROP_XML_PARALLEL_MIN children have them formatted in chunks on up to
+   nthreads threads, or one per CPU if nthreads is 0. Chunks are written out
+   in order a few at a time, so only a handful of them are held in memory. */
+
+#define PROP_XML_PARALLEL_MIN 256
+
+int prop_xml_write_file_parallel(const struct prop *p, FILE *f,
+                                 unsigned int nthreads);
+
+/* Formats a single value the same way it appears as an element's text. The
+   encoding is that of the document the value came from. */
+
+int prop_xml_format_value(enum prop_type type, enum prop_encoding encoding,
+                          const struct const_iobuf *value, char **out);
+
+/* Event-driven counterpart to prop_xml_write_file(). Output is only
+   guaranteed to have reached the file once the root node has ended. Node
+   values are borrowed, and must stay valid until the next event. Strings are
+   assumed to be Shift-JIS unless the encoding is set before the first node. */
+
+int prop_xml_stream_alloc(struct prop_xml_stream **s, FILE *f);
+void prop_xml_stream_free(struct prop_xml_stream *s);
+void prop_xml_stream_set_encoding(struct prop_xml_stream *s,
+                                  enum prop_encoding encoding);
+int prop_xml_stream_begin_node(struct prop_xml_stream *s, const char *name,
+                               enum prop_type type,
+                               const struct const_iobuf *value);
+int prop_xml_stream_attr(struct prop_xml_stream *s, const char *key,
+                         const char *val);
+int prop_xml_stream_end_node(struct prop_xml_stream *s);
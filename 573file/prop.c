@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -7,35 +8,92 @@
 #include "573file/prop-type.h"
 #include "573file/prop.h"
 
+#include "util/bswap.h"
 #include "util/list.h"
 #include "util/log.h"
 #include "util/macro.h"
 #include "util/str.h"
 
+/* Nodes get a hash index of their children (or attributes) as soon as they
+   have this many of them. Indexes are only ever built or updated by the
+   functions that add to a node, so that searching a finished tree never
+   writes to it. */
+
+#define PROP_INDEX_MIN_CHILDREN 16
+#define PROP_INDEX_MIN_ATTRS 8
+
 struct attr {
   struct list_node node;
   char *key;
   char *val;
+  uint32_t key_hash;
+};
+
+/* Children that share a name are chained together through their
+   next_same_name pointers, which are only meaningful while the parent has a
+   child index. */
+
+struct prop_child_slot {
+  struct prop *first;
+  struct prop *last;
+  uint32_t hash;
+};
+
+struct prop_child_index {
+  struct prop_child_slot *slots;
+  uint32_t nslots;
+  uint32_t nused;
+};
+
+struct prop_attr_index {
+  struct attr **slots;
+  uint32_t nslots;
+  uint32_t nused;
 };
 
 struct prop {
   struct list_node node;
   struct prop *parent;
+  struct prop *next_same_name;
   struct list attrs;
   struct list children;
+  struct prop_child_index *child_index;
+  struct prop_attr_index *attr_index;
   char *name;
+  prop_loader_t loader;
+  void *loader_ctx;
+  uint32_t loader_token;
+  uint32_t name_hash;
+  uint32_t nchildren;
+  uint32_t nattrs;
   uint32_t nbytes;
   enum prop_type type;
+  enum prop_encoding encoding;
   uint8_t bytes[];
 };
 
 static int attr_set(struct attr *a, const char *val);
 
-static int prop_validate(const char *name, enum prop_type type,
-                         const void *bytes, uint32_t nbytes);
-
-static int prop_validate(const char *name, enum prop_type type,
-                         const void *bytes, uint32_t nbytes) {
+static int prop_get_array(const struct prop *p, enum prop_type type, void *dest,
+                          uint32_t *nitems);
+static struct attr *prop_find_attr(const struct prop *p, const char *key,
+                                   uint32_t hash);
+static void prop_free_children(struct prop *p);
+static void prop_load_children(const struct prop *p);
+static void prop_index_attrs(struct prop *p);
+static void prop_index_children(struct prop *p);
+static void prop_drop_child_index(struct prop *p);
+static int prop_attr_index_insert(struct prop_attr_index *idx, struct attr *a);
+static struct attr **prop_attr_index_probe(const struct prop_attr_index *idx,
+                                           const char *key, uint32_t hash);
+static int prop_child_index_insert(struct prop_child_index *idx,
+                                   struct prop *child);
+static struct prop_child_slot *
+prop_child_index_probe(const struct prop_child_index *idx, const char *name,
+                       uint32_t hash);
+
+int prop_validate(const char *name, enum prop_type type, const void *bytes,
+                  uint32_t nbytes) {
   const char *chars;
   const char *type_str;
   int item_size;
@@ -125,7 +183,9 @@ int prop_alloc(struct prop **out, const char *name, enum prop_type type,
     goto end;
   }
 
+  p->name_hash = str_hash(name);
   p->type = type;
+  p->encoding = PROP_ENCODING_SHIFT_JIS;
   p->nbytes = nbytes;
 
   memcpy(p->bytes, bytes, nbytes);
@@ -144,18 +204,12 @@ void prop_free(struct prop *p) {
   struct list_node *pos;
   struct list_node *next;
   struct attr *attr;
-  struct prop *child;
 
   if (p == NULL) {
     return;
   }
 
-  for (pos = p->children.head; pos != NULL; pos = next) {
-    next = pos->next;
-    child = containerof(pos, struct prop, node);
-
-    prop_free(child);
-  }
+  prop_free_children(p);
 
   for (pos = p->attrs.head; pos != NULL; pos = next) {
     next = pos->next;
@@ -166,17 +220,99 @@ void prop_free(struct prop *p) {
     free(attr);
   }
 
+  if (p->attr_index != NULL) {
+    free(p->attr_index->slots);
+    free(p->attr_index);
+  }
+
   free(p->name);
   free(p);
 }
 
+static void prop_free_children(struct prop *p) {
+  struct list_node *pos;
+  struct list_node *next;
+  struct prop *child;
+
+  assert(p != NULL);
+
+  for (pos = p->children.head; pos != NULL; pos = next) {
+    next = pos->next;
+    child = containerof(pos, struct prop, node);
+
+    prop_free(child);
+  }
+
+  prop_drop_child_index(p);
+
+  p->children.head = NULL;
+  p->children.tail = NULL;
+  p->nchildren = 0;
+}
+
 void prop_append(struct prop *p, struct prop *child) {
   assert(p != NULL);
+  assert(p->loader == NULL);
   assert(child != NULL);
   assert(child->parent == NULL);
 
   list_append(&p->children, &child->node);
   child->parent = p;
+  p->nchildren++;
+
+  if (p->child_index != NULL) {
+    if (prop_child_index_insert(p->child_index, child) < 0) {
+      /* Not fatal, the next append will try building it from scratch */
+      prop_drop_child_index(p);
+    }
+  } else {
+    prop_index_children(p);
+  }
+}
+
+void prop_defer_children(struct prop *p, prop_loader_t loader, void *ctx,
+                         uint32_t token) {
+  assert(p != NULL);
+  assert(p->children.head == NULL);
+  assert(loader != NULL);
+
+  p->loader = loader;
+  p->loader_ctx = ctx;
+  p->loader_token = token;
+}
+
+/* Deferred children are loaded the first time anybody asks for them, which
+   includes callers that only hold a const pointer. Lazily loaded trees are
+   therefore not safe to share between threads until they have been fully
+   visited. Loaders are expected to validate their data before deferring
+   anything, so the only realistic failure here is running out of memory. We
+   log that, throw away whatever got appended and put the loader back, so the
+   node looks childless for now and the next access tries (and possibly logs)
+   again. */
+
+static void prop_load_children(const struct prop *p) {
+  struct prop *mut;
+  prop_loader_t loader;
+  int r;
+
+  assert(p != NULL);
+
+  if (p->loader == NULL) {
+    return;
+  }
+
+  mut = (struct prop *)p;
+  loader = mut->loader;
+  mut->loader = NULL;
+
+  r = loader(mut->loader_ctx, mut, mut->loader_token);
+
+  if (r < 0) {
+    log_write("\"%s\": Failed to load children: %s (%i)", mut->name,
+              strerror(-r), r);
+    prop_free_children(mut);
+    mut->loader = loader;
+  }
 }
 
 void prop_borrow_value(const struct prop *p, struct const_iobuf *out) {
@@ -189,21 +325,25 @@ void prop_borrow_value(const struct prop *p, struct const_iobuf *out) {
 }
 
 const char *prop_get_attr(const struct prop *p, const char *key) {
-  struct list_node *pos;
+  assert(key != NULL);
+
+  return prop_get_attr_hashed(p, key, str_hash(key));
+}
+
+const char *prop_get_attr_hashed(const struct prop *p, const char *key,
+                                 uint32_t hash) {
   struct attr *a;
 
   assert(p != NULL);
   assert(key != NULL);
 
-  for (pos = p->attrs.head; pos != NULL; pos = pos->next) {
-    a = containerof(pos, struct attr, node);
+  a = prop_find_attr(p, key, hash);
 
-    if (str_eq(key, a->key)) {
-      return a->val;
-    }
+  if (a == NULL) {
+    return NULL;
   }
 
-  return NULL;
+  return a->val;
 }
 
 uint32_t prop_get_count(const struct prop *p) {
@@ -220,6 +360,38 @@ uint32_t prop_get_count(const struct prop *p) {
   return p->nbytes / item_size;
 }
 
+int prop_get_s8_array(const struct prop *p, int8_t *dest, uint32_t *nitems) {
+  return prop_get_array(p, PROP_S8, dest, nitems);
+}
+
+int prop_get_u8_array(const struct prop *p, uint8_t *dest, uint32_t *nitems) {
+  return prop_get_array(p, PROP_U8, dest, nitems);
+}
+
+int prop_get_s16_array(const struct prop *p, int16_t *dest, uint32_t *nitems) {
+  return prop_get_array(p, PROP_S16, dest, nitems);
+}
+
+int prop_get_u16_array(const struct prop *p, uint16_t *dest, uint32_t *nitems) {
+  return prop_get_array(p, PROP_U16, dest, nitems);
+}
+
+int prop_get_s32_array(const struct prop *p, int32_t *dest, uint32_t *nitems) {
+  return prop_get_array(p, PROP_S32, dest, nitems);
+}
+
+int prop_get_u32_array(const struct prop *p, uint32_t *dest, uint32_t *nitems) {
+  return prop_get_array(p, PROP_U32, dest, nitems);
+}
+
+int prop_get_s64_array(const struct prop *p, int64_t *dest, uint32_t *nitems) {
+  return prop_get_array(p, PROP_S64, dest, nitems);
+}
+
+int prop_get_u64_array(const struct prop *p, uint64_t *dest, uint32_t *nitems) {
+  return prop_get_array(p, PROP_U64, dest, nitems);
+}
+
 const struct attr *prop_get_first_attr(const struct prop *p) {
   struct list_node *attr;
 
@@ -239,6 +411,7 @@ struct prop *prop_get_first_child(struct prop *p) {
 
   assert(p != NULL);
 
+  prop_load_children(p);
   child = p->children.head;
 
   if (child == NULL) {
@@ -253,6 +426,7 @@ const struct prop *prop_get_first_child_const(const struct prop *p) {
 
   assert(p != NULL);
 
+  prop_load_children(p);
   child = p->children.head;
 
   if (child == NULL) {
@@ -286,6 +460,12 @@ struct prop *prop_get_parent(struct prop *p) {
   return p->parent;
 }
 
+enum prop_encoding prop_get_encoding(const struct prop *p) {
+  assert(p != NULL);
+
+  return p->encoding;
+}
+
 enum prop_type prop_get_type(const struct prop *p) {
   assert(p != NULL);
 
@@ -305,16 +485,33 @@ struct prop *prop_search_child(struct prop *p, const char *name) {
 
 const struct prop *prop_search_child_const(const struct prop *p,
                                            const char *name) {
+  assert(name != NULL);
+
+  return prop_search_child_hashed_const(p, name, str_hash(name));
+}
+
+const struct prop *prop_search_child_hashed_const(const struct prop *p,
+                                                  const char *name,
+                                                  uint32_t hash) {
+  const struct prop_child_slot *slot;
   struct list_node *pos;
   struct prop *child;
 
   assert(p != NULL);
   assert(name != NULL);
 
+  prop_load_children(p);
+
+  if (p->child_index != NULL) {
+    slot = prop_child_index_probe(p->child_index, name, hash);
+
+    return slot->first;
+  }
+
   for (pos = p->children.head; pos != NULL; pos = pos->next) {
     child = containerof(pos, struct prop, node);
 
-    if (str_eq(child->name, name)) {
+    if (child->name_hash == hash && str_eq(child->name, name)) {
       return child;
     }
   }
@@ -322,8 +519,32 @@ const struct prop *prop_search_child_const(const struct prop *p,
   return NULL;
 }
 
-int prop_set_attr(struct prop *p, const char *key, const char *val) {
+struct prop *prop_search_next(struct prop *p) {
+  return (struct prop *)prop_search_next_const(p);
+}
+
+const struct prop *prop_search_next_const(const struct prop *p) {
   struct list_node *pos;
+  struct prop *sibling;
+
+  assert(p != NULL);
+
+  if (p->parent != NULL && p->parent->child_index != NULL) {
+    return p->next_same_name;
+  }
+
+  for (pos = p->node.next; pos != NULL; pos = pos->next) {
+    sibling = containerof(pos, struct prop, node);
+
+    if (sibling->name_hash == p->name_hash && str_eq(sibling->name, p->name)) {
+      return sibling;
+    }
+  }
+
+  return NULL;
+}
+
+int prop_set_attr(struct prop *p, const char *key, const char *val) {
   struct attr *a;
   int r;
 
@@ -331,12 +552,10 @@ int prop_set_attr(struct prop *p, const char *key, const char *val) {
   assert(key != NULL);
   assert(val != NULL);
 
-  for (pos = p->attrs.head; pos != NULL; pos = pos->next) {
-    a = containerof(pos, struct attr, node);
+  a = prop_find_attr(p, key, str_hash(key));
 
-    if (str_eq(key, a->key) == 0) {
-      return attr_set(a, val);
-    }
+  if (a != NULL) {
+    return attr_set(a, val);
   }
 
   a = calloc(1, sizeof(*a));
@@ -363,7 +582,19 @@ int prop_set_attr(struct prop *p, const char *key, const char *val) {
     goto end;
   }
 
+  a->key_hash = str_hash(key);
   list_append(&p->attrs, &a->node);
+  p->nattrs++;
+
+  if (p->attr_index != NULL) {
+    if (prop_attr_index_insert(p->attr_index, a) < 0) {
+      free(p->attr_index->slots);
+      free(p->attr_index);
+      p->attr_index = NULL;
+    }
+  } else {
+    prop_index_attrs(p);
+  }
 
   a = NULL;
   r = 0;
@@ -374,6 +605,13 @@ end:
   return r;
 }
 
+void prop_set_encoding(struct prop *p, enum prop_encoding encoding) {
+  assert(p != NULL);
+  assert(prop_encoding_is_valid(encoding));
+
+  p->encoding = encoding;
+}
+
 const struct attr *attr_get_next_sibling(const struct attr *a) {
   const struct list_node *next;
 
@@ -414,3 +652,318 @@ static int attr_set(struct attr *a, const char *val) {
 
   return 0;
 }
+
+static int prop_get_array(const struct prop *p, enum prop_type type, void *dest,
+                          uint32_t *nitems) {
+  uint32_t count;
+  int item_size;
+
+  assert(p != NULL);
+  assert(nitems != NULL);
+
+  if (p->type != (type | PROP_ARRAY_FLAG)) {
+    log_write("\"%s\": Expected %s array, got %s%s", p->name,
+              prop_type_to_string(type), prop_type_to_string(p->type),
+              prop_type_is_array(p->type) ? " array" : "");
+
+    return -EINVAL;
+  }
+
+  item_size = prop_type_to_size(type);
+  count = p->nbytes / item_size;
+
+  if (*nitems < count) {
+    *nitems = count;
+
+    return -ENOSPC;
+  }
+
+  assert(dest != NULL || count == 0);
+
+  switch (item_size) {
+  case 1:
+    memcpy(dest, p->bytes, count);
+
+    break;
+
+  case 2:
+    bswap_be16_array(dest, p->bytes, count);
+
+    break;
+
+  case 4:
+    bswap_be32_array(dest, p->bytes, count);
+
+    break;
+
+  case 8:
+    bswap_be64_array(dest, p->bytes, count);
+
+    break;
+
+  default:
+    abort();
+  }
+
+  *nitems = count;
+
+  return 0;
+}
+
+static struct attr *prop_find_attr(const struct prop *p, const char *key,
+                                   uint32_t hash) {
+  struct list_node *pos;
+  struct attr *a;
+  struct attr **slot;
+
+  assert(p != NULL);
+  assert(key != NULL);
+
+  if (p->attr_index != NULL) {
+    slot = prop_attr_index_probe(p->attr_index, key, hash);
+
+    return *slot;
+  }
+
+  for (pos = p->attrs.head; pos != NULL; pos = pos->next) {
+    a = containerof(pos, struct attr, node);
+
+    if (a->key_hash == hash && str_eq(key, a->key)) {
+      return a;
+    }
+  }
+
+  return NULL;
+}
+
+/* Running out of memory while building an index just means that searches
+   keep doing linear scans until the next addition tries again, so these
+   don't return an error. */
+
+static void prop_index_attrs(struct prop *p) {
+  struct prop_attr_index *idx;
+  struct list_node *pos;
+  int r;
+
+  assert(p != NULL);
+  assert(p->attr_index == NULL);
+
+  if (p->nattrs < PROP_INDEX_MIN_ATTRS) {
+    return;
+  }
+
+  idx = calloc(1, sizeof(*idx));
+
+  if (idx == NULL) {
+    return;
+  }
+
+  for (pos = p->attrs.head; pos != NULL; pos = pos->next) {
+    r = prop_attr_index_insert(idx, containerof(pos, struct attr, node));
+
+    if (r < 0) {
+      free(idx->slots);
+      free(idx);
+
+      return;
+    }
+  }
+
+  p->attr_index = idx;
+}
+
+static void prop_index_children(struct prop *p) {
+  struct prop_child_index *idx;
+  struct list_node *pos;
+  struct prop *child;
+  int r;
+
+  assert(p != NULL);
+  assert(p->child_index == NULL);
+
+  if (p->nchildren < PROP_INDEX_MIN_CHILDREN) {
+    return;
+  }
+
+  idx = calloc(1, sizeof(*idx));
+
+  if (idx == NULL) {
+    return;
+  }
+
+  for (pos = p->children.head; pos != NULL; pos = pos->next) {
+    child = containerof(pos, struct prop, node);
+    r = prop_child_index_insert(idx, child);
+
+    if (r < 0) {
+      free(idx->slots);
+      free(idx);
+
+      return;
+    }
+  }
+
+  p->child_index = idx;
+}
+
+static void prop_drop_child_index(struct prop *p) {
+  assert(p != NULL);
+
+  if (p->child_index == NULL) {
+    return;
+  }
+
+  free(p->child_index->slots);
+  free(p->child_index);
+  p->child_index = NULL;
+}
+
+/* Both indexes are open-addressed with linear probing and kept at most half
+   full. Nothing ever gets removed from them, which keeps this simple. */
+
+static int prop_attr_index_insert(struct prop_attr_index *idx, struct attr *a) {
+  struct prop_attr_index grown;
+  struct attr **slot;
+  uint32_t i;
+  int r;
+
+  assert(idx != NULL);
+  assert(a != NULL);
+
+  if ((idx->nused + 1) * 2 > idx->nslots) {
+    if (idx->nslots > UINT32_MAX / 4) {
+      return -EOVERFLOW;
+    }
+
+    grown.nslots = idx->nslots != 0 ? idx->nslots * 2 : 16;
+    grown.nused = 0;
+    grown.slots = calloc(grown.nslots, sizeof(*grown.slots));
+
+    if (grown.slots == NULL) {
+      return -ENOMEM;
+    }
+
+    for (i = 0; i < idx->nslots; i++) {
+      if (idx->slots[i] != NULL) {
+        r = prop_attr_index_insert(&grown, idx->slots[i]);
+
+        assert(r >= 0);
+      }
+    }
+
+    free(idx->slots);
+    *idx = grown;
+  }
+
+  slot = prop_attr_index_probe(idx, a->key, a->key_hash);
+
+  assert(*slot == NULL);
+
+  *slot = a;
+  idx->nused++;
+
+  return 0;
+}
+
+static struct attr **prop_attr_index_probe(const struct prop_attr_index *idx,
+                                           const char *key, uint32_t hash) {
+  struct attr **slot;
+  uint32_t mask;
+  uint32_t i;
+
+  assert(idx != NULL);
+  assert(idx->nslots > 0);
+  assert(key != NULL);
+
+  mask = idx->nslots - 1;
+
+  for (i = hash & mask;; i = (i + 1) & mask) {
+    slot = &idx->slots[i];
+
+    if (*slot == NULL) {
+      return slot;
+    }
+
+    if ((*slot)->key_hash == hash && str_eq((*slot)->key, key)) {
+      return slot;
+    }
+  }
+}
+
+static int prop_child_index_insert(struct prop_child_index *idx,
+                                   struct prop *child) {
+  struct prop_child_index grown;
+  struct prop_child_slot *slot;
+  struct prop_child_slot *src;
+  uint32_t i;
+
+  assert(idx != NULL);
+  assert(child != NULL);
+
+  if ((idx->nused + 1) * 2 > idx->nslots) {
+    if (idx->nslots > UINT32_MAX / 4) {
+      return -EOVERFLOW;
+    }
+
+    grown.nslots = idx->nslots != 0 ? idx->nslots * 2 : 16;
+    grown.nused = idx->nused;
+    grown.slots = calloc(grown.nslots, sizeof(*grown.slots));
+
+    if (grown.slots == NULL) {
+      return -ENOMEM;
+    }
+
+    for (i = 0; i < idx->nslots; i++) {
+      src = &idx->slots[i];
+
+      if (src->first != NULL) {
+        slot = prop_child_index_probe(&grown, src->first->name, src->hash);
+        *slot = *src;
+      }
+    }
+
+    free(idx->slots);
+    *idx = grown;
+  }
+
+  child->next_same_name = NULL;
+  slot = prop_child_index_probe(idx, child->name, child->name_hash);
+
+  if (slot->first != NULL) {
+    slot->last->next_same_name = child;
+    slot->last = child;
+  } else {
+    slot->first = child;
+    slot->last = child;
+    slot->hash = child->name_hash;
+    idx->nused++;
+  }
+
+  return 0;
+}
+
+static struct prop_child_slot *
+prop_child_index_probe(const struct prop_child_index *idx, const char *name,
+                       uint32_t hash) {
+  struct prop_child_slot *slot;
+  uint32_t mask;
+  uint32_t i;
+
+  assert(idx != NULL);
+  assert(idx->nslots > 0);
+  assert(name != NULL);
+
+  mask = idx->nslots - 1;
+
+  for (i = hash & mask;; i = (i + 1) & mask) {
+    slot = &idx->slots[i];
+
+    if (slot->first == NULL) {
+      return slot;
+    }
+
+    if (slot->hash == hash && str_eq(slot->first->name, name)) {
+      return slot;
+    }
+  }
+}
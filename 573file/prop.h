@@ -9,16 +9,46 @@
 struct attr;
 struct prop;
 
+typedef int (*prop_loader_t)(void *ctx, struct prop *p, uint32_t token);
+
+/* A prop's encoding describes the strings in the tree below it, so it only
+   really matters for root nodes. New nodes default to Shift-JIS.
+
+   Getters and searches never modify a tree, apart from loading deferred
+   children, so a tree without any can be read from several threads at once.
+
+   The _hashed variants take a precomputed str_hash() of the name or key, for
+   callers that look up the same few names over and over again. */
+
 int prop_alloc(struct prop **p, const char *name, enum prop_type type,
                const void *bytes, uint32_t nbytes);
 void prop_free(struct prop *p);
 void prop_append(struct prop *p, struct prop *child);
+void prop_defer_children(struct prop *p, prop_loader_t loader, void *ctx,
+                         uint32_t token);
 void prop_borrow_value(const struct prop *p, struct const_iobuf *out);
 const char *prop_get_attr(const struct prop *p, const char *key);
+const char *prop_get_attr_hashed(const struct prop *p, const char *key,
+                                 uint32_t hash);
 uint32_t prop_get_count(const struct prop *p);
+
+/* Decode a whole array node into native byte order. *nitems gives the
+   capacity of dest on the way in, and the number of items on the way out. If
+   dest is too small then this returns -ENOSPC and sets *nitems to the count
+   that would have been needed. */
+
+int prop_get_s8_array(const struct prop *p, int8_t *dest, uint32_t *nitems);
+int prop_get_u8_array(const struct prop *p, uint8_t *dest, uint32_t *nitems);
+int prop_get_s16_array(const struct prop *p, int16_t *dest, uint32_t *nitems);
+int prop_get_u16_array(const struct prop *p, uint16_t *dest, uint32_t *nitems);
+int prop_get_s32_array(const struct prop *p, int32_t *dest, uint32_t *nitems);
+int prop_get_u32_array(const struct prop *p, uint32_t *dest, uint32_t *nitems);
+int prop_get_s64_array(const struct prop *p, int64_t *dest, uint32_t *nitems);
+int prop_get_u64_array(const struct prop *p, uint64_t *dest, uint32_t *nitems);
 const struct attr *prop_get_first_attr(const struct prop *p);
 struct prop *prop_get_first_child(struct prop *p);
 const struct prop *prop_get_first_child_const(const struct prop *p);
+enum prop_encoding prop_get_encoding(const struct prop *p);
 const char *prop_get_name(const struct prop *p);
 struct prop *prop_get_next_sibling(struct prop *p);
 const struct prop *prop_get_next_sibling_const(const struct prop *p);
@@ -28,7 +58,15 @@ const char *prop_get_value_str(const struct prop *p);
 struct prop *prop_search_child(struct prop *p, const char *name);
 const struct prop *prop_search_child_const(const struct prop *p,
                                            const char *name);
+const struct prop *prop_search_child_hashed_const(const struct prop *p,
+                                                  const char *name,
+                                                  uint32_t hash);
+struct prop *prop_search_next(struct prop *p);
+const struct prop *prop_search_next_const(const struct prop *p);
 int prop_set_attr(struct prop *p, const char *key, const char *val);
+void prop_set_encoding(struct prop *p, enum prop_encoding encoding);
+int prop_validate(const char *name, enum prop_type type, const void *bytes,
+                  uint32_t nbytes);
 
 const struct attr *attr_get_next_sibling(const struct attr *a);
 const char *attr_get_key(const struct attr *a);
@@ -0,0 +1,182 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The individual code paths are private to hex.c, so pull the whole thing in
+   rather than exporting them just for this. */
+
+#include "util/hex.c"
+
+#include "util/macro.h"
+
+/* Times each hex_format_lc() code path, and the runtime dispatch through
+   hex_format_lc() itself, from MD5 sized inputs up to large bin blobs. Each
+   measurement repeats until it has taken at least BENCH_MIN_SECONDS, and
+   every path's output is checked against the scalar one. */
+
+#define BENCH_MIN_SECONDS 0.5
+
+typedef void (*bench_fn_t)(char *dest, const uint8_t *bytes, size_t nbytes);
+
+struct bench_path {
+  const char *name;
+  bench_fn_t fn;
+  bool (*is_supported)(void);
+};
+
+static void bench_scalar(char *dest, const uint8_t *bytes, size_t nbytes);
+static void bench_dispatch(char *dest, const uint8_t *bytes, size_t nbytes);
+
+#ifdef HEX_X86
+
+static bool bench_has_ssse3(void);
+static bool bench_has_avx2(void);
+static void bench_ssse3(char *dest, const uint8_t *bytes, size_t nbytes);
+static void bench_avx2(char *dest, const uint8_t *bytes, size_t nbytes);
+
+#endif
+
+static double bench_run(bench_fn_t fn, char *dest, const uint8_t *bytes,
+                        size_t nbytes);
+
+static const struct bench_path bench_paths[] = {
+    {"scalar", bench_scalar, NULL},
+#ifdef HEX_X86
+    {"ssse3", bench_ssse3, bench_has_ssse3},
+    {"avx2", bench_avx2, bench_has_avx2},
+#endif
+    {"hex_format_lc", bench_dispatch, NULL},
+};
+
+static const size_t bench_sizes[] = {16, 512, 64 * 1024, 16 * 1024 * 1024};
+
+int main(void) {
+  const struct bench_path *path;
+  uint8_t *bytes;
+  char *expected;
+  char *actual;
+  size_t max_nbytes;
+  size_t nbytes;
+  size_t i;
+  size_t j;
+  double secs;
+
+  max_nbytes = bench_sizes[lengthof(bench_sizes) - 1];
+  bytes = malloc(max_nbytes);
+  expected = malloc(max_nbytes * 2);
+  actual = malloc(max_nbytes * 2);
+
+  if (bytes == NULL || expected == NULL || actual == NULL) {
+    fprintf(stderr, "Out of memory\n");
+
+    return EXIT_FAILURE;
+  }
+
+  srand(573);
+
+  for (i = 0; i < max_nbytes; i++) {
+    bytes[i] = rand();
+  }
+
+  for (i = 0; i < lengthof(bench_sizes); i++) {
+    nbytes = bench_sizes[i];
+    bench_scalar(expected, bytes, nbytes);
+
+    for (j = 0; j < lengthof(bench_paths); j++) {
+      path = &bench_paths[j];
+
+      if (path->is_supported != NULL && !path->is_supported()) {
+        printf("%10lu bytes  %-14s  not supported\n", (unsigned long)nbytes,
+               path->name);
+
+        continue;
+      }
+
+      memset(actual, 0, nbytes * 2);
+      secs = bench_run(path->fn, actual, bytes, nbytes);
+
+      if (memcmp(actual, expected, nbytes * 2) != 0) {
+        printf("%10lu bytes  %-14s  WRONG OUTPUT\n", (unsigned long)nbytes,
+               path->name);
+        free(actual);
+        free(expected);
+        free(bytes);
+
+        return EXIT_FAILURE;
+      }
+
+      printf("%10lu bytes  %-14s  %9.1f MB/s\n", (unsigned long)nbytes,
+             path->name, nbytes / secs / 1e6);
+    }
+  }
+
+  free(actual);
+  free(expected);
+  free(bytes);
+
+  return EXIT_SUCCESS;
+}
+
+static void bench_scalar(char *dest, const uint8_t *bytes, size_t nbytes) {
+  hex_format_scalar(dest, bytes, nbytes, hex_digits_lc);
+}
+
+static void bench_dispatch(char *dest, const uint8_t *bytes, size_t nbytes) {
+  hex_format_lc(dest, bytes, nbytes);
+}
+
+#ifdef HEX_X86
+
+static bool bench_has_ssse3(void) {
+  return __builtin_cpu_supports("ssse3");
+}
+
+static bool bench_has_avx2(void) {
+  return __builtin_cpu_supports("avx2");
+}
+
+static void bench_ssse3(char *dest, const uint8_t *bytes, size_t nbytes) {
+  size_t i;
+
+  i = hex_format_ssse3(dest, bytes, nbytes, hex_digits_lc);
+  hex_format_scalar(dest + i * 2, bytes + i, nbytes - i, hex_digits_lc);
+}
+
+static void bench_avx2(char *dest, const uint8_t *bytes, size_t nbytes) {
+  size_t i;
+
+  i = hex_format_avx2(dest, bytes, nbytes, hex_digits_lc);
+  hex_format_scalar(dest + i * 2, bytes + i, nbytes - i, hex_digits_lc);
+}
+
+#endif
+
+/* Returns the average number of seconds that one call took */
+
+static double bench_run(bench_fn_t fn, char *dest, const uint8_t *bytes,
+                        size_t nbytes) {
+  clock_t start;
+  clock_t elapsed;
+  unsigned long nruns;
+  unsigned long batch;
+  unsigned long i;
+
+  nruns = 0;
+  batch = 1;
+  start = clock();
+
+  do {
+    for (i = 0; i < batch; i++) {
+      fn(dest, bytes, nbytes);
+    }
+
+    nruns += batch;
+    batch *= 2;
+    elapsed = clock() - start;
+  } while (elapsed < BENCH_MIN_SECONDS * CLOCKS_PER_SEC);
+
+  return (double)elapsed / CLOCKS_PER_SEC / nruns;
+}
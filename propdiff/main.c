@@ -0,0 +1,627 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "573file/prop-flat.h"
+#include "573file/prop-hash.h"
+#include "573file/prop-type.h"
+#include "573file/prop-xml-writer.h"
+
+#include "util/fs.h"
+#include "util/iobuf.h"
+#include "util/log.h"
+#include "util/str.h"
+
+/* Exit codes, following diff(1) */
+
+#define PROP_DIFF_SAME 0
+#define PROP_DIFF_CHANGED 1
+#define PROP_DIFF_TROUBLE 2
+
+struct prop_diff_side {
+  void *bytes;
+  struct prop_flat *f;
+  uint64_t *hashes;
+};
+
+struct prop_diff {
+  struct prop_diff_side sides[2];
+  unsigned long nchanges;
+};
+
+/* One child in a list of children being matched up. occurrence and total
+   give its position among same-named siblings, for printing paths. */
+
+struct prop_diff_child {
+  uint32_t node;
+  uint32_t occurrence;
+  uint32_t total;
+  uint32_t pair;
+  bool exact;
+};
+
+struct prop_diff_key {
+  uint64_t key;
+  uint32_t index;
+  bool consumed;
+};
+
+static int prop_diff_load(struct prop_diff_side *side, const char *path);
+static void prop_diff_side_fini(struct prop_diff_side *side);
+static int prop_diff_node(struct prop_diff *d, uint32_t a, uint32_t b,
+                          const char *path);
+static int prop_diff_value(struct prop_diff *d, uint32_t a, uint32_t b,
+                           const char *path);
+static void prop_diff_attrs(struct prop_diff *d, uint32_t a, uint32_t b,
+                            const char *path);
+static int prop_diff_children(struct prop_diff *d, uint32_t a, uint32_t b,
+                              const char *path);
+static int prop_diff_collect(const struct prop_flat *f, uint32_t parent,
+                             struct prop_diff_child **out, uint32_t *nout);
+static int prop_diff_match(struct prop_diff *d, struct prop_diff_child *ca,
+                           uint32_t na, struct prop_diff_child *cb, uint32_t nb,
+                           bool exact);
+static int prop_diff_child_path(const struct prop_flat *f,
+                                const struct prop_diff_child *child,
+                                const char *parent_path, char **out);
+static uint64_t prop_diff_key_of(const struct prop_diff_side *side,
+                                 uint32_t node, bool exact);
+static int prop_diff_key_compare(const void *lhs, const void *rhs);
+
+int main(int argc, char **argv) {
+  struct prop_diff d;
+  uint32_t roots[2];
+  char *path;
+  int r;
+
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s [old] [new]\n", argv[0]);
+    fprintf(stderr, "  Compares two binary props, printing changed paths\n");
+
+    return PROP_DIFF_TROUBLE;
+  }
+
+  memset(&d, 0, sizeof(d));
+  path = NULL;
+
+  r = prop_diff_load(&d.sides[0], argv[1]);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_diff_load(&d.sides[1], argv[2]);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  roots[0] = prop_flat_get_root(d.sides[0].f);
+  roots[1] = prop_flat_get_root(d.sides[1].f);
+
+  if (!str_eq(prop_flat_get_name(d.sides[0].f, roots[0]),
+              prop_flat_get_name(d.sides[1].f, roots[1]))) {
+    printf("~ /: root %s -> %s\n", prop_flat_get_name(d.sides[0].f, roots[0]),
+           prop_flat_get_name(d.sides[1].f, roots[1]));
+    d.nchanges++;
+  }
+
+  r = str_printf(&path, "/%s", prop_flat_get_name(d.sides[1].f, roots[1]));
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_diff_node(&d, roots[0], roots[1], path);
+
+  if (r < 0) {
+    goto end;
+  }
+
+end:
+  free(path);
+  prop_diff_side_fini(&d.sides[0]);
+  prop_diff_side_fini(&d.sides[1]);
+
+  if (r < 0) {
+    log_write("%s (%i)", strerror(-r), r);
+
+    return PROP_DIFF_TROUBLE;
+  }
+
+  return d.nchanges > 0 ? PROP_DIFF_CHANGED : PROP_DIFF_SAME;
+}
+
+static int prop_diff_load(struct prop_diff_side *side, const char *path) {
+  size_t nbytes;
+  int r;
+
+  assert(side != NULL);
+  assert(path != NULL);
+
+  r = fs_read_file(path, &side->bytes, &nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_flat_parse_binary(&side->f, side->bytes, nbytes);
+
+  if (r < 0) {
+    log_write("%s: Error parsing prop", path);
+
+    return r;
+  }
+
+  return prop_flat_hash(side->f, &side->hashes);
+}
+
+static void prop_diff_side_fini(struct prop_diff_side *side) {
+  assert(side != NULL);
+
+  free(side->hashes);
+  prop_flat_free(side->f);
+  free(side->bytes);
+}
+
+/* a and b are nodes with the same name, which may or may not differ */
+
+static int prop_diff_node(struct prop_diff *d, uint32_t a, uint32_t b,
+                          const char *path) {
+  int r;
+
+  assert(d != NULL);
+  assert(path != NULL);
+
+  if (d->sides[0].hashes[a] == d->sides[1].hashes[b]) {
+    return 0;
+  }
+
+  r = prop_diff_value(d, a, b, path);
+
+  if (r < 0) {
+    return r;
+  }
+
+  prop_diff_attrs(d, a, b, path);
+
+  return prop_diff_children(d, a, b, path);
+}
+
+static int prop_diff_value(struct prop_diff *d, uint32_t a, uint32_t b,
+                           const char *path) {
+  const struct prop_flat *fa;
+  const struct prop_flat *fb;
+  struct const_iobuf va;
+  struct const_iobuf vb;
+  enum prop_type ta;
+  enum prop_type tb;
+  char *sa;
+  char *sb;
+  int r;
+
+  assert(d != NULL);
+  assert(path != NULL);
+
+  fa = d->sides[0].f;
+  fb = d->sides[1].f;
+  ta = prop_flat_get_type(fa, a);
+  tb = prop_flat_get_type(fb, b);
+  prop_flat_borrow_value(fa, a, &va);
+  prop_flat_borrow_value(fb, b, &vb);
+
+  if (ta == tb && va.nbytes == vb.nbytes &&
+      (va.nbytes == 0 || memcmp(va.bytes, vb.bytes, va.nbytes) == 0)) {
+    return 0;
+  }
+
+  sa = NULL;
+  sb = NULL;
+
+  r = prop_xml_format_value(ta, prop_flat_get_encoding(fa), &va, &sa);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_xml_format_value(tb, prop_flat_get_encoding(fb), &vb, &sb);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  if (ta != tb) {
+    printf("~ %s: (%s) %s -> (%s) %s\n", path, prop_type_to_string(ta), sa,
+           prop_type_to_string(tb), sb);
+  } else {
+    printf("~ %s: %s -> %s\n", path, sa, sb);
+  }
+
+  d->nchanges++;
+
+end:
+  free(sa);
+  free(sb);
+
+  return r;
+}
+
+static void prop_diff_attrs(struct prop_diff *d, uint32_t a, uint32_t b,
+                            const char *path) {
+  const struct prop_flat *fa;
+  const struct prop_flat *fb;
+  const char *key;
+  const char *va;
+  const char *vb;
+  uint32_t first;
+  uint32_t count;
+  uint32_t i;
+
+  assert(d != NULL);
+  assert(path != NULL);
+
+  fa = d->sides[0].f;
+  fb = d->sides[1].f;
+  first = prop_flat_get_first_attr(fa, a);
+  count = prop_flat_get_attr_count(fa, a);
+
+  for (i = first; i < first + count; i++) {
+    key = prop_flat_attr_get_key(fa, i);
+    va = prop_flat_attr_get_val(fa, i);
+    vb = prop_flat_get_attr(fb, b, key);
+
+    if (vb == NULL) {
+      printf("- %s/@%s: \"%s\"\n", path, key, va);
+      d->nchanges++;
+    } else if (!str_eq(va, vb)) {
+      printf("~ %s/@%s: \"%s\" -> \"%s\"\n", path, key, va, vb);
+      d->nchanges++;
+    }
+  }
+
+  first = prop_flat_get_first_attr(fb, b);
+  count = prop_flat_get_attr_count(fb, b);
+
+  for (i = first; i < first + count; i++) {
+    key = prop_flat_attr_get_key(fb, i);
+
+    if (prop_flat_get_attr(fa, a, key) == NULL) {
+      printf("+ %s/@%s: \"%s\"\n", path, key, prop_flat_attr_get_val(fb, i));
+      d->nchanges++;
+    }
+  }
+}
+
+static int prop_diff_children(struct prop_diff *d, uint32_t a, uint32_t b,
+                              const char *path) {
+  const uint64_t *ha;
+  const uint64_t *hb;
+  struct prop_diff_child *ca;
+  struct prop_diff_child *cb;
+  uint32_t na;
+  uint32_t nb;
+  uint32_t prefix;
+  uint32_t suffix;
+  uint32_t i;
+  char *child_path;
+  int r;
+
+  assert(d != NULL);
+  assert(path != NULL);
+
+  ca = NULL;
+  cb = NULL;
+  child_path = NULL;
+  ha = d->sides[0].hashes;
+  hb = d->sides[1].hashes;
+
+  r = prop_diff_collect(d->sides[0].f, a, &ca, &na);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_diff_collect(d->sides[1].f, b, &cb, &nb);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  /* Edits are usually few and far between, so peel off the identical runs at
+     either end before doing any real matching. */
+
+  for (prefix = 0; prefix < na && prefix < nb; prefix++) {
+    if (ha[ca[prefix].node] != hb[cb[prefix].node]) {
+      break;
+    }
+  }
+
+  for (suffix = 0; suffix < na - prefix && suffix < nb - prefix; suffix++) {
+    if (ha[ca[na - 1 - suffix].node] != hb[cb[nb - 1 - suffix].node]) {
+      break;
+    }
+  }
+
+  na -= prefix + suffix;
+  nb -= prefix + suffix;
+
+  /* First pair up identical subtrees that merely moved, then pair up whatever
+     is left by name, in order. */
+
+  r = prop_diff_match(d, ca + prefix, na, cb + prefix, nb, true);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_diff_match(d, ca + prefix, na, cb + prefix, nb, false);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  for (i = prefix; i < prefix + na; i++) {
+    if (ca[i].exact) {
+      continue;
+    }
+
+    free(child_path);
+    child_path = NULL;
+
+    if (ca[i].pair != PROP_FLAT_NONE) {
+      r = prop_diff_child_path(d->sides[1].f, &cb[prefix + ca[i].pair], path,
+                               &child_path);
+
+      if (r < 0) {
+        goto end;
+      }
+
+      r = prop_diff_node(d, ca[i].node, cb[prefix + ca[i].pair].node,
+                         child_path);
+
+      if (r < 0) {
+        goto end;
+      }
+    } else {
+      r = prop_diff_child_path(d->sides[0].f, &ca[i], path, &child_path);
+
+      if (r < 0) {
+        goto end;
+      }
+
+      printf("- %s\n", child_path);
+      d->nchanges++;
+    }
+  }
+
+  for (i = prefix; i < prefix + nb; i++) {
+    if (cb[i].pair != PROP_FLAT_NONE) {
+      continue;
+    }
+
+    free(child_path);
+    child_path = NULL;
+
+    r = prop_diff_child_path(d->sides[1].f, &cb[i], path, &child_path);
+
+    if (r < 0) {
+      goto end;
+    }
+
+    printf("+ %s\n", child_path);
+    d->nchanges++;
+  }
+
+end:
+  free(child_path);
+  free(ca);
+  free(cb);
+
+  return r;
+}
+
+static int prop_diff_collect(const struct prop_flat *f, uint32_t parent,
+                             struct prop_diff_child **out, uint32_t *nout) {
+  struct prop_diff_child *children;
+  struct prop_diff_key *keys;
+  uint32_t nchildren;
+  uint32_t child;
+  uint32_t i;
+  uint32_t j;
+  uint32_t k;
+
+  assert(f != NULL);
+  assert(out != NULL);
+  assert(nout != NULL);
+
+  *out = NULL;
+  *nout = 0;
+  nchildren = 0;
+
+  for (child = prop_flat_get_first_child(f, parent); child != PROP_FLAT_NONE;
+       child = prop_flat_get_next_sibling(f, child)) {
+    nchildren++;
+  }
+
+  children = calloc(nchildren + 1, sizeof(*children));
+  keys = calloc(nchildren + 1, sizeof(*keys));
+
+  if (children == NULL || keys == NULL) {
+    free(children);
+    free(keys);
+
+    return -ENOMEM;
+  }
+
+  i = 0;
+
+  for (child = prop_flat_get_first_child(f, parent); child != PROP_FLAT_NONE;
+       child = prop_flat_get_next_sibling(f, child)) {
+    children[i].node = child;
+    children[i].pair = PROP_FLAT_NONE;
+    keys[i].key = prop_flat_get_name_id(f, child);
+    keys[i].index = i;
+    i++;
+  }
+
+  /* Sorting by name ID, then position, groups same-named siblings together
+     in document order. */
+
+  qsort(keys, nchildren, sizeof(*keys), prop_diff_key_compare);
+
+  for (i = 0; i < nchildren; i = j) {
+    for (j = i; j < nchildren && keys[j].key == keys[i].key; j++) {
+      children[keys[j].index].occurrence = j - i + 1;
+    }
+
+    for (k = i; k < j; k++) {
+      children[keys[k].index].total = j - i;
+    }
+  }
+
+  free(keys);
+
+  *out = children;
+  *nout = nchildren;
+
+  return 0;
+}
+
+static int prop_diff_match(struct prop_diff *d, struct prop_diff_child *ca,
+                           uint32_t na, struct prop_diff_child *cb, uint32_t nb,
+                           bool exact) {
+  const struct prop_flat *fa;
+  const struct prop_flat *fb;
+  struct prop_diff_key *keys;
+  struct prop_diff_key *pos;
+  struct prop_diff_key *end;
+  uint64_t key;
+  uint32_t nkeys;
+  uint32_t lo;
+  uint32_t hi;
+  uint32_t mid;
+  uint32_t i;
+
+  assert(d != NULL);
+
+  fa = d->sides[0].f;
+  fb = d->sides[1].f;
+  keys = calloc(nb + 1, sizeof(*keys));
+
+  if (keys == NULL) {
+    return -ENOMEM;
+  }
+
+  nkeys = 0;
+
+  for (i = 0; i < nb; i++) {
+    if (cb[i].pair == PROP_FLAT_NONE) {
+      keys[nkeys].key = prop_diff_key_of(&d->sides[1], cb[i].node, exact);
+      keys[nkeys].index = i;
+      nkeys++;
+    }
+  }
+
+  qsort(keys, nkeys, sizeof(*keys), prop_diff_key_compare);
+  end = keys + nkeys;
+
+  for (i = 0; i < na; i++) {
+    if (ca[i].pair != PROP_FLAT_NONE) {
+      continue;
+    }
+
+    key = prop_diff_key_of(&d->sides[0], ca[i].node, exact);
+    lo = 0;
+    hi = nkeys;
+
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+
+      if (keys[mid].key < key) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    /* Name keys are only hashes, so check the actual names too */
+
+    for (pos = keys + lo; pos < end && pos->key == key; pos++) {
+      if (pos->consumed) {
+        continue;
+      }
+
+      if (!exact && !str_eq(prop_flat_get_name(fa, ca[i].node),
+                            prop_flat_get_name(fb, cb[pos->index].node))) {
+        continue;
+      }
+
+      pos->consumed = true;
+      ca[i].pair = pos->index;
+      ca[i].exact = exact;
+      cb[pos->index].pair = i;
+      cb[pos->index].exact = exact;
+
+      break;
+    }
+  }
+
+  free(keys);
+
+  return 0;
+}
+
+static int prop_diff_child_path(const struct prop_flat *f,
+                                const struct prop_diff_child *child,
+                                const char *parent_path, char **out) {
+  const char *name;
+
+  assert(f != NULL);
+  assert(child != NULL);
+  assert(parent_path != NULL);
+  assert(out != NULL);
+
+  name = prop_flat_get_name(f, child->node);
+
+  if (child->total > 1) {
+    return str_printf(out, "%s/%s[%u]", parent_path, name, child->occurrence);
+  } else {
+    return str_printf(out, "%s/%s", parent_path, name);
+  }
+}
+
+/* Exact matching goes by subtree hash, otherwise we match by name. Name IDs
+   are private to each flat tree, so names get hashed here instead. */
+
+static uint64_t prop_diff_key_of(const struct prop_diff_side *side,
+                                 uint32_t node, bool exact) {
+  assert(side != NULL);
+
+  if (exact) {
+    return side->hashes[node];
+  } else {
+    return str_hash(prop_flat_get_name(side->f, node));
+  }
+}
+
+static int prop_diff_key_compare(const void *lhs, const void *rhs) {
+  const struct prop_diff_key *l;
+  const struct prop_diff_key *r;
+
+  l = lhs;
+  r = rhs;
+
+  if (l->key != r->key) {
+    return l->key < r->key ? -1 : 1;
+  }
+
+  if (l->index != r->index) {
+    return l->index < r->index ? -1 : 1;
+  }
+
+  return 0;
+}
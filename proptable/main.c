@@ -0,0 +1,288 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "573file/prop-flat.h"
+#include "573file/prop-table.h"
+
+#include "util/fs.h"
+#include "util/log.h"
+#include "util/str.h"
+#include "util/work.h"
+
+/* Size of the buffer that output is staged in */
+
+#define TABLE_SINK_NCHARS (64 * 1024)
+
+/* Number of files per thread whose rows are held in memory at once */
+
+#define TABLE_NFILES_PER_THREAD 4
+
+/* Files are converted in rounds of a few per thread, each into its own
+   buffer, and each round's rows get written out in the order the files were
+   given. A file that fails gets reported right away and contributes no
+   rows, but doesn't hold up the rest. */
+
+struct table_batch {
+  const struct prop_table *t;
+  enum prop_table_format format;
+  bool prefix;
+  char **infiles;
+  size_t first;
+  struct strbuf *bufs;
+  int *results;
+};
+
+static int table_run(struct table_batch *b, size_t nfiles,
+                     unsigned int nthreads, FILE *f, size_t *nfailed);
+static int table_batch_run(void *ctx, size_t begin, size_t end);
+static int table_load(struct prop_flat **out, const char *path);
+
+int main(int argc, char **argv) {
+  struct table_batch b;
+  struct prop_table *t;
+  const char *outfile;
+  const char *record;
+  const char **fields;
+  size_t nfields;
+  size_t nfailed;
+  unsigned int nthreads;
+  FILE *f;
+  int r;
+
+  memset(&b, 0, sizeof(b));
+  b.format = PROP_TABLE_TSV;
+  outfile = NULL;
+  record = NULL;
+  nthreads = 0;
+  nfields = 0;
+  nfailed = 0;
+  t = NULL;
+  f = NULL;
+
+  fields = calloc(argc, sizeof(*fields));
+
+  if (fields == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  while (argc > 1 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-c") == 0) {
+      b.format = PROP_TABLE_CSV;
+    } else if (strcmp(argv[1], "-p") == 0) {
+      b.prefix = true;
+    } else if (strcmp(argv[1], "-r") == 0 && argc > 2) {
+      record = argv[2];
+      argc--;
+      argv++;
+    } else if (strcmp(argv[1], "-f") == 0 && argc > 2) {
+      fields[nfields++] = argv[2];
+      argc--;
+      argv++;
+    } else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+      nthreads = strtoul(argv[2], NULL, 10);
+      argc--;
+      argv++;
+    } else if (strcmp(argv[1], "-o") == 0 && argc > 2) {
+      outfile = argv[2];
+      argc--;
+      argv++;
+    } else {
+      break;
+    }
+
+    argc--;
+    argv++;
+  }
+
+  if (argc < 2 || record == NULL || nfields == 0) {
+    fprintf(stderr, "Usage: %s [-c] [-p] [-j threads] [-o outfile]\n", argv[0]);
+    fprintf(stderr, "         -r <record> -f <field>... <infile>...\n");
+    fprintf(stderr, "  -r  Path of the records, such as /mdb/music\n");
+    fprintf(stderr, "  -f  Column below the record, e.g. info/title or @id\n");
+    fprintf(stderr, "  -c  Write CSV instead of TSV\n");
+    fprintf(stderr, "  -p  Start each row with the file it came from\n");
+    fprintf(stderr, "  -j  Number of threads (default: one per CPU)\n");
+    fprintf(stderr, "  -o  Write to a file instead of stdout\n");
+    free(fields);
+
+    return EXIT_FAILURE;
+  }
+
+  r = prop_table_compile(&t, record, fields, nfields);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  if (outfile != NULL) {
+    r = fs_open(&f, outfile, "wb");
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+  b.t = t;
+  b.infiles = argv + 1;
+  r = table_run(&b, argc - 1, nthreads, f != NULL ? f : stdout, &nfailed);
+
+end:
+  fs_close(f);
+  prop_table_free(t);
+  free(fields);
+
+  if (r < 0) {
+    log_write("%s (%i)", strerror(-r), r);
+
+    return EXIT_FAILURE;
+  }
+
+  /* Files that failed have been reported already */
+
+  return nfailed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int table_run(struct table_batch *b, size_t nfiles,
+                     unsigned int nthreads, FILE *f, size_t *nfailed) {
+  struct strbuf out;
+  char *chars;
+  size_t max_files;
+  size_t nround;
+  size_t i;
+  int r;
+
+  if (nthreads == 0) {
+    nthreads = work_get_cpu_count();
+  }
+
+  max_files = (size_t)nthreads * TABLE_NFILES_PER_THREAD;
+  chars = malloc(TABLE_SINK_NCHARS);
+  b->bufs = malloc(max_files * sizeof(*b->bufs));
+  b->results = calloc(nfiles, sizeof(*b->results));
+
+  if (chars == NULL || b->bufs == NULL || b->results == NULL) {
+    free(b->results);
+    free(b->bufs);
+    free(chars);
+
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < max_files; i++) {
+    strbuf_init(&b->bufs[i]);
+  }
+
+  strbuf_init_sink(&out, f, chars, TABLE_SINK_NCHARS);
+  prop_table_write_header(b->t, b->format, b->prefix ? "file" : NULL, &out);
+  r = 0;
+
+  for (b->first = 0; b->first < nfiles; b->first += nround) {
+    nround = nfiles - b->first;
+
+    if (nround > max_files) {
+      nround = max_files;
+    }
+
+    r = work_run(nthreads, nround, 1, table_batch_run, b);
+
+    if (r < 0) {
+      goto end;
+    }
+
+    for (i = 0; i < nround; i++) {
+      strbuf_putn(&out, b->bufs[i].chars, b->bufs[i].pos);
+    }
+
+    r = out.error;
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+  r = strbuf_flush(&out);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  *nfailed = 0;
+
+  for (i = 0; i < nfiles; i++) {
+    if (b->results[i] < 0) {
+      (*nfailed)++;
+    }
+  }
+
+  if (*nfailed > 0) {
+    log_write("%lu of %lu files failed to load", (unsigned long)*nfailed,
+              (unsigned long)nfiles);
+  }
+
+end:
+  for (i = 0; i < max_files; i++) {
+    free(b->bufs[i].chars);
+  }
+
+  free(b->bufs);
+  free(b->results);
+  free(chars);
+
+  return r;
+}
+
+static int table_batch_run(void *ctx, size_t begin, size_t end) {
+  struct table_batch *b;
+  struct prop_flat *f;
+  struct strbuf *buf;
+  const char *path;
+  size_t i;
+  int r;
+
+  b = ctx;
+
+  for (i = begin; i < end; i++) {
+    path = b->infiles[b->first + i];
+    buf = &b->bufs[i];
+    buf->pos = 0;
+
+    r = table_load(&f, path);
+
+    if (r < 0) {
+      log_write("%s: %s (%i)", path, strerror(-r), r);
+      b->results[b->first + i] = r;
+
+      continue;
+    }
+
+    r = prop_table_write_rows(b->t, f, b->format, b->prefix ? path : NULL, buf);
+    prop_flat_free(f);
+
+    /* Out of memory isn't a problem with the file, so give up on the lot */
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  return 0;
+}
+
+static int table_load(struct prop_flat **out, const char *path) {
+  const void *bytes;
+  size_t nbytes;
+  int r;
+
+  r = fs_map_file(path, &bytes, &nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_flat_parse_binary(out, bytes, nbytes);
+  fs_unmap_file(bytes, nbytes);
+
+  return r;
+}
@@ -0,0 +1,557 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "573file/prop-binary-reader.h"
+#include "573file/prop-binary-writer.h"
+#include "573file/prop-type.h"
+#include "573file/prop.h"
+
+#include "util/iobuf.h"
+#include "util/log.h"
+#include "util/macro.h"
+#include "util/str.h"
+
+/* Writes trees out with prop_binary_write() and with the builder, checks
+   that both produce the same bytes with the expected name format, then
+   parses them back and compares the result against the original tree. */
+
+static int test_build_types(struct prop **out);
+static int test_build_caves(struct prop **out);
+static int test_build_raw_names(struct prop **out);
+static int test_append(struct prop *parent, struct prop **out, const char *name,
+                       enum prop_type type, const void *bytes, uint32_t nbytes);
+static int test_round_trip(const char *desc, struct prop *p, bool packed_names);
+static int test_build_binary(const struct prop *p, bool packed_names,
+                             void **out_bytes, size_t *out_nbytes);
+static int test_build_node(struct prop_binary_builder *b, const struct prop *p);
+static bool test_compare(const struct prop *expected,
+                         const struct prop *actual);
+
+int main(void) {
+  struct prop *p;
+  int r;
+
+  r = test_build_types(&p);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = test_round_trip("types", p, true);
+  prop_free(p);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = test_build_caves(&p);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = test_round_trip("caves", p, true);
+  prop_free(p);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = test_build_raw_names(&p);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = test_round_trip("raw names", p, false);
+  prop_free(p);
+
+end:
+  if (r < 0) {
+    log_write("%s (%i)", strerror(-r), r);
+
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* One node for every type, plus a three-item array of every fixed-size one,
+   and empty variable-size values. Values are arbitrary byte patterns, since
+   the writer doesn't care what they mean. */
+
+static int test_build_types(struct prop **out) {
+  uint8_t bytes[3 * 32];
+  struct prop *root;
+  struct prop *child;
+  enum prop_type type;
+  char name[32];
+  size_t i;
+  int size;
+  int r;
+
+  r = prop_alloc(&root, "types", PROP_VOID, NULL, 0);
+
+  if (r < 0) {
+    return r;
+  }
+
+  r = prop_set_attr(root, "version", "1");
+
+  if (r < 0) {
+    goto end;
+  }
+
+  for (type = PROP_VOID; type < PROP_ARRAY_FLAG; type++) {
+    if (!prop_type_is_valid(type)) {
+      continue;
+    }
+
+    size = prop_type_to_size(type);
+
+    for (i = 0; i < sizeof(bytes); i++) {
+      bytes[i] = type * 31 + i * 7;
+    }
+
+    snprintf(name, sizeof(name), "t_%s", prop_type_to_string(type));
+
+    if (type == PROP_STR) {
+      r = test_append(root, &child, name, type, "str\xE3\x81\x82", 7);
+    } else if (size < 0) {
+      r = test_append(root, &child, name, type, bytes, 5);
+    } else {
+      r = test_append(root, &child, name, type, bytes, size);
+    }
+
+    if (r < 0) {
+      goto end;
+    }
+
+    r = prop_set_attr(child, "__type", prop_type_to_string(type));
+
+    if (r < 0) {
+      goto end;
+    }
+
+    if (size <= 0) {
+      continue;
+    }
+
+    r = test_append(root, &child, name, type | PROP_ARRAY_FLAG, bytes,
+                    3 * size);
+
+    if (r < 0) {
+      goto end;
+    }
+
+    r = test_append(root, &child, name, type | PROP_ARRAY_FLAG, NULL, 0);
+
+    if (r < 0) {
+      goto end;
+    }
+  }
+
+  r = test_append(root, &child, "empty_bin", PROP_BIN, NULL, 0);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = test_append(root, &child, "empty_str", PROP_STR, "", 1);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  *out = root;
+  root = NULL;
+
+end:
+  prop_free(root);
+
+  return r;
+}
+
+/* 1- and 2-byte values interleaved with larger ones and with attributes
+   (which live in the body too), so that caves get opened, shared, filled up
+   and left partly empty at the end. Nested nodes share caves with their
+   ancestors' siblings as well. */
+
+static int test_build_caves(struct prop **out) {
+  static const enum prop_type types[] = {
+      PROP_U8,  PROP_S16, PROP_U8,  PROP_U32, PROP_S8,   PROP_BOOL,
+      PROP_U16, PROP_U8,  PROP_2U8, PROP_U8,  PROP_S64,  PROP_2S8,
+      PROP_S8,  PROP_U16, PROP_STR, PROP_U8,  PROP_2BOOL, PROP_S16,
+      PROP_U8,
+  };
+
+  uint8_t bytes[8];
+  struct prop *root;
+  struct prop *parent;
+  struct prop *child;
+  size_t i;
+  int r;
+
+  r = prop_alloc(&root, "caves", PROP_U8, "\x01", 1);
+
+  if (r < 0) {
+    return r;
+  }
+
+  parent = root;
+
+  for (i = 0; i < lengthof(types); i++) {
+    memset(bytes, 0x10 + i, sizeof(bytes));
+
+    if (types[i] == PROP_STR) {
+      r = test_append(parent, &child, "s", types[i], "abc", 4);
+    } else {
+      r = test_append(parent, &child, "v", types[i], bytes,
+                      prop_type_to_size(types[i]));
+    }
+
+    if (r < 0) {
+      goto end;
+    }
+
+    if (i % 4 == 1) {
+      r = prop_set_attr(child, "k", "vv");
+
+      if (r < 0) {
+        goto end;
+      }
+    }
+
+    if (i % 5 == 2) {
+      parent = child;
+    }
+  }
+
+  *out = root;
+  root = NULL;
+
+end:
+  prop_free(root);
+
+  return r;
+}
+
+/* Names with characters outside of the packed name alphabet, including one
+   of the longest length that a raw name can have. */
+
+static int test_build_raw_names(struct prop **out) {
+  char name[65];
+  struct prop *root;
+  struct prop *child;
+  int r;
+
+  r = prop_alloc(&root, "raw-names", PROP_VOID, NULL, 0);
+
+  if (r < 0) {
+    return r;
+  }
+
+  prop_set_encoding(root, PROP_ENCODING_UTF_8);
+  r = prop_set_attr(root, "a.b", "c");
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = test_append(root, &child, "x.y", PROP_U8, "\x2A", 1);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_set_attr(child, "packable", "too");
+
+  if (r < 0) {
+    goto end;
+  }
+
+  memset(name, 'n', sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  name[10] = '.';
+
+  r = test_append(child, &child, name, PROP_S32, "\x80\x00\x00\x01", 4);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = test_append(root, &child, "Ok_name09", PROP_STR, "\xE3\x81\x82", 4);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  *out = root;
+  root = NULL;
+
+end:
+  prop_free(root);
+
+  return r;
+}
+
+static int test_append(struct prop *parent, struct prop **out, const char *name,
+                       enum prop_type type, const void *bytes,
+                       uint32_t nbytes) {
+  int r;
+
+  r = prop_alloc(out, name, type, bytes, nbytes);
+
+  if (r < 0) {
+    return r;
+  }
+
+  prop_append(parent, *out);
+
+  return 0;
+}
+
+static int test_round_trip(const char *desc, struct prop *p,
+                           bool packed_names) {
+  struct prop *parsed;
+  uint8_t *built;
+  uint8_t *bytes;
+  size_t built_nbytes;
+  size_t nbytes;
+  int r;
+
+  bytes = NULL;
+  built = NULL;
+  built_nbytes = 0;
+  parsed = NULL;
+
+  r = prop_binary_write(p, (void **)&bytes, &nbytes);
+
+  if (r < 0) {
+    log_write("%s: Write failed", desc);
+
+    goto end;
+  }
+
+  if (nbytes < 2 || bytes[1] != (packed_names ? 0x42 : 0x45)) {
+    log_write("%s: Expected %s names", desc, packed_names ? "packed" : "raw");
+    r = -EINVAL;
+
+    goto end;
+  }
+
+  r = test_build_binary(p, packed_names, (void **)&built, &built_nbytes);
+
+  if (r < 0) {
+    log_write("%s: Builder failed", desc);
+
+    goto end;
+  }
+
+  if (built_nbytes != nbytes || memcmp(built, bytes, nbytes) != 0) {
+    log_write("%s: Builder output differs from prop_binary_write()", desc);
+    r = -EINVAL;
+
+    goto end;
+  }
+
+  r = prop_binary_parse(&parsed, bytes, nbytes);
+
+  if (r < 0) {
+    log_write("%s: Parse failed", desc);
+
+    goto end;
+  }
+
+  if (prop_get_encoding(parsed) != prop_get_encoding(p) ||
+      !test_compare(p, parsed)) {
+    log_write("%s: Parsed tree differs from the original", desc);
+    r = -EINVAL;
+
+    goto end;
+  }
+
+  printf("%s: OK (%lu bytes)\n", desc, (unsigned long)nbytes);
+
+end:
+  prop_free(parsed);
+  free(built);
+  free(bytes);
+
+  return r;
+}
+
+static int test_build_binary(const struct prop *p, bool packed_names,
+                             void **out_bytes, size_t *out_nbytes) {
+  struct prop_binary_builder *b;
+  uint8_t *bytes;
+  FILE *f;
+  long nbytes;
+  int r;
+
+  b = NULL;
+  bytes = NULL;
+  f = tmpfile();
+
+  if (f == NULL) {
+    return -errno;
+  }
+
+  r = prop_binary_builder_alloc(&b);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  prop_binary_builder_set_encoding(b, prop_get_encoding(p));
+  prop_binary_builder_set_packed_names(b, packed_names);
+
+  r = test_build_node(b, p);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_binary_builder_finish(b, f);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  nbytes = ftell(f);
+  bytes = malloc(nbytes);
+
+  if (nbytes < 0 || bytes == NULL) {
+    r = -ENOMEM;
+
+    goto end;
+  }
+
+  rewind(f);
+
+  if (fread(bytes, 1, nbytes, f) != (size_t)nbytes) {
+    r = -EIO;
+
+    goto end;
+  }
+
+  *out_bytes = bytes;
+  *out_nbytes = nbytes;
+  bytes = NULL;
+
+end:
+  free(bytes);
+  prop_binary_builder_free(b);
+  fclose(f);
+
+  return r;
+}
+
+static int test_build_node(struct prop_binary_builder *b,
+                           const struct prop *p) {
+  struct const_iobuf value;
+  const struct prop *child;
+  const struct attr *a;
+  int r;
+
+  prop_borrow_value(p, &value);
+  r = prop_binary_builder_begin_node(b, prop_get_name(p), prop_get_type(p),
+                                     &value);
+
+  if (r < 0) {
+    return r;
+  }
+
+  for (a = prop_get_first_attr(p); a != NULL; a = attr_get_next_sibling(a)) {
+    r = prop_binary_builder_attr(b, attr_get_key(a), attr_get_val(a));
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  for (child = prop_get_first_child_const(p); child != NULL;
+       child = prop_get_next_sibling_const(child)) {
+    r = test_build_node(b, child);
+
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  return prop_binary_builder_end_node(b);
+}
+
+static bool test_compare(const struct prop *expected,
+                         const struct prop *actual) {
+  struct const_iobuf lhs;
+  struct const_iobuf rhs;
+  const struct attr *la;
+  const struct attr *ra;
+  const struct prop *lc;
+  const struct prop *rc;
+
+  if (!str_eq(prop_get_name(expected), prop_get_name(actual))) {
+    log_write("Expected node \"%s\", got \"%s\"", prop_get_name(expected),
+              prop_get_name(actual));
+
+    return false;
+  }
+
+  prop_borrow_value(expected, &lhs);
+  prop_borrow_value(actual, &rhs);
+
+  if (prop_get_type(expected) != prop_get_type(actual) ||
+      lhs.nbytes != rhs.nbytes ||
+      (lhs.nbytes > 0 && memcmp(lhs.bytes, rhs.bytes, lhs.nbytes) != 0)) {
+    log_write("\"%s\": Type or value differs", prop_get_name(expected));
+
+    return false;
+  }
+
+  la = prop_get_first_attr(expected);
+  ra = prop_get_first_attr(actual);
+
+  while (la != NULL && ra != NULL) {
+    if (!str_eq(attr_get_key(la), attr_get_key(ra)) ||
+        !str_eq(attr_get_val(la), attr_get_val(ra))) {
+      log_write("\"%s\": Attribute \"%s\" differs", prop_get_name(expected),
+                attr_get_key(la));
+
+      return false;
+    }
+
+    la = attr_get_next_sibling(la);
+    ra = attr_get_next_sibling(ra);
+  }
+
+  if (la != NULL || ra != NULL) {
+    log_write("\"%s\": Attribute count differs", prop_get_name(expected));
+
+    return false;
+  }
+
+  lc = prop_get_first_child_const(expected);
+  rc = prop_get_first_child_const(actual);
+
+  while (lc != NULL && rc != NULL) {
+    if (!test_compare(lc, rc)) {
+      return false;
+    }
+
+    lc = prop_get_next_sibling_const(lc);
+    rc = prop_get_next_sibling_const(rc);
+  }
+
+  if (lc != NULL || rc != NULL) {
+    log_write("\"%s\": Child count differs", prop_get_name(expected));
+
+    return false;
+  }
+
+  return true;
+}
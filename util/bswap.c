@@ -0,0 +1,176 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/bswap.h"
+
+/* On x86 we pick an SSSE3 or AVX2 pshufb kernel at runtime for the bulk of
+   the array, and finish off the tail with the portable scalar loop. The scalar
+   loop is also what everybody else gets, big-endian hosts included, since it
+   assembles each value byte by byte. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BSWAP_X86
+#include <immintrin.h>
+#endif
+
+static void bswap_be16_scalar(uint16_t *dest, const uint8_t *src, size_t count);
+static void bswap_be32_scalar(uint32_t *dest, const uint8_t *src, size_t count);
+static void bswap_be64_scalar(uint64_t *dest, const uint8_t *src, size_t count);
+
+#ifdef BSWAP_X86
+
+static size_t bswap_simd(void *dest, const void *src, size_t nbytes,
+                         const uint8_t *mask);
+static size_t bswap_ssse3(void *dest, const void *src, size_t nbytes,
+                          const uint8_t *mask)
+    __attribute__((target("ssse3")));
+static size_t bswap_avx2(void *dest, const void *src, size_t nbytes,
+                         const uint8_t *mask) __attribute__((target("avx2")));
+
+/* pshufb masks, repeated for both 128-bit lanes of an AVX2 register */
+
+static const uint8_t bswap16_mask[32] = {
+    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+};
+
+static const uint8_t bswap32_mask[32] = {
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+};
+
+static const uint8_t bswap64_mask[32] = {
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+};
+
+#endif
+
+void bswap_be16_array(uint16_t *dest, const void *src, size_t count) {
+  size_t done;
+
+  done = 0;
+
+#ifdef BSWAP_X86
+  done = bswap_simd(dest, src, count * 2, bswap16_mask) / 2;
+#endif
+
+  bswap_be16_scalar(dest + done, (const uint8_t *)src + done * 2, count - done);
+}
+
+void bswap_be32_array(uint32_t *dest, const void *src, size_t count) {
+  size_t done;
+
+  done = 0;
+
+#ifdef BSWAP_X86
+  done = bswap_simd(dest, src, count * 4, bswap32_mask) / 4;
+#endif
+
+  bswap_be32_scalar(dest + done, (const uint8_t *)src + done * 4, count - done);
+}
+
+void bswap_be64_array(uint64_t *dest, const void *src, size_t count) {
+  size_t done;
+
+  done = 0;
+
+#ifdef BSWAP_X86
+  done = bswap_simd(dest, src, count * 8, bswap64_mask) / 8;
+#endif
+
+  bswap_be64_scalar(dest + done, (const uint8_t *)src + done * 8, count - done);
+}
+
+static void bswap_be16_scalar(uint16_t *dest, const uint8_t *src,
+                              size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i++, src += 2) {
+    dest[i] = ((uint16_t)src[0] << 8) | src[1];
+  }
+}
+
+static void bswap_be32_scalar(uint32_t *dest, const uint8_t *src,
+                              size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i++, src += 4) {
+    dest[i] = ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) |
+              ((uint32_t)src[2] << 8) | src[3];
+  }
+}
+
+static void bswap_be64_scalar(uint64_t *dest, const uint8_t *src,
+                              size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i++, src += 8) {
+    dest[i] = ((uint64_t)src[0] << 56) | ((uint64_t)src[1] << 48) |
+              ((uint64_t)src[2] << 40) | ((uint64_t)src[3] << 32) |
+              ((uint64_t)src[4] << 24) | ((uint64_t)src[5] << 16) |
+              ((uint64_t)src[6] << 8) | src[7];
+  }
+}
+
+#ifdef BSWAP_X86
+
+/* These return how many bytes they got through, always a multiple of their
+   vector width. */
+
+static size_t bswap_simd(void *dest, const void *src, size_t nbytes,
+                         const uint8_t *mask) {
+  if (__builtin_cpu_supports("avx2")) {
+    return bswap_avx2(dest, src, nbytes, mask);
+  } else if (__builtin_cpu_supports("ssse3")) {
+    return bswap_ssse3(dest, src, nbytes, mask);
+  } else {
+    return 0;
+  }
+}
+
+static size_t bswap_ssse3(void *dest, const void *src, size_t nbytes,
+                          const uint8_t *mask) {
+  __m128i shuf;
+  __m128i v;
+  size_t i;
+
+  shuf = _mm_loadu_si128((const __m128i *)mask);
+
+  for (i = 0; i + 16 <= nbytes; i += 16) {
+    v = _mm_loadu_si128((const __m128i *)((const uint8_t *)src + i));
+    v = _mm_shuffle_epi8(v, shuf);
+    _mm_storeu_si128((__m128i *)((uint8_t *)dest + i), v);
+  }
+
+  return i;
+}
+
+static size_t bswap_avx2(void *dest, const void *src, size_t nbytes,
+                         const uint8_t *mask) {
+  __m256i shuf;
+  __m256i v0;
+  __m256i v1;
+  size_t i;
+
+  shuf = _mm256_loadu_si256((const __m256i *)mask);
+
+  for (i = 0; i + 64 <= nbytes; i += 64) {
+    v0 = _mm256_loadu_si256((const __m256i *)((const uint8_t *)src + i));
+    v1 = _mm256_loadu_si256((const __m256i *)((const uint8_t *)src + i + 32));
+    v0 = _mm256_shuffle_epi8(v0, shuf);
+    v1 = _mm256_shuffle_epi8(v1, shuf);
+    _mm256_storeu_si256((__m256i *)((uint8_t *)dest + i), v0);
+    _mm256_storeu_si256((__m256i *)((uint8_t *)dest + i + 32), v1);
+  }
+
+  for (; i + 32 <= nbytes; i += 32) {
+    v0 = _mm256_loadu_si256((const __m256i *)((const uint8_t *)src + i));
+    v0 = _mm256_shuffle_epi8(v0, shuf);
+    _mm256_storeu_si256((__m256i *)((uint8_t *)dest + i), v0);
+  }
+
+  return i;
+}
+
+#endif
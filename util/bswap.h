@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Convert arrays of big-endian values into native byte order. src needs no
+   particular alignment, and may be the same buffer as dest, but the two must
+   not otherwise overlap. */
+
+void bswap_be16_array(uint16_t *dest, const void *src, size_t count);
+void bswap_be32_array(uint32_t *dest, const void *src, size_t count);
+void bswap_be64_array(uint64_t *dest, const void *src, size_t count);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Shift-JIS double-byte characters, as mapped by Windows code page 932 */
+
+#define CHARSET_SJIS_LEADS 60
+#define CHARSET_SJIS_TRAILS 189
+#define CHARSET_SJIS_NREV 9206
+
+extern const uint16_t charset_sjis_table[CHARSET_SJIS_LEADS]
+                                        [CHARSET_SJIS_TRAILS];
+extern const uint16_t charset_sjis_rev_chars[CHARSET_SJIS_NREV];
+extern const uint16_t charset_sjis_rev_codes[CHARSET_SJIS_NREV];
@@ -0,0 +1,424 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/charset-sjis.h"
+#include "util/charset.h"
+#include "util/str.h"
+
+static size_t charset_decode_euc_jp(uint32_t *out, const uint8_t *bytes,
+                                    size_t nbytes);
+static size_t charset_decode_sjis(uint32_t *out, const uint8_t *bytes,
+                                  size_t nbytes);
+static size_t charset_decode_utf8(uint32_t *out, const uint8_t *bytes,
+                                  size_t nbytes);
+static size_t charset_encode_euc_jp(uint8_t *out, uint32_t c);
+static size_t charset_encode_sjis(uint8_t *out, uint32_t c);
+static size_t charset_encode_utf8(uint8_t *out, uint32_t c);
+static uint16_t charset_sjis_find(uint32_t c);
+static uint32_t charset_sjis_lookup(uint8_t lead, uint8_t trail);
+
+size_t charset_decode(enum charset cs, uint32_t *out, const void *bytes,
+                      size_t nbytes) {
+  const uint8_t *b;
+
+  assert(out != NULL);
+  assert(bytes != NULL);
+  assert(nbytes > 0);
+
+  b = bytes;
+
+  if (b[0] < 0x80) {
+    *out = b[0];
+
+    return 1;
+  }
+
+  switch (cs) {
+  case CHARSET_ISO_8859_1:
+    *out = b[0];
+
+    return 1;
+
+  case CHARSET_EUC_JP:
+    return charset_decode_euc_jp(out, b, nbytes);
+
+  case CHARSET_SHIFT_JIS:
+    return charset_decode_sjis(out, b, nbytes);
+
+  case CHARSET_UTF_8:
+    return charset_decode_utf8(out, b, nbytes);
+
+  default:
+    *out = CHARSET_REPLACEMENT;
+
+    return 1;
+  }
+}
+
+size_t charset_encode(enum charset cs, uint8_t *out, uint32_t c) {
+  assert(out != NULL);
+
+  if (c < 0x80) {
+    out[0] = c;
+
+    return 1;
+  }
+
+  switch (cs) {
+  case CHARSET_ISO_8859_1:
+    if (c > 0xFF) {
+      return 0;
+    }
+
+    out[0] = c;
+
+    return 1;
+
+  case CHARSET_EUC_JP:
+    return charset_encode_euc_jp(out, c);
+
+  case CHARSET_SHIFT_JIS:
+    return charset_encode_sjis(out, c);
+
+  case CHARSET_UTF_8:
+    return charset_encode_utf8(out, c);
+
+  default:
+    return 0;
+  }
+}
+
+void charset_put_utf8(struct strbuf *dest, uint32_t c) {
+  assert(dest != NULL);
+
+  if (c >= 0x110000 || (c >= 0xD800 && c <= 0xDFFF)) {
+    c = CHARSET_REPLACEMENT;
+  }
+
+  if (c < 0x80) {
+    strbuf_putc(dest, c);
+  } else if (c < 0x800) {
+    strbuf_putc(dest, 0xC0 | (c >> 6));
+    strbuf_putc(dest, 0x80 | (c & 0x3F));
+  } else if (c < 0x10000) {
+    strbuf_putc(dest, 0xE0 | (c >> 12));
+    strbuf_putc(dest, 0x80 | ((c >> 6) & 0x3F));
+    strbuf_putc(dest, 0x80 | (c & 0x3F));
+  } else {
+    strbuf_putc(dest, 0xF0 | (c >> 18));
+    strbuf_putc(dest, 0x80 | ((c >> 12) & 0x3F));
+    strbuf_putc(dest, 0x80 | ((c >> 6) & 0x3F));
+    strbuf_putc(dest, 0x80 | (c & 0x3F));
+  }
+}
+
+void charset_put_utf8_str(struct strbuf *dest, enum charset cs,
+                          const char *chars, size_t nchars) {
+  size_t pos;
+  size_t end;
+  uint32_t c;
+
+  assert(dest != NULL);
+  assert(chars != NULL || nchars == 0);
+
+  pos = 0;
+
+  while (pos < nchars) {
+    end = pos;
+
+    while (end < nchars && (uint8_t)chars[end] < 0x80) {
+      end++;
+    }
+
+    strbuf_putn(dest, chars + pos, end - pos);
+    pos = end;
+
+    if (pos < nchars) {
+      pos += charset_decode(cs, &c, chars + pos, nchars - pos);
+      charset_put_utf8(dest, c);
+    }
+  }
+}
+
+/* EUC-JP puts the JIS X 0208 row and cell in two bytes from 0xA1 upwards,
+   which we rearrange into the equivalent Shift-JIS pair. 0x8E introduces a
+   half-width katakana and 0x8F a JIS X 0212 character. */
+
+static size_t charset_decode_euc_jp(uint32_t *out, const uint8_t *bytes,
+                                    size_t nbytes) {
+  unsigned int row;
+  unsigned int cell;
+  uint8_t lead;
+  uint8_t trail;
+
+  *out = CHARSET_REPLACEMENT;
+
+  if (bytes[0] == 0x8E) {
+    if (nbytes < 2 || bytes[1] < 0xA1 || bytes[1] > 0xDF) {
+      return 1;
+    }
+
+    *out = 0xFF61 + (bytes[1] - 0xA1);
+
+    return 2;
+  }
+
+  if (bytes[0] == 0x8F) {
+    if (nbytes < 3 || bytes[1] < 0xA1 || bytes[1] == 0xFF ||
+        bytes[2] < 0xA1 || bytes[2] == 0xFF) {
+      return 1;
+    }
+
+    return 3;
+  }
+
+  if (bytes[0] < 0xA1 || bytes[0] == 0xFF || nbytes < 2 || bytes[1] < 0xA1 ||
+      bytes[1] == 0xFF) {
+    return 1;
+  }
+
+  row = bytes[0] - 0xA0;
+  cell = bytes[1] - 0xA0;
+  lead = (row + 1) / 2 + (row <= 62 ? 0x80 : 0xC0);
+
+  if (row % 2 != 0) {
+    trail = cell + (cell < 64 ? 0x3F : 0x40);
+  } else {
+    trail = cell + 0x9E;
+  }
+
+  *out = charset_sjis_lookup(lead, trail);
+
+  return 2;
+}
+
+static size_t charset_decode_sjis(uint32_t *out, const uint8_t *bytes,
+                                  size_t nbytes) {
+  uint8_t lead;
+  uint8_t trail;
+
+  lead = bytes[0];
+
+  if (lead >= 0xA1 && lead <= 0xDF) {
+    *out = 0xFF61 + (lead - 0xA1);
+
+    return 1;
+  }
+
+  *out = CHARSET_REPLACEMENT;
+
+  if (lead == 0x80 || lead == 0xA0 || lead >= 0xFD || nbytes < 2) {
+    return 1;
+  }
+
+  trail = bytes[1];
+
+  if (trail < 0x40 || trail == 0x7F || trail >= 0xFD) {
+    return 1;
+  }
+
+  *out = charset_sjis_lookup(lead, trail);
+
+  return 2;
+}
+
+/* The inverse of charset_decode_euc_jp(). Only the first 94 rows exist in
+   EUC-JP, so the IBM extensions at the end of code page 932 don't make it. */
+
+static size_t charset_encode_euc_jp(uint8_t *out, uint32_t c) {
+  unsigned int row;
+  unsigned int cell;
+  unsigned int pair;
+  uint16_t code;
+  uint8_t lead;
+  uint8_t trail;
+
+  if (c >= 0xFF61 && c <= 0xFF9F) {
+    out[0] = 0x8E;
+    out[1] = 0xA1 + (c - 0xFF61);
+
+    return 2;
+  }
+
+  code = charset_sjis_find(c);
+
+  if (code == 0) {
+    return 0;
+  }
+
+  lead = code >> 8;
+  trail = code & 0xFF;
+
+  if (lead <= 0x9F) {
+    pair = lead - 0x80;
+  } else if (lead <= 0xEF) {
+    pair = lead - 0xC0;
+  } else {
+    return 0;
+  }
+
+  if (trail >= 0x9F) {
+    row = pair * 2;
+    cell = trail - 0x9E;
+  } else {
+    row = pair * 2 - 1;
+    cell = trail - (trail < 0x7F ? 0x3F : 0x40);
+  }
+
+  out[0] = 0xA0 + row;
+  out[1] = 0xA0 + cell;
+
+  return 2;
+}
+
+static size_t charset_encode_sjis(uint8_t *out, uint32_t c) {
+  uint16_t code;
+
+  if (c >= 0xFF61 && c <= 0xFF9F) {
+    out[0] = 0xA1 + (c - 0xFF61);
+
+    return 1;
+  }
+
+  code = charset_sjis_find(c);
+
+  if (code == 0) {
+    return 0;
+  }
+
+  out[0] = code >> 8;
+  out[1] = code & 0xFF;
+
+  return 2;
+}
+
+static size_t charset_encode_utf8(uint8_t *out, uint32_t c) {
+  if (c >= 0x110000 || (c >= 0xD800 && c <= 0xDFFF)) {
+    return 0;
+  }
+
+  if (c < 0x800) {
+    out[0] = 0xC0 | (c >> 6);
+    out[1] = 0x80 | (c & 0x3F);
+
+    return 2;
+  } else if (c < 0x10000) {
+    out[0] = 0xE0 | (c >> 12);
+    out[1] = 0x80 | ((c >> 6) & 0x3F);
+    out[2] = 0x80 | (c & 0x3F);
+
+    return 3;
+  } else {
+    out[0] = 0xF0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3F);
+    out[2] = 0x80 | ((c >> 6) & 0x3F);
+    out[3] = 0x80 | (c & 0x3F);
+
+    return 4;
+  }
+}
+
+/* Malformed sequences are replaced the way the Unicode standard recommends:
+   one U+FFFD for each maximal prefix of a valid sequence. The range allowed
+   for the second byte rules out overlong forms, surrogates and anything past
+   U+10FFFF. */
+
+static size_t charset_decode_utf8(uint32_t *out, const uint8_t *bytes,
+                                  size_t nbytes) {
+  uint32_t c;
+  uint8_t lo;
+  uint8_t hi;
+  size_t len;
+  size_t i;
+
+  *out = CHARSET_REPLACEMENT;
+  lo = 0x80;
+  hi = 0xBF;
+
+  if (bytes[0] >= 0xC2 && bytes[0] <= 0xDF) {
+    c = bytes[0] & 0x1F;
+    len = 2;
+  } else if (bytes[0] >= 0xE0 && bytes[0] <= 0xEF) {
+    c = bytes[0] & 0x0F;
+    len = 3;
+
+    if (bytes[0] == 0xE0) {
+      lo = 0xA0;
+    } else if (bytes[0] == 0xED) {
+      hi = 0x9F;
+    }
+  } else if (bytes[0] >= 0xF0 && bytes[0] <= 0xF4) {
+    c = bytes[0] & 0x07;
+    len = 4;
+
+    if (bytes[0] == 0xF0) {
+      lo = 0x90;
+    } else if (bytes[0] == 0xF4) {
+      hi = 0x8F;
+    }
+  } else {
+    return 1;
+  }
+
+  for (i = 1; i < len; i++) {
+    if (i >= nbytes || bytes[i] < lo || bytes[i] > hi) {
+      return i;
+    }
+
+    c = (c << 6) | (bytes[i] & 0x3F);
+    lo = 0x80;
+    hi = 0xBF;
+  }
+
+  *out = c;
+
+  return len;
+}
+
+static uint32_t charset_sjis_lookup(uint8_t lead, uint8_t trail) {
+  unsigned int row;
+  uint16_t c;
+
+  assert(lead >= 0x81 && lead <= 0xFC);
+  assert(trail >= 0x40 && trail <= 0xFC);
+
+  if (lead < 0xA0) {
+    row = lead - 0x81;
+  } else {
+    assert(lead >= 0xE0);
+
+    row = lead - 0xE0 + 0x1F;
+  }
+
+  c = charset_sjis_table[row][trail - 0x40];
+
+  return c != 0 ? c : CHARSET_REPLACEMENT;
+}
+
+/* Returns the Shift-JIS pair for a character, or zero if there isn't one */
+
+static uint16_t charset_sjis_find(uint32_t c) {
+  size_t lo;
+  size_t hi;
+  size_t mid;
+
+  lo = 0;
+  hi = CHARSET_SJIS_NREV;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+
+    if (charset_sjis_rev_chars[mid] < c) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo == CHARSET_SJIS_NREV || charset_sjis_rev_chars[lo] != c) {
+    return 0;
+  }
+
+  return charset_sjis_rev_codes[lo];
+}
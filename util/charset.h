@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/str.h"
+
+/* Conversion of legacy 8-bit and multi-byte text into Unicode. Shift-JIS
+   follows Windows code page 932, and EUC-JP maps its JIS X 0208 plane through
+   the same table. JIS X 0212 characters are not supported. */
+
+enum charset {
+  CHARSET_ASCII,
+  CHARSET_ISO_8859_1,
+  CHARSET_EUC_JP,
+  CHARSET_SHIFT_JIS,
+  CHARSET_UTF_8,
+};
+
+#define CHARSET_REPLACEMENT 0xFFFD
+#define CHARSET_MAX_NBYTES 4
+
+/* Decodes the character at the start of a non-empty buffer and returns the
+   number of bytes it took up. Malformed input decodes to CHARSET_REPLACEMENT
+   without swallowing any valid character that follows it. */
+
+size_t charset_decode(enum charset cs, uint32_t *out, const void *bytes,
+                      size_t nbytes);
+
+/* Encodes a character into at most CHARSET_MAX_NBYTES bytes and returns the
+   number of bytes written, or zero if the charset can't represent it. */
+
+size_t charset_encode(enum charset cs, uint8_t *out, uint32_t c);
+
+void charset_put_utf8(struct strbuf *dest, uint32_t c);
+
+/* Transcodes a whole string to UTF-8, malformed characters and all, just as
+   decoding and putting one character at a time would. */
+
+void charset_put_utf8_str(struct strbuf *dest, enum charset cs,
+                          const char *chars, size_t nchars);
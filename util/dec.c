@@ -0,0 +1,133 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/dec.h"
+
+static size_t dec_count_u32(uint32_t value);
+static size_t dec_count_u64(uint64_t value);
+
+/* Two digits at a time halves the number of divisions */
+
+static const char dec_pairs[200] = {
+    '0', '0', '0', '1', '0', '2', '0', '3', '0', '4', '0', '5', '0', '6', '0',
+    '7', '0', '8', '0', '9', '1', '0', '1', '1', '1', '2', '1', '3', '1', '4',
+    '1', '5', '1', '6', '1', '7', '1', '8', '1', '9', '2', '0', '2', '1', '2',
+    '2', '2', '3', '2', '4', '2', '5', '2', '6', '2', '7', '2', '8', '2', '9',
+    '3', '0', '3', '1', '3', '2', '3', '3', '3', '4', '3', '5', '3', '6', '3',
+    '7', '3', '8', '3', '9', '4', '0', '4', '1', '4', '2', '4', '3', '4', '4',
+    '4', '5', '4', '6', '4', '7', '4', '8', '4', '9', '5', '0', '5', '1', '5',
+    '2', '5', '3', '5', '4', '5', '5', '5', '6', '5', '7', '5', '8', '5', '9',
+    '6', '0', '6', '1', '6', '2', '6', '3', '6', '4', '6', '5', '6', '6', '6',
+    '7', '6', '8', '6', '9', '7', '0', '7', '1', '7', '2', '7', '3', '7', '4',
+    '7', '5', '7', '6', '7', '7', '7', '8', '7', '9', '8', '0', '8', '1', '8',
+    '2', '8', '3', '8', '4', '8', '5', '8', '6', '8', '7', '8', '8', '8', '9',
+    '9', '0', '9', '1', '9', '2', '9', '3', '9', '4', '9', '5', '9', '6', '9',
+    '7', '9', '8', '9', '9',
+};
+
+size_t dec_format_s32(char *dest, int32_t value) {
+  assert(dest != NULL);
+
+  if (value < 0) {
+    dest[0] = '-';
+
+    return dec_format_u32(dest + 1, 0U - (uint32_t)value) + 1;
+  }
+
+  return dec_format_u32(dest, value);
+}
+
+size_t dec_format_u32(char *dest, uint32_t value) {
+  size_t nchars;
+  uint32_t pair;
+  char *pos;
+
+  assert(dest != NULL);
+
+  nchars = dec_count_u32(value);
+  pos = dest + nchars;
+
+  while (value >= 100) {
+    pair = (value % 100) * 2;
+    value /= 100;
+    *--pos = dec_pairs[pair + 1];
+    *--pos = dec_pairs[pair];
+  }
+
+  if (value >= 10) {
+    *--pos = dec_pairs[value * 2 + 1];
+    *--pos = dec_pairs[value * 2];
+  } else {
+    *--pos = '0' + value;
+  }
+
+  return nchars;
+}
+
+size_t dec_format_s64(char *dest, int64_t value) {
+  assert(dest != NULL);
+
+  if (value < 0) {
+    dest[0] = '-';
+
+    return dec_format_u64(dest + 1, 0U - (uint64_t)value) + 1;
+  }
+
+  return dec_format_u64(dest, value);
+}
+
+/* 64-bit division is slow on some targets, so only do as much of it as it
+   takes to get the rest of the number down to 32 bits. */
+
+size_t dec_format_u64(char *dest, uint64_t value) {
+  size_t nchars;
+  uint32_t pair;
+  char *pos;
+
+  assert(dest != NULL);
+
+  if (value <= UINT32_MAX) {
+    return dec_format_u32(dest, value);
+  }
+
+  nchars = dec_count_u64(value);
+  pos = dest + nchars;
+
+  while (value > UINT32_MAX) {
+    pair = (value % 100) * 2;
+    value /= 100;
+    *--pos = dec_pairs[pair + 1];
+    *--pos = dec_pairs[pair];
+  }
+
+  dec_format_u32(dest, value);
+
+  return nchars;
+}
+
+static size_t dec_count_u32(uint32_t value) {
+  uint32_t limit;
+  size_t nchars;
+
+  limit = 10;
+
+  for (nchars = 1; nchars < 10 && value >= limit; nchars++) {
+    limit *= 10;
+  }
+
+  return nchars;
+}
+
+static size_t dec_count_u64(uint64_t value) {
+  uint64_t limit;
+  size_t nchars;
+
+  limit = 10;
+
+  for (nchars = 1; nchars < 20 && value >= limit; nchars++) {
+    limit *= 10;
+  }
+
+  return nchars;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Decimal integer formatting for places where printf is too slow. These
+   write the digits (and sign) to dest without a NUL terminator and return
+   how many chars that took, which is never more than DEC_MAX_NCHARS. */
+
+#define DEC_MAX_NCHARS 20
+
+size_t dec_format_s32(char *dest, int32_t value);
+size_t dec_format_u32(char *dest, uint32_t value);
+size_t dec_format_s64(char *dest, int64_t value);
+size_t dec_format_u64(char *dest, uint64_t value);
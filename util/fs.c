@@ -1,11 +1,20 @@
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
 #include "util/fs.h"
 #include "util/iobuf.h"
 #include "util/log.h"
@@ -184,6 +193,59 @@ end:
   return r;
 }
 
+int fs_read_all(FILE *f, void **out_bytes, size_t *out_nbytes) {
+  uint8_t *bytes;
+  uint8_t *tmp;
+  size_t nbytes;
+  size_t max_nbytes;
+  int r;
+
+  assert(f != NULL);
+  assert(out_bytes != NULL);
+  assert(out_nbytes != NULL);
+
+  *out_bytes = NULL;
+  *out_nbytes = 0;
+
+  bytes = NULL;
+  nbytes = 0;
+  max_nbytes = 0;
+
+  do {
+    if (nbytes == max_nbytes) {
+      max_nbytes = max_nbytes != 0 ? max_nbytes * 2 : 64 * 1024;
+      tmp = realloc(bytes, max_nbytes);
+
+      if (tmp == NULL) {
+        r = -ENOMEM;
+
+        goto end;
+      }
+
+      bytes = tmp;
+    }
+
+    nbytes += fread(bytes + nbytes, 1, max_nbytes - nbytes, f);
+  } while (nbytes == max_nbytes);
+
+  if (ferror(f)) {
+    r = errno != 0 ? -errno : -EIO;
+    log_write("Read failed: %s (%i)", strerror(-r), r);
+
+    goto end;
+  }
+
+  *out_bytes = bytes;
+  *out_nbytes = nbytes;
+  bytes = NULL;
+  r = 0;
+
+end:
+  free(bytes);
+
+  return r;
+}
+
 int fs_write_file(const char *path, struct const_iobuf *buf) {
   FILE *f;
   int r;
@@ -243,3 +305,178 @@ int fs_mkdir(const char *path) {
 
   return r;
 }
+
+int fs_stat(const char *path, uint64_t *nbytes, int64_t *mtime_ns) {
+  struct stat s;
+  int r;
+
+  assert(path != NULL);
+  assert(nbytes != NULL);
+  assert(mtime_ns != NULL);
+
+  r = stat(path, &s);
+
+  if (r != 0) {
+    return -errno;
+  }
+
+  *nbytes = s.st_size;
+#if defined(_WIN32)
+  *mtime_ns = (int64_t)s.st_mtime * 1000000000;
+#elif defined(__APPLE__)
+  *mtime_ns = (int64_t)s.st_mtimespec.tv_sec * 1000000000 +
+              s.st_mtimespec.tv_nsec;
+#else
+  *mtime_ns = (int64_t)s.st_mtim.tv_sec * 1000000000 + s.st_mtim.tv_nsec;
+#endif
+
+  return 0;
+}
+
+#ifdef _WIN32
+
+int fs_map_file(const char *path, const void **bytes, size_t *nbytes) {
+  LARGE_INTEGER size;
+  HANDLE file;
+  HANDLE mapping;
+  void *view;
+  int r;
+
+  assert(path != NULL);
+  assert(bytes != NULL);
+  assert(nbytes != NULL);
+
+  *bytes = NULL;
+  *nbytes = 0;
+  mapping = NULL;
+
+  file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                     FILE_ATTRIBUTE_NORMAL, NULL);
+
+  if (file == INVALID_HANDLE_VALUE) {
+    r = -ENOENT;
+    log_write("Error opening \"%s\": %#lx", path, GetLastError());
+
+    goto end;
+  }
+
+  if (!GetFileSizeEx(file, &size)) {
+    r = -EIO;
+
+    goto end;
+  }
+
+  if (size.QuadPart == 0 || (uint64_t)size.QuadPart > SIZE_MAX) {
+    r = -EINVAL;
+
+    goto end;
+  }
+
+  mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+  if (mapping == NULL) {
+    r = -EIO;
+    log_write("CreateFileMapping(%s): %#lx", path, GetLastError());
+
+    goto end;
+  }
+
+  view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+  if (view == NULL) {
+    r = -EIO;
+    log_write("MapViewOfFile(%s): %#lx", path, GetLastError());
+
+    goto end;
+  }
+
+  *bytes = view;
+  *nbytes = size.QuadPart;
+  r = 0;
+
+end:
+  /* The view keeps the mapping alive by itself */
+
+  if (mapping != NULL) {
+    CloseHandle(mapping);
+  }
+
+  if (file != INVALID_HANDLE_VALUE) {
+    CloseHandle(file);
+  }
+
+  return r;
+}
+
+void fs_unmap_file(const void *bytes, size_t nbytes) {
+  if (bytes != NULL) {
+    UnmapViewOfFile(bytes);
+  }
+}
+
+#else
+
+int fs_map_file(const char *path, const void **bytes, size_t *nbytes) {
+  struct stat s;
+  void *view;
+  int fd;
+  int r;
+
+  assert(path != NULL);
+  assert(bytes != NULL);
+  assert(nbytes != NULL);
+
+  *bytes = NULL;
+  *nbytes = 0;
+
+  fd = open(path, O_RDONLY);
+
+  if (fd < 0) {
+    r = -errno;
+    log_write("Error opening \"%s\": %s (%i)", path, strerror(-r), r);
+
+    return r;
+  }
+
+  r = fstat(fd, &s);
+
+  if (r != 0) {
+    r = -errno;
+
+    goto end;
+  }
+
+  /* mmap() refuses zero-length mappings */
+
+  if (s.st_size == 0 || (uint64_t)s.st_size > SIZE_MAX) {
+    r = -EINVAL;
+
+    goto end;
+  }
+
+  view = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+  if (view == MAP_FAILED) {
+    r = -errno;
+    log_write("mmap(%s): %s (%i)", path, strerror(-r), r);
+
+    goto end;
+  }
+
+  *bytes = view;
+  *nbytes = s.st_size;
+  r = 0;
+
+end:
+  close(fd);
+
+  return r;
+}
+
+void fs_unmap_file(const void *bytes, size_t nbytes) {
+  if (bytes != NULL) {
+    munmap((void *)bytes, nbytes);
+  }
+}
+
+#endif
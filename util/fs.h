@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "util/iobuf.h"
@@ -11,5 +13,19 @@ int fs_read(FILE *f, struct iobuf *buf);
 int fs_write(FILE *f, struct const_iobuf *buf);
 
 int fs_read_file(const char *path, void **bytes, size_t *nbytes);
+
+/* Reads until EOF, for streams such as pipes that can't be sized up front. */
+
+int fs_read_all(FILE *f, void **bytes, size_t *nbytes);
 int fs_write_file(const char *path, struct const_iobuf *buf);
 int fs_mkdir(const char *path);
+
+/* mtime_ns is in nanoseconds since the epoch, though Windows only gives us
+   whole seconds. */
+
+int fs_stat(const char *path, uint64_t *nbytes, int64_t *mtime_ns);
+
+/* Maps a whole file read-only. Pass the same nbytes back to fs_unmap_file(). */
+
+int fs_map_file(const char *path, const void **bytes, size_t *nbytes);
+void fs_unmap_file(const void *bytes, size_t nbytes);
@@ -0,0 +1,51 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "util/hash.h"
+
+static const uint64_t hash64_m = 0xC6A4A7935BD1E995ULL;
+static const int hash64_r = 47;
+
+uint64_t hash64(const void *bytes, size_t nbytes, uint64_t seed) {
+  const uint8_t *pos;
+  uint64_t h;
+  uint64_t k;
+  size_t i;
+
+  assert(bytes != NULL || nbytes == 0);
+
+  pos = bytes;
+  h = seed ^ (nbytes * hash64_m);
+
+  for (i = 0; i + 8 <= nbytes; i += 8) {
+    memcpy(&k, pos + i, sizeof(k));
+
+    k *= hash64_m;
+    k ^= k >> hash64_r;
+    k *= hash64_m;
+
+    h ^= k;
+    h *= hash64_m;
+  }
+
+  if (i < nbytes) {
+    for (k = 0; i < nbytes; i++) {
+      k = (k << 8) | pos[i];
+    }
+
+    h ^= k;
+    h *= hash64_m;
+  }
+
+  h ^= h >> hash64_r;
+  h *= hash64_m;
+  h ^= h >> hash64_r;
+
+  return h;
+}
+
+uint64_t hash64_combine(uint64_t h, uint64_t value) {
+  return hash64(&value, sizeof(value), h);
+}
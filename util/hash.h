@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fast non-cryptographic 64-bit hashing, based on MurmurHash64A. Results
+   depend on host byte order, so they shouldn't be persisted. */
+
+uint64_t hash64(const void *bytes, size_t nbytes, uint64_t seed);
+uint64_t hash64_combine(uint64_t h, uint64_t value);
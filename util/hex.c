@@ -1,20 +1,132 @@
 #include <assert.h>
 #include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include "util/hex.h"
+
+/* Hex digits are looked up 16 or 32 nibbles at a time with pshufb on x86,
+   which turns each block of input into two interleaved stores. Decoding goes
+   the other way 32 digits at a time, and leaves any block containing a bad
+   digit to the scalar loop, which also finishes off the tail and reports the
+   error. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HEX_X86
+#include <immintrin.h>
+#endif
+
+static int hex_digit_value(char c);
+static int hex_encode(char **out, const void *ptr, size_t nbytes,
+                      const char *digits);
+static void hex_format(char *dest, const uint8_t *bytes, size_t nbytes,
+                       const char *digits);
+static void hex_format_scalar(char *dest, const uint8_t *bytes, size_t nbytes,
+                              const char *digits);
+
+#ifdef HEX_X86
+
+static size_t hex_decode_simd(uint8_t *dest, const char *chars, size_t nchars);
+static size_t hex_decode_sse2(uint8_t *dest, const char *chars, size_t nchars)
+    __attribute__((target("sse2")));
+static size_t hex_format_simd(char *dest, const uint8_t *bytes, size_t nbytes,
+                              const char *digits);
+static size_t hex_format_ssse3(char *dest, const uint8_t *bytes, size_t nbytes,
+                               const char *digits)
+    __attribute__((target("ssse3")));
+static size_t hex_format_avx2(char *dest, const uint8_t *bytes, size_t nbytes,
+                              const char *digits)
+    __attribute__((target("avx2")));
+
+#endif
+
+static const char hex_digits_lc[] = "0123456789abcdef";
+static const char hex_digits_uc[] = "0123456789ABCDEF";
+
+int hex_encode_lc(char **out, const void *bytes, size_t nbytes) {
+  assert(out != NULL);
+  assert(bytes != NULL);
+
+  return hex_encode(out, bytes, nbytes, hex_digits_lc);
+}
+
+int hex_encode_uc(char **out, const void *bytes, size_t nbytes) {
+  assert(out != NULL);
+  assert(bytes != NULL);
+
+  return hex_encode(out, bytes, nbytes, hex_digits_uc);
+}
+
+void hex_format_lc(char *dest, const void *bytes, size_t nbytes) {
+  assert(dest != NULL);
+  assert(bytes != NULL || nbytes == 0);
+
+  hex_format(dest, bytes, nbytes, hex_digits_lc);
+}
+
+void hex_format_uc(char *dest, const void *bytes, size_t nbytes) {
+  assert(dest != NULL);
+  assert(bytes != NULL || nbytes == 0);
+
+  hex_format(dest, bytes, nbytes, hex_digits_uc);
+}
+
+int hex_decode(uint8_t *dest, const char *chars, size_t nchars) {
+  int hi;
+  int lo;
+  size_t i;
+
+  assert(dest != NULL || nchars == 0);
+  assert(chars != NULL || nchars == 0);
+
+  if (nchars % 2 != 0) {
+    return -EINVAL;
+  }
+
+  i = 0;
+
+#ifdef HEX_X86
+  if (nchars >= 32) {
+    i = hex_decode_simd(dest, chars, nchars);
+  }
+#endif
+
+  for (; i < nchars; i += 2) {
+    hi = hex_digit_value(chars[i]);
+    lo = hex_digit_value(chars[i + 1]);
+
+    if (hi < 0 || lo < 0) {
+      return -EINVAL;
+    }
+
+    dest[i / 2] = (hi << 4) | lo;
+  }
+
+  return 0;
+}
+
+static int hex_digit_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  } else {
+    return -1;
+  }
+}
+
 static int hex_encode(char **out, const void *ptr, size_t nbytes,
                       const char *digits) {
-  const uint8_t *bytes;
   char *chars;
-  size_t i;
 
   assert(out != NULL);
   assert(ptr != NULL);
   assert(digits != NULL);
 
   *out = NULL;
-  bytes = ptr;
 
   chars = malloc(2 * nbytes + 1);
 
@@ -22,27 +134,166 @@ static int hex_encode(char **out, const void *ptr, size_t nbytes,
     return -ENOMEM;
   }
 
-  for (i = 0; i < nbytes; i++) {
-    chars[i * 2 + 0] = digits[bytes[i] >> 4];
-    chars[i * 2 + 1] = digits[bytes[i] & 15];
-  }
-
+  hex_format(chars, ptr, nbytes, digits);
   chars[nbytes * 2] = '\0';
   *out = chars;
 
   return 0;
 }
 
-int hex_encode_lc(char **out, const void *bytes, size_t nbytes) {
-  assert(out != NULL);
-  assert(bytes != NULL);
+static void hex_format(char *dest, const uint8_t *bytes, size_t nbytes,
+                       const char *digits) {
+  size_t i;
+
+  i = 0;
 
-  return hex_encode(out, bytes, nbytes, "0123456789abcdef");
+#ifdef HEX_X86
+  if (nbytes >= 16) {
+    i = hex_format_simd(dest, bytes, nbytes, digits);
+  }
+#endif
+
+  if (i < nbytes) {
+    hex_format_scalar(dest + i * 2, bytes + i, nbytes - i, digits);
+  }
 }
 
-int hex_encode_uc(char **out, const void *bytes, size_t nbytes) {
-  assert(out != NULL);
-  assert(bytes != NULL);
+static void hex_format_scalar(char *dest, const uint8_t *bytes, size_t nbytes,
+                              const char *digits) {
+  size_t i;
+
+  for (i = 0; i < nbytes; i++) {
+    dest[i * 2 + 0] = digits[bytes[i] >> 4];
+    dest[i * 2 + 1] = digits[bytes[i] & 15];
+  }
+}
+
+#ifdef HEX_X86
+
+/* Returns the number of digits decoded, which is a whole number of 32-digit
+   blocks. */
+
+static size_t hex_decode_simd(uint8_t *dest, const char *chars, size_t nchars) {
+  if (__builtin_cpu_supports("sse2")) {
+    return hex_decode_sse2(dest, chars, nchars);
+  } else {
+    return 0;
+  }
+}
+
+/* Digits and letters get converted separately and the results merged using
+   the masks of which bytes were which. Each pair of nibbles then gets
+   combined within a 16-bit lane, and the lanes get packed down to bytes. */
+
+static size_t hex_decode_sse2(uint8_t *dest, const char *chars, size_t nchars) {
+  __m128i words[2];
+  __m128i v;
+  __m128i lower;
+  __m128i is_digit;
+  __m128i is_alpha;
+  __m128i nibs;
+  size_t i;
+  int j;
+
+  for (i = 0; i + 32 <= nchars; i += 32) {
+    for (j = 0; j < 2; j++) {
+      v = _mm_loadu_si128((const __m128i *)(chars + i + j * 16));
+      lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+      is_digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                               _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+      is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                               _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+      if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xFFFF) {
+        return i;
+      }
 
-  return hex_encode(out, bytes, nbytes, "0123456789ABCDEF");
+      nibs = _mm_or_si128(
+          _mm_and_si128(is_digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+          _mm_and_si128(is_alpha,
+                        _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+      words[j] = _mm_or_si128(
+          _mm_slli_epi16(_mm_and_si128(nibs, _mm_set1_epi16(0x00FF)), 4),
+          _mm_srli_epi16(nibs, 8));
+    }
+
+    _mm_storeu_si128((__m128i *)(dest + i / 2),
+                     _mm_packus_epi16(words[0], words[1]));
+  }
+
+  return i;
+}
+
+/* These return the number of bytes they converted, which is always a whole
+   number of 16- or 32-byte blocks. */
+
+static size_t hex_format_simd(char *dest, const uint8_t *bytes, size_t nbytes,
+                              const char *digits) {
+  if (__builtin_cpu_supports("avx2")) {
+    return hex_format_avx2(dest, bytes, nbytes, digits);
+  } else if (__builtin_cpu_supports("ssse3")) {
+    return hex_format_ssse3(dest, bytes, nbytes, digits);
+  } else {
+    return 0;
+  }
 }
+
+static size_t hex_format_ssse3(char *dest, const uint8_t *bytes, size_t nbytes,
+                               const char *digits) {
+  __m128i lut;
+  __m128i mask;
+  __m128i v;
+  __m128i hi;
+  __m128i lo;
+  size_t i;
+
+  lut = _mm_loadu_si128((const __m128i *)digits);
+  mask = _mm_set1_epi8(0x0F);
+
+  for (i = 0; i + 16 <= nbytes; i += 16) {
+    v = _mm_loadu_si128((const __m128i *)(bytes + i));
+    hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+
+    _mm_storeu_si128((__m128i *)(dest + i * 2), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(dest + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+
+  return i;
+}
+
+/* AVX2 unpacks within each 128-bit lane, so the two halves of the output
+   have to be stitched back together across lanes before storing them. */
+
+static size_t hex_format_avx2(char *dest, const uint8_t *bytes, size_t nbytes,
+                              const char *digits) {
+  __m256i lut;
+  __m256i mask;
+  __m256i v;
+  __m256i hi;
+  __m256i lo;
+  __m256i a;
+  __m256i b;
+  size_t i;
+
+  lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)digits));
+  mask = _mm256_set1_epi8(0x0F);
+
+  for (i = 0; i + 32 <= nbytes; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *)(bytes + i));
+    hi = _mm256_shuffle_epi8(lut,
+                             _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+    lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+    a = _mm256_unpacklo_epi8(hi, lo);
+    b = _mm256_unpackhi_epi8(hi, lo);
+
+    _mm256_storeu_si256((__m256i *)(dest + i * 2),
+                        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(dest + i * 2 + 32),
+                        _mm256_permute2x128_si256(a, b, 0x31));
+  }
+
+  return i + hex_format_ssse3(dest + i * 2, bytes + i, nbytes - i, digits);
+}
+
+#endif
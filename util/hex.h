@@ -1,6 +1,17 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 int hex_encode_lc(char **out, const void *bytes, size_t nbytes);
 int hex_encode_uc(char **out, const void *bytes, size_t nbytes);
+
+/* Writes exactly 2 * nbytes hex digits to dest, without a NUL terminator */
+
+void hex_format_lc(char *dest, const void *bytes, size_t nbytes);
+void hex_format_uc(char *dest, const void *bytes, size_t nbytes);
+
+/* Decodes nchars hex digits of either case into nchars / 2 bytes. Returns
+   -EINVAL if nchars is odd or if any of the chars isn't a hex digit. */
+
+int hex_decode(uint8_t *dest, const char *chars, size_t nchars);
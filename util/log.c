@@ -14,10 +14,13 @@ void log_write_(const char *func, const char *fmt, ...) {
   va_end(ap);
 }
 
+/* Diagnostics go to stderr so that they never end up mixed into output that
+   a tool writes to stdout. */
+
 static void log_vwrite_(const char *func, const char *fmt, va_list ap) {
-  printf("%s: ", func);
-  vprintf(fmt, ap);
-  puts("");
+  fprintf(stderr, "%s: ", func);
+  vfprintf(stderr, fmt, ap);
+  fputc('\n', stderr);
 }
 
 void log_error_(const char *func, const char *file, int line, int r) {
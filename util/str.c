@@ -2,11 +2,16 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "util/fs.h"
+#include "util/iobuf.h"
 #include "util/str.h"
 
+static bool strbuf_reserve(struct strbuf *dest, size_t nchars);
+
 int str_dup(char **out, const char *src) {
   size_t len;
   char *dest;
@@ -37,6 +42,24 @@ bool str_eq(const char *lhs, const char *rhs) {
   return strcmp(lhs, rhs) == 0;
 }
 
+/* 32-bit FNV-1a */
+
+uint32_t str_hash(const char *str) {
+  const uint8_t *pos;
+  uint32_t hash;
+
+  assert(str != NULL);
+
+  hash = 0x811C9DC5;
+
+  for (pos = (const uint8_t *)str; *pos != '\0'; pos++) {
+    hash ^= *pos;
+    hash *= 0x01000193;
+  }
+
+  return hash;
+}
+
 int str_printf(char **out, const char *fmt, ...) {
   va_list ap;
   int r;
@@ -81,6 +104,76 @@ int str_vprintf(char **out, const char *fmt, va_list ap) {
   return 0;
 }
 
+void strbuf_init(struct strbuf *dest) {
+  assert(dest != NULL);
+
+  dest->chars = NULL;
+  dest->nchars = 0;
+  dest->pos = 0;
+  dest->growable = true;
+  dest->sink = NULL;
+  dest->error = 0;
+}
+
+void strbuf_init_sink(struct strbuf *dest, FILE *f, char *chars,
+                      size_t nchars) {
+  assert(dest != NULL);
+  assert(f != NULL);
+  assert(chars != NULL);
+  assert(nchars >= 2);
+
+  dest->chars = chars;
+  dest->nchars = nchars;
+  dest->pos = 0;
+  dest->growable = false;
+  dest->sink = f;
+  dest->error = 0;
+}
+
+int strbuf_finish(struct strbuf *dest, char **out) {
+  int r;
+
+  assert(dest != NULL);
+  assert(dest->growable);
+  assert(out != NULL);
+
+  *out = NULL;
+  strbuf_reserve(dest, 0);
+
+  if (dest->error != 0) {
+    r = dest->error;
+    free(dest->chars);
+    strbuf_init(dest);
+
+    return r;
+  }
+
+  dest->chars[dest->pos] = '\0';
+  *out = dest->chars;
+  strbuf_init(dest);
+
+  return 0;
+}
+
+int strbuf_flush(struct strbuf *dest) {
+  struct const_iobuf src;
+
+  assert(dest != NULL);
+  assert(dest->sink != NULL);
+
+  if (dest->error == 0 && dest->pos > 0) {
+    src.bytes = (const uint8_t *)dest->chars;
+    src.nbytes = dest->pos;
+    src.pos = 0;
+
+    dest->error = fs_write(dest->sink, &src);
+  }
+
+  dest->pos = 0;
+
+  return dest->error;
+}
+
 void strbuf_printf(struct strbuf *dest, const char *fmt, ...) {
   va_list ap;
 
@@ -93,6 +186,7 @@ void strbuf_printf(struct strbuf *dest, const char *fmt, ...) {
 }
 
 void strbuf_vprintf(struct strbuf *dest, const char *fmt, va_list ap) {
+  va_list ap2;
   size_t avail;
   char *chars;
   int result;
@@ -109,9 +203,29 @@ void strbuf_vprintf(struct strbuf *dest, const char *fmt, va_list ap) {
     chars = dest->chars + dest->pos;
   }
 
-  result = vsnprintf(chars, avail, fmt, ap);
+  va_copy(ap2, ap);
+  result = vsnprintf(chars, avail, fmt, ap2);
+  va_end(ap2);
+
+  assert(result >= 0);
 
-  assert(dest->chars == NULL || result < avail);
+  /* Growable and sink buffers only need a second attempt if the first one
+     didn't fit. Anything too big for a sink's buffer bypasses it. */
+
+  if ((dest->growable || dest->sink != NULL) && (size_t)result >= avail) {
+    if (!strbuf_reserve(dest, result)) {
+      if (dest->sink != NULL && dest->error == 0 &&
+          vfprintf(dest->sink, fmt, ap) < 0) {
+        dest->error = -EIO;
+      }
+
+      return;
+    }
+
+    result = vsnprintf(dest->chars + dest->pos, result + 1, fmt, ap);
+  }
+
+  assert(dest->chars == NULL || result < dest->nchars - dest->pos);
 
   dest->pos += result;
 }
@@ -119,6 +233,10 @@ void strbuf_vprintf(struct strbuf *dest, const char *fmt, va_list ap) {
 void strbuf_putc(struct strbuf *dest, char c) {
   assert(dest != NULL);
 
+  if ((dest->growable || dest->sink != NULL) && !strbuf_reserve(dest, 1)) {
+    return;
+  }
+
   if (dest->chars != NULL) {
     assert(dest->pos + 1 < dest->nchars);
 
@@ -130,18 +248,90 @@ void strbuf_putc(struct strbuf *dest, char c) {
 }
 
 void strbuf_puts(struct strbuf *dest, const char *str) {
-  size_t len;
-
   assert(dest != NULL);
   assert(str != NULL);
 
-  len = strlen(str);
+  strbuf_putn(dest, str, strlen(str));
+}
+
+void strbuf_putn(struct strbuf *dest, const char *chars, size_t nchars) {
+  struct const_iobuf src;
+
+  assert(dest != NULL);
+  assert(chars != NULL || nchars == 0);
+
+  /* Buffers that never had anything put in them have no chars at all */
+
+  if (nchars == 0) {
+    return;
+  }
+
+  if ((dest->growable || dest->sink != NULL) &&
+      !strbuf_reserve(dest, nchars)) {
+    if (dest->sink != NULL && dest->error == 0) {
+      src.bytes = (const uint8_t *)chars;
+      src.nbytes = nchars;
+      src.pos = 0;
+
+      dest->error = fs_write(dest->sink, &src);
+    }
+
+    return;
+  }
 
   if (dest->chars != NULL) {
-    assert(dest->pos + len < dest->nchars);
+    assert(dest->pos + nchars < dest->nchars);
 
-    memcpy(dest->chars + dest->pos, str, len + 1);
+    memcpy(dest->chars + dest->pos, chars, nchars);
+    dest->chars[dest->pos + nchars] = '\0';
   }
 
-  dest->pos += len;
+  dest->pos += nchars;
+}
+
+/* Makes room for nchars more chars plus a NUL terminator, either by growing
+   the buffer or by flushing it to the sink. Returns false if there still
+   isn't enough room, or if an error has happened now or at some earlier
+   point. */
+
+static bool strbuf_reserve(struct strbuf *dest, size_t nchars) {
+  size_t needed;
+  size_t max_nchars;
+  char *chars;
+
+  assert(dest != NULL);
+  assert(dest->growable || dest->sink != NULL);
+
+  if (dest->error != 0) {
+    return false;
+  }
+
+  needed = dest->pos + nchars + 1;
+
+  if (needed <= dest->nchars) {
+    return true;
+  }
+
+  if (dest->sink != NULL) {
+    return strbuf_flush(dest) == 0 && nchars + 1 <= dest->nchars;
+  }
+
+  max_nchars = dest->nchars != 0 ? dest->nchars : 256;
+
+  while (max_nchars < needed) {
+    max_nchars *= 2;
+  }
+
+  chars = realloc(dest->chars, max_nchars);
+
+  if (chars == NULL) {
+    dest->error = -ENOMEM;
+
+    return false;
+  }
+
+  dest->chars = chars;
+  dest->nchars = max_nchars;
+
+  return true;
 }
@@ -3,23 +3,42 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include "util/macro.h"
 
+/* A strbuf either writes into a fixed buffer, or, if chars is NULL, just
+   counts how many chars would have been written. strbuf_init() sets up a
+   third mode instead, where chars grows geometrically as needed and belongs
+   to the strbuf. strbuf_init_sink() sets up a fourth, where a fixed buffer
+   gets written out to a file whenever it fills up, so pos only counts what
+   is still pending. Errors in the last two modes are sticky: further writes
+   are dropped and strbuf_finish() or strbuf_flush() reports the error. */
+
 struct strbuf {
   char *chars;
   size_t nchars;
   size_t pos;
+  bool growable;
+  FILE *sink;
+  int error;
 };
 
 int str_dup(char **dest, const char *src);
 bool str_eq(const char *lhs, const char *rhs);
+uint32_t str_hash(const char *str);
 int str_printf(char **out, const char *fmt, ...)
     gcc_attribute((format(printf, 2, 3)));
 int str_vprintf(char **out, const char *fmt, va_list ap);
 
+void strbuf_init(struct strbuf *dest);
+void strbuf_init_sink(struct strbuf *dest, FILE *f, char *chars, size_t nchars);
+int strbuf_finish(struct strbuf *dest, char **out);
+int strbuf_flush(struct strbuf *dest);
 void strbuf_printf(struct strbuf *dest, const char *fmt, ...)
     gcc_attribute((format(printf, 2, 3)));
 void strbuf_vprintf(struct strbuf *dest, const char *fmt, va_list ap);
 void strbuf_putc(struct strbuf *dest, char c);
 void strbuf_puts(struct strbuf *dest, const char *str);
+void strbuf_putn(struct strbuf *dest, const char *chars, size_t nchars);
@@ -0,0 +1,247 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "util/log.h"
+#include "util/work.h"
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION work_lock_t;
+typedef HANDLE work_thread_t;
+#else
+typedef pthread_mutex_t work_lock_t;
+typedef pthread_t work_thread_t;
+#endif
+
+struct work_queue {
+  work_lock_t lock;
+  size_t next;
+  size_t nitems;
+  size_t grain;
+  work_fn_t fn;
+  void *ctx;
+  int r;
+};
+
+static int work_lock_init(work_lock_t *lock);
+static void work_lock_fini(work_lock_t *lock);
+static void work_lock(work_lock_t *lock);
+static void work_unlock(work_lock_t *lock);
+static int work_thread_start(work_thread_t *thread, struct work_queue *q);
+static void work_thread_join(work_thread_t thread);
+static void work_thread_main(struct work_queue *q);
+static bool work_queue_take(struct work_queue *q, size_t *begin, size_t *end);
+static void work_queue_fail(struct work_queue *q, int r);
+
+#ifdef _WIN32
+
+static DWORD WINAPI work_thread_entry(LPVOID param);
+
+unsigned int work_get_cpu_count(void) {
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+
+  return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+}
+
+static int work_lock_init(work_lock_t *lock) {
+  InitializeCriticalSection(lock);
+
+  return 0;
+}
+
+static void work_lock_fini(work_lock_t *lock) {
+  DeleteCriticalSection(lock);
+}
+
+static void work_lock(work_lock_t *lock) {
+  EnterCriticalSection(lock);
+}
+
+static void work_unlock(work_lock_t *lock) {
+  LeaveCriticalSection(lock);
+}
+
+static int work_thread_start(work_thread_t *thread, struct work_queue *q) {
+  *thread = CreateThread(NULL, 0, work_thread_entry, q, 0, NULL);
+
+  return *thread != NULL ? 0 : (int)GetLastError();
+}
+
+static void work_thread_join(work_thread_t thread) {
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
+
+static DWORD WINAPI work_thread_entry(LPVOID param) {
+  work_thread_main(param);
+
+  return 0;
+}
+
+#else
+
+static void *work_thread_entry(void *param);
+
+unsigned int work_get_cpu_count(void) {
+  long n;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n > 0 ? n : 1;
+}
+
+static int work_lock_init(work_lock_t *lock) {
+  return pthread_mutex_init(lock, NULL);
+}
+
+static void work_lock_fini(work_lock_t *lock) {
+  pthread_mutex_destroy(lock);
+}
+
+static void work_lock(work_lock_t *lock) {
+  pthread_mutex_lock(lock);
+}
+
+static void work_unlock(work_lock_t *lock) {
+  pthread_mutex_unlock(lock);
+}
+
+static int work_thread_start(work_thread_t *thread, struct work_queue *q) {
+  return pthread_create(thread, NULL, work_thread_entry, q);
+}
+
+static void work_thread_join(work_thread_t thread) {
+  pthread_join(thread, NULL);
+}
+
+static void *work_thread_entry(void *param) {
+  work_thread_main(param);
+
+  return NULL;
+}
+
+#endif
+
+int work_run(unsigned int nthreads, size_t nitems, size_t grain, work_fn_t fn,
+             void *ctx) {
+  struct work_queue q;
+  work_thread_t *threads;
+  size_t nchunks;
+  unsigned int nstarted;
+  unsigned int i;
+  int r;
+
+  assert(grain > 0);
+  assert(fn != NULL);
+
+  if (nthreads == 0) {
+    nthreads = work_get_cpu_count();
+  }
+
+  nchunks = nitems / grain + (nitems % grain != 0);
+
+  if (nthreads > nchunks) {
+    nthreads = nchunks;
+  }
+
+  if (nthreads <= 1) {
+    return nitems > 0 ? fn(ctx, 0, nitems) : 0;
+  }
+
+  threads = calloc(nthreads - 1, sizeof(*threads));
+
+  if (threads == NULL) {
+    return -ENOMEM;
+  }
+
+  r = work_lock_init(&q.lock);
+
+  if (r != 0) {
+    free(threads);
+
+    return -r;
+  }
+
+  q.next = 0;
+  q.nitems = nitems;
+  q.grain = grain;
+  q.fn = fn;
+  q.ctx = ctx;
+  q.r = 0;
+
+  /* Failing to start a thread just leaves more work for the others */
+
+  for (nstarted = 0; nstarted < nthreads - 1; nstarted++) {
+    r = work_thread_start(&threads[nstarted], &q);
+
+    if (r != 0) {
+      log_write("Failed to start worker thread (%i)", r);
+
+      break;
+    }
+  }
+
+  work_thread_main(&q);
+
+  for (i = 0; i < nstarted; i++) {
+    work_thread_join(threads[i]);
+  }
+
+  work_lock_fini(&q.lock);
+  free(threads);
+
+  return q.r;
+}
+
+static void work_thread_main(struct work_queue *q) {
+  size_t begin;
+  size_t end;
+  int r;
+
+  while (work_queue_take(q, &begin, &end)) {
+    r = q->fn(q->ctx, begin, end);
+
+    if (r < 0) {
+      work_queue_fail(q, r);
+    }
+  }
+}
+
+static bool work_queue_take(struct work_queue *q, size_t *begin, size_t *end) {
+  bool ok;
+
+  work_lock(&q->lock);
+
+  ok = q->r == 0 && q->next < q->nitems;
+
+  if (ok) {
+    *begin = q->next;
+    *end = q->nitems - q->next > q->grain ? q->next + q->grain : q->nitems;
+    q->next = *end;
+  }
+
+  work_unlock(&q->lock);
+
+  return ok;
+}
+
+static void work_queue_fail(struct work_queue *q, int r) {
+  work_lock(&q->lock);
+
+  if (q->r == 0) {
+    q->r = r;
+  }
+
+  work_unlock(&q->lock);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Minimal parallel-for. work_run() calls fn on consecutive chunks of
+   [0, nitems), each at most `grain` items long, from up to nthreads threads
+   including the calling one. Passing 0 for nthreads means one thread per CPU.
+   Chunks are handed out in order but may finish in any order. Once fn fails,
+   no further chunks are started and work_run() returns the first error. */
+
+typedef int (*work_fn_t)(void *ctx, size_t begin, size_t end);
+
+unsigned int work_get_cpu_count(void);
+int work_run(unsigned int nthreads, size_t nitems, size_t grain, work_fn_t fn,
+             void *ctx);
@@ -1,7 +1,15 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 #include "573file/prop-binary-reader.h"
+#include "573file/prop-json-writer.h"
 #include "573file/prop-xml-writer.h"
 #include "573file/prop.h"
 
@@ -9,51 +17,109 @@
 #include "util/iobuf.h"
 #include "util/log.h"
 
+static int xml_dump_begin_doc(void *ctx, enum prop_encoding encoding);
+static int xml_dump_begin_node(void *ctx, const char *name, enum prop_type type,
+                               const struct const_iobuf *value);
+static int xml_dump_attr(void *ctx, const char *key, const char *val);
+static int xml_dump_end_node(void *ctx);
+static int xml_dump_json_begin_doc(void *ctx, enum prop_encoding encoding);
+static int xml_dump_json_begin_node(void *ctx, const char *name,
+                                    enum prop_type type,
+                                    const struct const_iobuf *value);
+static int xml_dump_json_attr(void *ctx, const char *key, const char *val);
+static int xml_dump_json_end_node(void *ctx);
+static int xml_dump_stream(FILE *f, const void *bytes, size_t nbytes);
+static int xml_dump_stream_json(FILE *f, const void *bytes, size_t nbytes);
+static int xml_dump_tree(FILE *f, const void *bytes, size_t nbytes,
+                         bool parallel, bool json);
+
+static const struct prop_binary_visitor xml_dump_visitor = {
+    .begin_doc = xml_dump_begin_doc,
+    .begin_node = xml_dump_begin_node,
+    .attr = xml_dump_attr,
+    .end_node = xml_dump_end_node,
+};
+
+static const struct prop_binary_visitor xml_dump_json_visitor = {
+    .begin_doc = xml_dump_json_begin_doc,
+    .begin_node = xml_dump_json_begin_node,
+    .attr = xml_dump_json_attr,
+    .end_node = xml_dump_json_end_node,
+};
+
 int main(int argc, char **argv) {
   const char *infile;
   const char *outfile;
-  struct const_iobuf buf;
-  struct prop *p;
+  bool stream;
+  bool parallel;
+  bool json;
   void *bytes;
-  char *xml;
   size_t nbytes;
   FILE *f;
   FILE *f_dest;
   int r;
 
+  stream = false;
+  parallel = false;
+  json = false;
+
+  while (argc > 1 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-s") == 0) {
+      stream = true;
+    } else if (strcmp(argv[1], "-j") == 0) {
+      parallel = true;
+    } else if (strcmp(argv[1], "-f") == 0 && argc > 2) {
+      if (strcmp(argv[2], "json") == 0) {
+        json = true;
+      } else if (strcmp(argv[2], "xml") == 0) {
+        json = false;
+      } else {
+        fprintf(stderr, "Unknown output format \"%s\"\n", argv[2]);
+
+        return EXIT_FAILURE;
+      }
+
+      argc--;
+      argv++;
+    } else {
+      break;
+    }
+
+    argc--;
+    argv++;
+  }
+
   if (argc < 2 || argc > 3) {
-    fprintf(stderr, "Usage: %s [infile] <outfile>\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-s] [-j] [-f xml|json] [infile] <outfile>\n",
+            argv[0]);
+    fprintf(stderr, "  Use - for stdin or stdout\n");
+    fprintf(stderr, "  -s  Stream output without building a prop tree\n");
+    fprintf(stderr, "  -j  Parse and write large props on all CPUs\n");
+    fprintf(stderr, "  -f  Output format (default xml)\n");
 
     return EXIT_FAILURE;
   }
 
   f = NULL;
   bytes = NULL;
-  xml = NULL;
-  p = NULL;
 
   infile = argv[1];
 
-  if (argc > 2) {
+  if (argc > 2 && strcmp(argv[2], "-") != 0) {
     outfile = argv[2];
   } else {
     outfile = NULL;
   }
 
-  r = fs_read_file(infile, &bytes, &nbytes);
-
-  if (r < 0) {
-    goto end;
-  }
-
-  r = prop_binary_parse(&p, bytes, nbytes);
-
-  if (r < 0) {
-    goto end;
+  if (strcmp(infile, "-") == 0) {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    r = fs_read_all(stdin, &bytes, &nbytes);
+  } else {
+    r = fs_read_file(infile, &bytes, &nbytes);
   }
 
-  r = prop_xml_write(p, &xml);
-
   if (r < 0) {
     goto end;
   }
@@ -70,11 +136,13 @@ int main(int argc, char **argv) {
     f_dest = stdout;
   }
 
-  buf.bytes = (uint8_t *)xml;
-  buf.nbytes = strlen(xml);
-  buf.pos = 0;
-
-  r = fs_write(f_dest, &buf);
+  if (stream && json) {
+    r = xml_dump_stream_json(f_dest, bytes, nbytes);
+  } else if (stream) {
+    r = xml_dump_stream(f_dest, bytes, nbytes);
+  } else {
+    r = xml_dump_tree(f_dest, bytes, nbytes, parallel, json);
+  }
 
   if (r < 0) {
     goto end;
@@ -82,8 +150,6 @@ int main(int argc, char **argv) {
 
 end:
   fs_close(f);
-  free(xml);
-  prop_free(p);
   free(bytes);
 
   if (r < 0) {
@@ -94,3 +160,123 @@ end:
 
   return EXIT_SUCCESS;
 }
+
+static int xml_dump_tree(FILE *f, const void *bytes, size_t nbytes,
+                         bool parallel, bool json) {
+  struct prop *p;
+  int r;
+
+  p = NULL;
+
+  if (parallel) {
+    r = prop_binary_parse_parallel(&p, bytes, nbytes, 0);
+  } else {
+    r = prop_binary_parse(&p, bytes, nbytes);
+  }
+
+  if (r < 0) {
+    goto end;
+  }
+
+  if (json) {
+    r = prop_json_write_file(p, f);
+  } else if (parallel) {
+    r = prop_xml_write_file_parallel(p, f, 0);
+  } else {
+    r = prop_xml_write_file(p, f);
+  }
+
+  if (r < 0) {
+    goto end;
+  }
+
+end:
+  prop_free(p);
+
+  return r;
+}
+
+static int xml_dump_stream(FILE *f, const void *bytes, size_t nbytes) {
+  struct prop_xml_stream *s;
+  int r;
+
+  s = NULL;
+  r = prop_xml_stream_alloc(&s, f);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_binary_visit(bytes, nbytes, &xml_dump_visitor, s);
+
+  if (r < 0) {
+    goto end;
+  }
+
+end:
+  prop_xml_stream_free(s);
+
+  return r;
+}
+
+static int xml_dump_stream_json(FILE *f, const void *bytes, size_t nbytes) {
+  struct prop_json_stream *s;
+  int r;
+
+  s = NULL;
+  r = prop_json_stream_alloc(&s, f);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = prop_binary_visit(bytes, nbytes, &xml_dump_json_visitor, s);
+
+  if (r < 0) {
+    goto end;
+  }
+
+end:
+  prop_json_stream_free(s);
+
+  return r;
+}
+
+static int xml_dump_begin_doc(void *ctx, enum prop_encoding encoding) {
+  prop_xml_stream_set_encoding(ctx, encoding);
+
+  return 0;
+}
+
+static int xml_dump_begin_node(void *ctx, const char *name, enum prop_type type,
+                               const struct const_iobuf *value) {
+  return prop_xml_stream_begin_node(ctx, name, type, value);
+}
+
+static int xml_dump_attr(void *ctx, const char *key, const char *val) {
+  return prop_xml_stream_attr(ctx, key, val);
+}
+
+static int xml_dump_end_node(void *ctx) {
+  return prop_xml_stream_end_node(ctx);
+}
+
+static int xml_dump_json_begin_doc(void *ctx, enum prop_encoding encoding) {
+  prop_json_stream_set_encoding(ctx, encoding);
+
+  return 0;
+}
+
+static int xml_dump_json_begin_node(void *ctx, const char *name,
+                                    enum prop_type type,
+                                    const struct const_iobuf *value) {
+  return prop_json_stream_begin_node(ctx, name, type, value);
+}
+
+static int xml_dump_json_attr(void *ctx, const char *key, const char *val) {
+  return prop_json_stream_attr(ctx, key, val);
+}
+
+static int xml_dump_json_end_node(void *ctx) {
+  return prop_json_stream_end_node(ctx);
+}
@@ -0,0 +1,282 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "573file/prop-type.h"
+#include "573file/prop-xml-reader.h"
+
+#include "util/fs.h"
+#include "util/log.h"
+#include "util/str.h"
+#include "util/work.h"
+
+/* Batches convert one file per work item. A file that fails to convert gets
+   reported right away and doesn't hold up the rest of the batch. */
+
+struct xml_pack_batch {
+  const char *outdir;
+  char **infiles;
+  int *results;
+  enum prop_encoding encoding;
+};
+
+static int xml_pack_file(const char *infile, const char *outfile,
+                         enum prop_encoding encoding);
+static int xml_pack_batch(struct xml_pack_batch *batch, size_t nfiles,
+                          unsigned int nthreads, size_t *nfailed);
+static int xml_pack_batch_run(void *ctx, size_t begin, size_t end);
+static int xml_pack_batch_path(char **out, const char *outdir,
+                               const char *infile);
+
+int main(int argc, char **argv) {
+  struct xml_pack_batch batch;
+  enum prop_encoding encoding;
+  const char *outdir;
+  size_t nfailed;
+  unsigned int nthreads;
+  int r;
+
+  encoding = PROP_ENCODING_SHIFT_JIS;
+  outdir = NULL;
+  nfailed = 0;
+  nthreads = 0;
+
+  while (argc > 2 && argv[1][0] == '-' && argv[1][1] != '\0') {
+    if (strcmp(argv[1], "-e") == 0) {
+      if (prop_encoding_from_string(&encoding, argv[2]) < 0) {
+        fprintf(stderr, "Unknown encoding \"%s\"\n", argv[2]);
+
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[1], "-d") == 0) {
+      outdir = argv[2];
+    } else if (strcmp(argv[1], "-j") == 0) {
+      nthreads = strtoul(argv[2], NULL, 10);
+    } else {
+      break;
+    }
+
+    argc -= 2;
+    argv += 2;
+  }
+
+  if (outdir != NULL ? argc < 2 : argc != 3) {
+    fprintf(stderr, "Usage: %s [-e encoding] <infile> <outfile>\n", argv[0]);
+    fprintf(stderr,
+            "       %s [-e encoding] [-j threads] -d <outdir> <infile>...\n",
+            argv[0]);
+    fprintf(stderr, "  Use - for stdin or stdout\n");
+    fprintf(stderr, "  -e  Encoding of the binary prop (default SHIFT_JIS)\n");
+    fprintf(stderr, "  -d  Convert each infile into <outdir>/<name>.bin\n");
+    fprintf(stderr, "  -j  Threads to use with -d (default: one per CPU)\n");
+
+    return EXIT_FAILURE;
+  }
+
+  if (outdir != NULL) {
+    batch.outdir = outdir;
+    batch.infiles = argv + 1;
+    batch.encoding = encoding;
+    r = xml_pack_batch(&batch, argc - 1, nthreads, &nfailed);
+  } else {
+    r = xml_pack_file(argv[1], argv[2], encoding);
+  }
+
+  if (r < 0) {
+    log_write("%s (%i)", strerror(-r), r);
+
+    return EXIT_FAILURE;
+  }
+
+  /* Files that failed have been reported already */
+
+  return nfailed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Input files are mapped rather than read, so a conversion only ever holds
+   the builder's fixed-size buffers and the parser's per-depth state. */
+
+static int xml_pack_file(const char *infile, const char *outfile,
+                         enum prop_encoding encoding) {
+  const void *map;
+  const void *bytes;
+  void *buf;
+  size_t nbytes;
+  FILE *f;
+  FILE *f_dest;
+  int r;
+
+  assert(infile != NULL);
+  assert(outfile != NULL);
+
+  map = NULL;
+  buf = NULL;
+  nbytes = 0;
+  f = NULL;
+
+  if (strcmp(infile, "-") == 0) {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    r = fs_read_all(stdin, &buf, &nbytes);
+    bytes = buf;
+  } else {
+    r = fs_map_file(infile, &map, &nbytes);
+    bytes = map;
+  }
+
+  if (r < 0) {
+    goto end;
+  }
+
+  if (strcmp(outfile, "-") == 0) {
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    f_dest = stdout;
+  } else {
+    r = fs_open(&f, outfile, "wb");
+
+    if (r < 0) {
+      goto end;
+    }
+
+    f_dest = f;
+  }
+
+  r = prop_xml_pack(bytes, nbytes, encoding, f_dest);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  if (fflush(f_dest) != 0) {
+    r = -EIO;
+
+    goto end;
+  }
+
+end:
+  fs_close(f);
+
+  if (r < 0 && f != NULL) {
+    remove(outfile);
+  }
+
+  if (map != NULL) {
+    fs_unmap_file(map, nbytes);
+  }
+
+  free(buf);
+
+  return r;
+}
+
+static int xml_pack_batch(struct xml_pack_batch *batch, size_t nfiles,
+                          unsigned int nthreads, size_t *nfailed) {
+  size_t i;
+  int r;
+
+  assert(batch != NULL);
+  assert(nfailed != NULL);
+
+  batch->results = calloc(nfiles, sizeof(*batch->results));
+
+  if (batch->results == NULL) {
+    return -ENOMEM;
+  }
+
+  r = fs_mkdir(batch->outdir);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  r = work_run(nthreads, nfiles, 1, xml_pack_batch_run, batch);
+
+  if (r < 0) {
+    goto end;
+  }
+
+  *nfailed = 0;
+
+  for (i = 0; i < nfiles; i++) {
+    if (batch->results[i] < 0) {
+      (*nfailed)++;
+    }
+  }
+
+  if (*nfailed > 0) {
+    log_write("%lu of %lu files failed to convert", (unsigned long)*nfailed,
+              (unsigned long)nfiles);
+  }
+
+end:
+  free(batch->results);
+
+  return r;
+}
+
+static int xml_pack_batch_run(void *ctx, size_t begin, size_t end) {
+  struct xml_pack_batch *batch;
+  char *outfile;
+  size_t i;
+  int r;
+
+  batch = ctx;
+
+  for (i = begin; i < end; i++) {
+    r = xml_pack_batch_path(&outfile, batch->outdir, batch->infiles[i]);
+
+    if (r < 0) {
+      return r;
+    }
+
+    r = xml_pack_file(batch->infiles[i], outfile, batch->encoding);
+
+    if (r < 0) {
+      log_write("%s: %s (%i)", batch->infiles[i], strerror(-r), r);
+    }
+
+    batch->results[i] = r;
+    free(outfile);
+  }
+
+  return 0;
+}
+
+/* foo/bar.xml becomes <outdir>/bar.bin */
+
+static int xml_pack_batch_path(char **out, const char *outdir,
+                               const char *infile) {
+  const char *name;
+  const char *pos;
+  size_t len;
+
+  assert(out != NULL);
+  assert(outdir != NULL);
+  assert(infile != NULL);
+
+  name = infile;
+
+  for (pos = infile; *pos != '\0'; pos++) {
+    if (*pos == '/' || *pos == '\\') {
+      name = pos + 1;
+    }
+  }
+
+  len = strlen(name);
+
+  if (len > 4 && strcmp(name + len - 4, ".xml") == 0) {
+    len -= 4;
+  }
+
+  return str_printf(out, "%s/%.*s.bin", outdir, (int)len, name);
+}